@@ -0,0 +1,1444 @@
+/*
+ This file contains the end-to-end benchmark suite for the host-native build.
+ It boots the firmware against simulated bulbs and a simulated mmWave sensor, then measures
+ how long it takes to become operational, presence-edge-to-bulb-write latency (with the links both
+ fast and idle), presence handling while a bulb is reconnecting, how soon a reconnected bulb gets written to
+ loop iteration cost and heap use, including allocations made by the scan and notification callbacks,
+ and how long settings changed over serial take to apply compared with reflashing.
+
+ Run with: pio run -e native -t exec
+ Simulation timings can be changed with --name=value (see sim::Config), plus:
+   --edges=N   number of presence edges to time (default 20)
+   --idle-edges=N  number of presence edges to time once the links have gone idle (default 3)
+   --reconnects=N  number of power cut reconnects to time (default 3)
+   --pool-edges=N  number of presence edges to time for each size of the shrunk connection pool (default 5)
+   --flickers=N    number of times the presence flickers on and off while the links are idle (default 4)
+   --sleep-edges=N number of times the room is entered and left while the ESP32 light sleeps (default 3)
+   --trace-file=PATH  record the firmware's trace to this file, for replaying with the trace_replay environment
+   --nvs-file=PATH keep NVS (bonds, cached GATT handles and the sensor's configuration) in this file, so a second run boots warm
+   --log       print the firmware's serial output to stderr
+*/
+
+#include <Arduino.h>
+#include <config.h>
+#include <app_state.h>
+#include <NimBLEDevice.h>
+#include <binary_log.h>
+#include <trace.h>
+#include <telemetry.h>
+#include <sim.h>
+#include <thread>
+#include <chrono>
+#include <atomic>
+#include <algorithm>
+#include <numeric>
+#include <ctime>
+#include <new>
+#include <malloc.h>
+
+void setup();
+uint32_t runLoopPass();
+bool getBulbConnInfo(uint64_t mac, NimBLEConnInfo& connInfo);
+void getBulbEventQueueStats(uint32_t& peakDepth, uint32_t& dropped);
+void setConnectionPoolSize(size_t size);
+
+SensorState nextSensorState(SensorState state, int8_t report, unsigned long resumedAt, unsigned long now,
+    unsigned long resumeBuffer);
+
+struct Sample {
+    double wallMicros;
+    double cpuMicros;
+};
+
+static std::mutex samplesMutex;
+static std::vector<Sample> loopSamples;
+static std::atomic<bool> measuringLoop(false);
+static std::atomic<uint64_t> loopPasses(0);
+
+// Heap accounting for the whole process (firmware and simulation) through the global allocation functions
+static std::atomic<uint64_t> heapInUse(0);
+static std::atomic<uint64_t> heapPeak(0);
+static std::atomic<uint64_t> hotPathAllocations[4];
+
+static void* trackedAlloc(size_t size) {
+    void* ptr = malloc(size ? size : 1);
+    if (!ptr) {
+        throw std::bad_alloc();
+    }
+    uint64_t inUse = heapInUse += malloc_usable_size(ptr);
+    uint64_t peak = heapPeak;
+    while (inUse > peak && !heapPeak.compare_exchange_weak(peak, inUse)) {}
+    hotPathAllocations[sim::currentHotPath()]++;
+    return ptr;
+}
+
+static void trackedFree(void* ptr) {
+    if (ptr) {
+        heapInUse -= malloc_usable_size(ptr);
+        free(ptr);
+    }
+}
+
+void* operator new(size_t size) { return trackedAlloc(size); }
+void* operator new[](size_t size) { return trackedAlloc(size); }
+void operator delete(void* ptr) noexcept { trackedFree(ptr); }
+void operator delete[](void* ptr) noexcept { trackedFree(ptr); }
+void operator delete(void* ptr, size_t) noexcept { trackedFree(ptr); }
+void operator delete[](void* ptr, size_t) noexcept { trackedFree(ptr); }
+
+static double threadCpuMicros() {
+    timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/*
+ Mirrors the Arduino loopTask: setup() once, then loop() forever. loop() is run as its pass and the sleep that follows
+ (see loop() in main.cpp), so that only the pass is timed.
+*/
+static void appTask() {
+    setup();
+    while (true) {
+        loopPasses++;
+        double wall = (double)sim::nowMicros();
+        double cpu = threadCpuMicros();
+        uint32_t wakeIn = runLoopPass();
+        if (measuringLoop) {
+            std::lock_guard<std::mutex> lock(samplesMutex);
+            loopSamples.push_back({ (double)sim::nowMicros() - wall, threadCpuMicros() - cpu });
+        }
+        ulTaskNotifyTake(pdTRUE, wakeIn == LOOP_WAKE_NEVER ? portMAX_DELAY : pdMS_TO_TICKS(wakeIn));
+    }
+}
+
+static double percentile(std::vector<double> values, double p) {
+    if (values.empty()) {
+        return 0;
+    }
+    std::sort(values.begin(), values.end());
+    return values[std::min(values.size() - 1, (size_t)(p / 100.0 * values.size()))];
+}
+
+static double mean(const std::vector<double>& values) {
+    return values.empty() ? 0 : std::accumulate(values.begin(), values.end(), 0.0) / values.size();
+}
+
+static void report(const char* name, double value, const char* unit) {
+    printf("%-40s %12.3f %s\n", name, value, unit);
+}
+
+static void reportDistribution(const char* name, const std::vector<double>& values, const char* unit) {
+    std::string prefix = name;
+    report((prefix + ".mean").c_str(), mean(values), unit);
+    report((prefix + ".p50").c_str(), percentile(values, 50), unit);
+    report((prefix + ".p95").c_str(), percentile(values, 95), unit);
+    report((prefix + ".max").c_str(), values.empty() ? 0 : *std::max_element(values.begin(), values.end()), unit);
+}
+
+// Polls until the condition holds, returning false on timeout
+template<typename Condition>
+static bool waitFor(Condition condition, uint32_t timeoutMs) {
+    uint64_t deadline = sim::nowMicros() + timeoutMs * 1000ull;
+    while (!condition()) {
+        if (sim::nowMicros() > deadline) {
+            return false;
+        }
+        sim::sleepFor(200);
+    }
+    return true;
+}
+
+// The time the given bulb first received a write of the given value after the given time, 0 if not yet
+static uint64_t writeAfter(sim::BulbModel* bulb, bool value, uint64_t after) {
+    for (const sim::PowerWrite& write : bulb->writes()) {
+        if (write.atMicros >= after && write.value == value) {
+            return write.atMicros;
+        }
+    }
+    return 0;
+}
+
+// The write itself, or nullptr if there isn't one
+static const sim::PowerWrite* findWriteAfter(sim::BulbModel* bulb, bool value, uint64_t after) {
+    for (const sim::PowerWrite& write : bulb->writes()) {
+        if (write.atMicros >= after && write.value == value) {
+            return &write;
+        }
+    }
+    return nullptr;
+}
+
+// Whether the firmware reports every bulb's link running at the given interval (1.25ms units)
+static bool allAtInterval(uint16_t interval) {
+    for (sim::BulbModel* bulb : sim::bulbs()) {
+        NimBLEConnInfo connInfo;
+        if (!getBulbConnInfo(NimBLEAddress(bulb->mac()), connInfo) || connInfo.getConnInterval() != interval) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Whether the firmware considers the bulb connected and ready to control
+static bool bulbReady(sim::BulbModel* bulb) {
+    NimBLEConnInfo connInfo;
+    return getBulbConnInfo(NimBLEAddress(bulb->mac()), connInfo);
+}
+
+static size_t readyBulbs() {
+    return std::count_if(sim::bulbs().begin(), sim::bulbs().end(), bulbReady);
+}
+
+static bool allWritten(bool value, uint64_t after) {
+    for (sim::BulbModel* bulb : sim::bulbs()) {
+        if (!writeAfter(bulb, value, after)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void fail(const char* stage) {
+    printf("FAILED: timed out waiting for %s\n", stage);
+    fflush(stdout);
+    std::_Exit(1);
+}
+
+/*
+ Checks the sensor resume timing edge cases against nextSensorState() directly, returning how many were checked.
+ Exits on the first one that doesn't hold.
+*/
+static int checkResumeTiming() {
+    struct Case {
+        const char* name;
+        SensorState state;
+        int8_t report;
+        unsigned long resumedAt;
+        unsigned long now;
+        SensorState expected;
+    };
+    const unsigned long buffer = 10000;
+    const unsigned long nearWrap = (unsigned long)-1 - 100;
+    const Case cases[] = {
+        { "no frame yet", SENSOR_RESUMING, -1, 5000, 5000, SENSOR_RESUMING },
+        { "first frame is blind", SENSOR_RESUMING, 0, 5000, 5100, SENSOR_ARMED },
+        { "first frame reports presence", SENSOR_RESUMING, 1, 5000, 5100, SENSOR_LIVE },
+        { "presence while armed", SENSOR_ARMED, 1, 5000, 8000, SENSOR_LIVE },
+        { "absent at the buffer", SENSOR_ARMED, 0, 5000, 5000 + buffer, SENSOR_ARMED },
+        { "absent just past the buffer", SENSOR_ARMED, 0, 5000, 5000 + buffer + 1, SENSOR_LIVE },
+        { "sensor never sends a frame", SENSOR_RESUMING, -1, 5000, 5000 + buffer + 1, SENSOR_LIVE },
+        { "millis() wraps while armed", SENSOR_ARMED, 0, nearWrap, 50, SENSOR_ARMED },
+        { "millis() wraps past the buffer", SENSOR_ARMED, 0, nearWrap, nearWrap + buffer + 1, SENSOR_LIVE },
+        { "live ignores blind frames", SENSOR_LIVE, 0, 5000, 5100, SENSOR_LIVE },
+        { "paused stays paused", SENSOR_PAUSED, 1, 5000, 5000 + buffer + 1, SENSOR_PAUSED },
+    };
+    for (const Case& c : cases) {
+        if (nextSensorState(c.state, c.report, c.resumedAt, c.now, buffer) != c.expected) {
+            printf("FAILED: sensor resume timing, %s\n", c.name);
+            fflush(stdout);
+            std::_Exit(1);
+        }
+    }
+    return sizeof(cases) / sizeof(cases[0]);
+}
+
+// Collects everything a logger writes out, standing in for the serial port
+class CapturedOutput : public Print {
+public:
+    size_t write(uint8_t c) override {
+        return write(&c, 1);
+    }
+    size_t write(const uint8_t* buffer, size_t size) override {
+        std::lock_guard<std::mutex> lock(mutex);
+        bytes.insert(bytes.end(), buffer, buffer + size);
+        return size;
+    }
+    std::vector<uint8_t> take() {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::vector<uint8_t> taken;
+        taken.swap(bytes);
+        return taken;
+    }
+    // Holds up whatever writes next until the returned lock is released, like a serial port that's busy
+    std::unique_lock<std::mutex> hold() {
+        return std::unique_lock<std::mutex>(mutex);
+    }
+
+private:
+    std::mutex mutex;
+    std::vector<uint8_t> bytes;
+};
+
+/*
+ Writes the trace of the benchmark run to a file, decoding it on the way like a serial monitor reading the ESP32's would,
+ so the answers to serial commands can be taken out of it and anything that wouldn't replay is counted
+*/
+class TraceFileOutput : public Print {
+public:
+    explicit TraceFileOutput(FILE* file) : file(file) {}
+    size_t write(uint8_t c) override {
+        return write(&c, 1);
+    }
+    size_t write(const uint8_t* buffer, size_t size) override {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (size_t i = 0; i < size; i++) {
+            switch (decoder.feed(buffer[i])) {
+            case TraceDecoder::HEADER:
+                headers++;
+                break;
+            case TraceDecoder::RECORD:
+                records++;
+                break;
+            case TraceDecoder::CORRUPT:
+                corrupt++;
+                break;
+            case TraceDecoder::TEXT:
+                text += (char)decoder.text();
+                break;
+            default:
+                break;
+            }
+        }
+        return fwrite(buffer, 1, size, file);
+    }
+
+    std::string takeText() {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::string taken;
+        taken.swap(text);
+        return taken;
+    }
+
+    // Only read once the trace has drained
+    uint32_t headers = 0, records = 0, corrupt = 0;
+
+private:
+    FILE* file;
+    std::mutex mutex;
+    TraceDecoder decoder;
+    std::string text;
+};
+
+static TraceFileOutput* traceOutput = nullptr;
+
+// What the firmware has written to Serial since this was last called, which is carried in the trace while one is recorded
+static std::string takeSerialOutput() {
+    return traceOutput ? traceOutput->takeText() : sim::takeConsoleOutput();
+}
+
+static bool waitForDrained(BinaryLog& log) {
+    return waitFor([&log] { return log.drained(); }, 5000);
+}
+
+/*
+ Logs a set of entries through a text and a binary logger, then checks that the text logger wrote what ArduinoLog would
+ have and that decoding the binary output gives back the same lines. Returns how many entries were checked, exits on a mismatch.
+ Also reports what an entry costs the caller, what formatting it straight away would have cost and the bytes each output takes.
+*/
+static int checkLogRoundTrip() {
+    static BinaryLog textLog, binaryLog;
+    static CapturedOutput textOutput, binaryOutput;
+    textLog.begin(LOG_LEVEL_VERBOSE, &textOutput);
+    binaryLog.begin(LOG_LEVEL_VERBOSE, &binaryOutput, true);
+
+    char address[18] = "fe:2e:97:4e:16:ba";
+    std::string longName(100, 'x');
+    unsigned long elapsed = 123456;
+    const char* expected[] = {
+        "I: Turned the bulb 'fe:2e:97:4e:16:ba' on",
+        "E: Failed to connect to 'fe:2e:97:4e:16:ba'!",
+        "T: Powered 2 bulb(s) off, first acknowledged after 22547 us and last after 24790 us (spread of 2243 us)",
+        "W: -5 1 true F 0xff 0b101 c 2.50 %",
+        "V: The change reached the app 123456 us after its frame was received (70 frames so far)",
+        "I: 1/2 bulbs are unconnected, resuming scan",
+        "T: Missing ? and ?",
+        "I: -1234567 is a long",
+    };
+    auto logAll = [&](BinaryLog& log) {
+        log.infoln("Turned the bulb '%s' %s", address, true ? "on" : "off");
+        log.errorln("Failed to connect to '%s'!", BULB_MAC_ADDRESSES[0]);
+        log.traceln("Powered %d bulb(s) %s, first acknowledged after %u us and last after %u us (spread of %u us)",
+            2, "off", 22547u, 24790u, 24790u - 22547u);
+        log.warningln("%d %u %T %t %X %B %c %F %%", -5, 1u, true, false, 255, 5, 'c', 2.5);
+        log.verboseln("The change reached the app %l us after its frame was received (%u frames so far)", elapsed, 70u);
+        log.infoln("%d/%d bulbs are unconnected, resuming scan", 1, 2);
+        log.traceln("Missing %s and %d");
+        log.infoln("%l is a long", -1234567L);
+    };
+    logAll(textLog);
+    logAll(binaryLog);
+    // A string longer than an entry can hold is cut short rather than spilling into the next entry
+    binaryLog.infoln("%s", longName.c_str());
+    if (!waitForDrained(textLog) || !waitForDrained(binaryLog)) {
+        fail("the log to drain");
+    }
+
+    std::vector<uint8_t> text = textOutput.take();
+    std::vector<uint8_t> binary = binaryOutput.take();
+    std::vector<std::string> textLines, decodedLines;
+    std::string line;
+    for (uint8_t c : text) {
+        if (c == '\n') {
+            textLines.push_back(line);
+            line.clear();
+        } else {
+            line += (char)c;
+        }
+    }
+    LogStreamDecoder decoder;
+    for (uint8_t c : binary) {
+        if (decoder.feed(c)) {
+            // Drop the timestamp the decoder puts in front
+            decodedLines.push_back(strchr(decoder.line(), ']') + 2);
+        }
+    }
+    int count = sizeof(expected) / sizeof(expected[0]);
+    if ((int)textLines.size() != count || (int)decodedLines.size() != count + 1) {
+        printf("FAILED: log round trip, got %d text and %d decoded lines\n", (int)textLines.size(), (int)decodedLines.size());
+        fflush(stdout);
+        std::_Exit(1);
+    }
+    for (int i = 0; i < count; i++) {
+        if (textLines[i] != expected[i] || decodedLines[i] != expected[i]) {
+            printf("FAILED: log round trip, expected '%s' but got '%s' and decoded '%s'\n", expected[i], textLines[i].c_str(),
+                decodedLines[i].c_str());
+            fflush(stdout);
+            std::_Exit(1);
+        }
+    }
+    if (decodedLines[count].size() >= longName.size() || decodedLines[count].compare(3, std::string::npos, longName, 0,
+            decodedLines[count].size() - 3) != 0) {
+        printf("FAILED: log round trip, a long string wasn't cut short\n");
+        fflush(stdout);
+        std::_Exit(1);
+    }
+
+    /*
+     Time the caller's side in bursts the buffer can hold, then the same entry formatted on the spot
+     like ArduinoLog does (without even waiting on the serial port). The drain task is held off during each burst,
+     as on the ESP32 it runs at idle priority, where on the host it would write entries out alongside the burst and
+     the figure would depend on how many cores the host has. The median burst is taken for both, so a burst the host
+     preempted doesn't count.
+    */
+    const int bursts = 200, burstSize = LOG_BUFFER_ENTRIES / 2;
+    std::vector<double> callNanos, formatNanos;
+    for (int burst = 0; burst < bursts; burst++) {
+        {
+            std::unique_lock<std::mutex> serialBusy = binaryOutput.hold();
+            auto start = std::chrono::steady_clock::now();
+            for (int i = 0; i < burstSize; i++) {
+                binaryLog.traceln("Powered %d bulb(s) %s, first acknowledged after %u us and last after %u us (spread of %u us)",
+                    2, "off", 22547u, 24790u, 2243u);
+            }
+            callNanos.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+        }
+        if (!waitForDrained(binaryLog)) {
+            fail("the log to drain");
+        }
+    }
+    if (binaryLog.entriesDropped() != 0) {
+        printf("FAILED: log round trip, %u entries were dropped\n", binaryLog.entriesDropped());
+        fflush(stdout);
+        std::_Exit(1);
+    }
+    size_t binaryBytes = binaryOutput.take().size();
+    uint8_t args[LOG_ENTRY_ARGS_SIZE];
+    LogArgWriter writer(args, sizeof(args));
+    char formatted[256];
+    for (int burst = 0; burst < bursts; burst++) {
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < burstSize; i++) {
+            writer = LogArgWriter(args, sizeof(args));
+            writer.add(2);
+            writer.add("off");
+            writer.add(22547u);
+            writer.add(24790u);
+            writer.add(2243u);
+            formatLogMessage("Powered %d bulb(s) %s, first acknowledged after %u us and last after %u us (spread of %u us)",
+                args, writer.size(), formatted, sizeof(formatted));
+        }
+        formatNanos.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+    }
+    report("log.call_ns", percentile(callNanos, 50) / burstSize, "ns");
+    report("log.inline_format_ns", percentile(formatNanos, 50) / burstSize, "ns");
+    // "T: " and the newline are added to the message in the text output
+    report("log.text_bytes_per_entry", strlen(formatted) + 4.0, "B");
+    report("log.binary_bytes_per_entry", (double)binaryBytes / (bursts * burstSize), "B");
+    return count;
+}
+
+/*
+ Records a set of trace records covering every type and the largest values each field can hold, then checks that decoding
+ the output gives them back along with their order, pass and timing. Returns how many records were checked, exits on a mismatch.
+ Also reports what a record costs loop() and how many bytes it takes.
+*/
+static int checkTraceRoundTrip() {
+    static TraceRecorder recorder;
+    static CapturedOutput output;
+    // Something that isn't a trace first, which the decoder has to skip
+    output.write((const uint8_t*)"HB garbage", 10);
+    recorder.begin(&output, 7, false);
+    std::vector<TraceRecord> expected;
+    std::string expectedText;
+    uint64_t startedAt = sim::nowMicros();
+    for (int type = 0; type < TRACE_RECORD_TYPES; type++) {
+        // TRACE_DROPPED is only ever made by the recorder itself, and TRACE_TEXT by its text output
+        if (type == TRACE_DROPPED || type == TRACE_TEXT) {
+            continue;
+        }
+        for (uint32_t arg : { 0u, 127u, 128u, 0xffffffffu }) {
+            bool samePass = type % 2 == 1;
+            if (!samePass) {
+                recorder.beginPass();
+            }
+            const TraceRecordLayout& layout = TRACE_RECORD_LAYOUTS[type];
+            TraceRecord record = { (TraceRecordType)type, !expected.empty() && samePass, (uint8_t)(layout.bulb ? arg : 0),
+                (uint8_t)(layout.value ? arg >> 1 : 0), layout.arg ? arg : 0, 0 };
+            recorder.record(record.type, record.bulb, record.value, record.arg);
+            expected.push_back(record);
+        }
+        recorder.flush();
+        // Text between the records, like a serial command's answer, mustn't split them or move the clock
+        recorder.textOutput().print(TRACE_RECORD_LAYOUTS[type].name);
+        expectedText += TRACE_RECORD_LAYOUTS[type].name;
+        sim::sleepFor(1000);
+    }
+    uint64_t endedAt = sim::nowMicros();
+    std::vector<uint8_t> bytes = output.take();
+    TraceDecoder decoder;
+    std::vector<TraceRecord> decoded;
+    std::string text;
+    uint64_t previousMicros = 0;
+    for (uint8_t c : bytes) {
+        TraceDecoder::Result result = decoder.feed(c);
+        if (result == TraceDecoder::CORRUPT || (result == TraceDecoder::HEADER && decoder.bulbCount() != 7)) {
+            printf("FAILED: trace round trip, the decoder rejected the trace\n");
+            fflush(stdout);
+            std::_Exit(1);
+        }
+        if (result == TraceDecoder::RECORD) {
+            decoded.push_back(decoder.record());
+        } else if (result == TraceDecoder::TEXT) {
+            text += (char)decoder.text();
+        }
+    }
+    if (text != expectedText) {
+        printf("FAILED: trace round trip, the text decoded as '%s'\n", text.c_str());
+        fflush(stdout);
+        std::_Exit(1);
+    }
+    if (decoded.size() != expected.size()) {
+        printf("FAILED: trace round trip, recorded %d records but decoded %d\n", (int)expected.size(), (int)decoded.size());
+        fflush(stdout);
+        std::_Exit(1);
+    }
+    for (size_t i = 0; i < expected.size(); i++) {
+        const TraceRecord& want = expected[i];
+        const TraceRecord& got = decoded[i];
+        // The recorder uses the 32-bit micros() like the ESP32, so the times are compared as that
+        bool inTime = (uint32_t)(got.micros - (uint32_t)startedAt) <= endedAt - startedAt && got.micros >= previousMicros;
+        if (got.type != want.type || got.samePass != want.samePass || got.bulb != want.bulb || got.value != want.value
+                || got.arg != want.arg || !inTime) {
+            printf("FAILED: trace round trip, record %d (%s) didn't decode to what was recorded\n", (int)i,
+                TRACE_RECORD_LAYOUTS[want.type].name);
+            fflush(stdout);
+            std::_Exit(1);
+        }
+        previousMicros = got.micros;
+    }
+    // A reader that joins part way through, like a serial monitor opened late, picks up at the next sync header
+    TraceDecoder joining;
+    std::vector<TraceRecord> joined;
+    for (size_t i = bytes.size() / 2; i < bytes.size(); i++) {
+        if (joining.feed(bytes[i]) == TraceDecoder::RECORD) {
+            joined.push_back(joining.record());
+        }
+    }
+    bool joinedInStep = !joined.empty() && joined.size() < decoded.size();
+    for (size_t i = 0; joinedInStep && i < joined.size(); i++) {
+        const TraceRecord& want = decoded[decoded.size() - joined.size() + i];
+        joinedInStep = joined[i].type == want.type && joined[i].arg == want.arg && (uint32_t)joined[i].micros == (uint32_t)want.micros;
+    }
+    if (!joinedInStep) {
+        printf("FAILED: trace round trip, a decoder joining part way through didn't pick up the rest of the trace\n");
+        fflush(stdout);
+        std::_Exit(1);
+    }
+    // A restart part way through starts the clock again
+    uint8_t header[TRACE_HEADER_SIZE];
+    encodeTraceHeader(7, header);
+    for (uint8_t c : header) {
+        if (decoder.feed(c) == TraceDecoder::HEADER && decoder.record().micros != 0) {
+            printf("FAILED: trace round trip, a second header didn't restart the clock\n");
+            fflush(stdout);
+            std::_Exit(1);
+        }
+    }
+
+    // Time the caller's side in bursts the buffer can hold, like a busy pass of loop() would make
+    const int bursts = 200, burstSize = TRACE_BUFFER_ENTRIES / 2;
+    uint64_t callNanos = 0;
+    for (int burst = 0; burst < bursts; burst++) {
+        auto start = std::chrono::steady_clock::now();
+        recorder.beginPass();
+        for (int i = 0; i < burstSize; i++) {
+            recorder.record(TRACE_POWER_WRITE, i % 4, i % 2, burst);
+        }
+        callNanos += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+        recorder.flush();
+    }
+    if (recorder.recordsDropped() != 0) {
+        printf("FAILED: trace round trip, %u records were dropped\n", recorder.recordsDropped());
+        fflush(stdout);
+        std::_Exit(1);
+    }
+    report("trace.record_ns", (double)callNanos / (bursts * burstSize), "ns");
+    report("trace.bytes_per_record", (double)output.take().size() / (bursts * burstSize), "B");
+    return expected.size();
+}
+
+/*
+ Asks the firmware for its telemetry with the "stats" serial command and reports what it says about every stage,
+ totalled across the bulbs, along with how long the command took to be answered. Exits if the answer is malformed.
+*/
+static void readTelemetry() {
+    sim::captureConsole();
+    takeSerialOutput();
+    uint64_t askedAt = sim::nowMicros();
+    sim::consoleInput("stats\n");
+    std::string output;
+    if (!waitFor([&output] {
+            output += takeSerialOutput();
+            return output.find("\nend\n") != std::string::npos;
+        }, 5000)) {
+        fail("the telemetry to be written");
+    }
+    report("telemetry.command_ms", (sim::nowMicros() - askedAt) / 1000.0, "ms");
+
+    size_t bulbLines = 0;
+    unsigned long uptime = 0, operational = 0, detecting = 0;
+    unsigned headerBulbs = 0;
+    uint32_t reconnects = 0, failedWrites = 0, pauseToggles = 0, evictions = 0, writeRetries = 0, coalesced = 0, pausesAvoided = 0;
+    uint32_t stageCounts[STAGE_COUNT] = {}, stageMax[STAGE_COUNT] = {};
+    double stageTotals[STAGE_COUNT] = {};
+    size_t start = 0, end;
+    while ((end = output.find('\n', start)) != std::string::npos) {
+        std::string line = output.substr(start, end - start);
+        start = end + 1;
+        char address[18], stage[16];
+        unsigned connected, connects, lineReconnects, lineFailedWrites, linePauseToggles, lineEvictions, lineWriteRetries,
+            lineCoalesced, linePausesAvoided, count, mean, p50, p99, max;
+        if (sscanf(line.c_str(), "stats uptime_ms=%lu bulbs=%u operational_ms=%lu detecting_ms=%lu", &uptime, &headerBulbs,
+                &operational, &detecting) == 4) {
+            continue;
+        }
+        if (sscanf(line.c_str(), "bulb %17s connected=%u connects=%u reconnects=%u failed_writes=%u pause_toggles=%u evictions=%u"
+                " write_retries=%u coalesced=%u pauses_avoided=%u", address, &connected, &connects, &lineReconnects,
+                &lineFailedWrites, &linePauseToggles, &lineEvictions, &lineWriteRetries, &lineCoalesced, &linePausesAvoided) == 10) {
+            bulbLines++;
+            reconnects += lineReconnects;
+            failedWrites += lineFailedWrites;
+            pauseToggles += linePauseToggles;
+            evictions += lineEvictions;
+            writeRetries += lineWriteRetries;
+            coalesced += lineCoalesced;
+            pausesAvoided += linePausesAvoided;
+        } else if (sscanf(line.c_str(), "stage %17s %15s n=%u mean_us=%u p50_us=%u p99_us=%u max_us=%u",
+                address, stage, &count, &mean, &p50, &p99, &max) == 7) {
+            for (int i = 0; i < STAGE_COUNT; i++) {
+                if (strcmp(stage, TELEMETRY_STAGE_NAMES[i]) == 0) {
+                    stageCounts[i] += count;
+                    stageTotals[i] += (double)mean * count;
+                    stageMax[i] = std::max(stageMax[i], max);
+                }
+            }
+        }
+    }
+    if (bulbLines != sim::bulbs().size() || !operational || !detecting || !stageCounts[STAGE_WRITE_ACK] || !stageCounts[STAGE_EDGE_TO_ACK]) {
+        printf("FAILED: malformed telemetry:\n%s", output.c_str());
+        fflush(stdout);
+        std::_Exit(1);
+    }
+    char name[64];
+    for (int i = 0; i < STAGE_COUNT; i++) {
+        snprintf(name, sizeof(name), "telemetry.%s.n", TELEMETRY_STAGE_NAMES[i]);
+        report(name, stageCounts[i], "");
+        snprintf(name, sizeof(name), "telemetry.%s.mean_us", TELEMETRY_STAGE_NAMES[i]);
+        report(name, stageCounts[i] ? stageTotals[i] / stageCounts[i] : 0, "us");
+        snprintf(name, sizeof(name), "telemetry.%s.max_us", TELEMETRY_STAGE_NAMES[i]);
+        report(name, stageMax[i], "us");
+    }
+    report("telemetry.operational_ms", operational, "ms");
+    report("telemetry.detecting_ms", detecting, "ms");
+    report("telemetry.reconnects", reconnects, "");
+    report("telemetry.failed_writes", failedWrites, "");
+    report("telemetry.pause_toggles", pauseToggles, "");
+    report("telemetry.evictions", evictions, "");
+    report("telemetry.write_retries", writeRetries, "");
+    report("telemetry.coalesced_commands", coalesced, "");
+    report("telemetry.pauses_avoided", pausesAvoided, "");
+}
+
+/*
+ Shrinks the connection pool a slot at a time, so more and more of the bulbs have to be evicted and reconnected to be
+ switched, timing presence edges from the sensor to the write reaching the bulbs that were connected at the time and
+ the ones that weren't. The full pool is restored and the room emptied afterwards, so this returns false.
+*/
+static bool measureConnectionPool(bool present, int edges) {
+    size_t bulbCount = sim::bulbs().size();
+    for (size_t outOfPool = 1; outOfPool < bulbCount; outOfPool++) {
+        size_t poolSize = bulbCount - outOfPool;
+        setConnectionPoolSize(poolSize);
+        std::vector<double> resident, evicted;
+        for (int i = 0; i < edges; i++) {
+            if (!waitFor([poolSize] { return readyBulbs() == poolSize; }, 20000)) {
+                fail("the connection pool to settle");
+            }
+            sim::sleepFor((500 + sim::random(1000)) * 1000ull);
+            std::vector<bool> wasResident;
+            for (sim::BulbModel* bulb : sim::bulbs()) {
+                wasResident.push_back(bulbReady(bulb));
+            }
+            present = !present;
+            uint64_t flippedAt = sim::nowMicros();
+            sim::sensor().setPresence(present);
+            if (!waitFor([present, flippedAt] { return allWritten(present, flippedAt); }, 10000 * (outOfPool + 1))) {
+                fail("a presence edge to reach every bulb through the connection pool");
+            }
+            uint64_t edgeAt = sim::sensor().lastEdgeMicros();
+            for (size_t j = 0; j < bulbCount; j++) {
+                double latency = (writeAfter(sim::bulbs()[j], present, flippedAt) - edgeAt) / 1000.0;
+                (wasResident[j] ? resident : evicted).push_back(latency);
+            }
+        }
+        std::string prefix = "pool.out_" + std::to_string(outOfPool);
+        reportDistribution((prefix + ".resident_edge_ms").c_str(), resident, "ms");
+        reportDistribution((prefix + ".evicted_edge_ms").c_str(), evicted, "ms");
+    }
+    setConnectionPoolSize(NIMBLE_MAX_CONNECTIONS);
+    if (!waitFor([] {
+            return std::all_of(sim::bulbs().begin(), sim::bulbs().end(), [](sim::BulbModel* bulb) {
+                return bulbReady(bulb) && bulb->subscribed();
+            });
+        }, 30000)) {
+        fail("every bulb to rejoin the connection pool");
+    }
+    if (present) {
+        uint64_t flippedAt = sim::nowMicros();
+        sim::sensor().setPresence(present = false);
+        if (!waitFor([flippedAt] { return allWritten(false, flippedAt); }, 10000)) {
+            fail("the room to empty");
+        }
+    }
+    return present;
+}
+
+/*
+ Flickers the presence on and off at the edge of the sensor's range in an empty room whose links have gone idle, so
+ every edge arrives before the bulbs have acknowledged the last one. Commands superseded before they were sent never
+ reach the bulbs, and the echoes of the ones that were must not pause any bulb: once the bulbs have settled, a further
+ edge has to reach every one of them. Leaves the room empty.
+*/
+static void measureFlicker(int flickers) {
+    if (!waitFor([] { return allAtInterval(120); }, 60000)) {
+        fail("every link to go idle");
+    }
+    size_t writesBefore = 0;
+    for (sim::BulbModel* bulb : sim::bulbs()) {
+        writesBefore += bulb->writeCount();
+    }
+    bool present = false;
+    for (int i = 0; i < flickers * 2; i++) {
+        sim::sensor().setPresence(present = !present);
+        sim::sleepFor((sim::config().sensorFrameIntervalMs + 20 + sim::random(60)) * 1000ull);
+    }
+    uint64_t lastEdgeAt = sim::sensor().lastEdgeMicros();
+    // Settled once every bulb is off and nothing has been written to any of them for a second
+    if (!waitFor([] {
+            uint64_t lastWriteAt = 0;
+            for (sim::BulbModel* bulb : sim::bulbs()) {
+                std::vector<sim::PowerWrite> writes = bulb->writes();
+                if (bulb->poweredOn()) {
+                    return false;
+                }
+                lastWriteAt = std::max(lastWriteAt, writes.empty() ? 0 : writes.back().atMicros);
+            }
+            return sim::nowMicros() - lastWriteAt > 1000000;
+        }, 20000)) {
+        fail("the bulbs to settle after the presence flickered");
+    }
+    size_t writes = 0;
+    uint64_t settledAt = lastEdgeAt;
+    for (sim::BulbModel* bulb : sim::bulbs()) {
+        writes += bulb->writeCount();
+        settledAt = std::max(settledAt, bulb->writes().back().atMicros);
+    }
+    report("flicker.edges", flickers * 2, "");
+    report("flicker.writes_per_bulb", (double)(writes - writesBefore) / sim::bulbs().size(), "");
+    report("flicker.last_edge_to_settled_ms", (settledAt - lastEdgeAt) / 1000.0, "ms");
+
+    uint64_t flippedAt = sim::nowMicros();
+    sim::sensor().setPresence(true);
+    if (!waitFor([flippedAt] { return allWritten(true, flippedAt); }, 10000)) {
+        fail("every bulb to still be controlled after the presence flickered");
+    }
+    sim::sleepFor(1000000);
+    flippedAt = sim::nowMicros();
+    sim::sensor().setPresence(false);
+    if (!waitFor([flippedAt] { return allWritten(false, flippedAt); }, 10000)) {
+        fail("the room to empty");
+    }
+}
+
+// Rough ESP32-S3 figures for the current estimate, good for comparing builds rather than predicting battery life
+// The CPU running with the radio idle, and light sleeping with the BLE controller in modem sleep
+const double ACTIVE_MA = 40;
+const double LIGHT_SLEEP_MA = 0.24;
+// Waking from light sleep to run briefly and going back to sleep, about 0.5ms at the active current
+const double WAKEUP_UC = 20;
+// The radio's share of a connection event, a little under 0.2ms of receiving and transmitting at about 90mA
+const double CONN_EVENT_UC = 15;
+// How much longer than the sensor's frame interval a presence change may take to reach the first power write while asleep
+const double SLEEP_EDGE_BUDGET_MS = 50;
+
+/*
+ Watches an empty room whose links have gone idle, counting what wakes the ESP32 and how long it light sleeps for,
+ then estimates the average current from that. Then times presence edges arriving while it sleeps, from the sensor's
+ presence output changing to the first power write, which must stay within a frame interval plus SLEEP_EDGE_BUDGET_MS.
+ Leaves the room empty.
+*/
+static void measureLowPowerIdle(int edges) {
+    bool sleeps = LOW_POWER_IDLE && SENSOR_PRESENCE_PIN >= 0 && sim::config().sensorIo2Wired;
+    if (!waitFor([sleeps] { return allAtInterval(120) && (sim::lightSleeping() || !sleeps); }, 60000)) {
+        fail("the idle detector to light sleep");
+    }
+    uint64_t windowStart = sim::nowMicros();
+    uint64_t sleptBefore = sim::lightSleepMicros();
+    uint64_t loopBefore = loopPasses;
+    uint64_t uartBefore = sim::hotPathCalls(sim::HOT_PATH_UART);
+    uint64_t notifyBefore = sim::hotPathCalls(sim::HOT_PATH_NOTIFY);
+    uint64_t gpioBefore = sim::gpioWakeups();
+    sim::sleepFor(10000000);
+    double minutes = (sim::nowMicros() - windowStart) / 60e6;
+    double loopWakeups = (loopPasses - loopBefore) / minutes;
+    double uartWakeups = (sim::hotPathCalls(sim::HOT_PATH_UART) - uartBefore) / minutes;
+    double notifyWakeups = (sim::hotPathCalls(sim::HOT_PATH_NOTIFY) - notifyBefore) / minutes;
+    double gpioWakeups = (sim::gpioWakeups() - gpioBefore) / minutes;
+    double sleptFraction = (sim::lightSleepMicros() - sleptBefore) / (minutes * 60e6);
+    // The radio wakes for every connection event whatever the CPU is doing
+    double connEvents = 0;
+    for (sim::BulbModel* bulb : sim::bulbs()) {
+        NimBLEConnInfo connInfo;
+        if (getBulbConnInfo(NimBLEAddress(bulb->mac()), connInfo)) {
+            connEvents += 60000.0 / (connInfo.getConnInterval() * 1.25);
+        }
+    }
+    double wakeups = loopWakeups + uartWakeups + notifyWakeups + gpioWakeups;
+    report("idle.wakeups_per_min", wakeups, "/min");
+    report("idle.loop_wakeups_per_min", loopWakeups, "/min");
+    report("idle.uart_wakeups_per_min", uartWakeups, "/min");
+    report("idle.gpio_wakeups_per_min", gpioWakeups, "/min");
+    report("idle.conn_events_per_min", connEvents, "/min");
+    report("idle.light_sleep_pct", 100.0 * sleptFraction, "%");
+    double radioMa = connEvents / 60 * CONN_EVENT_UC / 1000;
+    report("power.estimated_ma", sleptFraction * LIGHT_SLEEP_MA + (1 - sleptFraction) * ACTIVE_MA
+        + wakeups / 60 * WAKEUP_UC / 1000 + radioMa, "mA");
+    report("power.always_awake_ma", ACTIVE_MA + radioMa, "mA");
+
+    std::vector<double> edgeToWrite;
+    bool present = false;
+    for (int i = 0; i < edges * 2 && sleeps; i++) {
+        sim::sleepFor((500 + sim::random(1000)) * 1000ull);
+        if (!waitFor([] { return sim::lightSleeping(); }, 30000)) {
+            fail("the detector to light sleep between presence edges");
+        }
+        uint64_t flippedAt = sim::nowMicros();
+        sim::sensor().setPresence(present = !present);
+        if (!waitFor([present, flippedAt] { return allWritten(present, flippedAt); }, 10000)) {
+            fail("a presence edge to wake the detector and reach every bulb");
+        }
+        uint64_t firstIssued = UINT64_MAX;
+        for (sim::BulbModel* bulb : sim::bulbs()) {
+            firstIssued = std::min(firstIssued, findWriteAfter(bulb, present, flippedAt)->issuedAtMicros);
+        }
+        edgeToWrite.push_back((firstIssued - flippedAt) / 1000.0);
+    }
+    reportDistribution("sleep.edge_to_write_ms", edgeToWrite, "ms");
+    double budget = sim::config().sensorFrameIntervalMs + SLEEP_EDGE_BUDGET_MS;
+    report("sleep.edge_to_write_budget_ms", budget, "ms");
+    report("sleep.frames_lost", sim::sensor().framesLost(), "");
+    if (!edgeToWrite.empty() && *std::max_element(edgeToWrite.begin(), edgeToWrite.end()) > budget) {
+        printf("FAILED: a presence edge took longer than %.0fms to reach a power write while asleep\n", budget);
+        fflush(stdout);
+        std::_Exit(1);
+    }
+}
+
+// An assumption for comparing against a runtime change: uploading the firmware with esptool over USB, not counting the build
+const double REFLASH_UPLOAD_MS = 15000;
+// A bulb that isn't in BULB_MAC_ADDRESSES, to add at runtime
+const char* ADDED_BULB_MAC = "fe:2e:97:4e:16:bc";
+
+// Asks for the settings with the "config" serial command and returns the line written, exits if there's no answer
+static std::string readSettings() {
+    sim::captureConsole();
+    takeSerialOutput();
+    sim::consoleInput("config\n");
+    std::string output;
+    size_t at = std::string::npos;
+    if (!waitFor([&output, &at] {
+            output += takeSerialOutput();
+            at = output.find("config version=");
+            return at != std::string::npos && output.find('\n', at) != std::string::npos;
+        }, 5000)) {
+        fail("the settings to be written");
+    }
+    return output.substr(at, output.find('\n', at) - at);
+}
+
+/*
+ Changes the settings over serial as someone would at runtime, timing each change from the command to it taking effect:
+ adding a bulb until it's connected and switched by the next presence edge, changing the sensor's latency until its
+ reports are trusted again, and removing the bulb. The bulb is then added back, which has to take a single write to
+ switch, and removed again. None of this may drop another bulb's link. Each is compared against
+ reflashing a changed config.h, estimated as REFLASH_UPLOAD_MS plus the given time this run took from boot to every bulb
+ being lit. Expects an empty room and leaves it empty, with the settings back to config.h's.
+*/
+static void measureRuntimeConfig(double bootToLitMs) {
+    std::vector<uint64_t> linkedAt;
+    for (sim::BulbModel* bulb : sim::bulbs()) {
+        linkedAt.push_back(bulb->connectedAt());
+    }
+    sim::BulbModel* added = &sim::addBulb(ADDED_BULB_MAC);
+    uint64_t askedAt = sim::nowMicros();
+    sim::consoleInput(std::string("add-bulb ") + ADDED_BULB_MAC + "\n");
+    if (!waitFor([added] { return bulbReady(added) && added->subscribed(); }, 30000)) {
+        fail("the added bulb to connect");
+    }
+    double addMs = (sim::nowMicros() - askedAt) / 1000.0;
+    report("config.add_bulb_to_ready_ms", addMs, "ms");
+    uint64_t flippedAt = sim::nowMicros();
+    sim::sensor().setPresence(true);
+    if (!waitFor([added, flippedAt] { return writeAfter(added, true, flippedAt); }, 10000)) {
+        fail("the added bulb to be switched on");
+    }
+    report("config.added_bulb_edge_to_write_ms", (writeAfter(added, true, flippedAt) - sim::sensor().lastEdgeMicros()) / 1000.0, "ms");
+
+    // Only the latency is sent, which the sensor takes as stop, the command, save and start
+    uint32_t commandsBefore = sim::sensor().commandsReceived();
+    askedAt = sim::nowMicros();
+    sim::consoleInput("sensor-latency 0 10\n");
+    if (!waitFor([commandsBefore] { return sim::sensor().commandsReceived() > commandsBefore && getSensorState() == SENSOR_LIVE; }, 30000)) {
+        fail("the reconfigured sensor's reports to be trusted");
+    }
+    double sensorMs = (sim::nowMicros() - askedAt) / 1000.0;
+    report("config.sensor_change_to_live_ms", sensorMs, "ms");
+    report("config.sensor_commands", sim::sensor().commandsReceived() - commandsBefore, "");
+
+    // Bulbs left paused by the resume stages are controlled again once pausing is turned off
+    sim::consoleInput("pause-on-external-control off\n");
+    sim::sleepFor(100000);
+    flippedAt = sim::nowMicros();
+    sim::sensor().setPresence(false);
+    if (!waitFor([flippedAt] { return allWritten(false, flippedAt); }, 10000)) {
+        fail("every bulb to be switched off with pausing turned off");
+    }
+
+    askedAt = sim::nowMicros();
+    sim::consoleInput(std::string("remove-bulb ") + ADDED_BULB_MAC + "\n");
+    if (!waitFor([added] { return !added->connected(); }, 10000)) {
+        fail("the removed bulb to be disconnected");
+    }
+    report("config.remove_bulb_ms", (sim::nowMicros() - askedAt) / 1000.0, "ms");
+
+    // Added back, the bulb gets its old client again, whose acknowledgements have to reach the new slot
+    sim::consoleInput(std::string("add-bulb ") + ADDED_BULB_MAC + "\n");
+    if (!waitFor([added] { return bulbReady(added) && added->subscribed(); }, 30000)) {
+        fail("the bulb added back to connect");
+    }
+    flippedAt = sim::nowMicros();
+    sim::sensor().setPresence(true);
+    if (!waitFor([added, flippedAt] { return writeAfter(added, true, flippedAt); }, 10000)) {
+        fail("the bulb added back to be switched on");
+    }
+    // Long enough for an unacknowledged write to be retried, see POWER_WRITE_TIMEOUT in main.cpp
+    sim::sleepFor(5000000);
+    std::vector<sim::PowerWrite> writes = added->writes();
+    int readdedWrites = std::count_if(writes.begin(), writes.end(),
+        [flippedAt](const sim::PowerWrite& write) { return write.atMicros >= flippedAt; });
+    report("config.readded_bulb_writes", readdedWrites, "");
+    if (readdedWrites != 1) {
+        printf("FAILED: the bulb added back took %d writes to switch on, its acknowledgements went astray\n", readdedWrites);
+        fflush(stdout);
+        std::_Exit(1);
+    }
+    flippedAt = sim::nowMicros();
+    sim::sensor().setPresence(false);
+    if (!waitFor([flippedAt] { return allWritten(false, flippedAt); }, 10000)) {
+        fail("every bulb to be switched off after adding one back");
+    }
+    sim::consoleInput(std::string("remove-bulb ") + ADDED_BULB_MAC + "\n");
+    if (!waitFor([added] { return !added->connected(); }, 10000)) {
+        fail("the bulb added back to be removed again");
+    }
+    std::string settings = readSettings();
+    if (settings.find(ADDED_BULB_MAC) != std::string::npos || settings.find("pause_on_external_control=0") == std::string::npos
+            || settings.find("sensor_latency_s=0.000/10.000") == std::string::npos) {
+        printf("FAILED: the settings don't show the changes made: %s\n", settings.c_str());
+        fflush(stdout);
+        std::_Exit(1);
+    }
+    int dropped = 0;
+    for (size_t i = 0; i < linkedAt.size(); i++) {
+        dropped += sim::bulbs()[i]->connectedAt() != linkedAt[i] ? 1 : 0;
+    }
+    report("config.links_dropped", dropped, "");
+    if (dropped) {
+        printf("FAILED: changing the settings dropped %d other link(s)\n", dropped);
+        fflush(stdout);
+        std::_Exit(1);
+    }
+
+    commandsBefore = sim::sensor().commandsReceived();
+    sim::consoleInput("reset-config\n");
+    if (!waitFor([commandsBefore] { return sim::sensor().commandsReceived() > commandsBefore && getSensorState() == SENSOR_LIVE; }, 30000)) {
+        fail("the sensor to be live again with the default settings");
+    }
+    double reflashMs = REFLASH_UPLOAD_MS + bootToLitMs;
+    report("config.reflash_estimate_ms", reflashMs, "ms");
+    report("config.add_bulb_speedup", reflashMs / addMs, "x");
+    report("config.sensor_change_speedup", reflashMs / sensorMs, "x");
+}
+
+/*
+ Flips the power of every bulb the firmware still controls with an external switch, pausing them all so it stops
+ the sensor. The room's presence is changed while the sensor is stopped, then the first bulb is flipped back so the
+ firmware resumes the sensor. Returns when the sensor was started, or 0 on timeout.
+*/
+static uint64_t pauseAndResumeSensor(const std::vector<sim::BulbModel*>& controlled, bool present) {
+    // Let the notifications of the firmware's own writes land first, or they would count as external control
+    sim::sleepFor(500000);
+    for (sim::BulbModel* bulb : controlled) {
+        bulb->setExternalPower(!bulb->poweredOn());
+    }
+    if (!waitFor([] { return !sim::sensor().running(); }, 10000)) {
+        return 0;
+    }
+    sim::sensor().setPresence(present);
+    sim::bulbs()[0]->setExternalPower(!sim::bulbs()[0]->poweredOn());
+    if (!waitFor([] { return sim::sensor().running(); }, 10000)) {
+        return 0;
+    }
+    return sim::sensor().startedMicros();
+}
+
+/*
+ Lets a power write to the first bulb time out, which the bulb applies late, and has a retry go through. The bulb is
+ then switched off by a presence edge and on again with an external switch while those writes are still recent. That's
+ external control, which has to pause the bulb (so stops the sensor, as every other bulb was left paused) rather than
+ be taken for a timed out write applied late. The bulb is switched back afterwards so the firmware resumes the sensor.
+ Returns how long the sensor took to stop after the external switch (ms).
+*/
+static double checkExternalControlAfterTimeout() {
+    sim::BulbModel* bulb = sim::bulbs()[0];
+    auto writesAfter = [bulb](bool value, uint64_t after) {
+        std::vector<sim::PowerWrite> writes = bulb->writes();
+        return std::count_if(writes.begin(), writes.end(), [=](const sim::PowerWrite& write) {
+            return write.atMicros >= after && write.value == value;
+        });
+    };
+    sim::Config faultless = sim::config();
+    // Past the firmware's 2s write timeout, and too slow for the first retry as well
+    sim::config().slowWritePct = 100;
+    sim::config().slowWriteMs = 2500;
+    uint64_t flippedAt = sim::nowMicros();
+    sim::sensor().setPresence(true);
+    if (!waitFor([&writesAfter, flippedAt] { return writesAfter(true, flippedAt) >= 1; }, 10000)) {
+        fail("a timed out write to be applied late");
+    }
+    sim::config().slowWritePct = faultless.slowWritePct;
+    sim::config().slowWriteMs = faultless.slowWriteMs;
+    if (!waitFor([&writesAfter, flippedAt] { return writesAfter(true, flippedAt) >= 3; }, 10000)) {
+        fail("a timed out write to be retried");
+    }
+    // Let the retry be acknowledged
+    sim::sleepFor(500000);
+    flippedAt = sim::nowMicros();
+    sim::sensor().setPresence(false);
+    if (!waitFor([bulb, flippedAt] { return writeAfter(bulb, false, flippedAt); }, 10000)) {
+        fail("the bulb to be switched off after a timed out write");
+    }
+    // Let its notification land
+    sim::sleepFor(200000);
+    uint64_t switchedAt = sim::nowMicros();
+    bulb->setExternalPower(true);
+    if (!waitFor([] { return !sim::sensor().running(); }, 10000)) {
+        fail("an external switch after a timed out write to pause the bulb");
+    }
+    double stoppedMs = (sim::nowMicros() - switchedAt) / 1000.0;
+    bulb->setExternalPower(false);
+    if (!waitFor([] { return getSensorState() == SENSOR_LIVE; }, 20000)) {
+        fail("the sensor to resume once the bulb was switched back");
+    }
+    return stoppedMs;
+}
+
+int main(int argc, char** argv) {
+    int edges = 20;
+    int idleEdges = 3;
+    int reconnects = 3;
+    int poolEdges = 5;
+    int flickers = 4;
+    int sleepEdges = 3;
+    FILE* traceFile = nullptr;
+    for (const std::string& arg : sim::configure(argc, argv)) {
+        if (arg.rfind("--edges=", 0) == 0) {
+            edges = atoi(arg.c_str() + 8);
+        } else if (arg.rfind("--idle-edges=", 0) == 0) {
+            idleEdges = atoi(arg.c_str() + 13);
+        } else if (arg.rfind("--reconnects=", 0) == 0) {
+            reconnects = atoi(arg.c_str() + 13);
+        } else if (arg.rfind("--pool-edges=", 0) == 0) {
+            poolEdges = atoi(arg.c_str() + 13);
+        } else if (arg.rfind("--flickers=", 0) == 0) {
+            flickers = atoi(arg.c_str() + 11);
+        } else if (arg.rfind("--sleep-edges=", 0) == 0) {
+            sleepEdges = atoi(arg.c_str() + 14);
+        } else if (arg.rfind("--trace-file=", 0) == 0) {
+            traceFile = fopen(arg.c_str() + 13, "wb");
+            if (!traceFile) {
+                fprintf(stderr, "Failed to open '%s'\n", arg.c_str() + 13);
+                return 2;
+            }
+        } else if (arg.rfind("--nvs-file=", 0) == 0) {
+            sim::loadNvs(arg.substr(11));
+        } else if (arg == "--log") {
+            sim::setConsole(stderr);
+        } else {
+            fprintf(stderr, "Unknown argument '%s'\n", arg.c_str());
+            return 2;
+        }
+    }
+    for (const auto& mac : BULB_MAC_ADDRESSES) {
+        sim::addBulb(mac);
+    }
+    printf("# Hue BLE presence detector benchmark, %d bulbs\n", (int)sim::bulbs().size());
+    sim::printConfig(stdout);
+
+    // The trace is recorded from before setup(), like the ESP32's is when TRACE_OUTPUT_ENABLED is set
+    if (traceFile) {
+        traceOutput = new TraceFileOutput(traceFile);
+        Trace.begin(traceOutput, sim::bulbs().size());
+    }
+
+    // Someone is already in the room when power comes back
+    sim::sensor().setPresence(true);
+    uint64_t bootAt = sim::nowMicros();
+    std::thread(appTask).detach();
+
+    std::vector<uint64_t> readyAt(sim::bulbs().size(), 0);
+    uint64_t sensorLiveAt = 0;
+    if (!waitFor([&readyAt, &sensorLiveAt] {
+            if (!sensorLiveAt && getSensorState() == SENSOR_LIVE) {
+                sensorLiveAt = sim::nowMicros();
+            }
+            bool allReady = true;
+            for (size_t i = 0; i < sim::bulbs().size(); i++) {
+                if (!readyAt[i] && bulbReady(sim::bulbs()[i])) {
+                    readyAt[i] = sim::nowMicros();
+                }
+                allReady = allReady && readyAt[i] && sim::bulbs()[i]->subscribed();
+            }
+            return allReady;
+        }, 120000)) {
+        fail("every bulb to connect");
+    }
+    report("boot.all_connected_ms", (sim::nowMicros() - bootAt) / 1000.0, "ms");
+    std::vector<double> bootLinkToReady;
+    for (size_t i = 0; i < sim::bulbs().size(); i++) {
+        bootLinkToReady.push_back((readyAt[i] - sim::bulbs()[i]->connectedAt()) / 1000.0);
+    }
+    report("boot.link_to_ready_ms.mean", mean(bootLinkToReady), "ms");
+    // How long the bulbs took to come up once the first link was made, which is what connecting them in parallel shortens
+    uint64_t firstLinkAt = UINT64_MAX, lastReadyAt = 0;
+    for (size_t i = 0; i < sim::bulbs().size(); i++) {
+        firstLinkAt = std::min(firstLinkAt, sim::bulbs()[i]->connectedAt());
+        lastReadyAt = std::max(lastReadyAt, readyAt[i]);
+    }
+    report("boot.first_link_to_all_ready_ms", (lastReadyAt - firstLinkAt) / 1000.0, "ms");
+    // The sensor is configured alongside the bulbs connecting, and not at all when its configuration is already saved
+    if (!waitFor([&sensorLiveAt] {
+            if (!sensorLiveAt && getSensorState() == SENSOR_LIVE) {
+                sensorLiveAt = sim::nowMicros();
+            }
+            return sensorLiveAt != 0;
+        }, 60000)) {
+        fail("the sensor's reports to be trusted");
+    }
+    report("boot.sensor_live_ms", (sensorLiveAt - bootAt) / 1000.0, "ms");
+    report("boot.sensor_commands", sim::sensor().commandsReceived(), "");
+    if (!waitFor([bootAt] { return allWritten(true, bootAt); }, 60000)) {
+        fail("every bulb to turn on after boot");
+    }
+    uint64_t lastLit = 0;
+    std::vector<double> bootLinkToWrite;
+    for (sim::BulbModel* bulb : sim::bulbs()) {
+        uint64_t litAt = writeAfter(bulb, true, bootAt);
+        lastLit = std::max(lastLit, litAt);
+        bootLinkToWrite.push_back((litAt - bulb->connectedAt()) / 1000.0);
+    }
+    report("boot.all_lit_ms", (lastLit - bootAt) / 1000.0, "ms");
+    report("boot.link_to_first_write_ms.mean", mean(bootLinkToWrite), "ms");
+
+    // Presence edges, measured from the first sensor frame carrying the new state to the power write reaching each bulb
+    std::vector<double> firstBulb, lastBulb, spread, writeInterval, sensorToApp;
+    bool present = true;
+    // Each pass of loop() is timed while the edges are handled, as once the room is idle loop() only wakes for the next one
+    measuringLoop = true;
+    uint64_t loopWindowStart = sim::nowMicros();
+    uint64_t uartCpuStart = sim::hotPathCpuMicros(sim::HOT_PATH_UART);
+    for (int i = 0; i < edges; i++) {
+        sim::sleepFor((500 + sim::random(1000)) * 1000ull);
+        present = !present;
+        uint64_t flippedAt = sim::nowMicros();
+        sim::sensor().setPresence(present);
+        if (!waitFor([present, flippedAt] { return allWritten(present, flippedAt); }, 10000)) {
+            fail("a presence edge to reach every bulb");
+        }
+        uint64_t edgeAt = sim::sensor().lastEdgeMicros();
+        uint64_t first = UINT64_MAX, last = 0, firstIssued = UINT64_MAX;
+        for (sim::BulbModel* bulb : sim::bulbs()) {
+            const sim::PowerWrite* write = findWriteAfter(bulb, present, flippedAt);
+            firstIssued = std::min(firstIssued, write->issuedAtMicros);
+            first = std::min(first, write->atMicros);
+            last = std::max(last, write->atMicros);
+            writeInterval.push_back(write->intervalUnits * 1.25);
+        }
+        firstBulb.push_back((first - edgeAt) / 1000.0);
+        lastBulb.push_back((last - edgeAt) / 1000.0);
+        spread.push_back((last - first) / 1000.0);
+        sensorToApp.push_back((firstIssued - edgeAt) / 1000.0);
+    }
+    measuringLoop = false;
+    double uartCpuMicros = (double)(sim::hotPathCpuMicros(sim::HOT_PATH_UART) - uartCpuStart);
+    double loopWindowMicros = (double)(sim::nowMicros() - loopWindowStart);
+    // From the first frame carrying the new state starting on the UART to the firmware issuing its first write
+    reportDistribution("edge.sensor_to_app_ms", sensorToApp, "ms");
+    reportDistribution("edge.first_bulb_ms", firstBulb, "ms");
+    reportDistribution("edge.last_bulb_ms", lastBulb, "ms");
+    reportDistribution("edge.bulb_spread_ms", spread, "ms");
+    report("edge.write_interval_ms.mean", mean(writeInterval), "ms");
+
+    /*
+     Someone walking into a room that has been empty for a while, so every link has relaxed to the idle
+     parameters. The connection interval of every link must be reported through getBulbConnInfo().
+    */
+    std::vector<double> idleLastBulb, idleWriteInterval;
+    if (present && idleEdges > 0) {
+        present = false;
+        uint64_t flippedAt = sim::nowMicros();
+        sim::sensor().setPresence(false);
+        if (!waitFor([flippedAt] { return allWritten(false, flippedAt); }, 10000)) {
+            fail("the room to empty");
+        }
+    }
+    for (int i = 0; i < idleEdges; i++) {
+        if (!waitFor([] { return allAtInterval(120); }, 60000)) {
+            fail("every link to go idle");
+        }
+        sim::sleepFor(sim::random(1000) * 1000ull);
+        uint64_t flippedAt = sim::nowMicros();
+        sim::sensor().setPresence(present = true);
+        if (!waitFor([flippedAt] { return allWritten(true, flippedAt); }, 10000)) {
+            fail("an idle presence edge to reach every bulb");
+        }
+        uint64_t edgeAt = sim::sensor().lastEdgeMicros();
+        uint64_t last = 0;
+        for (sim::BulbModel* bulb : sim::bulbs()) {
+            const sim::PowerWrite* write = findWriteAfter(bulb, true, flippedAt);
+            last = std::max(last, write->atMicros);
+            idleWriteInterval.push_back(write->intervalUnits * 1.25);
+        }
+        idleLastBulb.push_back((last - edgeAt) / 1000.0);
+        // Empty the room again, the links stay fast until it has been empty for a while
+        sim::sleepFor(1000000);
+        flippedAt = sim::nowMicros();
+        sim::sensor().setPresence(present = false);
+        if (!waitFor([flippedAt] { return allWritten(false, flippedAt); }, 10000)) {
+            fail("the room to empty");
+        }
+    }
+    reportDistribution("idle_edge.last_bulb_ms", idleLastBulb, "ms");
+    report("idle_edge.write_interval_ms.mean", mean(idleWriteInterval), "ms");
+    if (!present && flickers > 0) {
+        measureFlicker(flickers);
+    }
+    if (!present) {
+        measureLowPowerIdle(sleepEdges);
+    }
+
+    /*
+     Power cut one bulb at the wall and keep the presence changing while it reconnects.
+     Every edge should still reach the other bulbs, an edge that doesn't within a second counts as missed.
+    */
+    sim::BulbModel* flaky = sim::bulbs()[0];
+    const uint32_t powerCutMs = 3000;
+    uint64_t cutAt = sim::nowMicros();
+    flaky->powerCut(powerCutMs);
+    int reconnectEdges = 0, missed = 0;
+    while (sim::nowMicros() < cutAt + powerCutMs * 1000ull || !flaky->subscribed()) {
+        sim::sleepFor((300 + sim::random(400)) * 1000ull);
+        present = !present;
+        uint64_t flippedAt = sim::nowMicros();
+        sim::sensor().setPresence(present);
+        reconnectEdges++;
+        bool reached = waitFor([present, flippedAt, flaky] {
+            return std::all_of(sim::bulbs().begin(), sim::bulbs().end(), [=](sim::BulbModel* bulb) {
+                return bulb == flaky || writeAfter(bulb, present, flippedAt);
+            });
+        }, 1000);
+        missed += reached ? 0 : 1;
+        if (sim::nowMicros() > cutAt + 60000000ull) {
+            fail("the power cut bulb to reconnect");
+        }
+    }
+    report("reconnect.time_ms", (sim::nowMicros() - cutAt) / 1000.0 - powerCutMs, "ms");
+    report("reconnect.presence_events", reconnectEdges, "");
+    report("reconnect.presence_events_missed", missed, "");
+
+    /*
+     Power cut a bulb in an empty room. Hue bulbs come back on when power returns, so the firmware has to
+     write to the bulb as soon as it has reconnected. Timed from the link being established to that write.
+    */
+    std::vector<double> linkToReady, linkToWrite;
+    if (present) {
+        uint64_t flippedAt = sim::nowMicros();
+        sim::sensor().setPresence(present = false);
+        if (!waitFor([flippedAt] { return allWritten(false, flippedAt); }, 10000)) {
+            fail("the room to empty");
+        }
+    }
+    for (int i = 0; i < reconnects; i++) {
+        sim::BulbModel* bulb = sim::bulbs()[i % sim::bulbs().size()];
+        uint64_t cutAt = sim::nowMicros();
+        bulb->powerCut(2000);
+        if (!waitFor([bulb] { return !bulbReady(bulb); }, 10000)
+                || !waitFor([bulb, cutAt] { return bulb->connectedAt() > cutAt && bulbReady(bulb); }, 60000)) {
+            fail("a power cut bulb to reconnect");
+        }
+        linkToReady.push_back((sim::nowMicros() - bulb->connectedAt()) / 1000.0);
+        if (!waitFor([bulb] { return writeAfter(bulb, false, bulb->connectedAt()); }, 10000)) {
+            fail("a power cut bulb to be turned back off");
+        }
+        linkToWrite.push_back((writeAfter(bulb, false, bulb->connectedAt()) - bulb->connectedAt()) / 1000.0);
+        // Let the bulb finish reconnecting before cutting the next one
+        waitFor([bulb] { return bulb->subscribed(); }, 10000);
+    }
+    reportDistribution("reconnect.link_to_ready_ms", linkToReady, "ms");
+    reportDistribution("reconnect.link_to_first_write_ms", linkToWrite, "ms");
+
+    present = measureConnectionPool(present, poolEdges);
+
+    /*
+     Resume the sensor in an occupied room, it must go live on the first frame reporting presence once it is past its
+     blind period. Then again in an empty room, where it has to wait out the resume buffer before turning the bulb off.
+     Every bulb but the first is left paused afterwards.
+    */
+    report("resume.timing_checks", checkResumeTiming(), "");
+    for (sim::BulbModel* bulb : sim::bulbs()) {
+        waitFor([bulb] { return bulb->subscribed() && !bulb->poweredOn(); }, 10000);
+    }
+    uint64_t resumedAt = pauseAndResumeSensor(sim::bulbs(), present = true);
+    bool sawArmed = false;
+    if (!resumedAt || !waitFor([&sawArmed] {
+            sawArmed = sawArmed || getSensorState() == SENSOR_ARMED;
+            return getSensorState() == SENSOR_LIVE;
+        }, 20000)) {
+        fail("the sensor to resume in an occupied room");
+    }
+    uint64_t liveAt = sim::nowMicros();
+    if (!sawArmed) {
+        fail("the sensor to be armed while resuming");
+    }
+    if (!waitFor([resumedAt] { return writeAfter(sim::bulbs()[0], true, resumedAt); }, 10000)) {
+        fail("the resumed bulb to be turned on");
+    }
+    report("resume.present.start_to_live_ms", (liveAt - resumedAt) / 1000.0, "ms");
+    report("resume.present.first_frame_to_write_ms",
+        (writeAfter(sim::bulbs()[0], true, resumedAt) - sim::sensor().lastEdgeMicros()) / 1000.0, "ms");
+    resumedAt = pauseAndResumeSensor({ sim::bulbs()[0] }, present = false);
+    if (!resumedAt || !waitFor([] { return getSensorState() == SENSOR_LIVE; }, 20000)) {
+        fail("the sensor to resume in an empty room");
+    }
+    report("resume.absent.start_to_live_ms", (sim::nowMicros() - resumedAt) / 1000.0, "ms");
+    if (!waitFor([resumedAt] { return writeAfter(sim::bulbs()[0], false, resumedAt); }, 10000)) {
+        fail("the resumed bulb to be turned off");
+    }
+
+    readTelemetry();
+
+    // The cost of a pass of loop() while the presence edges were handled
+    std::vector<double> wall, cpu;
+    {
+        std::lock_guard<std::mutex> lock(samplesMutex);
+        for (const Sample& sample : loopSamples) {
+            wall.push_back(sample.wallMicros);
+            cpu.push_back(sample.cpuMicros);
+        }
+    }
+    if (wall.empty()) {
+        fail("a pass of loop() to be timed");
+    }
+    report("loop.iterations_per_s", wall.size() / (loopWindowMicros / 1e6), "/s");
+    reportDistribution("loop.wall_us", wall, "us");
+    reportDistribution("loop.cpu_us", cpu, "us");
+    report("loop.cpu_busy_pct", 100.0 * std::accumulate(cpu.begin(), cpu.end(), 0.0) / loopWindowMicros, "%");
+    // The app core runs loop() and the sensor's UART event callback
+    report("cpu.app_idle_pct", 100.0 - 100.0 * (std::accumulate(cpu.begin(), cpu.end(), 0.0) + uartCpuMicros) / loopWindowMicros, "%");
+
+    report("pause.after_timeout.switch_to_stop_ms", checkExternalControlAfterTimeout(), "ms");
+
+    measureRuntimeConfig((lastLit - bootAt) / 1000.0);
+
+    report("heap.peak_bytes", heapPeak, "B");
+    report("heap.in_use_bytes", heapInUse, "B");
+    report("scan.callbacks", sim::hotPathCalls(sim::HOT_PATH_SCAN), "");
+    double scanningSeconds = std::max(1.0, (double)NimBLEDevice::getScan()->simScanningMicros()) / 1e6;
+    report("scan.callbacks_per_s", sim::hotPathCalls(sim::HOT_PATH_SCAN) / scanningSeconds, "/s");
+    report("scan.host_packets_per_s", NimBLEDevice::getScan()->simAdvertisementsProcessed() / scanningSeconds, "/s");
+    report("scan.results_peak_bytes", NimBLEDevice::getScan()->simPeakResultBytes(), "B");
+    report("scan.allocations_per_callback",
+        hotPathAllocations[sim::HOT_PATH_SCAN] / std::max(1.0, (double)sim::hotPathCalls(sim::HOT_PATH_SCAN)), "");
+    report("notify.callbacks", sim::hotPathCalls(sim::HOT_PATH_NOTIFY), "");
+    report("notify.allocations_per_callback",
+        hotPathAllocations[sim::HOT_PATH_NOTIFY] / std::max(1.0, (double)sim::hotPathCalls(sim::HOT_PATH_NOTIFY)), "");
+    report("uart.callbacks", sim::hotPathCalls(sim::HOT_PATH_UART), "");
+    report("uart.allocations_per_callback",
+        hotPathAllocations[sim::HOT_PATH_UART] / std::max(1.0, (double)sim::hotPathCalls(sim::HOT_PATH_UART)), "");
+    uint32_t eventQueuePeak, eventsDropped;
+    getBulbEventQueueStats(eventQueuePeak, eventsDropped);
+    report("events.queue_peak_depth", eventQueuePeak, "");
+    report("events.dropped", eventsDropped, "");
+
+    report("log.roundtrip_checks", checkLogRoundTrip(), "");
+    report("log.entries", Log.entriesLogged(), "");
+    report("log.dropped", Log.entriesDropped(), "");
+    report("trace.roundtrip_checks", checkTraceRoundTrip(), "");
+    if (traceOutput) {
+        waitFor([] { return Trace.drained(); }, 5000);
+        report("trace.file_bytes", ftell(traceFile), "B");
+        report("trace.records", traceOutput->records, "");
+        report("trace.dropped", Trace.recordsDropped(), "");
+        fflush(traceFile);
+        // The serial commands answered part way through mustn't have cost the replayer a record or a restart
+        if (traceOutput->corrupt || traceOutput->headers != 1) {
+            printf("FAILED: the trace has %u corrupt record(s) and %u header(s)\n", traceOutput->corrupt, traceOutput->headers);
+            fflush(stdout);
+            std::_Exit(1);
+        }
+    }
+
+    fflush(stdout);
+    // The firmware and host tasks never return, so skip static destructors
+    std::_Exit(0);
+}
@@ -0,0 +1,33 @@
+/*
+ This file contains the state of the presence detector that main.cpp shares with the host-native bench and soak,
+ so they check against the firmware's own definitions.
+*/
+
+#ifndef app_state_h
+#define app_state_h
+
+#include <cstdint>
+
+/*
+ Where the mmWave sensor is in being (re)started. It reports no presence for a few seconds after starting,
+ so its reports are only trusted once it reports presence or SENSOR_RESUME_BUFFER has passed.
+ CONFIGURING (once, at boot) -> RESUMING
+ PAUSED -> RESUMING (started, no frame yet) -> ARMED (frames arriving) -> LIVE (reports are trusted) -> PAUSED
+*/
+enum SensorState : uint8_t {
+    SENSOR_CONFIGURING,
+    SENSOR_PAUSED,
+    SENSOR_RESUMING,
+    SENSOR_ARMED,
+    SENSOR_LIVE
+};
+
+constexpr const char* SENSOR_STATE_NAMES[] = { "configuring", "paused", "resuming", "armed", "live" };
+
+// What runLoopPass() returns when loop() can sleep until something wakes it
+const uint32_t LOOP_WAKE_NEVER = UINT32_MAX;
+
+// The current state of the mmWave sensor
+SensorState getSensorState();
+
+#endif
@@ -0,0 +1,110 @@
+/*
+ This file contains the logger used by the presence detector, a drop-in for ArduinoLog's Log.*ln() calls.
+ A call only copies the format string's address and its arguments into a lock-free ring buffer (see log_format.h),
+ a low priority task formats and writes them out later, so logging never waits on the serial port.
+ When the buffer is full the entry is dropped and counted instead, the count is written out once there is room again.
+*/
+
+#ifndef binary_log_h
+#define binary_log_h
+
+#include <Arduino.h>
+#include <atomic>
+#include <log_format.h>
+
+// How many entries can be waiting to be written out, must be a power of two
+const uint32_t LOG_BUFFER_ENTRIES = 64;
+static_assert((LOG_BUFFER_ENTRIES & (LOG_BUFFER_ENTRIES - 1)) == 0, "LOG_BUFFER_ENTRIES must be a power of two");
+// How many bytes of packed arguments each entry can hold, longer strings are cut short
+const size_t LOG_ENTRY_ARGS_SIZE = 48;
+// How many format strings the binary output keeps ids for before reusing them
+const uint16_t LOG_MAX_FORMATS = 128;
+// The stack size and priority of the task that writes the entries out, which only runs when nothing else wants to
+const uint32_t LOG_TASK_STACK_SIZE = 3072;
+const UBaseType_t LOG_TASK_PRIORITY = tskIDLE_PRIORITY;
+
+class BinaryLog {
+public:
+    BinaryLog();
+
+    /*
+     Starts the task that writes entries to the given output, either as text lines like ArduinoLog
+     or as binary records for the host-side decoder (see LOG_STREAM_MAGIC).
+    */
+    void begin(int level, Print* output, bool binary = false);
+
+    template<typename... Args> void fatalln(const char* format, Args... args) { log(LOG_LEVEL_FATAL, format, args...); }
+    template<typename... Args> void errorln(const char* format, Args... args) { log(LOG_LEVEL_ERROR, format, args...); }
+    template<typename... Args> void warningln(const char* format, Args... args) { log(LOG_LEVEL_WARNING, format, args...); }
+    template<typename... Args> void noticeln(const char* format, Args... args) { log(LOG_LEVEL_NOTICE, format, args...); }
+    template<typename... Args> void infoln(const char* format, Args... args) { log(LOG_LEVEL_INFO, format, args...); }
+    template<typename... Args> void traceln(const char* format, Args... args) { log(LOG_LEVEL_TRACE, format, args...); }
+    template<typename... Args> void verboseln(const char* format, Args... args) { log(LOG_LEVEL_VERBOSE, format, args...); }
+
+    // How many entries have been logged, and how many of those were dropped as the buffer was full
+    uint32_t entriesLogged() const { return logged; }
+    uint32_t entriesDropped() const { return dropped; }
+    // Whether every entry logged so far has been written out
+    bool drained();
+
+private:
+    // An entry is free for the producer at position p when its sequence is p, and ready for the drain task when it's p + 1
+    struct Entry {
+        std::atomic<uint32_t> sequence;
+        const char* format;
+        uint32_t timestamp;
+        uint8_t level;
+        uint8_t size;
+        uint8_t args[LOG_ENTRY_ARGS_SIZE];
+    };
+
+    template<typename... Args>
+    void log(uint8_t entryLevel, const char* format, Args... args) {
+        if (entryLevel > level) {
+            return;
+        }
+        uint32_t position;
+        Entry* entry = reserve(position);
+        if (!entry) {
+            return;
+        }
+        LogArgWriter writer(entry->args, LOG_ENTRY_ARGS_SIZE);
+        (writer.add(args), ...);
+        entry->format = format;
+        entry->timestamp = micros();
+        entry->level = entryLevel;
+        entry->size = writer.size();
+        publish(entry, position);
+    }
+
+    Entry* reserve(uint32_t& position);
+    void publish(Entry* entry, uint32_t position);
+    static void drainTask(void* parameter);
+    bool writeNext();
+    void writeText(const Entry& entry);
+    void writeBinary(const Entry& entry);
+    uint16_t formatId(const char* format);
+    void writeDropped();
+
+    volatile int level;
+    Print* output;
+    bool binary;
+    Entry entries[LOG_BUFFER_ENTRIES];
+    std::atomic<uint32_t> enqueuePosition;
+    // Only moved by the drain task, atomic so drained() can be called from anywhere
+    std::atomic<uint32_t> dequeuePosition;
+    std::atomic<uint32_t> logged;
+    std::atomic<uint32_t> dropped;
+    uint32_t droppedWritten;
+    // Set while the drain task sleeps on an empty buffer, so only the entry that ends the wait has to wake it
+    std::atomic<bool> drainWaiting;
+    TaskHandle_t drainTaskHandle;
+    // The format strings the binary output has sent so far, an entry refers to its format by index
+    const char* formats[LOG_MAX_FORMATS];
+    uint16_t formatCount;
+    uint16_t nextFormatToReuse;
+};
+
+extern BinaryLog Log;
+
+#endif
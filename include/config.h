@@ -5,22 +5,35 @@
 #ifndef config_h
 #define config_h
 
-#include <string>
-
 /*
  Sets the log level for the project.
- See https://github.com/thijse/Arduino-Log for different levels.
+ The levels are the same as https://github.com/thijse/Arduino-Log, see binary_log.h.
 */
 const int LOG_LEVEL = 5;
 
+/*
+ When enabled, the log is sent over serial as compact binary records instead of text, see the README for how to decode it.
+ This keeps the serial port from falling behind (and log entries from being dropped) at the higher log levels.
+*/
+const bool LOG_OUTPUT_BINARY = false;
+
+/*
+ When enabled, serial carries a binary trace of everything the presence and pausing logic was given and decided instead of the log.
+ It can be replayed on your computer to reproduce what happened, see the README.
+*/
+const bool TRACE_OUTPUT_ENABLED = false;
+
 /*
   The MAC addresses of the bulb(s) you want to control.
+  These, the sensor's range and latency and PAUSE_ON_EXTERNAL_CONTROL are only defaults, they can be changed
+  over serial without reflashing (see the README).
 
   Note that from searching, the ESP32 controller has a limit of 9 devices
   but CONFIG_BT_NIMBLE_MAX_CONNECTIONS has a default of 3.
-  So increase as needed.
+  So increase as needed. Any bulbs beyond that share the connections, the least recently used bulb is
+  disconnected to make room for one that needs to be switched (see CONNECTION_POOL_SIZE in main.cpp).
 */
-const std::string BULB_MAC_ADDRESSES[2] = {
+constexpr const char* BULB_MAC_ADDRESSES[] = {
     "fe:2e:97:4e:16:ba",
     "fe:2e:97:4e:16:bb"};
 
@@ -35,6 +48,22 @@ const float SENSOR_DISTANCE_END = 6.0;
 const float SENSOR_PRESENCE_LATENCY = 0.0;
 const float SENSOR_ABSENCE_LATENCY = 15.0;
 
+/*
+ The GPIO the mmWave sensor's IO2 is wired to (-1 if it isn't), which is high while it detects presence.
+ It wakes the ESP32 from light sleep for presence changes, as the sensor's UART can't be received while asleep.
+ Set this to 1 if you wired IO2 as in the README.
+*/
+const int SENSOR_PRESENCE_PIN = -1;
+
+/*
+ When enabled, the ESP32 slows its CPU down and light sleeps once every bulb is connected and the sensor is live,
+ only waking for presence changes (see SENSOR_PRESENCE_PIN), BLE events and timers.
+ Light sleep needs an ESP-IDF built with CONFIG_PM_ENABLE, CONFIG_FREERTOS_USE_TICKLESS_IDLE and the BLE controller's
+ modem sleep, without them only the CPU is slowed down. It also waits until the sensor's IO2 has been seen to follow
+ its reports, so a pin that isn't wired can't make the detector miss presence changes.
+*/
+const bool LOW_POWER_IDLE = false;
+
 /* 
  Enabling this stops the sensor from controlling a bulb if it detects that that bulb was turned on/off by something else.
  The sensor will resume control once it detects that same bulb has been turned back on/off.
@@ -0,0 +1,348 @@
+/*
+ This file contains the binary log format shared by the firmware's logger (see binary_log.h) and the host-side decoder (see ./tools).
+ A log entry is the address of its format string plus its arguments, each packed as a tag followed by its raw little-endian bytes.
+ Entries are only turned into text when they are written out, or on the host when the binary output is enabled.
+*/
+
+#ifndef log_format_h
+#define log_format_h
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+// The same levels as ArduinoLog, see https://github.com/thijse/Arduino-Log
+#define LOG_LEVEL_SILENT 0
+#define LOG_LEVEL_FATAL 1
+#define LOG_LEVEL_ERROR 2
+#define LOG_LEVEL_WARNING 3
+#define LOG_LEVEL_INFO 4
+#define LOG_LEVEL_NOTICE 4
+#define LOG_LEVEL_TRACE 5
+#define LOG_LEVEL_VERBOSE 6
+
+// The letter each line is prefixed with, indexed by level - 1
+constexpr char LOG_LEVEL_LETTERS[] = "FEWITV";
+
+// How each argument is packed, strings are a length byte followed by that many characters
+enum LogArgTag : uint8_t {
+    LOG_ARG_INT32,
+    LOG_ARG_UINT32,
+    LOG_ARG_INT64,
+    LOG_ARG_UINT64,
+    LOG_ARG_DOUBLE,
+    LOG_ARG_STRING
+};
+
+// Packs log arguments into a fixed size buffer. Arguments that don't fit are left out and strings are cut short.
+class LogArgWriter {
+public:
+    LogArgWriter(uint8_t* buffer, size_t capacity) : buffer(buffer), capacity(capacity) {}
+
+    template<typename T>
+    void add(T value) {
+        if constexpr (std::is_same<T, const char*>::value || std::is_same<T, char*>::value) {
+            addString(value);
+        } else if constexpr (std::is_floating_point<T>::value) {
+            double real = value;
+            addRaw(LOG_ARG_DOUBLE, &real, sizeof(real));
+        } else if constexpr (std::is_pointer<T>::value) {
+            uint64_t address = (uintptr_t)value;
+            addRaw(LOG_ARG_UINT64, &address, sizeof(address));
+        } else if constexpr (std::is_enum<T>::value) {
+            add(static_cast<typename std::underlying_type<T>::type>(value));
+        } else {
+            static_assert(std::is_integral<T>::value, "Log arguments must be strings, numbers or pointers");
+            if constexpr (sizeof(T) <= 4 && std::is_signed<T>::value) {
+                int32_t integer = value;
+                addRaw(LOG_ARG_INT32, &integer, sizeof(integer));
+            } else if constexpr (sizeof(T) <= 4) {
+                uint32_t integer = value;
+                addRaw(LOG_ARG_UINT32, &integer, sizeof(integer));
+            } else if constexpr (std::is_signed<T>::value) {
+                int64_t integer = value;
+                addRaw(LOG_ARG_INT64, &integer, sizeof(integer));
+            } else {
+                uint64_t integer = value;
+                addRaw(LOG_ARG_UINT64, &integer, sizeof(integer));
+            }
+        }
+    }
+
+    size_t size() const {
+        return used;
+    }
+
+private:
+    void addRaw(LogArgTag tag, const void* value, size_t size) {
+        if (used + 1 + size > capacity) {
+            used = capacity;
+            return;
+        }
+        buffer[used++] = tag;
+        memcpy(buffer + used, value, size);
+        used += size;
+    }
+
+    void addString(const char* value) {
+        if (used + 2 > capacity) {
+            used = capacity;
+            return;
+        }
+        // Cut short to what's left of the entry and to what the length byte can hold
+        size_t room = capacity - used - 2 < 255 ? capacity - used - 2 : 255;
+        size_t length = value ? strlen(value) : 0;
+        length = length < room ? length : room;
+        buffer[used++] = LOG_ARG_STRING;
+        buffer[used++] = length;
+        memcpy(buffer + used, value, length);
+        used += length;
+    }
+
+    uint8_t* buffer;
+    size_t capacity;
+    size_t used = 0;
+};
+
+// A single unpacked log argument
+struct LogArg {
+    LogArgTag tag;
+    int64_t integer;
+    double real;
+    const char* string;
+    uint8_t length;
+};
+
+// Reads back the arguments a LogArgWriter packed
+class LogArgReader {
+public:
+    LogArgReader(const uint8_t* buffer, size_t size) : buffer(buffer), size(size) {}
+
+    // Returns false once there are no (complete) arguments left
+    bool next(LogArg& arg) {
+        if (used >= size) {
+            return false;
+        }
+        arg = {};
+        arg.tag = (LogArgTag)buffer[used++];
+        size_t length = arg.tag == LOG_ARG_INT32 || arg.tag == LOG_ARG_UINT32 ? 4
+            : arg.tag == LOG_ARG_STRING ? (used < size ? buffer[used] + 1 : 1) : 8;
+        if (arg.tag > LOG_ARG_STRING || used + length > size) {
+            used = size;
+            return false;
+        }
+        const uint8_t* value = buffer + used;
+        used += length;
+        if (arg.tag == LOG_ARG_INT32) {
+            int32_t integer;
+            memcpy(&integer, value, sizeof(integer));
+            arg.integer = integer;
+        } else if (arg.tag == LOG_ARG_UINT32) {
+            uint32_t integer;
+            memcpy(&integer, value, sizeof(integer));
+            arg.integer = integer;
+        } else if (arg.tag == LOG_ARG_INT64 || arg.tag == LOG_ARG_UINT64) {
+            memcpy(&arg.integer, value, sizeof(arg.integer));
+        } else if (arg.tag == LOG_ARG_DOUBLE) {
+            memcpy(&arg.real, value, sizeof(arg.real));
+        } else {
+            arg.length = value[0];
+            arg.string = (const char*)value + 1;
+        }
+        return true;
+    }
+
+private:
+    const uint8_t* buffer;
+    size_t size;
+    size_t used = 0;
+};
+
+/*
+ Formats a log message from its format string and packed arguments into the given buffer, cutting it short if needed.
+ This supports the same format specifiers as ArduinoLog, so the output reads the same as it did when logging directly.
+ A specifier without a matching argument is printed as '?'. Returns the length of the message.
+*/
+inline size_t formatLogMessage(const char* format, const uint8_t* args, size_t argsSize, char* out, size_t capacity) {
+    LogArgReader reader(args, argsSize);
+    size_t length = 0;
+    auto append = [&](const char* text, size_t count) {
+        count = count < capacity - 1 - length ? count : capacity - 1 - length;
+        memcpy(out + length, text, count);
+        length += count;
+    };
+    char number[72];
+    for (; *format != '\0'; format++) {
+        if (*format != '%') {
+            append(format, 1);
+            continue;
+        }
+        char specifier = *++format;
+        if (specifier == '\0') {
+            break;
+        } else if (specifier == '%') {
+            append("%", 1);
+            continue;
+        }
+        LogArg arg;
+        if (!reader.next(arg)) {
+            append("?", 1);
+            continue;
+        }
+        if (arg.tag == LOG_ARG_STRING) {
+            append(arg.string, arg.length);
+            continue;
+        }
+        int count = 0;
+        uint32_t low = (uint32_t)arg.integer;
+        switch (specifier) {
+        case 's':
+        case 'S':
+            count = snprintf(number, sizeof(number), "?");
+            break;
+        case 'c':
+            count = snprintf(number, sizeof(number), "%c", (char)arg.integer);
+            break;
+        case 'd':
+        case 'i':
+            count = snprintf(number, sizeof(number), "%ld", (long)(int32_t)low);
+            break;
+        case 'u':
+            count = snprintf(number, sizeof(number), "%lu", (unsigned long)low);
+            break;
+        case 'l':
+            count = snprintf(number, sizeof(number), "%lld", (long long)arg.integer);
+            break;
+        case 'x':
+        case 'X':
+            count = snprintf(number, sizeof(number), "%s%lx", specifier == 'X' ? "0x" : "", (unsigned long)low);
+            break;
+        case 'b':
+        case 'B': {
+            // printf can't do binary, so write the digits out by hand
+            count = specifier == 'B' ? snprintf(number, sizeof(number), "0b") : 0;
+            int digits = 32;
+            while (digits > 1 && !(low >> (digits - 1) & 1)) {
+                digits--;
+            }
+            for (int i = digits - 1; i >= 0; i--) {
+                number[count++] = low >> i & 1 ? '1' : '0';
+            }
+            break;
+        }
+        case 't':
+            count = snprintf(number, sizeof(number), "%s", arg.integer ? "T" : "F");
+            break;
+        case 'T':
+            count = snprintf(number, sizeof(number), "%s", arg.integer ? "true" : "false");
+            break;
+        case 'D':
+        case 'F':
+            count = snprintf(number, sizeof(number), "%.2f", arg.tag == LOG_ARG_DOUBLE ? arg.real : (double)arg.integer);
+            break;
+        default:
+            count = snprintf(number, sizeof(number), "%%%c", specifier);
+            break;
+        }
+        append(number, count);
+    }
+    out[length] = '\0';
+    return length;
+}
+
+/*
+ The binary output is a series of records, each starting with LOG_STREAM_MAGIC and its type, with little-endian fields:
+ FORMAT: id (u16), length (u16), the format string's characters. Sent before the first entry that uses it, ids may be reused.
+ ENTRY: format id (u16), level (u8), timestamp in micros (u32), arguments size (u8), the packed arguments.
+ DROPPED: the total number of entries dropped so far (u32), sent whenever it has gone up.
+*/
+const uint8_t LOG_STREAM_MAGIC = 0xb7;
+enum LogRecordType : uint8_t {
+    LOG_RECORD_FORMAT = 1,
+    LOG_RECORD_ENTRY = 2,
+    LOG_RECORD_DROPPED = 3
+};
+const size_t LOG_RECORD_HEADER_SIZE = 2;
+const size_t LOG_FORMAT_RECORD_SIZE = LOG_RECORD_HEADER_SIZE + 4;
+const size_t LOG_ENTRY_RECORD_SIZE = LOG_RECORD_HEADER_SIZE + 8;
+const size_t LOG_DROPPED_RECORD_SIZE = LOG_RECORD_HEADER_SIZE + 4;
+
+/*
+ Turns the binary output back into text a byte at a time, see LOG_STREAM_MAGIC.
+ Anything that isn't a record, like the ESP32's boot messages, is skipped until the next one starts.
+*/
+class LogStreamDecoder {
+public:
+    // Feeds the next byte of the stream, returns true once it completes a line (see line())
+    bool feed(uint8_t byte) {
+        if (pending.empty() && byte != LOG_STREAM_MAGIC) {
+            return false;
+        }
+        pending.push_back(byte);
+        if (pending.size() < LOG_RECORD_HEADER_SIZE) {
+            return false;
+        }
+        switch (pending[1]) {
+        case LOG_RECORD_FORMAT:
+            if (pending.size() < LOG_FORMAT_RECORD_SIZE || pending.size() < LOG_FORMAT_RECORD_SIZE + field16(4)) {
+                return false;
+            }
+            if (formats.size() <= field16(2)) {
+                formats.resize(field16(2) + 1);
+            }
+            formats[field16(2)].assign((const char*)&pending[LOG_FORMAT_RECORD_SIZE], field16(4));
+            pending.clear();
+            return false;
+        case LOG_RECORD_ENTRY: {
+            if (pending.size() < LOG_ENTRY_RECORD_SIZE || pending.size() < LOG_ENTRY_RECORD_SIZE + pending[9]) {
+                return false;
+            }
+            uint16_t id = field16(2);
+            uint8_t level = pending[4];
+            uint32_t timestamp = field32(5);
+            int prefix = snprintf(text, sizeof(text), "[%6lu.%06lu] %c: ", (unsigned long)(timestamp / 1000000),
+                (unsigned long)(timestamp % 1000000), level >= 1 && level <= 6 ? LOG_LEVEL_LETTERS[level - 1] : '?');
+            if (id < formats.size() && !formats[id].empty()) {
+                formatLogMessage(formats[id].c_str(), &pending[LOG_ENTRY_RECORD_SIZE], pending[9], text + prefix, sizeof(text) - prefix);
+            } else {
+                snprintf(text + prefix, sizeof(text) - prefix, "<unknown format %u>", id);
+            }
+            pending.clear();
+            return true;
+        }
+        case LOG_RECORD_DROPPED:
+            if (pending.size() < LOG_DROPPED_RECORD_SIZE) {
+                return false;
+            }
+            snprintf(text, sizeof(text), "W: %lu log entries have been dropped so far", (unsigned long)field32(2));
+            pending.clear();
+            return true;
+        default:
+            // Not a record after all, look for the next one
+            pending.clear();
+            return false;
+        }
+    }
+
+    const char* line() const {
+        return text;
+    }
+
+private:
+    uint16_t field16(size_t offset) const {
+        return pending[offset] | pending[offset + 1] << 8;
+    }
+
+    uint32_t field32(size_t offset) const {
+        return (uint32_t)field16(offset) | (uint32_t)field16(offset + 2) << 16;
+    }
+
+    std::vector<uint8_t> pending;
+    std::vector<std::string> formats;
+    char text[320];
+};
+
+#endif
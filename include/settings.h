@@ -0,0 +1,90 @@
+/*
+ This file contains the detector's settings: the bulbs it controls, the sensor's range and latency and whether external
+ control pauses a bulb. Their defaults come from config.h. Changes sent over serial (see handleSerialCommand() in main.cpp)
+ are applied without restarting and saved to NVS as a single versioned record, which later boots start from instead.
+*/
+
+#ifndef settings_h
+#define settings_h
+
+#include <Arduino.h>
+#include <Preferences.h>
+#include <config.h>
+
+// The most bulbs the settings can hold
+const size_t MAX_BULBS = 16;
+static_assert(MAX_BULBS < 256, "The trace refers to bulbs by a one byte index");
+// Bumped whenever the layout or meaning of Settings changes, saved settings of any other version are ignored
+const uint8_t SETTINGS_VERSION = 1;
+// The furthest the sensor can detect in meters, and the longest output latency in seconds its commands can hold
+const float SENSOR_MAX_DISTANCE = 9.0;
+const float SENSOR_MAX_LATENCY = 800.0;
+
+/*
+ Parses a MAC address like "fe:2e:97:4e:16:ba" into the packed 48-bit value NimBLEAddress converts to (0xfe2e974e16ba).
+ Returns 0 if the address isn't valid, as that's never a real bulb's MAC.
+*/
+constexpr uint64_t parseMacAddress(const char* address) {
+    uint64_t packed = 0;
+    for (int i = 0; i < 17; i++) {
+        char c = address[i];
+        if (i % 3 == 2) {
+            if (c != ':') {
+                return 0;
+            }
+            continue;
+        }
+        int digit = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+        if (digit < 0) {
+            return 0;
+        }
+        packed = packed << 4 | digit;
+    }
+    return address[17] == '\0' ? packed : 0;
+}
+
+// The number of bulbs in BULB_MAC_ADDRESSES
+const size_t DEFAULT_BULB_COUNT = sizeof(BULB_MAC_ADDRESSES) / sizeof(BULB_MAC_ADDRESSES[0]);
+static_assert(DEFAULT_BULB_COUNT <= MAX_BULBS, "BULB_MAC_ADDRESSES can't have more than MAX_BULBS addresses");
+
+constexpr bool defaultMacAddressesValid() {
+    for (const char* address : BULB_MAC_ADDRESSES) {
+        if (parseMacAddress(address) == 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static_assert(defaultMacAddressesValid(), "BULB_MAC_ADDRESSES must only contain MAC addresses like \"fe:2e:97:4e:16:ba\"");
+
+// This is saved to NVS as is, so anything changing it has to bump SETTINGS_VERSION
+struct Settings {
+    uint8_t version;
+    uint8_t bulbCount;
+    bool pauseOnExternalControl;
+    float sensorDistanceStart;
+    float sensorDistanceEnd;
+    float sensorPresenceLatency;
+    float sensorAbsenceLatency;
+    // The packed MACs of the bulbs, see parseMacAddress()
+    uint64_t bulbMacs[MAX_BULBS];
+};
+
+// The settings config.h asks for
+Settings defaultSettings();
+
+/*
+ Loads the settings last saved to the given NVS namespace. Returns false and leaves the settings as they were
+ if none were saved, or they were saved by firmware with a different SETTINGS_VERSION.
+*/
+bool loadSettings(Preferences& store, Settings& settings);
+bool saveSettings(Preferences& store, const Settings& settings);
+// Forgets the saved settings, so the next boot starts from the defaults
+void clearSettings(Preferences& store);
+
+// Whether the detection range and output latency are ones the sensor accepts
+bool validSensorRange(float start, float end);
+bool validSensorLatency(float presence, float absence);
+
+#endif
@@ -0,0 +1,79 @@
+/*
+ This file contains the latency histograms and counters kept for every bulb.
+ They can be read over serial with the "stats" command, see writeTelemetry() in main.cpp for the format.
+*/
+
+#ifndef telemetry_h
+#define telemetry_h
+
+#include <cstdint>
+
+// The stages timed for every bulb
+enum TelemetryStage : uint8_t {
+    // Establishing the link, bonding with the bulb (or restarting encryption) and getting the power state's handles
+    STAGE_CONNECT,
+    STAGE_BOND,
+    STAGE_DISCOVERY,
+    // Handing the bulb's power write to the BLE host, timed with the cycle counter on its own so other bulbs' writes don't count
+    STAGE_WRITE_ISSUE,
+    // From a power write being issued to the bulb acknowledging it (or NimBLE queueing it, for writes without response)
+    STAGE_WRITE_ACK,
+    // From the sensor's frame reporting a presence change arriving to the bulb acknowledging the write it caused
+    STAGE_EDGE_TO_ACK,
+    STAGE_COUNT
+};
+
+constexpr const char* TELEMETRY_STAGE_NAMES[STAGE_COUNT] = { "connect", "bond", "discovery", "write_issue", "write_ack", "edge_to_ack" };
+
+/*
+ The buckets are powers of two in microseconds, bucket i counts durations in [2^i, 2^(i+1)) except that
+ the first also counts 0 and the last counts anything from 2^(HISTOGRAM_BUCKETS - 1)us (~8.4s) on.
+*/
+const int HISTOGRAM_BUCKETS = 24;
+
+struct LatencyHistogram {
+    uint32_t buckets[HISTOGRAM_BUCKETS];
+    uint32_t count;
+    uint32_t maxMicros;
+    uint64_t totalMicros;
+
+    void record(uint32_t micros) {
+        int bucket = micros ? 31 - __builtin_clz(micros) : 0;
+        buckets[bucket < HISTOGRAM_BUCKETS ? bucket : HISTOGRAM_BUCKETS - 1]++;
+        count++;
+        totalMicros += micros;
+        maxMicros = micros > maxMicros ? micros : maxMicros;
+    }
+
+    // The upper bound of the bucket the given percentile (0-100) falls in, or 0 if nothing has been recorded
+    uint32_t percentileMicros(uint32_t percentile) const {
+        uint64_t target = ((uint64_t)count * percentile + 99) / 100;
+        uint64_t seen = 0;
+        for (int i = 0; i < HISTOGRAM_BUCKETS && count; i++) {
+            seen += buckets[i];
+            if (seen >= target && seen > 0) {
+                return i == HISTOGRAM_BUCKETS - 1 ? maxMicros : (2u << i) - 1;
+            }
+        }
+        return 0;
+    }
+};
+
+struct BulbTelemetry {
+    LatencyHistogram stages[STAGE_COUNT];
+    // Connections made to the bulb, and how many of those were after it had already been connected once
+    uint32_t connects;
+    uint32_t reconnects;
+    uint32_t failedWrites;
+    // How many times the bulb has been paused or resumed by external control
+    uint32_t pauseToggles;
+    // How many times the bulb has been disconnected to make room in the connection pool
+    uint32_t evictions;
+    // Failed power writes sent again, and commands replaced by a newer one before they were sent
+    uint32_t writeRetries;
+    uint32_t coalescedCommands;
+    // Notifications that would have paused the bulb but were the echo of one of our own earlier writes
+    uint32_t pausesAvoided;
+};
+
+#endif
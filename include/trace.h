@@ -0,0 +1,134 @@
+/*
+ This file contains the recorder behind the presence detector's trace, see trace_format.h for what is recorded.
+ Only loop() records, so a record is a few stores into a single producer ring buffer. A low priority task encodes
+ the records and writes them out to anything that's a Print, such as Serial or a file on flash.
+ When the buffer is full the record is dropped and counted, which shows up in the trace as a TRACE_DROPPED record.
+ Text for the same output, such as the answer to a serial command, has to go through textOutput() so it doesn't
+ split a record.
+*/
+
+#ifndef trace_h
+#define trace_h
+
+#include <Arduino.h>
+#include <atomic>
+#include <freertos/semphr.h>
+#include <trace_format.h>
+
+// How many records can be waiting to be written out, must be a power of two
+const uint32_t TRACE_BUFFER_ENTRIES = 128;
+static_assert((TRACE_BUFFER_ENTRIES & (TRACE_BUFFER_ENTRIES - 1)) == 0, "TRACE_BUFFER_ENTRIES must be a power of two");
+// The longest gap in microseconds between records, a TRACE_CLOCK record is made if nothing else was
+const uint32_t TRACE_CLOCK_INTERVAL = 60000000;
+// The stack size and priority of the task that writes the records out, which only runs when nothing else wants to
+const uint32_t TRACE_TASK_STACK_SIZE = 2048;
+const UBaseType_t TRACE_TASK_PRIORITY = tskIDLE_PRIORITY;
+
+class TraceRecorder {
+public:
+    TraceRecorder();
+
+    /*
+     Starts recording to the given output, beginning with the trace's header. Without a drain task
+     nothing is written out until flush() is called, which is how the replayer records its own decisions.
+    */
+    void begin(Print* output, uint8_t bulbCount, bool drainInBackground = true);
+
+    bool recording() const {
+        return output != nullptr;
+    }
+
+    // Called by loop() at the start of every pass, the records made in a pass are replayed together
+    void beginPass() {
+        newPass = true;
+        if (output && (uint32_t)micros() - lastRecordedAt >= TRACE_CLOCK_INTERVAL) {
+            record(TRACE_CLOCK);
+        }
+    }
+
+    // Called from loop() only, see TraceRecordType for what bulb, value and arg hold
+    void record(TraceRecordType type, uint8_t bulb = 0, uint8_t value = 0, uint32_t arg = 0) {
+        if (!output) {
+            return;
+        }
+        uint32_t position = head.load(std::memory_order_relaxed);
+        if (position - tail.load(std::memory_order_acquire) == TRACE_BUFFER_ENTRIES) {
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        lastRecordedAt = micros();
+        entries[position % TRACE_BUFFER_ENTRIES] = { lastRecordedAt, arg, type, bulb, value, !newPass };
+        newPass = false;
+        head.store(position + 1, std::memory_order_seq_cst);
+        if (drainWaiting.load(std::memory_order_seq_cst) && drainWaiting.exchange(false)) {
+            xTaskNotifyGive(drainTaskHandle);
+        }
+    }
+
+    // Writes out every record made so far on the calling task
+    void flush();
+
+    // Where to print text while recording, it's written out between records as TRACE_TEXT records
+    Print& textOutput() {
+        return text;
+    }
+
+    // Whether every record made so far has been written out
+    bool drained() const {
+        return head.load() == tail.load();
+    }
+
+    uint32_t recordsDropped() const {
+        return dropped;
+    }
+
+private:
+    // Frames whatever is printed to it, each write is followed by a sync header so a reader can't be left lost
+    class TextOutput : public Print {
+    public:
+        explicit TextOutput(TraceRecorder& trace) : trace(trace) {}
+        size_t write(uint8_t c) override {
+            return write(&c, 1);
+        }
+        size_t write(const uint8_t* buffer, size_t size) override;
+
+    private:
+        TraceRecorder& trace;
+    };
+
+    struct Entry {
+        uint32_t timestamp;
+        uint32_t arg;
+        TraceRecordType type;
+        uint8_t bulb;
+        uint8_t value;
+        bool samePass;
+    };
+
+    static void drainTask(void* parameter);
+    bool writeNext();
+    void writeRecord(const TraceRecord& record, uint32_t timestamp);
+
+    Print* output;
+    uint8_t bulbCount;
+    TextOutput text;
+    // Held while writing to the output, so text and records can't interleave
+    SemaphoreHandle_t outputLock;
+    Entry entries[TRACE_BUFFER_ENTRIES];
+    std::atomic<uint32_t> head;
+    std::atomic<uint32_t> tail;
+    std::atomic<uint32_t> dropped;
+    // Only used by loop()
+    uint32_t lastRecordedAt;
+    bool newPass;
+    // Only used while holding outputLock
+    uint32_t droppedWritten;
+    uint32_t lastWrittenAt;
+    // Set while the drain task sleeps on an empty buffer, so only the record that ends the wait has to wake it
+    std::atomic<bool> drainWaiting;
+    TaskHandle_t drainTaskHandle;
+};
+
+extern TraceRecorder Trace;
+
+#endif
@@ -0,0 +1,302 @@
+/*
+ This file contains the binary trace format shared by the firmware's trace recorder (see trace.h) and the host-side
+ replayer (see ./tools). A trace is a header followed by a record for everything the presence and pausing logic in loop()
+ was given (sensor reports and bulb events) and everything it decided (presence edges, pauses and power writes), in order.
+ Records are a type byte, the fields that type has and the time since the previous record, so most take 3-5 bytes.
+*/
+
+#ifndef trace_format_h
+#define trace_format_h
+
+#include <cstddef>
+#include <cstdint>
+
+// Every trace starts with these bytes, then TRACE_VERSION and the number of configured bulbs
+constexpr uint8_t TRACE_MAGIC[4] = { 'H', 'B', 'T', 'R' };
+const size_t TRACE_HEADER_SIZE = 6;
+/*
+ A sync header is a header with this in place of the magic's last byte, followed by the 32-bit time (little endian) of
+ the record before it. It's written after text, so a reader that lost its place picks the trace up again without it
+ looking like a restart.
+*/
+const uint8_t TRACE_SYNC_MARK = 'S';
+const size_t TRACE_SYNC_HEADER_SIZE = TRACE_HEADER_SIZE + 4;
+// Bumped whenever a record's layout or meaning changes, the replayer refuses traces of any other version
+const uint8_t TRACE_VERSION = 3;
+
+enum TraceRecordType : uint8_t {
+    // What loop() was given. value is the presence reported and arg the frames received so far
+    TRACE_SENSOR_REPORT,
+    // The sensor's configuration finished at boot, see sensorConfigTask() in main.cpp
+    TRACE_SENSOR_CONFIGURED,
+    // value is the power state the bulb was read as having and arg its power state characteristic's properties
+    TRACE_BULB_CONNECTED,
+    TRACE_BULB_DISCONNECTED,
+    // The bulb was disconnected to make room in the connection pool
+    TRACE_BULB_EVICTED,
+    // value is the power state the bulb notified us of
+    TRACE_POWER_NOTIFIED,
+    // value is 1 if the write failed and arg is the write's sequence number
+    TRACE_POWER_WRITTEN,
+    // A bulb was added to or removed from the settings over serial, an added bulb is given the next index
+    TRACE_BULB_ADDED,
+    TRACE_BULB_REMOVED,
+    // value is whether PAUSE_ON_EXTERNAL_CONTROL is set, recorded at boot and whenever it's changed over serial
+    TRACE_PAUSE_ON_EXTERNAL_CONTROL,
+    // The sensor's range or latency was changed over serial, so it's being configured again
+    TRACE_SENSOR_RECONFIGURED,
+    // What it decided. value is the sensor's new SensorState
+    TRACE_SENSOR_STATE,
+    // value is the new presence state
+    TRACE_PRESENCE_EDGE,
+    // value is 1 if the bulb is now paused
+    TRACE_PAUSE_TOGGLED,
+    // value is the power state written and arg the write's sequence number
+    TRACE_POWER_WRITE,
+    // Keeps the time between records short while nothing happens, see TRACE_CLOCK_INTERVAL
+    TRACE_CLOCK,
+    // arg is how many records have been dropped so far as the recorder's buffer was full
+    TRACE_DROPPED,
+    // Text sharing the trace's output, such as a serial command's answer. arg is how many bytes of it follow the record
+    TRACE_TEXT,
+    TRACE_RECORD_TYPES
+};
+
+// Set on the type byte of a record made in the same loop() pass as the one before it
+const uint8_t TRACE_SAME_PASS = 0x80;
+
+// Which fields each type of record has, besides the time
+struct TraceRecordLayout {
+    const char* name;
+    bool bulb;
+    bool value;
+    bool arg;
+};
+
+constexpr TraceRecordLayout TRACE_RECORD_LAYOUTS[TRACE_RECORD_TYPES] = {
+    { "sensor_report", false, true, true },
+    { "sensor_configured", false, false, false },
+    { "bulb_connected", true, true, true },
+    { "bulb_disconnected", true, false, false },
+    { "bulb_evicted", true, false, false },
+    { "power_notified", true, true, false },
+    { "power_written", true, true, true },
+    { "bulb_added", true, false, false },
+    { "bulb_removed", true, false, false },
+    { "pause_on_external_control", false, true, false },
+    { "sensor_reconfigured", false, false, false },
+    { "sensor_state", false, true, false },
+    { "presence_edge", false, true, false },
+    { "pause_toggled", true, true, false },
+    { "power_write", true, true, true },
+    { "clock", false, false, false },
+    { "dropped", false, false, true },
+    { "text", false, false, true },
+};
+
+// Whether the record is something the logic was given, rather than something it decided
+constexpr bool isTraceInput(TraceRecordType type) {
+    return type <= TRACE_SENSOR_RECONFIGURED;
+}
+
+// Whether the record is something the logic decided, which a replay has to decide the same way
+constexpr bool isTraceDecision(TraceRecordType type) {
+    return type >= TRACE_SENSOR_STATE && type <= TRACE_POWER_WRITE;
+}
+
+// The type byte, the bulb, the value and two 32-bit varints
+const size_t TRACE_MAX_RECORD_SIZE = 13;
+static_assert(TRACE_SYNC_HEADER_SIZE <= TRACE_MAX_RECORD_SIZE, "The decoder reads a sync header into a record's space");
+
+struct TraceRecord {
+    TraceRecordType type;
+    bool samePass;
+    uint8_t bulb;
+    uint8_t value;
+    uint32_t arg;
+    // Microseconds since boot, the decoder keeps this going past where the firmware's micros() wraps
+    uint64_t micros;
+};
+
+// Writes the header every trace starts with, returns its size
+inline size_t encodeTraceHeader(uint8_t bulbCount, uint8_t* out) {
+    for (size_t i = 0; i < sizeof(TRACE_MAGIC); i++) {
+        out[i] = TRACE_MAGIC[i];
+    }
+    out[4] = TRACE_VERSION;
+    out[5] = bulbCount;
+    return TRACE_HEADER_SIZE;
+}
+
+inline size_t encodeTraceVarint(uint32_t value, uint8_t* out) {
+    size_t size = 0;
+    while (value >= 0x80) {
+        out[size++] = (uint8_t)value | 0x80;
+        value >>= 7;
+    }
+    out[size++] = value;
+    return size;
+}
+
+// Writes a sync header for a trace whose last record was at the given time, returns its size
+inline size_t encodeTraceSyncHeader(uint8_t bulbCount, uint32_t timestamp, uint8_t* out) {
+    size_t size = encodeTraceHeader(bulbCount, out);
+    out[sizeof(TRACE_MAGIC) - 1] = TRACE_SYNC_MARK;
+    for (int i = 0; i < 4; i++) {
+        out[size++] = timestamp >> (8 * i);
+    }
+    return size;
+}
+
+// Writes a record that happened delta microseconds after the one before it, returns its size
+inline size_t encodeTraceRecord(const TraceRecord& record, uint32_t delta, uint8_t* out) {
+    const TraceRecordLayout& layout = TRACE_RECORD_LAYOUTS[record.type];
+    size_t size = 0;
+    out[size++] = record.type | (record.samePass ? TRACE_SAME_PASS : 0);
+    if (layout.bulb) {
+        out[size++] = record.bulb;
+    }
+    if (layout.value) {
+        out[size++] = record.value;
+    }
+    size += encodeTraceVarint(delta, out + size);
+    if (layout.arg) {
+        size += encodeTraceVarint(record.arg, out + size);
+    }
+    return size;
+}
+
+/*
+ Reads a trace back a byte at a time. A header part way through means the firmware restarted,
+ which starts the clock from 0 again. Anything before the first header is skipped.
+ TRACE_TEXT records aren't handed on, their text is instead, a byte at a time.
+*/
+class TraceDecoder {
+public:
+    enum Result {
+        NEED_MORE,
+        HEADER,
+        RECORD,
+        // The bytes don't make a record of a supported version, the decoder skips to the next header
+        CORRUPT,
+        // A byte of text, see text()
+        TEXT,
+        // A sync header put the decoder (back) in step with the trace, without a restart
+        SYNCED
+    };
+
+    Result feed(uint8_t byte) {
+        if (textLeft) {
+            textLeft--;
+            textByte = byte;
+            return TEXT;
+        }
+        pending[size++] = byte;
+        if (size == 1) {
+            // A record's type byte never matches the start of a header
+            readingHeader = !synced || byte == TRACE_MAGIC[0];
+        }
+        if (readingHeader) {
+            return feedHeader();
+        }
+        uint8_t type = pending[0] & ~TRACE_SAME_PASS;
+        if (type >= TRACE_RECORD_TYPES) {
+            return lose();
+        }
+        const TraceRecordLayout& layout = TRACE_RECORD_LAYOUTS[type];
+        size_t offset = 1 + layout.bulb + layout.value;
+        uint32_t delta, arg = 0;
+        if (!readVarint(offset, delta) || (layout.arg && !readVarint(offset, arg))) {
+            return size == TRACE_MAX_RECORD_SIZE ? lose() : NEED_MORE;
+        }
+        size = 0;
+        if (type == TRACE_TEXT) {
+            textLeft = arg;
+            return NEED_MORE;
+        }
+        decoded = { (TraceRecordType)type, (pending[0] & TRACE_SAME_PASS) != 0, layout.bulb ? pending[1] : (uint8_t)0,
+            layout.value ? pending[1 + layout.bulb] : (uint8_t)0, arg, decoded.micros + delta };
+        return RECORD;
+    }
+
+    // The record the last call to feed() completed
+    const TraceRecord& record() const {
+        return decoded;
+    }
+
+    // The byte of text the last call to feed() returned TEXT for
+    uint8_t text() const {
+        return textByte;
+    }
+
+    // The version and bulb count from the latest header
+    uint8_t version() const {
+        return headerVersion;
+    }
+
+    uint8_t bulbCount() const {
+        return headerBulbCount;
+    }
+
+private:
+    Result feedHeader() {
+        uint8_t byte = pending[size - 1];
+        bool sync = size >= sizeof(TRACE_MAGIC) && pending[sizeof(TRACE_MAGIC) - 1] == TRACE_SYNC_MARK;
+        if (size <= sizeof(TRACE_MAGIC) && byte != TRACE_MAGIC[size - 1] && !(sync && size == sizeof(TRACE_MAGIC))) {
+            if (synced) {
+                return lose();
+            }
+            // Still looking for a header, the byte may start one itself
+            size = 0;
+            if (byte == TRACE_MAGIC[0]) {
+                pending[size++] = byte;
+            }
+            return NEED_MORE;
+        }
+        if (size < (sync ? TRACE_SYNC_HEADER_SIZE : TRACE_HEADER_SIZE)) {
+            return NEED_MORE;
+        }
+        headerVersion = pending[4];
+        headerBulbCount = pending[5];
+        size = 0;
+        synced = headerVersion == TRACE_VERSION;
+        if (!sync) {
+            decoded.micros = 0;
+            return synced ? HEADER : CORRUPT;
+        }
+        // The clock carries on from the record before, going by the firmware's 32-bit micros()
+        uint32_t timestamp = pending[6] | pending[7] << 8 | pending[8] << 16 | (uint32_t)pending[9] << 24;
+        decoded.micros += (uint32_t)(timestamp - (uint32_t)decoded.micros);
+        return synced ? SYNCED : CORRUPT;
+    }
+
+    bool readVarint(size_t& offset, uint32_t& value) {
+        value = 0;
+        for (int shift = 0; offset < size && shift < 35; shift += 7) {
+            uint8_t byte = pending[offset++];
+            value |= (uint32_t)(byte & 0x7f) << shift;
+            if (!(byte & 0x80)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    Result lose() {
+        synced = false;
+        size = 0;
+        return CORRUPT;
+    }
+
+    uint8_t pending[TRACE_MAX_RECORD_SIZE];
+    size_t size = 0;
+    bool synced = false;
+    bool readingHeader = false;
+    uint8_t headerVersion = 0;
+    uint8_t headerBulbCount = 0;
+    TraceRecord decoded = {};
+    uint32_t textLeft = 0;
+    uint8_t textByte = 0;
+};
+
+#endif
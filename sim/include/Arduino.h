@@ -0,0 +1,110 @@
+/*
+ This file contains a host-native stand-in for the parts of the Arduino-ESP32 core used by the firmware.
+ Time comes from the simulation clock, Serial goes to the simulation console and UART 1 is wired to
+ the simulated mmWave sensor.
+*/
+
+#ifndef Arduino_h
+#define Arduino_h
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <cstdlib>
+#include <cmath>
+#include <string>
+#include <functional>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/semphr.h>
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#define HIGH 0x1
+#define LOW 0x0
+
+#define INPUT 0x01
+#define INPUT_PULLDOWN 0x09
+
+// Host code has no IRAM to place interrupt handlers in
+#define IRAM_ATTR
+
+// Default UART0 pins of the ESP32-S3
+#define RX 44
+#define TX 43
+
+#define SERIAL_8N1 0x800001c
+
+typedef std::function<void(void)> OnReceiveCb;
+
+unsigned long millis();
+unsigned long micros();
+void delay(uint32_t ms);
+void delayMicroseconds(uint32_t us);
+void yield();
+
+void pinMode(uint8_t pin, uint8_t mode);
+// Every GPIO reads the simulated sensor's IO2, the only thing wired to one, see sim::SensorModel::outputLevel()
+int digitalRead(uint8_t pin);
+
+class Print {
+public:
+    virtual ~Print() {}
+    virtual size_t write(uint8_t c) = 0;
+    virtual size_t write(const uint8_t* buffer, size_t size);
+    size_t write(const char* str) { return str ? write((const uint8_t*)str, strlen(str)) : 0; }
+
+    size_t print(const char* str) { return write(str); }
+    size_t print(const std::string& str) { return write((const uint8_t*)str.data(), str.size()); }
+    size_t print(char c) { return write((uint8_t)c); }
+    size_t print(long value, int base = 10);
+    size_t print(unsigned long value, int base = 10);
+    size_t print(int value, int base = 10) { return print((long)value, base); }
+    size_t print(unsigned int value, int base = 10) { return print((unsigned long)value, base); }
+    size_t print(double value, int digits = 2);
+    size_t println() { return write("\r\n"); }
+    template<typename T>
+    size_t println(const T& value) { return print(value) + println(); }
+};
+
+class Stream : public Print {
+public:
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual int peek() = 0;
+    virtual void flush() {}
+};
+
+class HardwareSerial : public Stream {
+public:
+    explicit HardwareSerial(int uartNum) : m_uartNum(uartNum) {}
+
+    void begin(unsigned long baud, uint32_t config = SERIAL_8N1, int8_t rxPin = -1, int8_t txPin = -1) {}
+    void end() {}
+    // UART 1 is the sensor, see sim::SensorModel::onReceive(), and UART 0 the console, see sim::onConsoleInput()
+    void onReceive(OnReceiveCb function, bool onlyOnTimeout = false);
+    int available() override;
+    int read() override;
+    int peek() override;
+    size_t write(uint8_t c) override;
+    size_t write(const uint8_t* buffer, size_t size) override;
+    using Print::write;
+    operator bool() const { return true; }
+
+private:
+    int m_uartNum;
+};
+
+extern HardwareSerial Serial;
+
+// The parts of Arduino-ESP32's EspClass the firmware uses, the cycle counter runs at a simulated 240MHz
+class EspClass {
+public:
+    uint32_t getCycleCount();
+    uint32_t getCpuFreqMHz() { return 240; }
+};
+
+extern EspClass ESP;
+
+#endif
@@ -0,0 +1,30 @@
+/*
+ This file contains a host-native stand-in for the DFRobot_mmWave_Radar library fork.
+ It speaks the same UART protocol as the real library, so its timing comes from the simulated sensor.
+*/
+
+#ifndef __DFRobot_mmWave_Radar_H__
+#define __DFRobot_mmWave_Radar_H__
+
+#include <Arduino.h>
+
+class DFRobot_mmWave_Radar {
+public:
+    DFRobot_mmWave_Radar(Stream* s);
+
+    bool readPresenceDetection(void);
+    void DetRangeCfg(float parA_s, float parA_e);
+    void OutputLatency(float par1, float par2);
+    void factoryReset(void);
+    void start(void);
+    void stop(void);
+
+private:
+    size_t readN(uint8_t* buf, size_t len);
+    bool recdData(uint8_t* buf);
+    void writeCMD(const char* cmd);
+
+    Stream* _s;
+};
+
+#endif
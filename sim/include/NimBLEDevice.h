@@ -0,0 +1,450 @@
+/*
+ This file contains a host-native stand-in for the NimBLE-Arduino 1.4 client API used by the firmware.
+ Calls block for as long as the simulated link layer would take, and callbacks run on the simulated host task.
+*/
+
+#ifndef MAIN_NIMBLEDEVICE_H_
+#define MAIN_NIMBLEDEVICE_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <functional>
+
+#ifndef CONFIG_BT_NIMBLE_MAX_CONNECTIONS
+#define CONFIG_BT_NIMBLE_MAX_CONNECTIONS 3
+#endif
+#define NIMBLE_MAX_CONNECTIONS CONFIG_BT_NIMBLE_MAX_CONNECTIONS
+
+#define BLE_HS_FOREVER INT32_MAX
+#define BLE_HS_CONN_HANDLE_NONE 0xffff
+#define BLE_HS_ENOTCONN 7
+#define BLE_HS_ETIMEOUT 13
+#define BLE_HS_EDONE 14
+#define BLE_HS_EALREADY 2
+#define BLE_HS_EBUSY 15
+#define BLE_HS_ERR_ATT_BASE 0x100
+#define BLE_ATT_ERR_INVALID_HANDLE 0x01
+#define BLE_ATT_ERR_ATTR_NOT_FOUND 0x0a
+#define BLE_ATT_ERR_INSUFFICIENT_ENC 0x0f
+
+#define BLE_GAP_EVENT_NOTIFY_RX 12
+
+#define BLE_GATT_CHR_PROP_READ 0x02
+#define BLE_GATT_CHR_PROP_WRITE_NO_RSP 0x04
+#define BLE_GATT_CHR_PROP_WRITE 0x08
+#define BLE_GATT_CHR_PROP_NOTIFY 0x10
+#define BLE_GATT_CHR_PROP_INDICATE 0x20
+
+#define BLE_UUID_TYPE_16 16
+#define BLE_UUID_TYPE_32 32
+#define BLE_UUID_TYPE_128 128
+
+#define BLE_ADDR_PUBLIC 0x00
+#define BLE_ADDR_RANDOM 0x01
+
+#define BLE_HCI_SCAN_FILT_NO_WL 0
+#define BLE_HCI_SCAN_FILT_USE_WL 1
+
+#define BLE_HS_IO_DISPLAY_ONLY 0x00
+#define BLE_HS_IO_DISPLAY_YESNO 0x01
+#define BLE_HS_IO_KEYBOARD_ONLY 0x02
+#define BLE_HS_IO_NO_INPUT_OUTPUT 0x03
+#define BLE_HS_IO_KEYBOARD_DISPLAY 0x04
+
+#define BLE_SM_PAIR_KEY_DIST_ENC 0x01
+#define BLE_SM_PAIR_KEY_DIST_ID 0x02
+#define BLE_SM_PAIR_AUTHREQ_BOND 0x01
+#define BLE_SM_PAIR_AUTHREQ_MITM 0x04
+#define BLE_SM_PAIR_AUTHREQ_SC 0x08
+
+#define BLE_ERR_REM_USER_CONN_TERM 0x13
+
+struct ble_gap_upd_params {
+    uint16_t itvl_min;
+    uint16_t itvl_max;
+    uint16_t latency;
+    uint16_t supervision_timeout;
+    uint16_t min_ce_len;
+    uint16_t max_ce_len;
+};
+
+typedef struct {
+    uint8_t type;
+} ble_uuid_t;
+
+typedef struct {
+    ble_uuid_t u;
+    uint16_t value;
+} ble_uuid16_t;
+
+typedef struct {
+    ble_uuid_t u;
+    uint8_t value[16];
+} ble_uuid128_t;
+
+typedef union {
+    ble_uuid_t u;
+    ble_uuid16_t u16;
+    ble_uuid128_t u128;
+} ble_uuid_any_t;
+
+struct os_mbuf {
+    uint8_t* om_data;
+    uint16_t om_len;
+};
+
+#define OS_MBUF_PKTLEN(om) ((om)->om_len)
+
+struct ble_gap_event {
+    uint8_t type;
+    union {
+        struct {
+            struct os_mbuf* om;
+            uint16_t attr_handle;
+            uint16_t conn_handle;
+            uint8_t indication:1;
+        } notify_rx;
+    };
+};
+
+typedef int ble_gap_event_fn(struct ble_gap_event* event, void* arg);
+
+struct ble_gap_event_listener {
+    ble_gap_event_fn* fn;
+    void* arg;
+    struct ble_gap_event_listener* next;
+};
+
+// Registers a listener that sees every GAP event, including notifications NimBLE itself has no characteristic for
+int ble_gap_event_listener_register(struct ble_gap_event_listener* listener, ble_gap_event_fn* fn, void* arg);
+
+struct ble_gatt_error {
+    uint16_t status;
+    uint16_t att_handle;
+};
+
+struct ble_gatt_attr {
+    uint16_t handle;
+    uint16_t offset;
+    struct os_mbuf* om;
+};
+
+typedef int ble_gatt_attr_fn(uint16_t conn_handle, const struct ble_gatt_error* error, struct ble_gatt_attr* attr, void* arg);
+
+// The NimBLE host's asynchronous GATT client calls, the callback runs on the host task
+int ble_gattc_write_flat(uint16_t conn_handle, uint16_t attr_handle, const void* data, uint16_t data_len,
+                         ble_gatt_attr_fn* cb, void* cb_arg);
+int ble_gattc_write_no_rsp_flat(uint16_t conn_handle, uint16_t attr_handle, const void* data, uint16_t data_len);
+int ble_gattc_read_by_uuid(uint16_t conn_handle, uint16_t start_handle, uint16_t end_handle, const ble_uuid_t* uuid,
+                           ble_gatt_attr_fn* cb, void* cb_arg);
+
+class NimBLEClient;
+class NimBLERemoteService;
+class NimBLERemoteCharacteristic;
+class NimBLEScan;
+
+class NimBLEUUID {
+public:
+    NimBLEUUID() {}
+    NimBLEUUID(const std::string& uuid);
+    NimBLEUUID(const char* uuid) : NimBLEUUID(std::string(uuid)) {}
+    NimBLEUUID(uint16_t uuid);
+    const ble_uuid_any_t* getNative() const { return &m_native; }
+    bool equals(const NimBLEUUID& uuid) const { return m_uuid == uuid.m_uuid; }
+    bool operator==(const NimBLEUUID& rhs) const { return equals(rhs); }
+    bool operator!=(const NimBLEUUID& rhs) const { return !equals(rhs); }
+    std::string toString() const { return m_uuid; }
+
+private:
+    std::string m_uuid;
+    ble_uuid_any_t m_native = {};
+};
+
+class NimBLEAddress {
+public:
+    NimBLEAddress();
+    NimBLEAddress(const uint8_t address[6], uint8_t type = BLE_ADDR_PUBLIC);
+    NimBLEAddress(const std::string& stringAddress, uint8_t type = BLE_ADDR_PUBLIC);
+    NimBLEAddress(const uint64_t& address, uint8_t type = BLE_ADDR_PUBLIC);
+    bool equals(const NimBLEAddress& otherAddress) const;
+    const uint8_t* getNative() const { return m_address; }
+    uint8_t getType() const { return m_addrType; }
+    std::string toString() const;
+    bool operator==(const NimBLEAddress& rhs) const { return equals(rhs); }
+    bool operator!=(const NimBLEAddress& rhs) const { return !equals(rhs); }
+    operator std::string() const { return toString(); }
+    operator uint64_t() const;
+
+private:
+    uint8_t m_address[6];
+    uint8_t m_addrType;
+};
+
+class NimBLEAttValue {
+public:
+    NimBLEAttValue() {}
+    NimBLEAttValue(const uint8_t* data, size_t length) : m_value(data, data + length) {}
+    const uint8_t* data() const { return m_value.data(); }
+    size_t length() const { return m_value.size(); }
+    size_t size() const { return m_value.size(); }
+
+private:
+    std::vector<uint8_t> m_value;
+};
+
+class NimBLEConnInfo {
+public:
+    uint16_t getConnHandle() const { return m_handle; }
+    uint16_t getConnInterval() const { return m_interval; }
+    uint16_t getConnLatency() const { return m_latency; }
+    uint16_t getConnTimeout() const { return m_timeout; }
+    bool isEncrypted() const { return m_encrypted; }
+    bool isBonded() const { return m_bonded; }
+
+private:
+    friend class NimBLEClient;
+    uint16_t m_handle = BLE_HS_CONN_HANDLE_NONE;
+    uint16_t m_interval = 0;
+    uint16_t m_latency = 0;
+    uint16_t m_timeout = 0;
+    bool m_encrypted = false;
+    bool m_bonded = false;
+};
+
+class NimBLEAdvertisedDevice {
+public:
+    NimBLEAddress getAddress() { return m_address; }
+    int getRSSI() { return m_rssi; }
+    std::string getName() { return m_name; }
+    std::string toString();
+
+private:
+    friend class NimBLEScan;
+    NimBLEAddress m_address;
+    int m_rssi = 0;
+    std::string m_name;
+    std::vector<uint8_t> m_payload;
+    bool m_callbackSent = false;
+};
+
+class NimBLEAdvertisedDeviceCallbacks {
+public:
+    virtual ~NimBLEAdvertisedDeviceCallbacks() {}
+    virtual void onResult(NimBLEAdvertisedDevice* advertisedDevice) = 0;
+};
+
+class NimBLEScanResults {
+public:
+    int getCount() { return (int)m_advertisedDevicesVector.size(); }
+    NimBLEAdvertisedDevice getDevice(uint32_t i) { return *m_advertisedDevicesVector[i]; }
+    std::vector<NimBLEAdvertisedDevice*>::iterator begin() { return m_advertisedDevicesVector.begin(); }
+    std::vector<NimBLEAdvertisedDevice*>::iterator end() { return m_advertisedDevicesVector.end(); }
+
+private:
+    friend class NimBLEScan;
+    std::vector<NimBLEAdvertisedDevice*> m_advertisedDevicesVector;
+};
+
+class NimBLEScan {
+public:
+    bool start(uint32_t duration, void (*scanCompleteCB)(NimBLEScanResults), bool is_continue = false);
+    NimBLEScanResults start(uint32_t duration, bool is_continue = false);
+    bool isScanning();
+    void setAdvertisedDeviceCallbacks(NimBLEAdvertisedDeviceCallbacks* pAdvertisedDeviceCallbacks, bool wantDuplicates = false);
+    void setActiveScan(bool active) { m_activeScan = active; }
+    void setInterval(uint16_t intervalMSecs) { m_intervalMs = intervalMSecs; }
+    void setWindow(uint16_t windowMSecs) { m_windowMs = windowMSecs; }
+    void setDuplicateFilter(bool enabled) { m_duplicateFilter = enabled; }
+    void setMaxResults(uint8_t maxResults) { m_maxResults = maxResults; }
+    void setFilterPolicy(uint8_t filter) { m_filterPolicy = filter; }
+    bool stop();
+    void clearResults();
+    NimBLEScanResults getResults();
+
+    // Simulation counters
+    uint32_t simAdvertisementsProcessed() const { return m_advProcessed; }
+    uint32_t simCallbacks() const { return m_callbacks; }
+    // Time spent scanning so far, and the most memory the stored scan results have taken up
+    uint64_t simScanningMicros();
+    size_t simPeakResultBytes() const { return m_peakResultBytes; }
+
+private:
+    friend class NimBLEDevice;
+    friend class NimBLEClient;
+    void scheduleAdvertiser(size_t index, uint32_t generation, uint64_t at);
+    void onAdvertisement(size_t index, uint32_t generation);
+    void endScan();
+
+    NimBLEAdvertisedDeviceCallbacks* m_pAdvertisedDeviceCallbacks = nullptr;
+    bool m_wantDuplicates = false;
+    bool m_activeScan = false;
+    bool m_duplicateFilter = false;
+    uint16_t m_intervalMs = 100;
+    uint16_t m_windowMs = 100;
+    uint8_t m_maxResults = 0xFF;
+    uint8_t m_filterPolicy = BLE_HCI_SCAN_FILT_NO_WL;
+    bool m_scanning = false;
+    uint32_t m_generation = 0;
+    uint64_t m_startedAt = 0;
+    void (*m_scanCompleteCB)(NimBLEScanResults) = nullptr;
+    std::vector<NimBLEAdvertisedDevice*> m_results;
+    // Addresses the controller's duplicate filter has already passed up during this scan
+    std::vector<NimBLEAddress> m_duplicateFilterSeen;
+    uint32_t m_advProcessed = 0;
+    uint32_t m_callbacks = 0;
+    uint64_t m_scanningMicros = 0;
+    size_t m_resultBytes = 0;
+    size_t m_peakResultBytes = 0;
+};
+
+class NimBLEClientCallbacks {
+public:
+    virtual ~NimBLEClientCallbacks() {}
+    virtual void onConnect(NimBLEClient* pClient) {}
+    virtual void onDisconnect(NimBLEClient* pClient) {}
+    virtual bool onConnParamsUpdateRequest(NimBLEClient* pClient, const ble_gap_upd_params* params) { return true; }
+};
+
+typedef std::function<void(NimBLERemoteCharacteristic* pBLERemoteCharacteristic, uint8_t* pData, size_t length, bool isNotify)> notify_callback;
+
+class NimBLERemoteDescriptor {
+public:
+    NimBLEUUID getUUID() { return m_uuid; }
+    uint16_t getHandle() { return m_handle; }
+    NimBLERemoteCharacteristic* getRemoteCharacteristic() { return m_pRemoteCharacteristic; }
+
+private:
+    friend class NimBLERemoteCharacteristic;
+    NimBLERemoteCharacteristic* m_pRemoteCharacteristic = nullptr;
+    NimBLEUUID m_uuid;
+    uint16_t m_handle = 0;
+};
+
+class NimBLERemoteCharacteristic {
+public:
+    ~NimBLERemoteCharacteristic();
+    NimBLEUUID getUUID() { return m_uuid; }
+    uint16_t getHandle() { return m_handle; }
+    NimBLERemoteService* getRemoteService() { return m_pRemoteService; }
+    bool canRead() { return m_properties & 0x02; }
+    bool canWriteNoResponse() { return m_properties & 0x04; }
+    bool canWrite() { return m_properties & 0x08; }
+    bool canNotify() { return m_properties & 0x10; }
+    bool canIndicate() { return m_properties & 0x20; }
+    NimBLERemoteDescriptor* getDescriptor(const NimBLEUUID& uuid);
+    NimBLEAttValue readValue(time_t* timestamp = nullptr);
+    bool writeValue(const uint8_t* data, size_t length, bool response = false);
+    bool writeValue(const std::vector<uint8_t>& v, bool response = false) { return writeValue(v.data(), v.size(), response); }
+    template<typename T>
+    bool writeValue(const T& s, bool response = false) { return writeValue((const uint8_t*)&s, sizeof(T), response); }
+    bool subscribe(bool notifications = true, notify_callback notifyCallback = nullptr, bool response = false);
+    bool unsubscribe(bool response = false);
+
+private:
+    friend class NimBLERemoteService;
+    friend class NimBLEClient;
+    friend struct SimLink;
+    NimBLERemoteService* m_pRemoteService = nullptr;
+    NimBLEUUID m_uuid;
+    uint16_t m_handle = 0;
+    uint8_t m_properties = 0;
+    bool m_descriptorsDiscovered = false;
+    std::vector<NimBLERemoteDescriptor*> m_descriptorVector;
+    notify_callback m_notifyCallback;
+};
+
+class NimBLERemoteService {
+public:
+    ~NimBLERemoteService();
+    NimBLERemoteCharacteristic* getCharacteristic(const NimBLEUUID& uuid);
+    NimBLEClient* getClient() { return m_pClient; }
+    NimBLEUUID getUUID() { return m_uuid; }
+    uint16_t getStartHandle() { return m_startHandle; }
+    uint16_t getEndHandle() { return m_endHandle; }
+
+private:
+    friend class NimBLEClient;
+    friend struct SimLink;
+    NimBLEClient* m_pClient = nullptr;
+    NimBLEUUID m_uuid;
+    uint16_t m_startHandle = 0;
+    uint16_t m_endHandle = 0;
+    std::vector<NimBLERemoteCharacteristic*> m_characteristicVector;
+};
+
+class NimBLEClient {
+public:
+    bool connect(NimBLEAdvertisedDevice* device, bool deleteAttributes = true);
+    bool connect(const NimBLEAddress& address, bool deleteAttributes = true);
+    bool connect(bool deleteAttributes = true);
+    int disconnect(uint8_t reason = BLE_ERR_REM_USER_CONN_TERM);
+    bool isConnected();
+    NimBLEAddress getPeerAddress() { return m_peerAddress; }
+    uint16_t getConnId() { return m_connHandle; }
+    int getRssi();
+    NimBLEConnInfo getConnInfo();
+    void setClientCallbacks(NimBLEClientCallbacks* pClientCallbacks, bool deleteCallbacks = true);
+    void setConnectionParams(uint16_t minInterval, uint16_t maxInterval, uint16_t latency, uint16_t timeout,
+                             uint16_t scanInterval = 16, uint16_t scanWindow = 16);
+    void updateConnParams(uint16_t minInterval, uint16_t maxInterval, uint16_t latency, uint16_t timeout);
+    void setConnectTimeout(uint32_t timeout) { m_connectTimeout = timeout * 1000; }
+    NimBLERemoteService* getService(const NimBLEUUID& uuid);
+    void deleteServices();
+    bool secureConnection();
+
+private:
+    friend class NimBLEDevice;
+    friend class NimBLERemoteService;
+    friend class NimBLERemoteCharacteristic;
+    friend class NimBLEScan;
+    friend struct SimLink;
+    NimBLEClient(const NimBLEAddress& peerAddress);
+    ~NimBLEClient();
+
+    NimBLEAddress m_peerAddress;
+    uint16_t m_connHandle = BLE_HS_CONN_HANDLE_NONE;
+    struct SimLink* m_link = nullptr;
+    NimBLEClientCallbacks* m_pClientCallbacks;
+    bool m_deleteCallbacks = false;
+    uint32_t m_connectTimeout = 30000;
+    ble_gap_upd_params m_pConnParams;
+    std::vector<NimBLERemoteService*> m_servicesVector;
+};
+
+class NimBLEDevice {
+public:
+    static void init(const std::string& deviceName);
+    static void deinit(bool clearAll = false);
+    static bool getInitialized();
+    static NimBLEScan* getScan();
+    static NimBLEClient* createClient(NimBLEAddress peerAddress = NimBLEAddress(""));
+    static bool deleteClient(NimBLEClient* pClient);
+    static NimBLEClient* getClientByID(uint16_t conn_id);
+    static NimBLEClient* getClientByPeerAddress(const NimBLEAddress& peer_addr);
+    static NimBLEClient* getDisconnectedClient();
+    static size_t getClientListSize();
+    static std::vector<NimBLEClient*>* getClientList();
+    static void setPower(int dbm) {}
+    static void setSecurityAuth(uint8_t auth_req) {}
+    static void setSecurityIOCap(uint8_t iocap) {}
+    static void setSecurityInitKey(uint8_t init_key) {}
+    static void setSecurityRespKey(uint8_t init_key) {}
+    static int startSecurity(uint16_t conn_id);
+    static int getNumBonds();
+    static bool isBonded(const NimBLEAddress& address);
+    static bool deleteBond(const NimBLEAddress& address);
+    static NimBLEAddress getBondedAddress(int index);
+    static bool whiteListAdd(const NimBLEAddress& address);
+    static bool whiteListRemove(const NimBLEAddress& address);
+    static bool onWhiteList(const NimBLEAddress& address);
+    static size_t getWhiteListCount();
+};
+
+// Compatibility with the original ESP32 BLE library names
+#define BLEDevice NimBLEDevice
+#define BLEAddress NimBLEAddress
+#define BLEUUID NimBLEUUID
+#define BLEClient NimBLEClient
+
+#endif
@@ -0,0 +1,32 @@
+/*
+ This file contains a host-native stand-in for the Arduino-ESP32 Preferences library (NVS key/value storage).
+ Values live in the simulation's NVS, see sim::loadNvs().
+*/
+
+#ifndef _PREFERENCES_H_
+#define _PREFERENCES_H_
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+
+class Preferences {
+public:
+    bool begin(const char* name, bool readOnly = false, const char* partition_label = nullptr);
+    void end();
+    bool clear();
+    bool remove(const char* key);
+    bool isKey(const char* key);
+    size_t putBytes(const char* key, const void* value, size_t len);
+    size_t getBytesLength(const char* key);
+    size_t getBytes(const char* key, void* buf, size_t maxLen);
+
+private:
+    std::string fullKey(const char* key) const;
+
+    std::string m_namespace;
+    bool m_started = false;
+    bool m_readOnly = false;
+};
+
+#endif
@@ -0,0 +1,34 @@
+/*
+ This file contains a host-native stand-in for the parts of ESP-IDF's GPIO driver the firmware uses.
+ The sensor's IO2 is the only thing wired to a GPIO, so every pin is it (see sim::SensorModel::onOutputLevel()),
+ and only one interrupt handler is supported.
+*/
+
+#ifndef _DRIVER_GPIO_H_
+#define _DRIVER_GPIO_H_
+
+#include <esp_err.h>
+
+typedef enum {
+    GPIO_NUM_NC = -1,
+    GPIO_NUM_MAX = 49
+} gpio_num_t;
+
+typedef enum {
+    GPIO_INTR_DISABLE,
+    GPIO_INTR_POSEDGE,
+    GPIO_INTR_NEGEDGE,
+    GPIO_INTR_ANYEDGE,
+    GPIO_INTR_LOW_LEVEL,
+    GPIO_INTR_HIGH_LEVEL
+} gpio_int_type_t;
+
+typedef void (*gpio_isr_t)(void* arg);
+
+esp_err_t gpio_install_isr_service(int intr_alloc_flags);
+esp_err_t gpio_isr_handler_add(gpio_num_t gpio_num, gpio_isr_t isr_handler, void* args);
+esp_err_t gpio_intr_enable(gpio_num_t gpio_num);
+// Only the level types are supported, the handler runs once the pin is at the level and must then ask for the other one
+esp_err_t gpio_wakeup_enable(gpio_num_t gpio_num, gpio_int_type_t intr_type);
+
+#endif
@@ -0,0 +1,31 @@
+/*
+ This file contains a host-native stand-in for ESP-IDF's power management API.
+ Enabling automatic light sleep lets the simulated chip sleep whenever no lock is held, see sim::setLightSleepEnabled().
+*/
+
+#ifndef __ESP_PM_H__
+#define __ESP_PM_H__
+
+#include <esp_err.h>
+
+typedef enum {
+    ESP_PM_CPU_FREQ_MAX,
+    ESP_PM_APB_FREQ_MAX,
+    ESP_PM_NO_LIGHT_SLEEP
+} esp_pm_lock_type_t;
+
+typedef struct {
+    int max_freq_mhz;
+    int min_freq_mhz;
+    bool light_sleep_enable;
+} esp_pm_config_esp32s3_t;
+
+struct SimPowerLock;
+typedef SimPowerLock* esp_pm_lock_handle_t;
+
+esp_err_t esp_pm_configure(const void* config);
+esp_err_t esp_pm_lock_create(esp_pm_lock_type_t lock_type, int arg, const char* name, esp_pm_lock_handle_t* out_handle);
+esp_err_t esp_pm_lock_acquire(esp_pm_lock_handle_t handle);
+esp_err_t esp_pm_lock_release(esp_pm_lock_handle_t handle);
+
+#endif
@@ -0,0 +1,13 @@
+/*
+ This file contains a host-native stand-in for the parts of ESP-IDF's sleep API the firmware uses.
+*/
+
+#ifndef __ESP_SLEEP_H__
+#define __ESP_SLEEP_H__
+
+#include <esp_err.h>
+
+// GPIOs always wake the simulated chip, see the stand-in gpio_wakeup_enable()
+esp_err_t esp_sleep_enable_gpio_wakeup(void);
+
+#endif
@@ -0,0 +1,30 @@
+/*
+ This file contains a host-native stand-in for the FreeRTOS kernel types used by the firmware.
+ Tasks are host threads and a tick is one millisecond of simulation time.
+*/
+
+#ifndef INC_FREERTOS_H
+#define INC_FREERTOS_H
+
+#include <cstdint>
+#include <cstddef>
+
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+
+#define pdFALSE ((BaseType_t)0)
+#define pdTRUE ((BaseType_t)1)
+#define pdFAIL pdFALSE
+#define pdPASS pdTRUE
+
+#define configTICK_RATE_HZ 1000
+#define portTICK_PERIOD_MS ((TickType_t)1000 / configTICK_RATE_HZ)
+#define portMAX_DELAY ((TickType_t)0xffffffffUL)
+#define pdMS_TO_TICKS(xTimeInMs) ((TickType_t)(((TickType_t)(xTimeInMs) * (TickType_t)configTICK_RATE_HZ) / (TickType_t)1000U))
+#define tskNO_AFFINITY 0x7FFFFFFF
+#define tskIDLE_PRIORITY ((UBaseType_t)0U)
+// Interrupts run on the simulated host task, which never preempts anything
+#define portYIELD_FROM_ISR(xHigherPriorityTaskWoken) ((void)(xHigherPriorityTaskWoken))
+
+#endif
@@ -0,0 +1,303 @@
+/*
+ This file contains the control surface for the host-native simulation.
+ The stand-in Arduino, NimBLE and DFRobot headers next to it talk to the models declared here,
+ and the benchmark harness uses it to configure timings and drive bulbs and the mmWave sensor.
+*/
+
+#ifndef sim_h
+#define sim_h
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <functional>
+#include <chrono>
+#include <cstdio>
+
+namespace sim {
+
+/*
+ Timing and environment knobs for the simulation.
+ Every value can be overridden from the command line as --name=value, see sim::configure().
+*/
+struct Config {
+    // How often an unconnected bulb advertises (ms)
+    uint32_t advIntervalMs = 100;
+    // Time from the initiator catching an advertisement to the first connection event (ms)
+    uint32_t connectSetupMs = 10;
+    /*
+     A GATT round trip is the wait for the next connection event, one connection interval for the
+     response and then this much processing time on the bulb (ms).
+    */
+    uint32_t gattProcessingMs = 2;
+    // Round trips needed for primary service, characteristic and descriptor discovery
+    uint32_t serviceDiscoveryRoundTrips = 2;
+    uint32_t charDiscoveryRoundTrips = 3;
+    uint32_t descDiscoveryRoundTrips = 2;
+    // Round trips needed to pair/bond, and to restart encryption with an existing bond
+    uint32_t bondRoundTrips = 6;
+    uint32_t encryptRoundTrips = 2;
+    // Other devices advertising nearby (phones, beacons, ...)
+    uint32_t noiseAdvertisers = 0;
+    uint32_t noiseAdvIntervalMs = 200;
+    // UART baud rate between the ESP32 and the mmWave sensor
+    uint32_t uartBaud = 115200;
+    // How often the sensor outputs a $JYBSS frame while running (ms)
+    uint32_t sensorFrameIntervalMs = 100;
+    // How long the sensor takes to answer a CLI command (ms)
+    uint32_t sensorCommandMs = 50;
+    // Fixed delay the DFRobot library waits after writing each command (ms)
+    uint32_t sensorCommandDelayMs = 1000;
+    // How long the sensor reports no presence after being started (ms)
+    uint32_t sensorResumeBlindMs = 3000;
+    // Whether the sensor's IO2 (high while it reports presence) is wired to a GPIO, see SensorModel::outputLevel()
+    uint32_t sensorIo2Wired = 1;
+    // How long a GPIO takes to wake the chip from light sleep before its interrupt runs (us)
+    uint32_t lightSleepWakeUs = 500;
+    // How many times faster than real time the simulation runs, for soaking the firmware over long stretches of simulated time
+    uint32_t timeScale = 1;
+    // The percentage of attempts to bond or restore encryption that fail, see sim::injectFault()
+    uint32_t bondFailurePct = 0;
+    // The percentage of power state notifications that are lost
+    uint32_t notificationDropPct = 0;
+    // The percentage of writes with response that the bulb is slow to process, and how much longer those take (ms)
+    uint32_t slowWritePct = 0;
+    uint32_t slowWriteMs = 2000;
+    // Seed for all randomness in the simulation
+    uint32_t seed = 1;
+};
+
+Config& config();
+
+// Parses --name=value arguments into the config, returning the arguments that were not recognised
+std::vector<std::string> configure(int argc, char** argv);
+
+// Prints every config value, used so benchmark output records the conditions it was taken under
+void printConfig(FILE* out);
+
+// Microseconds since the simulation started
+uint64_t nowMicros();
+void sleepUntil(uint64_t micros);
+void sleepFor(uint64_t micros);
+// How long the given simulated time takes to pass in real time, see Config::timeScale
+std::chrono::microseconds realDuration(uint64_t micros);
+/*
+ Stops the clock from following real time, from then on it only moves when it's set again or something sleeps.
+ Used by the trace replayer, which runs the firmware's logic on a single thread as fast as it can.
+*/
+void setClock(uint64_t micros);
+
+// Uniformly distributed random value in [0, bound)
+uint32_t random(uint32_t bound);
+
+// Guards all model state, never held while calling back into firmware code
+std::mutex& mutex();
+
+// Runs the given function on the simulated BLE host task at the given time
+void post(uint64_t atMicros, std::function<void()> fn);
+
+// Where the firmware's Serial output goes, nullptr (the default) discards it
+void setConsole(FILE* out);
+FILE* console();
+// Serial's side of the console, used by the stand-in HardwareSerial
+void consoleWrite(const uint8_t* buffer, size_t size);
+int consoleRead();
+int consolePeek();
+int consoleAvailable();
+// Queues bytes for the firmware to read from Serial, as if they were typed into the serial monitor
+void consoleInput(const std::string& bytes);
+// Runs the callback on the simulated host task whenever consoleInput() is given bytes, like Serial's RX event
+void onConsoleInput(std::function<void()> callback);
+// Keeps a copy of everything the firmware writes to Serial from now on, until it is taken with takeConsoleOutput()
+void captureConsole();
+std::string takeConsoleOutput();
+
+/*
+ Non-volatile storage shared by the stand-in Preferences library and the NimBLE bond store.
+ It starts empty unless loadNvs() is given a file, which every change is then saved back to,
+ so a later run sees the storage a previous run left behind as if the ESP32 had rebooted.
+*/
+void loadNvs(const std::string& path);
+bool nvsGet(const std::string& key, std::vector<uint8_t>& value);
+void nvsPut(const std::string& key, const std::vector<uint8_t>& value);
+bool nvsRemove(const std::string& key);
+
+/*
+ Power management, used by the stand-in esp_pm.h. The chip is taken to be light sleeping whenever automatic light sleep
+ is enabled and no power management lock is held, which leaves out its brief wakeups for timers, connection events and
+ interrupts (the harness counts those itself). While asleep the UART receives nothing, so the sensor's frames are lost,
+ and a GPIO takes lightSleepWakeUs to wake the chip before its interrupt runs.
+*/
+void setLightSleepEnabled(bool enabled);
+void acquirePowerLock();
+void releasePowerLock();
+bool lightSleeping();
+// The total time spent light sleeping so far
+uint64_t lightSleepMicros();
+// How many times a GPIO has woken the chip from light sleep
+uint64_t gpioWakeups();
+
+// The firmware callbacks that run for every advertisement, notification or UART burst received
+enum HotPath {
+    HOT_PATH_NONE,
+    HOT_PATH_SCAN,
+    HOT_PATH_NOTIFY,
+    HOT_PATH_UART
+};
+
+// Marks the calling thread as running a hot path firmware callback while in scope, so the harness can attribute heap allocations to it
+class HotPathScope {
+public:
+    explicit HotPathScope(HotPath path);
+    ~HotPathScope();
+
+private:
+    HotPath m_path;
+    HotPath m_previous;
+    uint64_t m_cpuStartNanos;
+};
+
+HotPath currentHotPath();
+// How many times the firmware's callbacks for the given hot path have been run
+uint64_t hotPathCalls(HotPath path);
+// The thread CPU time spent in the firmware's callbacks for the given hot path
+uint64_t hotPathCpuMicros(HotPath path);
+
+// The faults the simulation can inject at random, each with its own percentage in Config
+enum Fault {
+    FAULT_BOND,
+    FAULT_NOTIFICATION,
+    FAULT_SLOW_WRITE,
+    FAULT_COUNT
+};
+
+// Decides at random whether the fault happens this time, counting it if it does. Never consumes randomness while it's disabled
+bool injectFault(Fault fault);
+// How many times the fault has been injected
+uint64_t faultsInjected(Fault fault);
+
+struct PowerWrite {
+    // When the firmware issued the write, and when it reached the bulb
+    uint64_t issuedAtMicros;
+    uint64_t atMicros;
+    bool value;
+    bool withResponse;
+    // Connection interval in effect when the write reached the bulb (1.25ms units)
+    uint16_t intervalUnits;
+};
+
+// A simulated Philips Hue BLE bulb
+class BulbModel {
+public:
+    explicit BulbModel(const std::string& mac);
+
+    const std::string& mac() const { return m_mac; }
+
+    // Harness controls, these are thread safe
+    // Changes the power state as if another controller did (notifies subscribers)
+    void setExternalPower(bool on);
+    // Cuts power at the wall: drops the link and stops advertising for the given time
+    void powerCut(uint32_t offMs);
+    // Loses the link as if to interference, the bulb stays powered and advertises again once the central notices
+    void dropLink();
+    // Forgets the writes received so far, so a long soak doesn't keep every one
+    void clearWrites();
+    bool poweredOn() const;
+    bool connected() const;
+    bool subscribed() const;
+    // When the current (or last) link to the bulb was established, 0 if never
+    uint64_t connectedAt() const;
+    std::vector<PowerWrite> writes() const;
+    size_t writeCount() const;
+
+    // Model state below is owned by the simulation and guarded by sim::mutex()
+    std::string m_mac;
+    uint8_t m_native[6];
+    bool m_poweredOn = false;
+    uint64_t m_advertisingFrom = 0;
+    void* m_link = nullptr;
+    uint64_t m_connectedAt = 0;
+    bool m_subscribed = false;
+    bool m_bonded = false;
+    std::vector<PowerWrite> m_writes;
+};
+
+// Adds a bulb to the simulated room, it starts advertising straight away
+BulbModel& addBulb(const std::string& mac);
+std::vector<BulbModel*>& bulbs();
+BulbModel* findBulb(const uint8_t* native);
+
+// The simulated DFRobot SEN0395 mmWave sensor, wired to UART 1
+class SensorModel {
+public:
+    // Harness controls, these are thread safe
+    // Sets whether the sensor's output reports presence from now on
+    void setPresence(bool present);
+    bool running() const;
+    // When the first frame carrying the latest reported state started arriving, 0 if not yet sent
+    uint64_t lastEdgeMicros() const;
+    // When the sensor was last started, 0 if never
+    uint64_t startedMicros() const;
+    uint32_t commandsReceived() const;
+    // How many frames were lost as the chip was light sleeping when they arrived
+    uint32_t framesLost() const;
+
+    // IO2, high while the sensor is running and reporting presence. Always low if it isn't wired, see Config::sensorIo2Wired
+    bool outputLevel() const;
+    /*
+     Runs the callback on the simulated host task once IO2 is at the given level (straight away if it already is),
+     standing in for a level triggered GPIO interrupt. Only the latest callback is kept, and it only runs once.
+    */
+    void onOutputLevel(bool level, std::function<void()> callback);
+
+    // UART side, used by the stand-in HardwareSerial
+    int available();
+    int read();
+    int peek();
+    void write(uint8_t c);
+    /*
+     Runs the callback on the simulated UART event task once a burst of bytes has been received and the line
+     has then been idle for the RX timeout, like HardwareSerial::onReceive(callback, true) on the ESP32.
+    */
+    void onReceive(std::function<void()> callback);
+
+private:
+    void produce(uint64_t now);
+    void handleCommand(const std::string& line, uint64_t now);
+    void queueBytes(const std::string& bytes, uint64_t at);
+    bool presenceAt(uint64_t at) const;
+    bool reportsPresenceAt(uint64_t at) const;
+    void checkOutputLevel(uint64_t now);
+    void schedulePump();
+
+    struct Edge {
+        uint64_t at;
+        bool present;
+    };
+    struct RxByte {
+        uint64_t at;
+        uint8_t value;
+    };
+    std::vector<Edge> m_edges;
+    std::vector<RxByte> m_rx;
+    size_t m_rxHead = 0;
+    std::string m_tx;
+    bool m_running = true;
+    uint64_t m_startedAt = 0;
+    uint64_t m_nextFrameAt = 0;
+    int m_lastFrameValue = -1;
+    uint64_t m_lastEdgeAt = 0;
+    uint32_t m_commands = 0;
+    uint32_t m_framesLost = 0;
+    bool m_awaitedLevel = false;
+    std::function<void()> m_levelCallback;
+    std::function<void()> m_rxCallback;
+    uint32_t m_pumpGeneration = 0;
+};
+
+SensorModel& sensor();
+
+}
+
+#endif
@@ -0,0 +1,111 @@
+/*
+ This file contains the host-native stand-in for the Arduino-ESP32 core.
+*/
+
+#include <Arduino.h>
+#include <sim.h>
+#include <thread>
+
+HardwareSerial Serial(0);
+EspClass ESP;
+
+uint32_t EspClass::getCycleCount() {
+    return sim::nowMicros() * getCpuFreqMHz();
+}
+
+unsigned long millis() {
+    return sim::nowMicros() / 1000;
+}
+
+unsigned long micros() {
+    return sim::nowMicros();
+}
+
+void delay(uint32_t ms) {
+    sim::sleepFor(ms * 1000ull);
+}
+
+void delayMicroseconds(uint32_t us) {
+    sim::sleepFor(us);
+}
+
+void yield() {
+    std::this_thread::yield();
+}
+
+void pinMode(uint8_t pin, uint8_t mode) {}
+
+int digitalRead(uint8_t pin) {
+    return sim::sensor().outputLevel() ? HIGH : LOW;
+}
+
+size_t Print::write(const uint8_t* buffer, size_t size) {
+    size_t written = 0;
+    while (size--) {
+        written += write(*buffer++);
+    }
+    return written;
+}
+
+size_t Print::print(long value, int base) {
+    if (value < 0 && base == 10) {
+        return print('-') + print((unsigned long)-value, base);
+    }
+    return print((unsigned long)value, base);
+}
+
+size_t Print::print(unsigned long value, int base) {
+    char buffer[8 * sizeof(long) + 1];
+    char* str = &buffer[sizeof(buffer) - 1];
+    *str = '\0';
+    if (base < 2) {
+        base = 10;
+    }
+    do {
+        unsigned long digit = value % base;
+        value /= base;
+        *--str = digit < 10 ? '0' + digit : 'A' + digit - 10;
+    } while (value);
+    return write(str);
+}
+
+size_t Print::print(double value, int digits) {
+    char buffer[64];
+    snprintf(buffer, sizeof(buffer), "%.*f", digits, value);
+    return write(buffer);
+}
+
+void HardwareSerial::onReceive(OnReceiveCb function, bool onlyOnTimeout) {
+    if (m_uartNum == 1) {
+        sim::sensor().onReceive(function);
+    } else {
+        sim::onConsoleInput(function);
+    }
+}
+
+int HardwareSerial::available() {
+    return m_uartNum == 1 ? sim::sensor().available() : sim::consoleAvailable();
+}
+
+int HardwareSerial::read() {
+    return m_uartNum == 1 ? sim::sensor().read() : sim::consoleRead();
+}
+
+int HardwareSerial::peek() {
+    return m_uartNum == 1 ? sim::sensor().peek() : sim::consolePeek();
+}
+
+size_t HardwareSerial::write(uint8_t c) {
+    return write(&c, 1);
+}
+
+size_t HardwareSerial::write(const uint8_t* buffer, size_t size) {
+    if (m_uartNum == 1) {
+        for (size_t i = 0; i < size; i++) {
+            sim::sensor().write(buffer[i]);
+        }
+    } else {
+        sim::consoleWrite(buffer, size);
+    }
+    return size;
+}
@@ -0,0 +1,92 @@
+/*
+ This file contains the host-native stand-in for the DFRobot_mmWave_Radar library fork.
+ The frame parsing, timeouts and command sequences follow the real library.
+*/
+
+#include <DFRobot_mmWave_Radar.h>
+#include <sim.h>
+
+static const char* COM_STOP = "sensorStop";
+static const char* COM_START = "sensorStart";
+static const char* COM_FACTORY_RESET = "factoryReset 0x45670123 0xCDEF89AB 0x956128C6 0xDF54AC89";
+static const char* COM_SAVE_CFG = "saveCfg 0x45670123 0xCDEF89AB 0x956128C6 0xDF54AC89";
+
+DFRobot_mmWave_Radar::DFRobot_mmWave_Radar(Stream* s) : _s(s) {}
+
+size_t DFRobot_mmWave_Radar::readN(uint8_t* buf, size_t len) {
+    size_t offset = 0, left = len;
+    unsigned long curr = millis();
+    while (left) {
+        if (_s->available()) {
+            buf[offset] = _s->read();
+            offset++;
+            left--;
+        }
+        if (millis() - curr > 500) {
+            break;
+        }
+    }
+    return offset;
+}
+
+// Waits for a "$JYBSS,x, , , *" frame, giving up after a second
+bool DFRobot_mmWave_Radar::recdData(uint8_t* buf) {
+    unsigned long timeStart = millis();
+    uint8_t ch;
+    while (millis() - timeStart <= 1000) {
+        if (readN(&ch, 1) == 1 && ch == '$') {
+            buf[0] = ch;
+            if (readN(&buf[1], 14) == 14 && memcmp(&buf[1], "JYBSS", 5) == 0 && buf[14] == '*') {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+bool DFRobot_mmWave_Radar::readPresenceDetection(void) {
+    uint8_t dat[15] = { 0 };
+    if (recdData(dat)) {
+        return dat[7] == '1';
+    }
+    return false;
+}
+
+void DFRobot_mmWave_Radar::writeCMD(const char* cmd) {
+    _s->write(cmd);
+    _s->write("\r\n");
+    delay(sim::config().sensorCommandDelayMs);
+}
+
+void DFRobot_mmWave_Radar::DetRangeCfg(float parA_s, float parA_e) {
+    char comDetRangeCfg[52] = { 0 };
+    sprintf(comDetRangeCfg, "detRangeCfg -1 %d %d", (int)(parA_s / 0.15), (int)(parA_e / 0.15));
+    writeCMD(COM_STOP);
+    writeCMD(comDetRangeCfg);
+    writeCMD(COM_SAVE_CFG);
+    writeCMD(COM_START);
+}
+
+void DFRobot_mmWave_Radar::OutputLatency(float par1, float par2) {
+    char comOutputLatency[52] = { 0 };
+    sprintf(comOutputLatency, "outputLatency -1 %d %d", (int)(par1 * 1000 / 25), (int)(par2 * 1000 / 25));
+    writeCMD(COM_STOP);
+    writeCMD(comOutputLatency);
+    writeCMD(COM_SAVE_CFG);
+    writeCMD(COM_START);
+}
+
+void DFRobot_mmWave_Radar::factoryReset(void) {
+    writeCMD(COM_STOP);
+    writeCMD(COM_FACTORY_RESET);
+    writeCMD(COM_SAVE_CFG);
+    writeCMD(COM_START);
+}
+
+void DFRobot_mmWave_Radar::start(void) {
+    writeCMD(COM_START);
+}
+
+void DFRobot_mmWave_Radar::stop(void) {
+    writeCMD(COM_STOP);
+}
@@ -0,0 +1,1318 @@
+/*
+ This file contains the host-native stand-in for the NimBLE-Arduino client API and the simulated Hue bulbs.
+
+ Each link keeps a real connection event schedule: an ATT request goes out on the next connection event,
+ the bulb answers on the first event after it has processed the request and write-without-response
+ values land on the next event. So the connection interval set by the firmware directly shapes latency.
+*/
+
+#include <NimBLEDevice.h>
+#include <sim.h>
+#include <memory>
+#include <algorithm>
+#include <condition_variable>
+#include <cstring>
+#include <cstdio>
+
+// Layout of the simulated bulb's light service
+static const NimBLEUUID SIM_LIGHT_SERVICE_UUID("932c32bd-0000-47a2-835a-a8d455b859dd");
+static const NimBLEUUID SIM_POWER_STATE_CHAR_UUID("932c32bd-0002-47a2-835a-a8d455b859dd");
+static const NimBLEUUID SIM_BRIGHTNESS_CHAR_UUID("932c32bd-0003-47a2-835a-a8d455b859dd");
+static const uint16_t SIM_LIGHT_SERVICE_START = 0x0030;
+static const uint16_t SIM_LIGHT_SERVICE_END = 0x0040;
+static const uint16_t SIM_POWER_STATE_HANDLE = 0x0034;
+static const uint16_t SIM_POWER_STATE_CCCD_HANDLE = 0x0035;
+static const uint16_t SIM_BRIGHTNESS_HANDLE = 0x0037;
+static const uint16_t SIM_BRIGHTNESS_CCCD_HANDLE = 0x0038;
+static const uint16_t CCCD_UUID = 0x2902;
+// Where the simulated NimBLE bond store is kept in NVS, as concatenated 6 byte addresses
+static const char* SIM_BONDS_NVS_KEY = "nimble_bond/addresses";
+// Read, write & notify
+static const uint8_t SIM_POWER_STATE_PROPERTIES = 0x02 | 0x08 | 0x10;
+
+struct SimLink {
+    NimBLEClient* client;
+    sim::BulbModel* bulb;
+    uint16_t handle;
+    uint64_t anchor;
+    uint16_t interval;
+    uint16_t latency;
+    uint16_t timeout;
+    uint16_t pendingInterval = 0;
+    uint64_t pendingAt = 0;
+    bool encrypted = false;
+    bool peerGone = false;
+    bool alive = true;
+    // Asynchronous GATT operations that can only complete once the link drops
+    std::vector<std::function<void(int)>> pendingOps;
+
+    // Applies an accepted parameter update once its instant has passed
+    void settle(uint64_t t) {
+        if (pendingInterval && pendingAt <= t) {
+            anchor = pendingAt;
+            interval = pendingInterval;
+            pendingInterval = 0;
+        }
+    }
+
+    // The first connection event at or after the given time
+    uint64_t nextEvent(uint64_t t) {
+        settle(t);
+        uint64_t period = interval * 1250ull;
+        uint64_t event = t <= anchor ? anchor : anchor + ((t - anchor + period - 1) / period) * period;
+        if (pendingInterval && event >= pendingAt) {
+            return pendingAt;
+        }
+        return event;
+    }
+
+    uint16_t intervalAt(uint64_t t) {
+        settle(t);
+        return interval;
+    }
+
+    // When the response to a request issued at the given time arrives
+    uint64_t responseAt(uint64_t t) {
+        uint64_t sent = nextEvent(t);
+        return nextEvent(sent + 1 + sim::config().gattProcessingMs * 1000ull);
+    }
+
+    static void terminate(const std::shared_ptr<SimLink>& link);
+    static void queueNotification(sim::BulbModel* bulb, uint64_t at);
+    static void applyPowerWrite(SimLink* link, bool value, bool withResponse, uint64_t issuedAt, uint64_t at);
+    static bool roundTrips(NimBLEClient* client, uint32_t count);
+};
+
+typedef std::shared_ptr<SimLink> SimLinkPtr;
+
+static NimBLEScan scan;
+static std::vector<NimBLEClient*> clients;
+static std::vector<NimBLEAddress> bonds;
+static std::vector<SimLinkPtr> links;
+static std::vector<NimBLEAddress> noiseAdvertisers;
+// The controller's filter accept list, matched on both the address and its type like the real controller
+static std::vector<NimBLEAddress> whiteList;
+// Scan results NimBLE would free, kept until the next clear so stale pointers held by the firmware don't crash the host
+static std::vector<NimBLEAdvertisedDevice*> clearedResults;
+static std::condition_variable scanStateChanged;
+static std::condition_variable linkStateChanged;
+static uint16_t nextConnHandle = 1;
+static bool initialized = false;
+static ble_gap_event_listener* gapListeners = nullptr;
+
+static SimLinkPtr findLink(SimLink* link) {
+    for (const SimLinkPtr& candidate : links) {
+        if (candidate.get() == link) {
+            return candidate;
+        }
+    }
+    return nullptr;
+}
+
+static SimLinkPtr findLinkByHandle(uint16_t handle) {
+    for (const SimLinkPtr& candidate : links) {
+        if (candidate->handle == handle) {
+            return candidate;
+        }
+    }
+    return nullptr;
+}
+
+static bool isBondedLocked(const NimBLEAddress& address) {
+    return std::find(bonds.begin(), bonds.end(), address) != bonds.end();
+}
+
+// Persists the bond store like NimBLE does, called with the model lock held
+static void saveBondsLocked() {
+    std::vector<uint8_t> addresses;
+    for (const NimBLEAddress& bond : bonds) {
+        addresses.insert(addresses.end(), bond.getNative(), bond.getNative() + 6);
+    }
+    sim::nvsPut(SIM_BONDS_NVS_KEY, addresses);
+}
+
+// Whether a write to the given handle of a simulated bulb is accepted
+static bool isWritableHandle(uint16_t handle) {
+    return handle == SIM_POWER_STATE_HANDLE || handle == SIM_POWER_STATE_CCCD_HANDLE
+        || handle == SIM_BRIGHTNESS_HANDLE || handle == SIM_BRIGHTNESS_CCCD_HANDLE;
+}
+
+// Tears down the link and tells the client, must be called without the model lock held
+void SimLink::terminate(const SimLinkPtr& link) {
+    NimBLEClient* client;
+    std::vector<std::function<void(int)>> pendingOps;
+    {
+        std::lock_guard<std::mutex> lock(sim::mutex());
+        if (!link->alive) {
+            return;
+        }
+        link->alive = false;
+        link->bulb->m_link = nullptr;
+        if (!link->bulb->m_bonded) {
+            link->bulb->m_subscribed = false;
+        }
+        link->bulb->m_advertisingFrom = std::max(link->bulb->m_advertisingFrom, sim::nowMicros());
+        client = link->client;
+        client->m_link = nullptr;
+        client->m_connHandle = BLE_HS_CONN_HANDLE_NONE;
+        links.erase(std::find(links.begin(), links.end(), link));
+        pendingOps.swap(link->pendingOps);
+    }
+    linkStateChanged.notify_all();
+    // Like NimBLE, outstanding GATT procedures fail before the disconnect is reported
+    for (std::function<void(int)>& complete : pendingOps) {
+        complete(BLE_HS_ENOTCONN);
+    }
+    if (client->m_pClientCallbacks) {
+        client->m_pClientCallbacks->onDisconnect(client);
+    }
+}
+
+// Sends a power state notification to the subscribed client on the next connection event
+void SimLink::queueNotification(sim::BulbModel* bulb, uint64_t at) {
+    SimLink* raw = (SimLink*)bulb->m_link;
+    if (!raw || !bulb->m_subscribed || raw->peerGone) {
+        return;
+    }
+    SimLinkPtr link = findLink(raw);
+    uint64_t deliverAt = link->nextEvent(at + 1 + sim::config().gattProcessingMs * 1000ull);
+    sim::post(deliverAt, [link]() {
+        NimBLERemoteCharacteristic* powerStateChar = nullptr;
+        uint8_t value;
+        uint16_t connHandle;
+        if (sim::injectFault(sim::FAULT_NOTIFICATION)) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(sim::mutex());
+            if (!link->alive || link->peerGone) {
+                return;
+            }
+            value = link->bulb->m_poweredOn ? 1 : 0;
+            connHandle = link->handle;
+            for (NimBLERemoteService* service : link->client->m_servicesVector) {
+                for (NimBLERemoteCharacteristic* characteristic : service->m_characteristicVector) {
+                    if (characteristic->m_handle == SIM_POWER_STATE_HANDLE && characteristic->m_notifyCallback) {
+                        powerStateChar = characteristic;
+                    }
+                }
+            }
+        }
+        // GAP event listeners see every notification, before the client looks for a characteristic to pass it to
+        for (ble_gap_event_listener* listener = gapListeners; listener; listener = listener->next) {
+            uint8_t data = value;
+            os_mbuf om = { &data, 1 };
+            ble_gap_event event = {};
+            event.type = BLE_GAP_EVENT_NOTIFY_RX;
+            event.notify_rx.om = &om;
+            event.notify_rx.attr_handle = SIM_POWER_STATE_HANDLE;
+            event.notify_rx.conn_handle = connHandle;
+            sim::HotPathScope hotPath(sim::HOT_PATH_NOTIFY);
+            listener->fn(&event, listener->arg);
+        }
+        // NimBLE drops notifications for characteristics it hasn't discovered
+        if (powerStateChar) {
+            sim::HotPathScope hotPath(sim::HOT_PATH_NOTIFY);
+            powerStateChar->m_notifyCallback(powerStateChar, &value, 1, true);
+        }
+    });
+}
+
+// Applies a power write that reached the bulb, guarded by the model lock
+void SimLink::applyPowerWrite(SimLink* link, bool value, bool withResponse, uint64_t issuedAt, uint64_t at) {
+    sim::BulbModel* bulb = link->bulb;
+    bulb->m_writes.push_back({ issuedAt, at, value, withResponse, link->intervalAt(at) });
+    if (bulb->m_poweredOn != value) {
+        bulb->m_poweredOn = value;
+        SimLink::queueNotification(bulb, at);
+    }
+}
+
+/*
+ Blocks the caller for the given number of GATT round trips on the client's link.
+ Returns false if the link went away in the meantime.
+*/
+bool SimLink::roundTrips(NimBLEClient* client, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++) {
+        SimLinkPtr link;
+        uint64_t responseAt;
+        {
+            std::lock_guard<std::mutex> lock(sim::mutex());
+            if (!client->m_link) {
+                return false;
+            }
+            link = findLink(client->m_link);
+            responseAt = link->responseAt(sim::nowMicros());
+        }
+        if (link->peerGone) {
+            // The request goes unanswered until the supervision timeout drops the link
+            std::unique_lock<std::mutex> lock(sim::mutex());
+            linkStateChanged.wait(lock, [&link] { return !link->alive; });
+            return false;
+        }
+        sim::sleepUntil(responseAt);
+        std::lock_guard<std::mutex> lock(sim::mutex());
+        if (!link->alive) {
+            return false;
+        }
+    }
+    return true;
+}
+
+namespace sim {
+
+BulbModel::BulbModel(const std::string& mac) : m_mac(mac) {
+    NimBLEAddress address(mac);
+    memcpy(m_native, address.getNative(), sizeof(m_native));
+}
+
+void BulbModel::setExternalPower(bool on) {
+    std::lock_guard<std::mutex> lock(mutex());
+    if (m_poweredOn != on) {
+        m_poweredOn = on;
+        SimLink::queueNotification(this, nowMicros());
+    }
+}
+
+void BulbModel::powerCut(uint32_t offMs) {
+    uint64_t now = nowMicros();
+    {
+        std::lock_guard<std::mutex> lock(mutex());
+        m_advertisingFrom = now + offMs * 1000ull;
+    }
+    dropLink();
+    // Hue bulbs come back on when power is restored
+    post(now + offMs * 1000ull, [this]() {
+        std::lock_guard<std::mutex> lock(mutex());
+        m_poweredOn = true;
+    });
+}
+
+void BulbModel::dropLink() {
+    SimLinkPtr link;
+    {
+        std::lock_guard<std::mutex> lock(mutex());
+        if (m_link) {
+            link = findLink((SimLink*)m_link);
+            link->peerGone = true;
+        }
+    }
+    if (link) {
+        // The central only notices once the supervision timeout expires
+        post(nowMicros() + link->timeout * 10000ull, [link]() { SimLink::terminate(link); });
+    }
+}
+
+void BulbModel::clearWrites() {
+    std::lock_guard<std::mutex> lock(mutex());
+    std::vector<PowerWrite>().swap(m_writes);
+}
+
+bool BulbModel::poweredOn() const {
+    std::lock_guard<std::mutex> lock(mutex());
+    return m_poweredOn;
+}
+
+bool BulbModel::connected() const {
+    std::lock_guard<std::mutex> lock(mutex());
+    return m_link != nullptr;
+}
+
+bool BulbModel::subscribed() const {
+    std::lock_guard<std::mutex> lock(mutex());
+    return m_link != nullptr && m_subscribed;
+}
+
+uint64_t BulbModel::connectedAt() const {
+    std::lock_guard<std::mutex> lock(mutex());
+    return m_connectedAt;
+}
+
+std::vector<PowerWrite> BulbModel::writes() const {
+    std::lock_guard<std::mutex> lock(mutex());
+    return m_writes;
+}
+
+size_t BulbModel::writeCount() const {
+    std::lock_guard<std::mutex> lock(mutex());
+    return m_writes.size();
+}
+
+std::vector<BulbModel*>& bulbs() {
+    static std::vector<BulbModel*> instance;
+    return instance;
+}
+
+BulbModel& addBulb(const std::string& mac) {
+    std::lock_guard<std::mutex> lock(mutex());
+    BulbModel* bulb = new BulbModel(mac);
+    bulbs().push_back(bulb);
+    return *bulb;
+}
+
+BulbModel* findBulb(const uint8_t* native) {
+    for (BulbModel* bulb : bulbs()) {
+        if (memcmp(bulb->m_native, native, sizeof(bulb->m_native)) == 0) {
+            return bulb;
+        }
+    }
+    return nullptr;
+}
+
+}
+
+NimBLEUUID::NimBLEUUID(const std::string& uuid) : m_uuid(uuid) {
+    std::transform(m_uuid.begin(), m_uuid.end(), m_uuid.begin(), ::tolower);
+    if (m_uuid.size() == 36) {
+        // NimBLE keeps 128 bit UUIDs little endian
+        std::string hex;
+        for (char c : m_uuid) {
+            if (c != '-') {
+                hex += c;
+            }
+        }
+        m_native.u.type = BLE_UUID_TYPE_128;
+        for (int i = 0; i < 16; i++) {
+            m_native.u128.value[15 - i] = (uint8_t)strtoul(hex.substr(i * 2, 2).c_str(), nullptr, 16);
+        }
+    } else if (m_uuid.size() == 4) {
+        m_native.u.type = BLE_UUID_TYPE_16;
+        m_native.u16.value = (uint16_t)strtoul(m_uuid.c_str(), nullptr, 16);
+    }
+}
+
+NimBLEUUID::NimBLEUUID(uint16_t uuid) {
+    char text[7];
+    snprintf(text, sizeof(text), "0x%04x", uuid);
+    m_uuid = text;
+    m_native.u.type = BLE_UUID_TYPE_16;
+    m_native.u16.value = uuid;
+}
+
+NimBLEAddress::NimBLEAddress() : m_addrType(BLE_ADDR_PUBLIC) {
+    memset(m_address, 0, sizeof(m_address));
+}
+
+NimBLEAddress::NimBLEAddress(const uint8_t address[6], uint8_t type) : m_addrType(type) {
+    memcpy(m_address, address, sizeof(m_address));
+}
+
+NimBLEAddress::NimBLEAddress(const std::string& stringAddress, uint8_t type) : m_addrType(type) {
+    unsigned int data[6];
+    memset(m_address, 0, sizeof(m_address));
+    if (stringAddress.length() == 17 && sscanf(stringAddress.c_str(), "%2x:%2x:%2x:%2x:%2x:%2x",
+            &data[5], &data[4], &data[3], &data[2], &data[1], &data[0]) == 6) {
+        for (int i = 0; i < 6; i++) {
+            m_address[i] = (uint8_t)data[i];
+        }
+    }
+}
+
+NimBLEAddress::NimBLEAddress(const uint64_t& address, uint8_t type) : m_addrType(type) {
+    memcpy(m_address, &address, sizeof(m_address));
+}
+
+bool NimBLEAddress::equals(const NimBLEAddress& otherAddress) const {
+    return memcmp(otherAddress.m_address, m_address, sizeof(m_address)) == 0;
+}
+
+std::string NimBLEAddress::toString() const {
+    char buffer[18];
+    snprintf(buffer, sizeof(buffer), "%02x:%02x:%02x:%02x:%02x:%02x",
+        m_address[5], m_address[4], m_address[3], m_address[2], m_address[1], m_address[0]);
+    return std::string(buffer);
+}
+
+NimBLEAddress::operator uint64_t() const {
+    uint64_t address = 0;
+    memcpy(&address, m_address, sizeof(m_address));
+    return address;
+}
+
+std::string NimBLEAdvertisedDevice::toString() {
+    std::string res = "Name: " + m_name + ", Address: " + m_address.toString();
+    char hex[4];
+    res += ", payload: ";
+    for (uint8_t byte : m_payload) {
+        snprintf(hex, sizeof(hex), "%02x", byte);
+        res += hex;
+    }
+    return res;
+}
+
+/*
+ Advertisers are indexed with the simulated bulbs first, then the background noise.
+ Each one re-arms itself for as long as the scan generation it was scheduled for is current.
+*/
+void NimBLEScan::scheduleAdvertiser(size_t index, uint32_t generation, uint64_t at) {
+    sim::post(at, [this, index, generation]() { onAdvertisement(index, generation); });
+}
+
+void NimBLEScan::onAdvertisement(size_t index, uint32_t generation) {
+    NimBLEAdvertisedDevice* device = nullptr;
+    bool callback = false;
+    bool deleteAfter = false;
+    {
+        std::lock_guard<std::mutex> lock(sim::mutex());
+        if (!m_scanning || generation != m_generation) {
+            return;
+        }
+        uint64_t now = sim::nowMicros();
+        NimBLEAddress address;
+        uint32_t interval;
+        if (index < sim::bulbs().size()) {
+            sim::BulbModel* bulb = sim::bulbs()[index];
+            interval = sim::config().advIntervalMs;
+            if (bulb->m_link || bulb->m_advertisingFrom > now) {
+                scheduleAdvertiser(index, generation, std::max(now, bulb->m_advertisingFrom) + sim::random(interval * 1000));
+                return;
+            }
+            address = NimBLEAddress(bulb->m_native, BLE_ADDR_RANDOM);
+        } else {
+            address = noiseAdvertisers[index - sim::bulbs().size()];
+            interval = sim::config().noiseAdvIntervalMs;
+        }
+        // advDelay is a random 0-10ms added to every advertising interval
+        scheduleAdvertiser(index, generation, now + interval * 1000ull + sim::random(10000));
+
+        // Only advertisements that land in the scan window are received
+        if ((now - m_startedAt) / 1000 % m_intervalMs >= m_windowMs) {
+            return;
+        }
+        // With the accept list in use, the controller drops everyone else before the host sees them
+        if (m_filterPolicy == BLE_HCI_SCAN_FILT_USE_WL && std::none_of(whiteList.begin(), whiteList.end(),
+                [&address](const NimBLEAddress& entry) { return entry == address && entry.getType() == address.getType(); })) {
+            return;
+        }
+        for (NimBLEAdvertisedDevice* result : m_results) {
+            if (result->m_address == address) {
+                device = result;
+            }
+        }
+        if (m_duplicateFilter) {
+            // The controller filters repeats before they reach the host, whether or not the host kept a result
+            if (std::find(m_duplicateFilterSeen.begin(), m_duplicateFilterSeen.end(), address) != m_duplicateFilterSeen.end()) {
+                return;
+            }
+            m_duplicateFilterSeen.push_back(address);
+        }
+        m_advProcessed += m_activeScan ? 2 : 1;
+        if (!device) {
+            device = new NimBLEAdvertisedDevice();
+            device->m_address = address;
+            device->m_payload.resize(24 + sim::random(7));
+            for (uint8_t& byte : device->m_payload) {
+                byte = (uint8_t)sim::random(256);
+            }
+            if (m_results.size() < m_maxResults) {
+                m_results.push_back(device);
+                m_resultBytes += sizeof(NimBLEAdvertisedDevice) + device->m_payload.capacity();
+                m_peakResultBytes = std::max(m_peakResultBytes, m_resultBytes);
+            } else {
+                deleteAfter = true;
+            }
+        }
+        device->m_rssi = -50 - (int)sim::random(40);
+        callback = m_pAdvertisedDeviceCallbacks && (m_wantDuplicates || !device->m_callbackSent);
+        device->m_callbackSent = true;
+        if (callback) {
+            m_callbacks++;
+        }
+    }
+    if (callback) {
+        sim::HotPathScope hotPath(sim::HOT_PATH_SCAN);
+        m_pAdvertisedDeviceCallbacks->onResult(device);
+    }
+    if (deleteAfter) {
+        delete device;
+    }
+}
+
+// Frees the results the previous clear kept and keeps these instead, emptying the given list
+static void retireResultsLocked(std::vector<NimBLEAdvertisedDevice*>& results) {
+    for (NimBLEAdvertisedDevice* device : clearedResults) {
+        delete device;
+    }
+    clearedResults.swap(results);
+    results.clear();
+}
+
+bool NimBLEScan::start(uint32_t duration, void (*scanCompleteCB)(NimBLEScanResults), bool is_continue) {
+    std::lock_guard<std::mutex> lock(sim::mutex());
+    if (m_scanning) {
+        return true;
+    }
+    if (!is_continue) {
+        retireResultsLocked(m_results);
+        m_resultBytes = 0;
+    } else {
+        for (NimBLEAdvertisedDevice* device : m_results) {
+            device->m_callbackSent = false;
+        }
+    }
+    if (noiseAdvertisers.size() < sim::config().noiseAdvertisers) {
+        while (noiseAdvertisers.size() < sim::config().noiseAdvertisers) {
+            uint64_t address = ((uint64_t)sim::random(0xFFFFFF) << 24) | sim::random(0xFFFFFF);
+            noiseAdvertisers.push_back(NimBLEAddress(address, BLE_ADDR_RANDOM));
+        }
+    }
+    m_scanning = true;
+    m_generation++;
+    m_startedAt = sim::nowMicros();
+    m_duplicateFilterSeen.clear();
+    m_scanCompleteCB = scanCompleteCB;
+    size_t advertisers = sim::bulbs().size() + noiseAdvertisers.size();
+    for (size_t i = 0; i < advertisers; i++) {
+        uint32_t interval = i < sim::bulbs().size() ? sim::config().advIntervalMs : sim::config().noiseAdvIntervalMs;
+        scheduleAdvertiser(i, m_generation, m_startedAt + sim::random(interval * 1000));
+    }
+    if (duration) {
+        uint32_t generation = m_generation;
+        sim::post(m_startedAt + duration * 1000000ull, [this, generation]() {
+            {
+                std::lock_guard<std::mutex> lock(sim::mutex());
+                if (!m_scanning || generation != m_generation) {
+                    return;
+                }
+            }
+            endScan();
+        });
+    }
+    return true;
+}
+
+NimBLEScanResults NimBLEScan::start(uint32_t duration, bool is_continue) {
+    if (start(duration, nullptr, is_continue)) {
+        std::unique_lock<std::mutex> lock(sim::mutex());
+        scanStateChanged.wait(lock, [this] { return !m_scanning; });
+    }
+    return getResults();
+}
+
+void NimBLEScan::endScan() {
+    void (*scanCompleteCB)(NimBLEScanResults);
+    {
+        std::lock_guard<std::mutex> lock(sim::mutex());
+        if (!m_scanning) {
+            return;
+        }
+        m_scanning = false;
+        m_generation++;
+        m_scanningMicros += sim::nowMicros() - m_startedAt;
+        scanCompleteCB = m_scanCompleteCB;
+    }
+    scanStateChanged.notify_all();
+    if (scanCompleteCB) {
+        scanCompleteCB(getResults());
+    }
+}
+
+bool NimBLEScan::isScanning() {
+    std::lock_guard<std::mutex> lock(sim::mutex());
+    return m_scanning;
+}
+
+void NimBLEScan::setAdvertisedDeviceCallbacks(NimBLEAdvertisedDeviceCallbacks* pAdvertisedDeviceCallbacks, bool wantDuplicates) {
+    m_pAdvertisedDeviceCallbacks = pAdvertisedDeviceCallbacks;
+    m_wantDuplicates = wantDuplicates;
+}
+
+bool NimBLEScan::stop() {
+    endScan();
+    return true;
+}
+
+void NimBLEScan::clearResults() {
+    std::lock_guard<std::mutex> lock(sim::mutex());
+    retireResultsLocked(m_results);
+    m_resultBytes = 0;
+}
+
+uint64_t NimBLEScan::simScanningMicros() {
+    std::lock_guard<std::mutex> lock(sim::mutex());
+    return m_scanningMicros + (m_scanning ? sim::nowMicros() - m_startedAt : 0);
+}
+
+NimBLEScanResults NimBLEScan::getResults() {
+    std::lock_guard<std::mutex> lock(sim::mutex());
+    NimBLEScanResults results;
+    results.m_advertisedDevicesVector = m_results;
+    return results;
+}
+
+NimBLEClient::NimBLEClient(const NimBLEAddress& peerAddress) : m_peerAddress(peerAddress), m_pClientCallbacks(nullptr) {
+    m_pConnParams = { 16, 16, 0, 400, 0, 0 };
+}
+
+NimBLEClient::~NimBLEClient() {
+    deleteServices();
+    if (m_deleteCallbacks) {
+        delete m_pClientCallbacks;
+    }
+}
+
+bool NimBLEClient::connect(NimBLEAdvertisedDevice* device, bool deleteAttributes) {
+    return connect(device->getAddress(), deleteAttributes);
+}
+
+bool NimBLEClient::connect(bool deleteAttributes) {
+    return connect(m_peerAddress, deleteAttributes);
+}
+
+bool NimBLEClient::connect(const NimBLEAddress& address, bool deleteAttributes) {
+    if (isConnected()) {
+        return false;
+    }
+    // A running scan gets in the way of the connection, NimBLE stops it and retries
+    scan.endScan();
+
+    uint64_t deadline = sim::nowMicros() + m_connectTimeout * 1000ull;
+    SimLinkPtr link;
+    while (!link) {
+        uint64_t connectAt;
+        sim::BulbModel* bulb;
+        {
+            std::lock_guard<std::mutex> lock(sim::mutex());
+            bulb = sim::findBulb(address.getNative());
+            uint64_t now = sim::nowMicros();
+            connectAt = deadline + 1;
+            if (bulb && !bulb->m_link) {
+                connectAt = std::max(now, bulb->m_advertisingFrom)
+                    + sim::random(sim::config().advIntervalMs * 1000) + sim::config().connectSetupMs * 1000ull;
+            }
+        }
+        if (connectAt > deadline) {
+            sim::sleepUntil(deadline);
+            return false;
+        }
+        sim::sleepUntil(connectAt);
+
+        std::lock_guard<std::mutex> lock(sim::mutex());
+        uint64_t now = sim::nowMicros();
+        if (bulb->m_link || bulb->m_advertisingFrom > now) {
+            continue;
+        }
+        link = std::make_shared<SimLink>();
+        link->client = this;
+        link->bulb = bulb;
+        link->handle = nextConnHandle++;
+        link->anchor = now;
+        link->interval = m_pConnParams.itvl_min;
+        link->latency = m_pConnParams.latency;
+        link->timeout = m_pConnParams.supervision_timeout;
+        links.push_back(link);
+        bulb->m_link = link.get();
+        bulb->m_connectedAt = now;
+        if (!bulb->m_bonded || !isBondedLocked(address)) {
+            bulb->m_subscribed = false;
+        }
+        m_link = link.get();
+        m_connHandle = link->handle;
+        m_peerAddress = address;
+    }
+    if (deleteAttributes) {
+        deleteServices();
+    }
+    if (m_pClientCallbacks) {
+        m_pClientCallbacks->onConnect(this);
+    }
+    return true;
+}
+
+int NimBLEClient::disconnect(uint8_t reason) {
+    SimLinkPtr link;
+    uint64_t at;
+    {
+        std::lock_guard<std::mutex> lock(sim::mutex());
+        if (!m_link) {
+            return BLE_HS_ENOTCONN;
+        }
+        link = findLink(m_link);
+        at = link->nextEvent(sim::nowMicros());
+    }
+    sim::post(at, [link]() { SimLink::terminate(link); });
+    return 0;
+}
+
+bool NimBLEClient::isConnected() {
+    std::lock_guard<std::mutex> lock(sim::mutex());
+    return m_link != nullptr;
+}
+
+int NimBLEClient::getRssi() {
+    return isConnected() ? -50 - (int)sim::random(30) : 0;
+}
+
+NimBLEConnInfo NimBLEClient::getConnInfo() {
+    std::lock_guard<std::mutex> lock(sim::mutex());
+    NimBLEConnInfo info;
+    if (m_link) {
+        info.m_handle = m_link->handle;
+        info.m_interval = m_link->intervalAt(sim::nowMicros());
+        info.m_latency = m_link->latency;
+        info.m_timeout = m_link->timeout;
+        info.m_encrypted = m_link->encrypted;
+        info.m_bonded = isBondedLocked(m_peerAddress);
+    }
+    return info;
+}
+
+void NimBLEClient::setClientCallbacks(NimBLEClientCallbacks* pClientCallbacks, bool deleteCallbacks) {
+    m_pClientCallbacks = pClientCallbacks;
+    m_deleteCallbacks = deleteCallbacks;
+}
+
+void NimBLEClient::setConnectionParams(uint16_t minInterval, uint16_t maxInterval, uint16_t latency, uint16_t timeout,
+                                       uint16_t scanInterval, uint16_t scanWindow) {
+    m_pConnParams = { minInterval, maxInterval, latency, timeout, 0, 0 };
+}
+
+void NimBLEClient::updateConnParams(uint16_t minInterval, uint16_t maxInterval, uint16_t latency, uint16_t timeout) {
+    std::lock_guard<std::mutex> lock(sim::mutex());
+    if (!m_link) {
+        return;
+    }
+    uint64_t now = sim::nowMicros();
+    // The new parameters take effect at an instant at least 6 connection events away
+    uint64_t instant = m_link->nextEvent(now) + 6 * m_link->interval * 1250ull;
+    m_link->settle(now);
+    m_link->pendingInterval = minInterval;
+    m_link->pendingAt = instant;
+    m_link->latency = latency;
+    m_link->timeout = timeout;
+}
+
+NimBLERemoteService* NimBLEClient::getService(const NimBLEUUID& uuid) {
+    {
+        std::lock_guard<std::mutex> lock(sim::mutex());
+        for (NimBLERemoteService* service : m_servicesVector) {
+            if (service->m_uuid == uuid) {
+                return service;
+            }
+        }
+        if (!m_link) {
+            return nullptr;
+        }
+    }
+    if (!SimLink::roundTrips(this, sim::config().serviceDiscoveryRoundTrips) || uuid != SIM_LIGHT_SERVICE_UUID) {
+        return nullptr;
+    }
+    std::lock_guard<std::mutex> lock(sim::mutex());
+    NimBLERemoteService* service = new NimBLERemoteService();
+    service->m_pClient = this;
+    service->m_uuid = uuid;
+    service->m_startHandle = SIM_LIGHT_SERVICE_START;
+    service->m_endHandle = SIM_LIGHT_SERVICE_END;
+    m_servicesVector.push_back(service);
+    return service;
+}
+
+void NimBLEClient::deleteServices() {
+    std::lock_guard<std::mutex> lock(sim::mutex());
+    for (NimBLERemoteService* service : m_servicesVector) {
+        delete service;
+    }
+    m_servicesVector.clear();
+}
+
+bool NimBLEClient::secureConnection() {
+    bool bonded;
+    {
+        std::lock_guard<std::mutex> lock(sim::mutex());
+        if (!m_link) {
+            return false;
+        }
+        if (m_link->encrypted) {
+            return true;
+        }
+        bonded = isBondedLocked(m_peerAddress) && m_link->bulb->m_bonded;
+    }
+    if (!SimLink::roundTrips(this, bonded ? sim::config().encryptRoundTrips : sim::config().bondRoundTrips)
+            || sim::injectFault(sim::FAULT_BOND)) {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(sim::mutex());
+    m_link->encrypted = true;
+    m_link->bulb->m_bonded = true;
+    if (!isBondedLocked(m_peerAddress)) {
+        bonds.push_back(m_peerAddress);
+        saveBondsLocked();
+    }
+    return true;
+}
+
+NimBLERemoteService::~NimBLERemoteService() {
+    for (NimBLERemoteCharacteristic* characteristic : m_characteristicVector) {
+        delete characteristic;
+    }
+}
+
+NimBLERemoteCharacteristic* NimBLERemoteService::getCharacteristic(const NimBLEUUID& uuid) {
+    {
+        std::lock_guard<std::mutex> lock(sim::mutex());
+        if (!m_characteristicVector.empty()) {
+            for (NimBLERemoteCharacteristic* characteristic : m_characteristicVector) {
+                if (characteristic->m_uuid == uuid) {
+                    return characteristic;
+                }
+            }
+            return nullptr;
+        }
+    }
+    if (!SimLink::roundTrips(m_pClient, sim::config().charDiscoveryRoundTrips)) {
+        return nullptr;
+    }
+    std::lock_guard<std::mutex> lock(sim::mutex());
+    NimBLERemoteCharacteristic* power = new NimBLERemoteCharacteristic();
+    power->m_pRemoteService = this;
+    power->m_uuid = SIM_POWER_STATE_CHAR_UUID;
+    power->m_handle = SIM_POWER_STATE_HANDLE;
+    power->m_properties = SIM_POWER_STATE_PROPERTIES;
+    NimBLERemoteCharacteristic* brightness = new NimBLERemoteCharacteristic();
+    brightness->m_pRemoteService = this;
+    brightness->m_uuid = SIM_BRIGHTNESS_CHAR_UUID;
+    brightness->m_handle = SIM_BRIGHTNESS_HANDLE;
+    brightness->m_properties = SIM_POWER_STATE_PROPERTIES;
+    m_characteristicVector.push_back(power);
+    m_characteristicVector.push_back(brightness);
+    for (NimBLERemoteCharacteristic* characteristic : m_characteristicVector) {
+        if (characteristic->m_uuid == uuid) {
+            return characteristic;
+        }
+    }
+    return nullptr;
+}
+
+NimBLERemoteCharacteristic::~NimBLERemoteCharacteristic() {
+    for (NimBLERemoteDescriptor* descriptor : m_descriptorVector) {
+        delete descriptor;
+    }
+}
+
+NimBLERemoteDescriptor* NimBLERemoteCharacteristic::getDescriptor(const NimBLEUUID& uuid) {
+    NimBLEClient* client = m_pRemoteService->getClient();
+    if (!m_descriptorsDiscovered) {
+        if (!SimLink::roundTrips(client, sim::config().descDiscoveryRoundTrips)) {
+            return nullptr;
+        }
+        m_descriptorsDiscovered = true;
+    }
+    std::lock_guard<std::mutex> lock(sim::mutex());
+    if (m_descriptorVector.empty()) {
+        // Every characteristic of the simulated bulb has a CCCD straight after its value
+        NimBLERemoteDescriptor* cccd = new NimBLERemoteDescriptor();
+        cccd->m_pRemoteCharacteristic = this;
+        cccd->m_uuid = NimBLEUUID(CCCD_UUID);
+        cccd->m_handle = m_handle + 1;
+        m_descriptorVector.push_back(cccd);
+    }
+    for (NimBLERemoteDescriptor* descriptor : m_descriptorVector) {
+        if (descriptor->m_uuid == uuid) {
+            return descriptor;
+        }
+    }
+    return nullptr;
+}
+
+NimBLEAttValue NimBLERemoteCharacteristic::readValue(time_t* timestamp) {
+    NimBLEClient* client = m_pRemoteService->getClient();
+    bool encrypted;
+    {
+        std::lock_guard<std::mutex> lock(sim::mutex());
+        encrypted = client->m_link && client->m_link->encrypted;
+    }
+    if (!encrypted && (!SimLink::roundTrips(client, 1) || !client->secureConnection())) {
+        return NimBLEAttValue();
+    }
+    if (!SimLink::roundTrips(client, 1)) {
+        return NimBLEAttValue();
+    }
+    std::lock_guard<std::mutex> lock(sim::mutex());
+    if (!client->m_link) {
+        return NimBLEAttValue();
+    }
+    uint8_t value = m_handle == SIM_POWER_STATE_HANDLE ? client->m_link->bulb->m_poweredOn : 0xFE;
+    return NimBLEAttValue(&value, 1);
+}
+
+bool NimBLERemoteCharacteristic::writeValue(const uint8_t* data, size_t length, bool response) {
+    NimBLEClient* client = m_pRemoteService->getClient();
+    bool value = length > 0 && data[0] == 1;
+    if (!response) {
+        std::lock_guard<std::mutex> lock(sim::mutex());
+        SimLink* link = client->m_link;
+        if (!link) {
+            return false;
+        }
+        // Write commands on an unencrypted link or to a bulb that lost power vanish without an error
+        if (link->encrypted && !link->peerGone && m_handle == SIM_POWER_STATE_HANDLE) {
+            SimLinkPtr shared = findLink(link);
+            uint64_t issuedAt = sim::nowMicros();
+            uint64_t arrivesAt = link->nextEvent(issuedAt);
+            sim::post(arrivesAt, [shared, value, issuedAt, arrivesAt]() {
+                std::lock_guard<std::mutex> lock(sim::mutex());
+                if (shared->alive && !shared->peerGone) {
+                    SimLink::applyPowerWrite(shared.get(), value, false, issuedAt, arrivesAt);
+                }
+            });
+        }
+        return true;
+    }
+    uint64_t issuedAt = sim::nowMicros();
+    bool encrypted;
+    {
+        std::lock_guard<std::mutex> lock(sim::mutex());
+        encrypted = client->m_link && client->m_link->encrypted;
+    }
+    if (!encrypted && (!SimLink::roundTrips(client, 1) || !client->secureConnection())) {
+        return false;
+    }
+    uint64_t arrivesAt;
+    {
+        std::lock_guard<std::mutex> lock(sim::mutex());
+        if (!client->m_link) {
+            return false;
+        }
+        arrivesAt = client->m_link->nextEvent(sim::nowMicros());
+    }
+    if (!SimLink::roundTrips(client, 1)) {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(sim::mutex());
+    if (!client->m_link) {
+        return false;
+    }
+    if (m_handle == SIM_POWER_STATE_HANDLE) {
+        SimLink::applyPowerWrite(client->m_link, value, true, issuedAt, arrivesAt);
+    }
+    return true;
+}
+
+bool NimBLERemoteCharacteristic::subscribe(bool notifications, notify_callback notifyCallback, bool response) {
+    NimBLEClient* client = m_pRemoteService->getClient();
+    if (!m_descriptorsDiscovered) {
+        if (!SimLink::roundTrips(client, sim::config().descDiscoveryRoundTrips)) {
+            return false;
+        }
+        m_descriptorsDiscovered = true;
+    }
+    if (response && !SimLink::roundTrips(client, 1)) {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(sim::mutex());
+    if (!client->m_link) {
+        return false;
+    }
+    m_notifyCallback = notifyCallback;
+    if (m_handle == SIM_POWER_STATE_HANDLE) {
+        client->m_link->bulb->m_subscribed = true;
+    }
+    return true;
+}
+
+bool NimBLERemoteCharacteristic::unsubscribe(bool response) {
+    NimBLEClient* client = m_pRemoteService->getClient();
+    std::lock_guard<std::mutex> lock(sim::mutex());
+    m_notifyCallback = nullptr;
+    if (client->m_link && m_handle == SIM_POWER_STATE_HANDLE) {
+        client->m_link->bulb->m_subscribed = false;
+    }
+    return true;
+}
+
+void NimBLEDevice::init(const std::string& deviceName) {
+    std::lock_guard<std::mutex> lock(sim::mutex());
+    initialized = true;
+    // Bonds survive a reboot, the bulbs on the other end remember them too
+    std::vector<uint8_t> addresses;
+    bonds.clear();
+    if (sim::nvsGet(SIM_BONDS_NVS_KEY, addresses)) {
+        for (size_t i = 0; i + 6 <= addresses.size(); i += 6) {
+            bonds.push_back(NimBLEAddress(&addresses[i]));
+            if (sim::BulbModel* bulb = sim::findBulb(&addresses[i])) {
+                bulb->m_bonded = true;
+            }
+        }
+    }
+}
+
+void NimBLEDevice::deinit(bool clearAll) {
+    initialized = false;
+}
+
+bool NimBLEDevice::getInitialized() {
+    return initialized;
+}
+
+NimBLEScan* NimBLEDevice::getScan() {
+    return &scan;
+}
+
+NimBLEClient* NimBLEDevice::createClient(NimBLEAddress peerAddress) {
+    std::lock_guard<std::mutex> lock(sim::mutex());
+    NimBLEClient* client = new NimBLEClient(peerAddress);
+    clients.push_back(client);
+    return client;
+}
+
+bool NimBLEDevice::deleteClient(NimBLEClient* pClient) {
+    if (pClient == nullptr) {
+        return false;
+    }
+    if (pClient->isConnected()) {
+        if (pClient->disconnect() != 0) {
+            return false;
+        }
+        std::unique_lock<std::mutex> lock(sim::mutex());
+        linkStateChanged.wait(lock, [pClient] { return pClient->m_link == nullptr; });
+    }
+    {
+        std::lock_guard<std::mutex> lock(sim::mutex());
+        clients.erase(std::find(clients.begin(), clients.end(), pClient));
+    }
+    delete pClient;
+    return true;
+}
+
+NimBLEClient* NimBLEDevice::getClientByID(uint16_t conn_id) {
+    std::lock_guard<std::mutex> lock(sim::mutex());
+    for (NimBLEClient* client : clients) {
+        if (client->m_connHandle == conn_id) {
+            return client;
+        }
+    }
+    return nullptr;
+}
+
+NimBLEClient* NimBLEDevice::getClientByPeerAddress(const NimBLEAddress& peer_addr) {
+    std::lock_guard<std::mutex> lock(sim::mutex());
+    for (NimBLEClient* client : clients) {
+        if (client->m_peerAddress == peer_addr) {
+            return client;
+        }
+    }
+    return nullptr;
+}
+
+NimBLEClient* NimBLEDevice::getDisconnectedClient() {
+    std::lock_guard<std::mutex> lock(sim::mutex());
+    for (NimBLEClient* client : clients) {
+        if (!client->m_link) {
+            return client;
+        }
+    }
+    return nullptr;
+}
+
+size_t NimBLEDevice::getClientListSize() {
+    std::lock_guard<std::mutex> lock(sim::mutex());
+    return clients.size();
+}
+
+std::vector<NimBLEClient*>* NimBLEDevice::getClientList() {
+    return &clients;
+}
+
+int NimBLEDevice::startSecurity(uint16_t conn_id) {
+    std::lock_guard<std::mutex> lock(sim::mutex());
+    for (const SimLinkPtr& link : links) {
+        if (link->handle == conn_id) {
+            return 0;
+        }
+    }
+    return BLE_HS_ENOTCONN;
+}
+
+int NimBLEDevice::getNumBonds() {
+    std::lock_guard<std::mutex> lock(sim::mutex());
+    return (int)bonds.size();
+}
+
+bool NimBLEDevice::isBonded(const NimBLEAddress& address) {
+    std::lock_guard<std::mutex> lock(sim::mutex());
+    return isBondedLocked(address);
+}
+
+bool NimBLEDevice::whiteListAdd(const NimBLEAddress& address) {
+    std::lock_guard<std::mutex> lock(sim::mutex());
+    if (std::find(whiteList.begin(), whiteList.end(), address) == whiteList.end()) {
+        whiteList.push_back(address);
+    }
+    return true;
+}
+
+bool NimBLEDevice::whiteListRemove(const NimBLEAddress& address) {
+    std::lock_guard<std::mutex> lock(sim::mutex());
+    auto entry = std::find(whiteList.begin(), whiteList.end(), address);
+    if (entry == whiteList.end()) {
+        return false;
+    }
+    whiteList.erase(entry);
+    return true;
+}
+
+bool NimBLEDevice::onWhiteList(const NimBLEAddress& address) {
+    std::lock_guard<std::mutex> lock(sim::mutex());
+    return std::find(whiteList.begin(), whiteList.end(), address) != whiteList.end();
+}
+
+size_t NimBLEDevice::getWhiteListCount() {
+    std::lock_guard<std::mutex> lock(sim::mutex());
+    return whiteList.size();
+}
+
+bool NimBLEDevice::deleteBond(const NimBLEAddress& address) {
+    std::lock_guard<std::mutex> lock(sim::mutex());
+    auto bond = std::find(bonds.begin(), bonds.end(), address);
+    if (bond == bonds.end()) {
+        return false;
+    }
+    bonds.erase(bond);
+    saveBondsLocked();
+    return true;
+}
+
+NimBLEAddress NimBLEDevice::getBondedAddress(int index) {
+    std::lock_guard<std::mutex> lock(sim::mutex());
+    return index < (int)bonds.size() ? bonds[index] : NimBLEAddress();
+}
+
+int ble_gattc_write_flat(uint16_t conn_handle, uint16_t attr_handle, const void* data, uint16_t data_len,
+                         ble_gatt_attr_fn* cb, void* cb_arg) {
+    std::lock_guard<std::mutex> lock(sim::mutex());
+    SimLinkPtr link = findLinkByHandle(conn_handle);
+    if (!link) {
+        return BLE_HS_ENOTCONN;
+    }
+    bool value = data_len > 0 && ((const uint8_t*)data)[0] == 1;
+    std::function<void(int)> complete = [cb, cb_arg, conn_handle, attr_handle](int status) {
+        if (cb) {
+            ble_gatt_error error = { (uint16_t)status, attr_handle };
+            ble_gatt_attr attr = { attr_handle, 0, nullptr };
+            cb(conn_handle, &error, &attr, cb_arg);
+        }
+    };
+    if (link->peerGone) {
+        link->pendingOps.push_back(complete);
+        return 0;
+    }
+    uint64_t now = sim::nowMicros();
+    // A slow bulb applies the write and responds late, but the link keeps running in the meantime
+    uint64_t arrivesAt = link->nextEvent(now) + (sim::injectFault(sim::FAULT_SLOW_WRITE) ? sim::config().slowWriteMs * 1000ull : 0);
+    uint64_t respondsAt = link->nextEvent(arrivesAt + 1 + sim::config().gattProcessingMs * 1000ull);
+    bool encrypted = link->encrypted;
+    int status = !isWritableHandle(attr_handle) ? BLE_HS_ERR_ATT_BASE + BLE_ATT_ERR_INVALID_HANDLE
+        : !encrypted ? BLE_HS_ERR_ATT_BASE + BLE_ATT_ERR_INSUFFICIENT_ENC : 0;
+    uint8_t first = data_len > 0 ? ((const uint8_t*)data)[0] : 0;
+    sim::post(arrivesAt, [link, value, first, now, arrivesAt, attr_handle, status]() {
+        std::lock_guard<std::mutex> lock(sim::mutex());
+        if (!link->alive || link->peerGone || status != 0) {
+            return;
+        }
+        if (attr_handle == SIM_POWER_STATE_HANDLE) {
+            SimLink::applyPowerWrite(link.get(), value, true, now, arrivesAt);
+        } else if (attr_handle == SIM_POWER_STATE_CCCD_HANDLE) {
+            // Bit 0 enables notifications and bit 1 indications
+            link->bulb->m_subscribed = (first & 0x03) != 0;
+        }
+    });
+    sim::post(respondsAt, [link, complete, status]() {
+        {
+            std::lock_guard<std::mutex> lock(sim::mutex());
+            if (link->alive && link->peerGone) {
+                link->pendingOps.push_back(complete);
+                return;
+            }
+        }
+        if (!link->alive) {
+            complete(BLE_HS_ENOTCONN);
+        } else {
+            complete(status);
+        }
+    });
+    return 0;
+}
+
+int ble_gattc_write_no_rsp_flat(uint16_t conn_handle, uint16_t attr_handle, const void* data, uint16_t data_len) {
+    std::lock_guard<std::mutex> lock(sim::mutex());
+    SimLinkPtr link = findLinkByHandle(conn_handle);
+    if (!link) {
+        return BLE_HS_ENOTCONN;
+    }
+    bool value = data_len > 0 && ((const uint8_t*)data)[0] == 1;
+    uint64_t issuedAt = sim::nowMicros();
+    uint64_t arrivesAt = link->nextEvent(issuedAt);
+    sim::post(arrivesAt, [link, value, issuedAt, arrivesAt, attr_handle]() {
+        std::lock_guard<std::mutex> lock(sim::mutex());
+        if (link->alive && !link->peerGone && link->encrypted && attr_handle == SIM_POWER_STATE_HANDLE) {
+            SimLink::applyPowerWrite(link.get(), value, false, issuedAt, arrivesAt);
+        }
+    });
+    return 0;
+}
+
+int ble_gattc_read_by_uuid(uint16_t conn_handle, uint16_t start_handle, uint16_t end_handle, const ble_uuid_t* uuid,
+                           ble_gatt_attr_fn* cb, void* cb_arg) {
+    std::lock_guard<std::mutex> lock(sim::mutex());
+    SimLinkPtr link = findLinkByHandle(conn_handle);
+    if (!link) {
+        return BLE_HS_ENOTCONN;
+    }
+    const ble_uuid_any_t* powerStateUuid = SIM_POWER_STATE_CHAR_UUID.getNative();
+    bool matches = start_handle <= SIM_POWER_STATE_HANDLE && SIM_POWER_STATE_HANDLE <= end_handle
+        && uuid->type == BLE_UUID_TYPE_128
+        && memcmp(((const ble_uuid128_t*)uuid)->value, powerStateUuid->u128.value, 16) == 0;
+    std::function<void(int)> complete = [cb, cb_arg, conn_handle, link, matches](int status) {
+        ble_gatt_error error = { (uint16_t)status, 0 };
+        if (status == 0 && matches) {
+            uint8_t value;
+            {
+                std::lock_guard<std::mutex> lock(sim::mutex());
+                value = link->bulb->m_poweredOn ? 1 : 0;
+            }
+            os_mbuf om = { &value, 1 };
+            ble_gatt_attr attr = { SIM_POWER_STATE_HANDLE, 0, &om };
+            error.att_handle = SIM_POWER_STATE_HANDLE;
+            cb(conn_handle, &error, &attr, cb_arg);
+        }
+        // Like NimBLE, the procedure always ends with a final call without an attribute
+        if (status == 0) {
+            error.status = matches ? BLE_HS_EDONE : BLE_HS_ERR_ATT_BASE + BLE_ATT_ERR_ATTR_NOT_FOUND;
+        }
+        cb(conn_handle, &error, nullptr, cb_arg);
+    };
+    if (link->peerGone) {
+        link->pendingOps.push_back(complete);
+        return 0;
+    }
+    bool encrypted = link->encrypted;
+    sim::post(link->responseAt(sim::nowMicros()), [link, complete, encrypted]() {
+        {
+            std::lock_guard<std::mutex> lock(sim::mutex());
+            if (link->alive && link->peerGone) {
+                link->pendingOps.push_back(complete);
+                return;
+            }
+        }
+        if (!link->alive) {
+            complete(BLE_HS_ENOTCONN);
+        } else {
+            complete(encrypted ? 0 : BLE_HS_ERR_ATT_BASE + BLE_ATT_ERR_INSUFFICIENT_ENC);
+        }
+    });
+    return 0;
+}
+
+int ble_gap_event_listener_register(struct ble_gap_event_listener* listener, ble_gap_event_fn* fn, void* arg) {
+    std::lock_guard<std::mutex> lock(sim::mutex());
+    for (ble_gap_event_listener* existing = gapListeners; existing; existing = existing->next) {
+        if (existing == listener) {
+            return BLE_HS_EALREADY;
+        }
+    }
+    listener->fn = fn;
+    listener->arg = arg;
+    listener->next = gapListeners;
+    gapListeners = listener;
+    return 0;
+}
@@ -0,0 +1,70 @@
+/*
+ This file contains the host-native stand-in for the Arduino-ESP32 Preferences library.
+*/
+
+#include <Preferences.h>
+#include <sim.h>
+#include <cstring>
+
+// NVS limits namespace and key names to 15 characters
+static const size_t NVS_KEY_NAME_MAX_SIZE = 15;
+
+bool Preferences::begin(const char* name, bool readOnly, const char* partition_label) {
+    if (m_started || !name || strlen(name) > NVS_KEY_NAME_MAX_SIZE) {
+        return false;
+    }
+    m_namespace = name;
+    m_readOnly = readOnly;
+    m_started = true;
+    return true;
+}
+
+void Preferences::end() {
+    m_started = false;
+}
+
+std::string Preferences::fullKey(const char* key) const {
+    return m_namespace + "/" + key;
+}
+
+bool Preferences::clear() {
+    // Only used to wipe a namespace, which nothing in the firmware does yet
+    return m_started && !m_readOnly;
+}
+
+bool Preferences::remove(const char* key) {
+    if (!m_started || !key || m_readOnly) {
+        return false;
+    }
+    return sim::nvsRemove(fullKey(key));
+}
+
+bool Preferences::isKey(const char* key) {
+    std::vector<uint8_t> value;
+    return m_started && key && sim::nvsGet(fullKey(key), value);
+}
+
+size_t Preferences::putBytes(const char* key, const void* value, size_t len) {
+    if (!m_started || !key || !value || !len || m_readOnly || strlen(key) > NVS_KEY_NAME_MAX_SIZE) {
+        return 0;
+    }
+    sim::nvsPut(fullKey(key), std::vector<uint8_t>((const uint8_t*)value, (const uint8_t*)value + len));
+    return len;
+}
+
+size_t Preferences::getBytesLength(const char* key) {
+    std::vector<uint8_t> value;
+    if (!m_started || !key || !sim::nvsGet(fullKey(key), value)) {
+        return 0;
+    }
+    return value.size();
+}
+
+size_t Preferences::getBytes(const char* key, void* buf, size_t maxLen) {
+    std::vector<uint8_t> value;
+    if (!m_started || !key || !buf || !sim::nvsGet(fullKey(key), value) || value.size() > maxLen) {
+        return 0;
+    }
+    memcpy(buf, value.data(), value.size());
+    return value.size();
+}
@@ -0,0 +1,110 @@
+/*
+ This file contains the host-native stand-ins for the ESP-IDF power management, sleep and GPIO APIs.
+ Power management locks keep the simulated chip awake, and the GPIO interrupt follows the sensor's IO2.
+*/
+
+#include <esp_err.h>
+#include <esp_pm.h>
+#include <esp_sleep.h>
+#include <driver/gpio.h>
+#include <sim.h>
+
+struct SimPowerLock {
+    int count;
+};
+
+const char* esp_err_to_name(esp_err_t code) {
+    switch (code) {
+        case ESP_OK:
+            return "ESP_OK";
+        case ESP_FAIL:
+            return "ESP_FAIL";
+        case ESP_ERR_INVALID_ARG:
+            return "ESP_ERR_INVALID_ARG";
+        case ESP_ERR_INVALID_STATE:
+            return "ESP_ERR_INVALID_STATE";
+        case ESP_ERR_NOT_SUPPORTED:
+            return "ESP_ERR_NOT_SUPPORTED";
+        default:
+            return "UNKNOWN ERROR";
+    }
+}
+
+esp_err_t esp_pm_configure(const void* config) {
+    const esp_pm_config_esp32s3_t* pmConfig = (const esp_pm_config_esp32s3_t*)config;
+    if (pmConfig->min_freq_mhz > pmConfig->max_freq_mhz) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    sim::setLightSleepEnabled(pmConfig->light_sleep_enable);
+    return ESP_OK;
+}
+
+esp_err_t esp_pm_lock_create(esp_pm_lock_type_t lock_type, int arg, const char* name, esp_pm_lock_handle_t* out_handle) {
+    *out_handle = new SimPowerLock{ 0 };
+    return ESP_OK;
+}
+
+// Like ESP-IDF's, the locks are counted and only the first acquire and the last release change anything
+esp_err_t esp_pm_lock_acquire(esp_pm_lock_handle_t handle) {
+    if (handle->count++ == 0) {
+        sim::acquirePowerLock();
+    }
+    return ESP_OK;
+}
+
+esp_err_t esp_pm_lock_release(esp_pm_lock_handle_t handle) {
+    if (handle->count == 0) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (--handle->count == 0) {
+        sim::releasePowerLock();
+    }
+    return ESP_OK;
+}
+
+esp_err_t esp_sleep_enable_gpio_wakeup(void) {
+    return ESP_OK;
+}
+
+static gpio_isr_t isrHandler = nullptr;
+static void* isrArg = nullptr;
+static gpio_int_type_t isrType = GPIO_INTR_DISABLE;
+static bool isrEnabled = false;
+
+// Waits for IO2 to reach the level the interrupt is set to, once the handler and the level are both known
+static void armInterrupt() {
+    if (!isrEnabled || !isrHandler || (isrType != GPIO_INTR_LOW_LEVEL && isrType != GPIO_INTR_HIGH_LEVEL)) {
+        return;
+    }
+    gpio_isr_t handler = isrHandler;
+    void* arg = isrArg;
+    sim::sensor().onOutputLevel(isrType == GPIO_INTR_HIGH_LEVEL, [handler, arg]() {
+        handler(arg);
+    });
+}
+
+esp_err_t gpio_install_isr_service(int intr_alloc_flags) {
+    return ESP_OK;
+}
+
+esp_err_t gpio_isr_handler_add(gpio_num_t gpio_num, gpio_isr_t isr_handler, void* args) {
+    isrHandler = isr_handler;
+    isrArg = args;
+    armInterrupt();
+    return ESP_OK;
+}
+
+esp_err_t gpio_intr_enable(gpio_num_t gpio_num) {
+    isrEnabled = true;
+    armInterrupt();
+    return ESP_OK;
+}
+
+esp_err_t gpio_wakeup_enable(gpio_num_t gpio_num, gpio_int_type_t intr_type) {
+    if (intr_type != GPIO_INTR_LOW_LEVEL && intr_type != GPIO_INTR_HIGH_LEVEL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    isrType = intr_type;
+    armInterrupt();
+    return ESP_OK;
+}
@@ -0,0 +1,135 @@
+/*
+ This file contains the host-native stand-in for the FreeRTOS task and semaphore APIs.
+ Each task is a detached host thread with its own notification value.
+*/
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/semphr.h>
+#include <sim.h>
+#include <thread>
+#include <condition_variable>
+
+struct SimTask {
+    std::mutex mutex;
+    std::condition_variable notified;
+    uint32_t notificationValue = 0;
+};
+
+static thread_local SimTask* currentTask = nullptr;
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t pvTaskCode, const char* pcName, uint32_t usStackDepth,
+                                   void* pvParameters, UBaseType_t uxPriority, TaskHandle_t* pvCreatedTask,
+                                   BaseType_t xCoreID) {
+    SimTask* task = new SimTask();
+    if (pvCreatedTask) {
+        *pvCreatedTask = task;
+    }
+    std::thread([task, pvTaskCode, pvParameters]() {
+        currentTask = task;
+        pvTaskCode(pvParameters);
+    }).detach();
+    return pdPASS;
+}
+
+void vTaskDelete(TaskHandle_t xTask) {
+    // Host threads can't be killed from outside, tasks in this firmware only ever delete themselves
+}
+
+void vTaskDelay(TickType_t xTicksToDelay) {
+    sim::sleepFor(xTicksToDelay * 1000ull * portTICK_PERIOD_MS);
+}
+
+TickType_t xTaskGetTickCount(void) {
+    return (TickType_t)(sim::nowMicros() / 1000 / portTICK_PERIOD_MS);
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void) {
+    if (!currentTask) {
+        // The Arduino loop task and other host threads get a handle on first use
+        currentTask = new SimTask();
+    }
+    return currentTask;
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t xTaskToNotify) {
+    {
+        std::lock_guard<std::mutex> lock(xTaskToNotify->mutex);
+        xTaskToNotify->notificationValue++;
+    }
+    xTaskToNotify->notified.notify_all();
+    return pdPASS;
+}
+
+void vTaskNotifyGiveFromISR(TaskHandle_t xTaskToNotify, BaseType_t* pxHigherPriorityTaskWoken) {
+    xTaskNotifyGive(xTaskToNotify);
+    if (pxHigherPriorityTaskWoken) {
+        *pxHigherPriorityTaskWoken = pdFALSE;
+    }
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t xClearCountOnExit, TickType_t xTicksToWait) {
+    SimTask* task = xTaskGetCurrentTaskHandle();
+    std::unique_lock<std::mutex> lock(task->mutex);
+    auto pending = [task] { return task->notificationValue > 0; };
+    if (xTicksToWait == portMAX_DELAY) {
+        task->notified.wait(lock, pending);
+    } else {
+        task->notified.wait_for(lock, sim::realDuration(xTicksToWait * 1000ull * portTICK_PERIOD_MS), pending);
+    }
+    uint32_t value = task->notificationValue;
+    if (value) {
+        task->notificationValue = xClearCountOnExit ? 0 : value - 1;
+    }
+    return value;
+}
+
+struct SimSemaphore {
+    std::mutex mutex;
+    std::condition_variable given;
+    UBaseType_t count;
+    UBaseType_t maxCount;
+};
+
+SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t uxMaxCount, UBaseType_t uxInitialCount) {
+    SimSemaphore* semaphore = new SimSemaphore();
+    semaphore->count = uxInitialCount;
+    semaphore->maxCount = uxMaxCount;
+    return semaphore;
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t xSemaphore, TickType_t xBlockTime) {
+    std::unique_lock<std::mutex> lock(xSemaphore->mutex);
+    auto available = [xSemaphore] { return xSemaphore->count > 0; };
+    if (xBlockTime == portMAX_DELAY) {
+        xSemaphore->given.wait(lock, available);
+    } else if (!xSemaphore->given.wait_for(lock, sim::realDuration(xBlockTime * 1000ull * portTICK_PERIOD_MS), available)) {
+        return pdFALSE;
+    }
+    xSemaphore->count--;
+    return pdTRUE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t xSemaphore) {
+    {
+        std::lock_guard<std::mutex> lock(xSemaphore->mutex);
+        if (xSemaphore->count >= xSemaphore->maxCount) {
+            return pdFALSE;
+        }
+        xSemaphore->count++;
+    }
+    xSemaphore->given.notify_one();
+    return pdTRUE;
+}
+
+BaseType_t xSemaphoreGiveFromISR(SemaphoreHandle_t xSemaphore, BaseType_t* pxHigherPriorityTaskWoken) {
+    if (pxHigherPriorityTaskWoken) {
+        *pxHigherPriorityTaskWoken = pdFALSE;
+    }
+    return xSemaphoreGive(xSemaphore);
+}
+
+UBaseType_t uxSemaphoreGetCount(SemaphoreHandle_t xSemaphore) {
+    std::lock_guard<std::mutex> lock(xSemaphore->mutex);
+    return xSemaphore->count;
+}
@@ -0,0 +1,663 @@
+/*
+ This file contains the core of the host-native simulation: config, clock, the simulated
+ BLE host task and the mmWave sensor model.
+*/
+
+#include <sim.h>
+#include <chrono>
+#include <thread>
+#include <condition_variable>
+#include <queue>
+#include <atomic>
+#include <algorithm>
+#include <random>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+
+namespace sim {
+
+Config& config() {
+    static Config instance;
+    return instance;
+}
+
+struct ConfigField {
+    const char* name;
+    uint32_t Config::*field;
+};
+
+static const ConfigField CONFIG_FIELDS[] = {
+    { "adv-interval-ms", &Config::advIntervalMs },
+    { "connect-setup-ms", &Config::connectSetupMs },
+    { "gatt-processing-ms", &Config::gattProcessingMs },
+    { "service-discovery-round-trips", &Config::serviceDiscoveryRoundTrips },
+    { "char-discovery-round-trips", &Config::charDiscoveryRoundTrips },
+    { "desc-discovery-round-trips", &Config::descDiscoveryRoundTrips },
+    { "bond-round-trips", &Config::bondRoundTrips },
+    { "encrypt-round-trips", &Config::encryptRoundTrips },
+    { "noise-advertisers", &Config::noiseAdvertisers },
+    { "noise-adv-interval-ms", &Config::noiseAdvIntervalMs },
+    { "uart-baud", &Config::uartBaud },
+    { "sensor-frame-interval-ms", &Config::sensorFrameIntervalMs },
+    { "sensor-command-ms", &Config::sensorCommandMs },
+    { "sensor-command-delay-ms", &Config::sensorCommandDelayMs },
+    { "sensor-resume-blind-ms", &Config::sensorResumeBlindMs },
+    { "sensor-io2-wired", &Config::sensorIo2Wired },
+    { "light-sleep-wake-us", &Config::lightSleepWakeUs },
+    { "time-scale", &Config::timeScale },
+    { "bond-failure-pct", &Config::bondFailurePct },
+    { "notification-drop-pct", &Config::notificationDropPct },
+    { "slow-write-pct", &Config::slowWritePct },
+    { "slow-write-ms", &Config::slowWriteMs },
+    { "seed", &Config::seed },
+};
+
+std::vector<std::string> configure(int argc, char** argv) {
+    std::vector<std::string> rest;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool matched = false;
+        if (arg.rfind("--", 0) == 0 && arg.find('=') != std::string::npos) {
+            std::string name = arg.substr(2, arg.find('=') - 2);
+            for (const ConfigField& field : CONFIG_FIELDS) {
+                if (name == field.name) {
+                    config().*field.field = (uint32_t)strtoul(arg.c_str() + arg.find('=') + 1, nullptr, 10);
+                    matched = true;
+                }
+            }
+        }
+        if (!matched) {
+            rest.push_back(arg);
+        }
+    }
+    return rest;
+}
+
+void printConfig(FILE* out) {
+    for (const ConfigField& field : CONFIG_FIELDS) {
+        fprintf(out, "#   --%s=%u\n", field.name, config().*field.field);
+    }
+}
+
+static const std::chrono::steady_clock::time_point START = std::chrono::steady_clock::now();
+
+static std::atomic<bool> clockManual(false);
+static std::atomic<uint64_t> manualMicros(0);
+
+uint64_t nowMicros() {
+    if (clockManual) {
+        return manualMicros;
+    }
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - START).count() * config().timeScale;
+}
+
+std::chrono::microseconds realDuration(uint64_t micros) {
+    return std::chrono::microseconds(micros / std::max(config().timeScale, 1u));
+}
+
+void sleepUntil(uint64_t micros) {
+    if (clockManual) {
+        manualMicros = std::max(manualMicros.load(), micros);
+        return;
+    }
+    std::this_thread::sleep_until(START + realDuration(micros));
+}
+
+void sleepFor(uint64_t micros) {
+    if (clockManual) {
+        manualMicros += micros;
+        return;
+    }
+    std::this_thread::sleep_for(realDuration(micros));
+}
+
+void setClock(uint64_t micros) {
+    manualMicros = micros;
+    clockManual = true;
+}
+
+uint32_t random(uint32_t bound) {
+    static std::mutex randomMutex;
+    static std::mt19937 generator(config().seed);
+    std::lock_guard<std::mutex> lock(randomMutex);
+    return bound ? generator() % bound : 0;
+}
+
+std::mutex& mutex() {
+    static std::mutex instance;
+    return instance;
+}
+
+static std::mutex nvsMutex;
+static std::string nvsPath;
+static std::vector<std::pair<std::string, std::vector<uint8_t>>> nvsEntries;
+
+// Writes every entry as a "key hex-value" line, called with nvsMutex held
+static void saveNvs() {
+    if (nvsPath.empty()) {
+        return;
+    }
+    FILE* file = fopen(nvsPath.c_str(), "w");
+    if (!file) {
+        return;
+    }
+    for (const auto& entry : nvsEntries) {
+        fprintf(file, "%s ", entry.first.c_str());
+        for (uint8_t byte : entry.second) {
+            fprintf(file, "%02x", byte);
+        }
+        fprintf(file, "\n");
+    }
+    fclose(file);
+}
+
+void loadNvs(const std::string& path) {
+    std::lock_guard<std::mutex> lock(nvsMutex);
+    nvsPath = path;
+    nvsEntries.clear();
+    FILE* file = fopen(path.c_str(), "r");
+    if (!file) {
+        return;
+    }
+    char key[64];
+    char hex[1024];
+    while (fscanf(file, "%63s %1023s", key, hex) == 2) {
+        std::vector<uint8_t> value;
+        for (size_t i = 0; hex[i] && hex[i + 1]; i += 2) {
+            unsigned int byte;
+            sscanf(hex + i, "%2x", &byte);
+            value.push_back((uint8_t)byte);
+        }
+        nvsEntries.push_back({ key, value });
+    }
+    fclose(file);
+}
+
+bool nvsGet(const std::string& key, std::vector<uint8_t>& value) {
+    std::lock_guard<std::mutex> lock(nvsMutex);
+    for (const auto& entry : nvsEntries) {
+        if (entry.first == key) {
+            value = entry.second;
+            return true;
+        }
+    }
+    return false;
+}
+
+void nvsPut(const std::string& key, const std::vector<uint8_t>& value) {
+    std::lock_guard<std::mutex> lock(nvsMutex);
+    for (auto& entry : nvsEntries) {
+        if (entry.first == key) {
+            entry.second = value;
+            saveNvs();
+            return;
+        }
+    }
+    nvsEntries.push_back({ key, value });
+    saveNvs();
+}
+
+bool nvsRemove(const std::string& key) {
+    std::lock_guard<std::mutex> lock(nvsMutex);
+    for (auto entry = nvsEntries.begin(); entry != nvsEntries.end(); ++entry) {
+        if (entry->first == key) {
+            nvsEntries.erase(entry);
+            saveNvs();
+            return true;
+        }
+    }
+    return false;
+}
+
+static thread_local HotPath hotPath = HOT_PATH_NONE;
+static std::atomic<uint64_t> hotPathCallCounts[4];
+static std::atomic<uint64_t> hotPathCpuNanos[4];
+
+static uint64_t threadCpuNanos() {
+    timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+HotPathScope::HotPathScope(HotPath path) : m_path(path), m_previous(hotPath), m_cpuStartNanos(threadCpuNanos()) {
+    hotPath = path;
+    hotPathCallCounts[path]++;
+}
+
+HotPathScope::~HotPathScope() {
+    hotPathCpuNanos[m_path] += threadCpuNanos() - m_cpuStartNanos;
+    hotPath = m_previous;
+}
+
+HotPath currentHotPath() {
+    return hotPath;
+}
+
+uint64_t hotPathCalls(HotPath path) {
+    return hotPathCallCounts[path];
+}
+
+uint64_t hotPathCpuMicros(HotPath path) {
+    return hotPathCpuNanos[path] / 1000;
+}
+
+static std::atomic<uint64_t> faultCounts[FAULT_COUNT];
+
+bool injectFault(Fault fault) {
+    uint32_t pct = fault == FAULT_BOND ? config().bondFailurePct
+        : fault == FAULT_NOTIFICATION ? config().notificationDropPct : config().slowWritePct;
+    if (!pct || random(100) >= pct) {
+        return false;
+    }
+    faultCounts[fault]++;
+    return true;
+}
+
+uint64_t faultsInjected(Fault fault) {
+    return faultCounts[fault];
+}
+
+// The simulated BLE host task, runs posted work in time order on a single thread
+struct HostEvent {
+    uint64_t at;
+    uint64_t sequence;
+    std::function<void()> fn;
+    bool operator>(const HostEvent& other) const {
+        return at != other.at ? at > other.at : sequence > other.sequence;
+    }
+};
+
+static std::mutex hostMutex;
+static std::condition_variable hostWake;
+static std::priority_queue<HostEvent, std::vector<HostEvent>, std::greater<HostEvent>> hostEvents;
+static uint64_t hostSequence = 0;
+
+static void hostTask() {
+    std::unique_lock<std::mutex> lock(hostMutex);
+    while (true) {
+        if (hostEvents.empty()) {
+            hostWake.wait(lock);
+            continue;
+        }
+        uint64_t at = hostEvents.top().at;
+        if (at > nowMicros()) {
+            hostWake.wait_until(lock, START + realDuration(at));
+            continue;
+        }
+        std::function<void()> fn = std::move(const_cast<HostEvent&>(hostEvents.top()).fn);
+        hostEvents.pop();
+        lock.unlock();
+        fn();
+        lock.lock();
+    }
+}
+
+void post(uint64_t atMicros, std::function<void()> fn) {
+    static std::once_flag started;
+    std::call_once(started, [] { std::thread(hostTask).detach(); });
+    std::lock_guard<std::mutex> lock(hostMutex);
+    hostEvents.push({ atMicros, hostSequence++, std::move(fn) });
+    hostWake.notify_one();
+}
+
+static FILE* consoleOut = nullptr;
+
+void setConsole(FILE* out) {
+    consoleOut = out;
+}
+
+FILE* console() {
+    return consoleOut;
+}
+
+static std::mutex consoleMutex;
+static std::string consoleIn;
+static std::string consoleCaptured;
+static bool consoleCapturing = false;
+static std::function<void()> consoleCallback;
+
+void consoleWrite(const uint8_t* buffer, size_t size) {
+    if (consoleOut) {
+        fwrite(buffer, 1, size, consoleOut);
+    }
+    std::lock_guard<std::mutex> lock(consoleMutex);
+    if (consoleCapturing) {
+        consoleCaptured.append((const char*)buffer, size);
+    }
+}
+
+int consoleRead() {
+    std::lock_guard<std::mutex> lock(consoleMutex);
+    if (consoleIn.empty()) {
+        return -1;
+    }
+    uint8_t c = consoleIn[0];
+    consoleIn.erase(0, 1);
+    return c;
+}
+
+int consolePeek() {
+    std::lock_guard<std::mutex> lock(consoleMutex);
+    return consoleIn.empty() ? -1 : (uint8_t)consoleIn[0];
+}
+
+int consoleAvailable() {
+    std::lock_guard<std::mutex> lock(consoleMutex);
+    return consoleIn.size();
+}
+
+void consoleInput(const std::string& bytes) {
+    std::lock_guard<std::mutex> lock(consoleMutex);
+    consoleIn += bytes;
+    if (consoleCallback) {
+        post(nowMicros(), consoleCallback);
+    }
+}
+
+void onConsoleInput(std::function<void()> callback) {
+    std::lock_guard<std::mutex> lock(consoleMutex);
+    consoleCallback = callback;
+}
+
+void captureConsole() {
+    std::lock_guard<std::mutex> lock(consoleMutex);
+    consoleCapturing = true;
+}
+
+std::string takeConsoleOutput() {
+    std::lock_guard<std::mutex> lock(consoleMutex);
+    std::string taken;
+    taken.swap(consoleCaptured);
+    return taken;
+}
+
+static std::mutex powerMutex;
+static bool lightSleepEnabled = false;
+static int powerLocks = 0;
+static uint64_t sleepingSince = 0;
+static uint64_t sleptMicros = 0;
+static std::atomic<uint64_t> gpioWakeCount(0);
+
+// Called with powerMutex held
+static bool sleeping() {
+    return lightSleepEnabled && powerLocks == 0;
+}
+
+// Adds up the time slept once the chip wakes, called with powerMutex held
+static void sleepChanged(bool wasSleeping) {
+    if (sleeping() && !wasSleeping) {
+        sleepingSince = nowMicros();
+    } else if (!sleeping() && wasSleeping) {
+        sleptMicros += nowMicros() - sleepingSince;
+    }
+}
+
+void setLightSleepEnabled(bool enabled) {
+    std::lock_guard<std::mutex> lock(powerMutex);
+    bool wasSleeping = sleeping();
+    lightSleepEnabled = enabled;
+    sleepChanged(wasSleeping);
+}
+
+void acquirePowerLock() {
+    std::lock_guard<std::mutex> lock(powerMutex);
+    bool wasSleeping = sleeping();
+    powerLocks++;
+    sleepChanged(wasSleeping);
+}
+
+void releasePowerLock() {
+    std::lock_guard<std::mutex> lock(powerMutex);
+    bool wasSleeping = sleeping();
+    powerLocks--;
+    sleepChanged(wasSleeping);
+}
+
+bool lightSleeping() {
+    std::lock_guard<std::mutex> lock(powerMutex);
+    return sleeping();
+}
+
+uint64_t lightSleepMicros() {
+    std::lock_guard<std::mutex> lock(powerMutex);
+    return sleptMicros + (sleeping() ? nowMicros() - sleepingSince : 0);
+}
+
+uint64_t gpioWakeups() {
+    return gpioWakeCount;
+}
+
+// How long the sensor keeps presence edges for, far longer than its frames are ever produced behind
+static const uint64_t EDGE_HISTORY_MICROS = 60000000;
+// The UART hardware buffers this many received bytes before it starts dropping them
+static const size_t UART_RX_BUFFER = 256;
+// How many symbols (bytes) the line must be idle for before an RX event fires, Arduino-ESP32's default
+static const uint32_t UART_RX_TIMEOUT_SYMBOLS = 2;
+
+SensorModel& sensor() {
+    static SensorModel instance;
+    return instance;
+}
+
+void SensorModel::setPresence(bool present) {
+    std::lock_guard<std::mutex> lock(mutex());
+    uint64_t now = nowMicros();
+    // Frames are produced as they start, so only the edge in effect a while ago and the ones since can still be reported
+    while (m_edges.size() > 1 && m_edges[1].at + EDGE_HISTORY_MICROS < now) {
+        m_edges.erase(m_edges.begin());
+    }
+    m_edges.push_back({ now, present });
+    checkOutputLevel(now);
+}
+
+bool SensorModel::running() const {
+    std::lock_guard<std::mutex> lock(mutex());
+    return m_running;
+}
+
+uint64_t SensorModel::lastEdgeMicros() const {
+    std::lock_guard<std::mutex> lock(mutex());
+    return m_lastEdgeAt;
+}
+
+uint64_t SensorModel::startedMicros() const {
+    std::lock_guard<std::mutex> lock(mutex());
+    return m_startedAt;
+}
+
+uint32_t SensorModel::commandsReceived() const {
+    std::lock_guard<std::mutex> lock(mutex());
+    return m_commands;
+}
+
+uint32_t SensorModel::framesLost() const {
+    std::lock_guard<std::mutex> lock(mutex());
+    return m_framesLost;
+}
+
+bool SensorModel::outputLevel() const {
+    std::lock_guard<std::mutex> lock(mutex());
+    return config().sensorIo2Wired && reportsPresenceAt(nowMicros());
+}
+
+void SensorModel::onOutputLevel(bool level, std::function<void()> callback) {
+    std::lock_guard<std::mutex> lock(mutex());
+    m_awaitedLevel = level;
+    m_levelCallback = callback;
+    checkOutputLevel(nowMicros());
+}
+
+// Runs the interrupt if IO2 has reached the awaited level, after waking the chip if it's asleep. Guarded by the model lock
+void SensorModel::checkOutputLevel(uint64_t now) {
+    bool level = config().sensorIo2Wired && reportsPresenceAt(now);
+    if (!m_levelCallback || level != m_awaitedLevel) {
+        return;
+    }
+    std::function<void()> callback = std::move(m_levelCallback);
+    m_levelCallback = nullptr;
+    uint64_t wakeMicros = 0;
+    if (lightSleeping()) {
+        gpioWakeCount++;
+        wakeMicros = config().lightSleepWakeUs;
+    }
+    post(now + wakeMicros, callback);
+}
+
+// What the sensor's frames (and IO2) say at the given time, it reports nothing while stopped or blind after starting
+bool SensorModel::reportsPresenceAt(uint64_t at) const {
+    bool blind = at < m_startedAt + config().sensorResumeBlindMs * 1000ull && m_startedAt != 0;
+    return m_running && !blind && presenceAt(at);
+}
+
+bool SensorModel::presenceAt(uint64_t at) const {
+    bool present = false;
+    for (const Edge& edge : m_edges) {
+        if (edge.at > at) {
+            break;
+        }
+        present = edge.present;
+    }
+    return present;
+}
+
+void SensorModel::queueBytes(const std::string& bytes, uint64_t at) {
+    uint64_t byteMicros = 10 * 1000000ull / config().uartBaud;
+    for (char c : bytes) {
+        at += byteMicros;
+        if (m_rx.size() - m_rxHead < UART_RX_BUFFER) {
+            m_rx.push_back({ at, (uint8_t)c });
+        }
+    }
+    if (m_rxCallback) {
+        std::function<void()> callback = m_rxCallback;
+        post(at + UART_RX_TIMEOUT_SYMBOLS * byteMicros, [callback]() {
+            HotPathScope hotPath(HOT_PATH_UART);
+            callback();
+        });
+    }
+}
+
+// Produces each frame as it starts so RX events fire on time without anyone reading, guarded by the model lock
+void SensorModel::schedulePump() {
+    uint32_t generation = ++m_pumpGeneration;
+    post(m_nextFrameAt, [this, generation]() {
+        std::lock_guard<std::mutex> lock(mutex());
+        if (generation != m_pumpGeneration || !m_running) {
+            return;
+        }
+        produce(nowMicros());
+        schedulePump();
+    });
+}
+
+void SensorModel::onReceive(std::function<void()> callback) {
+    std::lock_guard<std::mutex> lock(mutex());
+    produce(nowMicros());
+    m_rxCallback = callback;
+    if (m_rxCallback && m_running) {
+        schedulePump();
+    }
+}
+
+// Lazily emits every frame the sensor would have sent up to now
+void SensorModel::produce(uint64_t now) {
+    if (m_rxHead == m_rx.size()) {
+        m_rx.clear();
+        m_rxHead = 0;
+    } else if (m_rxHead > 4096) {
+        m_rx.erase(m_rx.begin(), m_rx.begin() + m_rxHead);
+        m_rxHead = 0;
+    }
+    if (m_nextFrameAt == 0) {
+        m_nextFrameAt = config().sensorFrameIntervalMs * 1000ull;
+    }
+    while (m_running && m_nextFrameAt <= now) {
+        uint64_t at = m_nextFrameAt;
+        m_nextFrameAt += config().sensorFrameIntervalMs * 1000ull;
+        // Frames are produced as they start, so whether the chip is asleep now is whether it was for the frame
+        if (lightSleeping()) {
+            m_framesLost++;
+            continue;
+        }
+        int value = reportsPresenceAt(at) ? 1 : 0;
+        if (value != m_lastFrameValue) {
+            m_lastEdgeAt = at;
+            m_lastFrameValue = value;
+        }
+        char frame[24];
+        snprintf(frame, sizeof(frame), "$JYBSS,%d, , , *\r\n", value);
+        queueBytes(frame, at);
+    }
+}
+
+int SensorModel::available() {
+    std::lock_guard<std::mutex> lock(mutex());
+    uint64_t now = nowMicros();
+    produce(now);
+    int count = 0;
+    for (size_t i = m_rxHead; i < m_rx.size() && m_rx[i].at <= now; i++) {
+        count++;
+    }
+    return count;
+}
+
+int SensorModel::peek() {
+    std::lock_guard<std::mutex> lock(mutex());
+    uint64_t now = nowMicros();
+    produce(now);
+    if (m_rxHead < m_rx.size() && m_rx[m_rxHead].at <= now) {
+        return m_rx[m_rxHead].value;
+    }
+    return -1;
+}
+
+int SensorModel::read() {
+    std::lock_guard<std::mutex> lock(mutex());
+    uint64_t now = nowMicros();
+    produce(now);
+    if (m_rxHead < m_rx.size() && m_rx[m_rxHead].at <= now) {
+        return m_rx[m_rxHead++].value;
+    }
+    return -1;
+}
+
+void SensorModel::write(uint8_t c) {
+    std::lock_guard<std::mutex> lock(mutex());
+    if (c == '\n') {
+        uint64_t now = nowMicros();
+        produce(now);
+        handleCommand(m_tx, now);
+        m_tx.clear();
+    } else if (c != '\r') {
+        m_tx += (char)c;
+    }
+}
+
+void SensorModel::handleCommand(const std::string& line, uint64_t now) {
+    m_commands++;
+    std::string command = line.substr(0, line.find(' '));
+    uint64_t doneAt = now + config().sensorCommandMs * 1000ull;
+    if (command == "sensorStop") {
+        m_running = false;
+        m_lastFrameValue = -1;
+        checkOutputLevel(now);
+    } else if (command == "sensorStart") {
+        if (!m_running) {
+            m_running = true;
+            m_startedAt = doneAt;
+            m_nextFrameAt = doneAt + config().sensorFrameIntervalMs * 1000ull;
+            if (m_rxCallback) {
+                schedulePump();
+            }
+            // IO2 follows the presence again once the sensor is past its blind period
+            post(m_startedAt + config().sensorResumeBlindMs * 1000ull, [this]() {
+                std::lock_guard<std::mutex> lock(mutex());
+                checkOutputLevel(nowMicros());
+            });
+        }
+    }
+    queueBytes("Done\r\nleapMMW:/>", doneAt);
+}
+
+}
@@ -0,0 +1,142 @@
+/*
+ This file contains the ring buffer and drain task behind the logger, see binary_log.h.
+ The buffer is a bounded multi-producer queue (every task logs) with the drain task as its only consumer.
+*/
+
+#include <binary_log.h>
+
+BinaryLog Log;
+
+BinaryLog::BinaryLog() : level(LOG_LEVEL_SILENT), output(nullptr), binary(false), enqueuePosition(0), dequeuePosition(0),
+        logged(0), dropped(0), droppedWritten(0), drainWaiting(false), drainTaskHandle(nullptr), formatCount(0), nextFormatToReuse(0) {
+    for (uint32_t i = 0; i < LOG_BUFFER_ENTRIES; i++) {
+        entries[i].sequence.store(i, std::memory_order_relaxed);
+    }
+}
+
+void BinaryLog::begin(int level, Print* output, bool binary) {
+    this->output = output;
+    this->binary = binary;
+    if (!drainTaskHandle) {
+        xTaskCreate(drainTask, "log", LOG_TASK_STACK_SIZE, this, LOG_TASK_PRIORITY, &drainTaskHandle);
+    }
+    this->level = output ? level : LOG_LEVEL_SILENT;
+}
+
+// Claims the next free entry, or counts a drop and returns nullptr if the drain task hasn't caught up
+BinaryLog::Entry* BinaryLog::reserve(uint32_t& position) {
+    logged.fetch_add(1, std::memory_order_relaxed);
+    position = enqueuePosition.load(std::memory_order_relaxed);
+    for (;;) {
+        Entry* entry = &entries[position % LOG_BUFFER_ENTRIES];
+        int32_t lag = (int32_t)(entry->sequence.load(std::memory_order_acquire) - position);
+        if (lag == 0) {
+            if (enqueuePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                return entry;
+            }
+        } else if (lag < 0) {
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return nullptr;
+        } else {
+            // Another task claimed this entry first
+            position = enqueuePosition.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+void BinaryLog::publish(Entry* entry, uint32_t position) {
+    entry->sequence.store(position + 1, std::memory_order_seq_cst);
+    if (drainWaiting.load(std::memory_order_seq_cst) && drainWaiting.exchange(false)) {
+        xTaskNotifyGive(drainTaskHandle);
+    }
+}
+
+bool BinaryLog::drained() {
+    return enqueuePosition.load() == dequeuePosition.load();
+}
+
+void BinaryLog::drainTask(void* parameter) {
+    BinaryLog* log = (BinaryLog*)parameter;
+    for (;;) {
+        while (log->writeNext()) {}
+        if (log->dropped != log->droppedWritten) {
+            log->writeDropped();
+        }
+        // Only sleep once the buffer is still empty after saying so, otherwise a racing entry could be missed
+        log->drainWaiting = true;
+        Entry* next = &log->entries[log->dequeuePosition % LOG_BUFFER_ENTRIES];
+        if (next->sequence.load(std::memory_order_seq_cst) == log->dequeuePosition + 1) {
+            log->drainWaiting = false;
+            continue;
+        }
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    }
+}
+
+// Writes out the oldest entry if it's ready, returns false if there wasn't one
+bool BinaryLog::writeNext() {
+    Entry* entry = &entries[dequeuePosition % LOG_BUFFER_ENTRIES];
+    if (entry->sequence.load(std::memory_order_acquire) != dequeuePosition + 1) {
+        return false;
+    }
+    if (binary) {
+        writeBinary(*entry);
+    } else {
+        writeText(*entry);
+    }
+    entry->sequence.store(dequeuePosition + LOG_BUFFER_ENTRIES, std::memory_order_release);
+    dequeuePosition.store(dequeuePosition + 1, std::memory_order_release);
+    return true;
+}
+
+void BinaryLog::writeText(const Entry& entry) {
+    char line[256];
+    line[0] = LOG_LEVEL_LETTERS[entry.level - 1];
+    line[1] = ':';
+    line[2] = ' ';
+    size_t length = 3 + formatLogMessage(entry.format, entry.args, entry.size, line + 3, sizeof(line) - 4);
+    line[length++] = '\n';
+    output->write((const uint8_t*)line, length);
+}
+
+// The id the format string has in the binary output, sending it first if the decoder hasn't seen it (or its id was reused)
+uint16_t BinaryLog::formatId(const char* format) {
+    for (uint16_t id = 0; id < formatCount; id++) {
+        if (formats[id] == format) {
+            return id;
+        }
+    }
+    uint16_t id = formatCount < LOG_MAX_FORMATS ? formatCount++ : nextFormatToReuse++ % LOG_MAX_FORMATS;
+    formats[id] = format;
+    uint16_t length = strlen(format);
+    uint8_t header[LOG_FORMAT_RECORD_SIZE] = { LOG_STREAM_MAGIC, LOG_RECORD_FORMAT, (uint8_t)id, (uint8_t)(id >> 8),
+        (uint8_t)length, (uint8_t)(length >> 8) };
+    output->write(header, sizeof(header));
+    output->write((const uint8_t*)format, length);
+    return id;
+}
+
+void BinaryLog::writeBinary(const Entry& entry) {
+    uint16_t id = formatId(entry.format);
+    uint8_t record[LOG_ENTRY_RECORD_SIZE + LOG_ENTRY_ARGS_SIZE] = { LOG_STREAM_MAGIC, LOG_RECORD_ENTRY, (uint8_t)id, (uint8_t)(id >> 8),
+        entry.level, (uint8_t)entry.timestamp, (uint8_t)(entry.timestamp >> 8), (uint8_t)(entry.timestamp >> 16),
+        (uint8_t)(entry.timestamp >> 24), entry.size };
+    memcpy(record + LOG_ENTRY_RECORD_SIZE, entry.args, entry.size);
+    output->write(record, LOG_ENTRY_RECORD_SIZE + entry.size);
+}
+
+// Reports how many entries have been dropped, which happens once the drain task has caught up again
+void BinaryLog::writeDropped() {
+    uint32_t total = dropped;
+    if (binary) {
+        uint8_t record[LOG_DROPPED_RECORD_SIZE] = { LOG_STREAM_MAGIC, LOG_RECORD_DROPPED, (uint8_t)total, (uint8_t)(total >> 8),
+            (uint8_t)(total >> 16), (uint8_t)(total >> 24) };
+        output->write(record, sizeof(record));
+    } else {
+        char line[64];
+        int length = snprintf(line, sizeof(line), "W: %lu log entries were dropped as the buffer was full\n",
+            (unsigned long)(total - droppedWritten));
+        output->write((const uint8_t*)line, length);
+    }
+    droppedWritten = total;
+}
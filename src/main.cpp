@@ -2,421 +2,2384 @@
  This file contains code for the Hue BLE presence detector.
 */
 
-#include <map>
+#include <atomic>
 #include <config.h>
-#include <ArduinoLog.h>
+#include <settings.h>
+#include <app_state.h>
+#include <binary_log.h>
+#include <telemetry.h>
+#include <trace.h>
 #include <NimBLEDevice.h>
+#include <Preferences.h>
 #include <DFRobot_mmWave_Radar.h>
+#include <esp_pm.h>
+#include <esp_sleep.h>
+#include <driver/gpio.h>
 
 static const NimBLEUUID LIGHT_SERVICE_UUID = NimBLEUUID("932c32bd-0000-47a2-835a-a8d455b859dd");
 static const NimBLEUUID POWER_STATE_CHAR_UUID = NimBLEUUID("932c32bd-0002-47a2-835a-a8d455b859dd");
+static const NimBLEUUID CCCD_UUID = NimBLEUUID((uint16_t)0x2902);
+// The NVS namespace the bulbs' GATT handles are cached in
+static const char* GATT_CACHE_NAMESPACE = "gatt_handles";
+// The NVS namespace the configuration last saved to the sensor is kept in, see configureSensor()
+static const char* SENSOR_CONFIG_NAMESPACE = "sensor_config";
+// The NVS namespace the settings changed over serial are saved in, see settings.h
+static const char* SETTINGS_NAMESPACE = "settings";
 /*
  How long in seconds to scan for. If set to 0, the scan will run forever.
  However, if non-zero the current code will just start the scan again if there are unconnected bulbs.
 */
 const uint32_t SCAN_LENGTH = 0;
 /*
- The maximum amount of time to wait for the mmWave sensor to resume in seconds.
+ When enabled, the configured bulbs are loaded into the BLE controller's filter accept list and only their
+ advertisements are passed up to us, rather than waking the host for every phone and beacon nearby.
+ Philips Hue BLE bulbs advertise with a random static address, change BULB_ADDRESS_TYPE if yours don't.
+*/
+const bool SCAN_USING_ACCEPT_LIST = true;
+const uint8_t BULB_ADDRESS_TYPE = BLE_ADDR_RANDOM;
+/*
+ The maximum amount of time to wait for the mmWave sensor to resume in milliseconds.
  This is helpful as the sensor reports no presence for a few seconds after resuming.
 */
-const int SENSOR_RESUME_BUFFER = 10000;
+const unsigned long SENSOR_RESUME_BUFFER = 10000;
+/*
+ How long in milliseconds to wait at boot for a frame from a sensor whose configuration is already up to date,
+ before deciding it was left stopped and starting it.
+*/
+const uint32_t SENSOR_FRAME_WAIT = 1000;
+// The stack size and priority of the task that configures the sensor at boot, see sensorConfigTask()
+const uint32_t SENSOR_CONFIG_TASK_STACK_SIZE = 4096;
+const UBaseType_t SENSOR_CONFIG_TASK_PRIORITY = 1;
+/*
+ The stack size and priority of the background task that scans for, connects to and bonds with bulbs.
+ NimBLE's blocking client calls need a fair amount of stack.
+*/
+const uint32_t CONNECTION_TASK_STACK_SIZE = 8192;
+const UBaseType_t CONNECTION_TASK_PRIORITY = 1;
+/*
+ How long in milliseconds a scan carries on for once it has found a bulb, so that every unconnected bulb can be collected
+ from the one scan. The scan stops straight away once every bulb that's missing has been found.
+*/
+const uint32_t SCAN_COLLECT_WINDOW = 1000;
+/*
+ The stack size and priority of the task that bonds with, discovers and subscribes to each newly connected bulb,
+ while the connection task goes on to connect the next one.
+*/
+const uint32_t SETUP_TASK_STACK_SIZE = 8192;
+const UBaseType_t SETUP_TASK_PRIORITY = 1;
+/*
+ When enabled, a presence change is written to every bulb at once rather than one bulb after another.
+ The writes are acknowledged by each bulb, so a failure is still caught (and reverted) per bulb.
+*/
+const bool FAN_OUT_POWER_WRITES = true;
+// How long in milliseconds to wait for a bulb to acknowledge a power write before counting it as failed
+const uint32_t POWER_WRITE_TIMEOUT = 2000;
+/*
+ A failed power write is sent again after POWER_WRITE_RETRY_BACKOFF milliseconds, doubling with every further failure,
+ and given up on after POWER_WRITE_MAX_RETRIES retries. A newer command for the bulb replaces the retry.
+*/
+const uint32_t POWER_WRITE_RETRY_BACKOFF = 100;
+const uint8_t POWER_WRITE_MAX_RETRIES = 4;
+/*
+ How long in milliseconds after a power write a notification of the same value is taken as the bulb echoing it.
+ Without this the echo of a write we've since superseded would look like someone switching the bulb.
+*/
+const uint32_t POWER_ECHO_WINDOW = 3000;
+
+// A set of connection parameters, intervals are in 1.25ms units and the supervision timeout in 10ms units
+struct ConnParams {
+    uint16_t minInterval;
+    uint16_t maxInterval;
+    uint16_t latency;
+    uint16_t timeout;
+};
+/*
+ The connection parameters used while a bulb is connecting, while the room is occupied (so the next change turns
+ the bulbs off) and for a while after any presence change, so that writes go out on the next connection event.
+ These settings are safe for 3 clients to connect reliably. Timeout should be a multiple of the interval, minimum is 100ms.
+ Min interval: 12 * 1.25ms = 15, Max interval: 12 * 1.25ms = 15, 0 latency, 51 * 10ms = 510ms timeout
+*/
+const ConnParams FAST_CONN_PARAMS = { 12, 12, 0, 51 };
+/*
+ The connection parameters used while the room is empty and idle, keeping the radio duty cycle low.
+ I find a timeout of 3-5 * the interval works best for quick response/reconnect.
+ Min interval: 120 * 1.25ms = 150, Max interval: 120 * 1.25ms = 150, 0 latency, 100 * 10ms = 1000ms/1s timeout
+*/
+const ConnParams IDLE_CONN_PARAMS = { 120, 120, 0, 100 };
+// How long in milliseconds the bulbs stay on the fast connection parameters after the last presence change
+const uint32_t FAST_CONN_HOLD = 10000;
+// How many of each bulb's most recent power writes to keep a record of
+const int POWER_WRITE_HISTORY_SIZE = 8;
+/*
+ The longest loop() sleeps for in milliseconds while bulbs are being connected, presence changes and bulb events wake it straight away.
+ It also wakes in time for any power write that is due to be retried or given up on, and for any bulb that failed to reconnect
+ being due another try. Once it's idle (see loopIsIdle())
+ it only wakes for those, sleeping for LOOP_WAKE_NEVER otherwise.
+*/
+const uint32_t LOOP_WAKE_INTERVAL = 1000;
+/*
+ The CPU frequencies in MHz the ESP32 scales between once idle, see LOW_POWER_IDLE in config.h.
+ Arduino's UART driver is clocked from the APB bus, which slows down along with the CPU below 80MHz.
+*/
+const int IDLE_MAX_CPU_FREQ = 240;
+const int IDLE_MIN_CPU_FREQ = 80;
+/*
+ How long in milliseconds the ESP32 is kept awake after the sensor's presence output changes, for a frame to report the change.
+ The UART can't receive while the ESP32 light sleeps, so frames only arrive once the presence output has woken it.
+*/
+const uint32_t SENSOR_OUTPUT_CONFIRM_WAIT = 500;
+/*
+ How many bulb events (see BulbEvent) each task can have waiting for loop() before further ones are dropped.
+ Must be a power of two. The host task only produces a handful per presence change, so this is plenty.
+*/
+const uint32_t BULB_EVENT_QUEUE_SIZE = 16;
+static_assert((BULB_EVENT_QUEUE_SIZE & (BULB_EVENT_QUEUE_SIZE - 1)) == 0, "BULB_EVENT_QUEUE_SIZE must be a power of two");
+/*
+ How many bulbs are kept connected at once. With more bulbs configured than this, the links are shared: the least recently
+ used bulb is disconnected to make room for one that needs a command, which is reconnected straight away using its bond and
+ cached GATT handles. An evicted bulb can't report being switched by something else until it is reconnected.
+*/
+const size_t CONNECTION_POOL_SIZE = NIMBLE_MAX_CONNECTIONS;
+// How long in milliseconds to wait before trying an evicted bulb again after failing to reconnect to it
+const uint32_t EVICTED_RECONNECT_RETRY_INTERVAL = 5000;
+/*
+ The core loop() and the connection task run on. The NimBLE host task is pinned to the other core
+ (CONFIG_BT_NIMBLE_PINNED_TO_CORE, see platformio.ini) so BLE events keep being handled while loop() is busy.
+*/
+const BaseType_t APP_CORE = 1;
+#ifdef CONFIG_BT_NIMBLE_PINNED_TO_CORE
+static_assert(CONFIG_BT_NIMBLE_PINNED_TO_CORE != APP_CORE, "The NimBLE host task must not share a core with the app");
+#endif
+#ifdef CONFIG_ARDUINO_RUNNING_CORE
+static_assert(CONFIG_ARDUINO_RUNNING_CORE == APP_CORE, "loop() must run on APP_CORE");
+#endif
 
 static HardwareSerial mySerial(1);
 static DFRobot_mmWave_Radar sensor(&mySerial);
 
+// The settings in effect, only changed by loop() (see handleSerialCommand()) once setup() has loaded them
+static Settings settings = defaultSettings();
+static Preferences settingsStore;
+
 // General state vars
 static bool detectedState = false;
-static bool sensorPaused = false;
-static int connectedBulbs = 0;
+static unsigned long lastPresenceChange = 0;
+// Only changed by loop(), the connection task reads it to decide whether to scan
+static std::atomic<int> connectedBulbs(0);
+// How many bulbs may be connected at once, see CONNECTION_POOL_SIZE and setConnectionPoolSize()
+static std::atomic<size_t> connectionPoolSize(CONNECTION_POOL_SIZE);
 static int pausedBulbs = 0;
+// The presence state in the sensor's latest frame (-1 until a frame arrives after a (re)start), set from the UART event task
+static std::atomic<int8_t> sensorReport(-1);
+// The report loop() is acting on in the current pass, see observeSensorReport()
+static int8_t observedSensorReport = -1;
+// When the UART event task saw the reported presence change (micros), for measuring how long it takes to reach the app
+static volatile unsigned long sensorReportChangedAt = 0;
+static volatile uint32_t sensorFrames = 0;
+static TaskHandle_t loopTaskHandle = nullptr;
+// Held while loop() has work to do, which keeps the CPU at full speed and out of light sleep, see updatePowerManagement()
+static esp_pm_lock_handle_t busyLock = nullptr;
+static bool busyLockHeld = false;
+static bool lightSleepEnabled = false;
+// The level the sensor's presence output was last seen at by its interrupt, and when that last changed
+static volatile uint8_t sensorOutputLevel = LOW;
+static std::atomic<bool> sensorOutputChanged(false);
+static unsigned long sensorOutputChangedAt = 0;
+// Set once the sensor's presence output has been seen to follow its reports, the ESP32 doesn't light sleep until then
+static bool sensorOutputVerified = false;
+/*
+ Set when the firmware is being driven by the trace replayer (see tools/trace_replay.cpp) rather than running on the ESP32.
+ The bulbs and the sensor then only exist in the trace, so nothing is sent to them and their responses come from its records.
+*/
+static bool replayingTrace = false;
+
+// The sensor is configured and started in the background at boot, then waited on to resume like any other time
+static volatile SensorState sensorState = SENSOR_CONFIGURING;
+static std::atomic<bool> sensorConfigured(false);
+// The settings the sensor config task is applying, copied before it starts so loop() can change the settings meanwhile
+static Settings sensorSettingsToApply;
+// Set when the sensor's settings change while it's still being configured, so it's configured again once done
+static bool sensorReconfigurePending = false;
+static unsigned long sensorResumedAt = 0;
+// When the sensor's reports were first trusted (millis since power on), 0 until then
+static unsigned long sensorLiveAt = 0;
+// Presence changes that happened while at least one bulb was disconnected, and how many of those didn't reach every connected bulb
+static uint32_t presenceEventsWhileReconnecting = 0;
+static uint32_t presenceEventsMissedWhileReconnecting = 0;
+
+/*
+ The attribute handles of a bulb's power state characteristic, along with its properties (BLE_GATT_CHR_PROP_*).
+ These are cached in NVS keyed by the bulb's MAC, so that a reconnect can use them straight away instead of
+ going through service discovery.
+*/
+struct GattHandles {
+    uint16_t powerState;
+    uint16_t powerStateCccd;
+    uint8_t powerStateProperties;
+};
+
+/*
+ The outcome of a GATT procedure a task is waiting on for a bulb, set from the NimBLE host task.
+ Every bulb has its own, as the connection and setup tasks can each be setting up a bulb at the same time.
+*/
+struct GattProcedure {
+    SemaphoreHandle_t completed;
+    int status;
+    bool found;
+    uint8_t value;
+};
+
+// A power write and the connection interval (1.25ms units) in effect when it was issued
+struct PowerWriteRecord {
+    unsigned long writtenAt;
+    bool poweredOn;
+    uint16_t interval;
+    // Set once the bulb has notified us of the write's value, see matchPowerEcho()
+    bool echoed;
+    // Set if it went unacknowledged for POWER_WRITE_TIMEOUT, the bulb may still have applied it
+    bool timedOut;
+};
+
+/*
+ What we keep from a bulb's advertisement, copied out of NimBLE as it doesn't keep scan results (see setMaxResults()).
+ Until the bulb has been seen this holds its configured address, so an evicted bulb can be connected to without a scan.
+*/
+struct ScanResult {
+    NimBLEAddress address;
+    int rssi;
+    unsigned long seenAt;
+};
 
 struct BulbData {
-    NimBLEAdvertisedDevice* advDevice;
-    NimBLERemoteService* lightService;
-    NimBLERemoteCharacteristic* powerStateChar;
+    // The bulb's packed MAC, see parseMacAddress(), and its address for logging
+    uint64_t mac;
+    char address[18];
+    // Set once the bulb has been removed from the settings, its slot isn't reused until the ESP32 restarts
+    std::atomic<bool> removed;
+    // The bulb's latest advertisement, this is the only scan result storage so it's bounded by the number of bulbs
+    ScanResult advertisement;
+    NimBLEClient* client;
+    GattHandles handles;
+    GattProcedure gattProcedure;
+    // Set when the handles turned out to be wrong, so the next connection discovers them again
+    volatile bool handlesStale;
     bool connected;
     bool poweredOn;
     bool paused;
+    // Whether the bulb has been set to the current presence state, an evicted bulb stays synced until the presence changes
+    bool stateSynced;
+    // Set while the bulb is disconnected to make room in the connection pool, along with the power state it had then
+    bool evicted;
+    bool poweredOnWhenEvicted;
+    // When the bulb was last written to, notified us or connected (millis), the least recent is evicted first
+    unsigned long lastUsedAt;
+    // Set by loop() for the connection task to connect to the bulb, see requestConnection()
+    std::atomic<bool> connectRequested;
+    // When connecting to the bulb last failed (millis), if it hasn't connected since
+    bool connectFailed;
+    unsigned long connectFailedAt;
+    /*
+     The power state loop() last asked for, waiting to be sent until the bulb has nothing in flight (or a retry is due).
+     A newer command replaces it rather than queueing behind it, see setDesiredPowerState().
+    */
+    bool desiredPoweredOn;
+    bool commandPending;
+    // When the sensor reported the presence change behind the pending command (micros), 0 if it wasn't one
+    unsigned long commandEdgeAt;
+    // The power write waiting on the bulb's acknowledgement, completions of any other write are ignored
+    bool writeInFlight;
+    bool inFlightPoweredOn;
+    unsigned long inFlightEdgeAt;
+    uint32_t writeSequence;
+    // Failed attempts at the pending command, and when it may next be sent (millis)
+    uint8_t writeRetries;
+    unsigned long retryAt;
+    // The connection parameters last requested for the bulb's link, see scheduleConnParams()
+    const ConnParams* connParams;
+    // The most recent power writes, writeCount % POWER_WRITE_HISTORY_SIZE is the next slot to fill
+    PowerWriteRecord writeHistory[POWER_WRITE_HISTORY_SIZE];
+    uint32_t writeCount;
+    // When the bulb's power write in flight was issued (micros), for timing the acknowledgement
+    unsigned long writeIssuedAt;
+    // Latency histograms and counters, written by the connection task (connect stages) and loop() (everything else)
+    BulbTelemetry telemetry;
+};
+
+/*
+ Something that happened to a bulb on another task. The NimBLE host task and the connection task only ever
+ push these, loop() applies them, so the bulbs' state and the counts above are only changed on the loop task.
+*/
+enum BulbEventType : uint8_t {
+    // A configured bulb's advertisement was received, see BulbEvent::advertisement
+    BULB_ADVERTISED,
+    // The connection task has connected to, bonded with and subscribed to the bulb
+    BULB_CONNECTED,
+    BULB_DISCONNECTED,
+    // The bulb notified us of its power state, see BulbEvent::poweredOn
+    BULB_POWER_NOTIFIED,
+    // The connection task failed to connect to the bulb
+    BULB_CONNECT_FAILED,
+    // The bulb acknowledged (or failed) a power write, see BulbEvent::writeSequence
+    BULB_POWER_WRITTEN,
+    // The bulb refused our subscription to its power state, see BulbEvent::writeStatus
+    BULB_SUBSCRIBE_FAILED
+};
+
+struct BulbEvent {
+    BulbEventType type;
+    bool poweredOn;
+    BulbData* bulb;
+    ScanResult advertisement;
+    // Which of the bulb's power writes completed, its status (0 if it succeeded, also a failed subscription's) and when (micros)
+    uint32_t writeSequence;
+    int writeStatus;
+    unsigned long writtenAt;
 };
 
-static std::map<std::string, BulbData*> bulbs;
-static BulbData* bulbToConnect;
+/*
+ A fixed size, lock-free ring buffer of bulb events with a single producer task and loop() as the only consumer.
+ The producer only moves the head and the consumer only moves the tail, so neither ever blocks the other.
+ A push when the queue is full is dropped and counted, the producer is never made to wait.
+*/
+class BulbEventQueue {
+public:
+    // Called from the producer task only
+    bool push(const BulbEvent& event) {
+        uint32_t position = head.load(std::memory_order_relaxed);
+        uint32_t waiting = position - tail.load(std::memory_order_acquire);
+        if (waiting == BULB_EVENT_QUEUE_SIZE) {
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        events[position % BULB_EVENT_QUEUE_SIZE] = event;
+        head.store(position + 1, std::memory_order_release);
+        if (waiting + 1 > peakDepth.load(std::memory_order_relaxed)) {
+            peakDepth.store(waiting + 1, std::memory_order_relaxed);
+        }
+        return true;
+    }
+
+    // Called from loop() only, returns the oldest event without removing it or nullptr if there isn't one
+    const BulbEvent* peek() {
+        uint32_t position = tail.load(std::memory_order_relaxed);
+        return position == head.load(std::memory_order_acquire) ? nullptr : &events[position % BULB_EVENT_QUEUE_SIZE];
+    }
+
+    // Called from loop() only, removes the event peek() returned once it has been applied
+    void pop() {
+        tail.store(tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    // How many events are waiting, an applied event stops counting only after its changes are visible
+    uint32_t depth() const {
+        uint32_t consumed = tail.load(std::memory_order_acquire);
+        return head.load(std::memory_order_acquire) - consumed;
+    }
+
+    // The most events that have been waiting at once, and how many were dropped because the queue was full
+    std::atomic<uint32_t> peakDepth{0};
+    std::atomic<uint32_t> dropped{0};
+
+private:
+    BulbEvent events[BULB_EVENT_QUEUE_SIZE];
+    std::atomic<uint32_t> head{0};
+    std::atomic<uint32_t> tail{0};
+};
+
+// Events from the NimBLE host task (advertisements, disconnects and notifications), the connection task and the setup task
+static BulbEventQueue hostEvents;
+static BulbEventQueue connectionEvents;
+static BulbEventQueue setupEvents;
+static uint32_t bulbEventsDropped = 0;
+
+static Preferences gattCache;
+static Preferences sensorConfigCache;
+static ble_gap_event_listener gapEventListener;
+
+/*
+ Every bulb configured since boot, in the order they were added (see Settings::bulbMacs), including any removed since.
+ A bulb's slot is filled in before bulbSlotsUsed counts it, so the other tasks only ever see bulbs that are ready.
+*/
+static BulbData bulbs[MAX_BULBS];
+static std::atomic<size_t> bulbSlotsUsed(0);
+// How many bulbs are configured, the used slots less the removed bulbs
+static std::atomic<int> configuredBulbs(0);
+
+// The used slots of bulbs, for iterating over with a range based for
+struct BulbSlots {
+    BulbData* begin() const {
+        return bulbs;
+    }
+    BulbData* end() const {
+        return bulbs + bulbSlotsUsed.load(std::memory_order_acquire);
+    }
+};
+
+BulbSlots bulbSlots() {
+    return {};
+}
+
+// How many bulbs loop() has asked the connection task to connect to, see BulbData::connectRequested
+static std::atomic<int> connectRequests(0);
+// The bulb the connection task has handed to the setup task, cleared by the setup task once it's done
+static std::atomic<BulbData*> bulbToSetUp(nullptr);
+static SemaphoreHandle_t bulbSetUp;
+// Advertisements passed up to us since the current scan started, for gauging how busy the scan is
+static std::atomic<uint32_t> scanCallbacks(0);
+static unsigned long scanStartedAt;
+
+/*
+ Finds the configured bulb with the given packed MAC, returns nullptr if it isn't one of ours.
+ Every entry is checked without branching on the result, so this costs the same for any advertiser in range.
+*/
+BulbData* findBulb(uint64_t mac) {
+    BulbData* found = nullptr;
+    for (BulbData& bulb : bulbSlots()) {
+        found = bulb.mac == mac && !bulb.removed.load(std::memory_order_relaxed) ? &bulb : found;
+    }
+    return found;
+}
+
+// Finds the bulb connected on the given connection handle, returns nullptr if there isn't one
+BulbData* findBulbByConnection(uint16_t connHandle) {
+    for (BulbData& bulb : bulbSlots()) {
+        // A removed bulb added again gets its old client back, which its old slot mustn't match
+        if (bulb.client && !bulb.removed.load(std::memory_order_relaxed) && bulb.client->getConnId() == connHandle) {
+            return &bulb;
+        }
+    }
+    return nullptr;
+}
+
+// The bulb's slot in bulbs, which is how the trace refers to it
+uint8_t bulbIndex(const BulbData* bulb) {
+    return bulb - bulbs;
+}
+
+// Formats a packed MAC into the given buffer, for logging without allocating
+const char* formatMacAddress(uint64_t mac, char (&buffer)[18]) {
+    static const char HEX_DIGITS[] = "0123456789abcdef";
+    for (int i = 0; i < 6; i++) {
+        uint8_t octet = mac >> (40 - i * 8);
+        buffer[i * 3] = HEX_DIGITS[octet >> 4];
+        buffer[i * 3 + 1] = HEX_DIGITS[octet & 0x0f];
+        buffer[i * 3 + 2] = i < 5 ? ':' : '\0';
+    }
+    return buffer;
+}
+
+// Sets up a bulb's slot for the bulb with the given packed MAC
+void initBulb(BulbData* bulb, uint64_t mac) {
+    bulb->mac = mac;
+    formatMacAddress(mac, bulb->address);
+    bulb->advertisement.address = NimBLEAddress(mac, BULB_ADDRESS_TYPE);
+    bulb->gattProcedure.completed = xSemaphoreCreateBinary();
+}
+
+// The states of the background connection task
+enum ConnectionState {
+    CONNECTION_IDLE,
+    CONNECTION_SCANNING,
+    CONNECTION_CONNECTING
+};
+
+static volatile ConnectionState connectionState = CONNECTION_IDLE;
+// Set when a bulb is added or removed, for the connection task to bring the accept list in line, see updateAcceptList()
+static std::atomic<bool> acceptListChanged(false);
+static TaskHandle_t connectionTaskHandle = nullptr;
+static TaskHandle_t setupTaskHandle = nullptr;
+// When every bulb that fits in the connection pool was first ready with the sensor live (millis since power on), 0 until then
+static unsigned long operationalAt = 0;
+
+// Wakes the connection task so it can re-evaluate its state
+void notifyConnectionTask() {
+    if (connectionTaskHandle) {
+        xTaskNotifyGive(connectionTaskHandle);
+    }
+}
+
+// Asks the connection task to connect to the bulb, which it does without scanning if it isn't already
+void requestConnection(BulbData* bulb) {
+    bulb->connectRequested = true;
+    connectRequests++;
+    notifyConnectionTask();
+}
+
+// How many bulbs should be connected at once, see CONNECTION_POOL_SIZE
+size_t residentBulbLimit() {
+    return std::min((size_t)configuredBulbs.load(), connectionPoolSize.load());
+}
+
+// Wakes loop() so it can react to a presence change or a bulb event straight away
+void notifyLoopTask() {
+    if (loopTaskHandle) {
+        xTaskNotifyGive(loopTaskHandle);
+    }
+}
+
+void setSensorState(SensorState state) {
+    Log.infoln("The mmWave sensor is now %s (was %s)", SENSOR_STATE_NAMES[state], SENSOR_STATE_NAMES[sensorState]);
+    sensorState = state;
+    Trace.record(TRACE_SENSOR_STATE, 0, state);
+}
+
+// The current state of the mmWave sensor, see SensorState
+SensorState getSensorState() {
+    return sensorState;
+}
+
+// Starts waiting for the just (re)started sensor, anything it reported before is stale
+void beginSensorResume() {
+    sensorReport = -1;
+    observedSensorReport = -1;
+    sensorResumedAt = millis();
+    setSensorState(SENSOR_RESUMING);
+}
 
 // Will pause the mmWave sensor
 void pauseSensor() {
-    sensor.stop();
-    sensorPaused = true;
+    if (!replayingTrace) {
+        sensor.stop();
+    }
+    setSensorState(SENSOR_PAUSED);
 }
 
 // Will resume the mmWave sensor
 void resumeSensor() {
-    sensor.start();
-    sensorPaused = false;
+    if (!replayingTrace) {
+        sensor.start();
+    }
+    beginSensorResume();
 }
 
-class ClientCallbacks : public NimBLEClientCallbacks {
-    void onConnect(NimBLEClient* pClient) {
-        /*
-         After connection we should change the parameters if we don't need fast response times.
-         These settings are 150ms interval, 0 latency, 450ms timeout.
-         Timeout should be a multiple of the interval, minimum is 100ms.
-         I find a multiple of 3-5 * the interval works best for quick response/reconnect.
-         Min interval: 120 * 1.25ms = 150, Max interval: 120 * 1.25ms = 150, 0 latency, 100 * 10ms = 1000ms/1s timeout
-        */
-        pClient->updateConnParams(120, 120, 0, 100);
-    };
+// Hands an event from the NimBLE host task over to loop()
+void pushHostEvent(const BulbEvent& event) {
+    hostEvents.push(event);
+    notifyLoopTask();
+}
 
-    void onDisconnect(NimBLEClient* pClient) {
-        std::string bulbAddress = pClient->getPeerAddress().toString();
-        Log.warningln("Disconnected from the bulb '%s'", bulbAddress.c_str());
+/*
+ Takes the sensor's latest report for the current pass of loop(), so every decision in the pass
+ is made on the same report and the trace records exactly what they were made on.
+*/
+void observeSensorReport() {
+    int8_t report = sensorReport;
+    if (report != observedSensorReport) {
+        observedSensorReport = report;
+        Trace.record(TRACE_SENSOR_REPORT, 0, report, sensorFrames);
+    }
+}
 
-        // Reset our local state variables
-        BulbData* disconnectedBulb = bulbs.find(bulbAddress)->second;
-        disconnectedBulb->connected = false;
-        connectedBulbs--;
+// Called with the presence state of every complete frame, only a change wakes the app
+void sensorFrameReceived(int8_t present) {
+    sensorFrames++;
+    if (sensorReport.exchange(present) != present) {
+        sensorReportChangedAt = micros();
+        notifyLoopTask();
+    }
+}
+
+/*
+ Runs when the sensor's presence output reaches the level it was being watched for, which also wakes the ESP32 from light sleep.
+ The wakeup is level triggered, so it then watches for the opposite level.
+*/
+void IRAM_ATTR sensorOutputReached(void* arg) {
+    sensorOutputLevel = !sensorOutputLevel;
+    gpio_wakeup_enable((gpio_num_t)SENSOR_PRESENCE_PIN, sensorOutputLevel ? GPIO_INTR_LOW_LEVEL : GPIO_INTR_HIGH_LEVEL);
+    sensorOutputChanged = true;
+    BaseType_t woken = pdFALSE;
+    vTaskNotifyGiveFromISR(loopTaskHandle, &woken);
+    portYIELD_FROM_ISR(woken);
+}
+
+/*
+ Runs on the UART event task whenever the sensor has sent something.
+ The "$JYBSS,x, , , *" frames are matched a byte at a time as they come out of the UART driver's buffer,
+ so nothing is copied into a frame buffer of our own. Anything else, like command responses, is skipped.
+*/
+void sensorDataReceived() {
+    static const char FRAME[] = "$JYBSS,x, , , *";
+    static const uint8_t FRAME_LENGTH = sizeof(FRAME) - 1;
+    static const uint8_t VALUE_INDEX = 7;
+    static uint8_t matched = 0;
+    static int8_t value = 0;
+    int c;
+    while ((c = mySerial.read()) >= 0) {
+        if (matched == VALUE_INDEX ? c == '0' || c == '1' : c == FRAME[matched]) {
+            if (matched == VALUE_INDEX) {
+                value = c - '0';
+            }
+            if (++matched == FRAME_LENGTH) {
+                matched = 0;
+                sensorFrameReceived(value);
+            }
+        } else {
+            matched = c == '$' ? 1 : 0;
+        }
+    }
+}
+
+class ClientCallbacks : public NimBLEClientCallbacks {
+    void onDisconnect(NimBLEClient* pClient) {
+        // We only ever connect to configured bulbs, removeBulb() has already dealt with any that have since been removed
+        BulbData* bulb = findBulb(pClient->getPeerAddress());
+        if (bulb) {
+            pushHostEvent({ BULB_DISCONNECTED, false, bulb, {} });
+        }
     };
 
     /*
      Called when the peripheral requests a change to the connection parameters.
      Return true to accept and apply them or false to reject and keep
      the currently used parameters. Default will return true.
+     We only accept parameters that fit within the ones the scheduler currently wants for the link.
     */
     bool onConnParamsUpdateRequest(NimBLEClient* pClient, const ble_gap_upd_params* params) {
-        if(params->itvl_min < 24) { // 1.25ms units
+        BulbData* bulb = findBulb(pClient->getPeerAddress());
+        const ConnParams* wanted = bulb && bulb->connParams ? bulb->connParams : &FAST_CONN_PARAMS;
+        if (params->itvl_min < wanted->minInterval) { // 1.25ms units
             return false;
-        } else if (params->itvl_max > 40) { // 1.25ms units
+        } else if (params->itvl_max > wanted->maxInterval) { // 1.25ms units
             return false;
-        } else if (params->latency > 2) { // Number of intervals allowed to skip
+        } else if (params->latency > wanted->latency) { // Number of intervals allowed to skip
             return false;
-        } else if (params->supervision_timeout > 100) { // 10ms units
+        } else if (params->supervision_timeout > wanted->timeout) { // 10ms units
             return false;
         }
         return true;
     };
 };
 
-// Define a class to handle the callbacks when advertisements are received
-class AdvertisedDeviceCallbacks: public NimBLEAdvertisedDeviceCallbacks {
-    void onResult(NimBLEAdvertisedDevice* advertisedDevice) {
-        Log.traceln("Advertised device found: %s", advertisedDevice->toString().c_str());
-        std::string deviceAddress = advertisedDevice->getAddress().toString();
-        if (bulbs.count(deviceAddress)) {
-            Log.infoln("Found a configured bulb!");
-            // NimBLE cannot scan and connect at the same time, so stop scanning now
-            NimBLEDevice::getScan()->stop();
-            // Save reference to the device in the appropriate bulb data
-            BulbData* bulb = bulbs.find(deviceAddress)->second;
-            bulb->advDevice = advertisedDevice;
-            // We can't connect from here due to API blocking calls, so instead save a reference for the main loop to do it
-            bulbToConnect = bulb;
+// Define a class to handle the callbacks when advertisements are received
+class AdvertisedDeviceCallbacks: public NimBLEAdvertisedDeviceCallbacks {
+    void onResult(NimBLEAdvertisedDevice* advertisedDevice) {
+        // This runs for every advertisement in range, so it mustn't allocate
+        scanCallbacks.fetch_add(1, std::memory_order_relaxed);
+        uint64_t mac = advertisedDevice->getAddress();
+        char address[18];
+        Log.traceln("Advertised device found: %s, RSSI: %d", formatMacAddress(mac, address), advertisedDevice->getRSSI());
+        BulbData* bulb = findBulb(mac);
+        if (bulb) {
+            // NimBLE frees the advertised device once we return, so copy what we need to connect
+            pushHostEvent({ BULB_ADVERTISED, false, bulb, { advertisedDevice->getAddress(), advertisedDevice->getRSSI(), millis() } });
+        }
+    }
+};
+
+// Simple helper to get the power value for a bulb from the raw data
+bool getPoweredOn(const uint8_t* powerData) {
+    return powerData[0] == 1;
+}
+
+// Keeps a record of a power write to the given bulb along with the connection interval it went out on
+void recordPowerWrite(BulbData* bulb, bool powerOn) {
+    uint16_t interval = replayingTrace ? 0 : bulb->client->getConnInfo().getConnInterval();
+    bulb->writeHistory[bulb->writeCount++ % POWER_WRITE_HISTORY_SIZE] = { millis(), powerOn, interval, false, false };
+    bulb->lastUsedAt = millis();
+}
+
+/*
+ The power writes issued together by one sendPowerCommands() call, for logging how far apart the bulbs acknowledged them.
+ pending also holds one for the call itself until it has issued every write, so writes completing straight away don't end the batch.
+*/
+struct PowerWriteBatch {
+    unsigned long startedAt;
+    bool powerOn;
+    int pending;
+    int succeeded;
+    unsigned long firstCompleted;
+    unsigned long lastCompleted;
+};
+
+static PowerWriteBatch powerWriteBatch;
+// How many bulbs have a power write waiting on its acknowledgement
+static int powerWritesInFlight = 0;
+
+/*
+ Sets the power state the bulb should be in, replacing any command for it that hasn't been sent yet (latest wins).
+ Nothing is sent if the bulb is already in (or on its way to) that state, sendPowerCommands() sends the rest.
+ edgeAt is when the sensor reported the presence change (micros) that caused this, or 0 if it wasn't one.
+*/
+void setDesiredPowerState(BulbData* bulb, bool powerOn, unsigned long edgeAt) {
+    if (!bulb->connected || bulb->paused) {
+        return;
+    }
+    if (bulb->commandPending) {
+        if (bulb->desiredPoweredOn == powerOn) {
+            return;
+        }
+        // Superseded before it was ever sent
+        bulb->commandPending = false;
+        bulb->telemetry.coalescedCommands++;
+    }
+    // The state is set as a write is issued, so this is also where the bulb is heading while the write is in flight
+    if (powerOn != bulb->poweredOn) {
+        bulb->desiredPoweredOn = powerOn;
+        bulb->commandPending = true;
+        bulb->commandEdgeAt = edgeAt;
+        bulb->writeRetries = 0;
+        bulb->retryAt = millis();
+    }
+}
+
+// Drops the hold a write (or the call issuing the batch) has on the batch, logging it once nothing holds it
+void releasePowerWriteBatch() {
+    PowerWriteBatch& batch = powerWriteBatch;
+    if (--batch.pending == 0 && batch.succeeded) {
+        Log.traceln("Powered %d bulb(s) %s, first acknowledged after %u us and last after %u us (spread of %u us)",
+            batch.succeeded, batch.powerOn ? "on" : "off", batch.firstCompleted, batch.lastCompleted,
+            batch.lastCompleted - batch.firstCompleted);
+    }
+}
+
+// Counts a completed write towards the batch it was issued in, logging the batch once every write in it has completed
+void completeBatchedWrite(BulbData* bulb, bool succeeded, unsigned long completedAt) {
+    PowerWriteBatch& batch = powerWriteBatch;
+    if (!batch.pending || (long)(bulb->writeIssuedAt - batch.startedAt) < 0) {
+        return;
+    }
+    if (succeeded) {
+        unsigned long completed = completedAt - batch.startedAt;
+        batch.firstCompleted = batch.succeeded++ ? std::min(batch.firstCompleted, completed) : completed;
+        batch.lastCompleted = std::max(batch.lastCompleted, completed);
+    }
+    releasePowerWriteBatch();
+}
+
+// Clears the bulb's power write in flight, if it has one
+void endPowerWrite(BulbData* bulb) {
+    if (bulb->writeInFlight) {
+        bulb->writeInFlight = false;
+        powerWritesInFlight--;
+    }
+}
+
+// Called once the bulb has acknowledged its power write (or NimBLE has queued it, for writes without response)
+void powerWriteSucceeded(BulbData* bulb, unsigned long completedAt) {
+    endPowerWrite(bulb);
+    bulb->writeRetries = 0;
+    Log.noticeln("Turned the bulb '%s' %s", bulb->address, bulb->inFlightPoweredOn ? "on" : "off");
+    bulb->telemetry.stages[STAGE_WRITE_ACK].record(completedAt - bulb->writeIssuedAt);
+    if (bulb->inFlightEdgeAt) {
+        bulb->telemetry.stages[STAGE_EDGE_TO_ACK].record(completedAt - bulb->inFlightEdgeAt);
+    }
+    completeBatchedWrite(bulb, true, completedAt);
+}
+
+// Called when the bulb's power write failed or timed out, it's retried with backoff unless a newer command replaced it
+void powerWriteFailed(BulbData* bulb) {
+    endPowerWrite(bulb);
+    bool powerOn = bulb->inFlightPoweredOn;
+    Log.errorln("Failed to power the bulb '%s' %s", bulb->address, powerOn ? "on" : "off");
+    bulb->telemetry.failedWrites++;
+    // Since we updated our local state first, revert it
+    bulb->poweredOn = !powerOn;
+    completeBatchedWrite(bulb, false, 0);
+    if (bulb->commandPending || !bulb->connected) {
+        return;
+    }
+    if (bulb->writeRetries >= POWER_WRITE_MAX_RETRIES) {
+        Log.errorln("Giving up on powering the bulb '%s' %s after %d retries", bulb->address, powerOn ? "on" : "off",
+            (int)bulb->writeRetries);
+        return;
+    }
+    bulb->desiredPoweredOn = powerOn;
+    bulb->commandPending = true;
+    bulb->commandEdgeAt = bulb->inFlightEdgeAt;
+    bulb->retryAt = millis() + (POWER_WRITE_RETRY_BACKOFF << bulb->writeRetries++);
+    bulb->telemetry.writeRetries++;
+}
+
+// Drops whatever the disconnected bulb had pending or in flight, syncConnectedBulbs() sends the current state once it's back
+void abandonPowerCommands(BulbData* bulb) {
+    endPowerWrite(bulb);
+    bulb->commandPending = false;
+}
+
+// Called on the NimBLE host task when a bulb acknowledges (or fails) a power write, arg is the write's sequence number
+int powerWriteCompleted(uint16_t connHandle, const struct ble_gatt_error* error, struct ble_gatt_attr* attr, void* arg) {
+    BulbData* bulb = findBulbByConnection(connHandle);
+    if (bulb) {
+        pushHostEvent({ BULB_POWER_WRITTEN, false, bulb, {}, (uint32_t)(uintptr_t)arg, error->status, micros() });
+    }
+    return 0;
+}
+
+/*
+ Issues a power write to the bulb, returns false if it couldn't be. A write with response is acknowledged by a
+ BULB_POWER_WRITTEN event (or while replaying, the trace's record of one). A write without response is done once it's queued.
+*/
+bool issuePowerWrite(BulbData* bulb, bool powerOn) {
+    static const uint8_t POWER_VALUES[2] = { 0, 1 };
+    uint8_t properties = bulb->handles.powerStateProperties;
+    if (properties & BLE_GATT_CHR_PROP_WRITE_NO_RSP) {
+        if (!replayingTrace && ble_gattc_write_no_rsp_flat(bulb->client->getConnId(), bulb->handles.powerState,
+                &POWER_VALUES[powerOn], 1) != 0) {
+            return false;
+        }
+        powerWriteSucceeded(bulb, micros());
+        return true;
+    }
+    if (properties & BLE_GATT_CHR_PROP_WRITE) {
+        return replayingTrace || ble_gattc_write_flat(bulb->client->getConnId(), bulb->handles.powerState, &POWER_VALUES[powerOn], 1,
+            powerWriteCompleted, (void*)(uintptr_t)bulb->writeSequence) == 0;
+    }
+    return false;
+}
+
+// Whether the bulb's pending command can be sent now
+bool canSendPowerCommand(const BulbData* bulb) {
+    return bulb->commandPending && !bulb->writeInFlight && bulb->connected && !bulb->paused
+        && (FAN_OUT_POWER_WRITES || powerWritesInFlight == 0);
+}
+
+/*
+ Sends the pending power commands of connected, non-paused bulbs that have nothing in flight, issuing the writes to
+ every bulb at once. The acknowledgements come back as BULB_POWER_WRITTEN events, so loop() never waits on a bulb
+ and a slow bulb only holds up its own commands. Writes that go unacknowledged for POWER_WRITE_TIMEOUT count as failed.
+ Returns false if any write couldn't be issued.
+*/
+bool sendPowerCommands() {
+    for (BulbData& bulb : bulbSlots()) {
+        if (bulb.writeInFlight && micros() - bulb.writeIssuedAt >= POWER_WRITE_TIMEOUT * 1000ul) {
+            Log.errorln("The bulb '%s' didn't acknowledge a power write within %ums", bulb.address, POWER_WRITE_TIMEOUT);
+            // The write in flight is always the last one recorded
+            bulb.writeHistory[(bulb.writeCount - 1) % POWER_WRITE_HISTORY_SIZE].timedOut = true;
+            powerWriteFailed(&bulb);
+        }
+    }
+
+    bool allIssued = true;
+    int issued = 0;
+    unsigned long startedAt = micros();
+    for (BulbData& bulb : bulbSlots()) {
+        BulbData* bulbData = &bulb;
+        if (!canSendPowerCommand(bulbData) || (long)(millis() - bulbData->retryAt) < 0) {
+            continue;
+        }
+        bool powerOn = bulbData->desiredPoweredOn;
+        bulbData->commandPending = false;
+        // A failed write may have left the bulb where a retry would have put it
+        if (powerOn == bulbData->poweredOn) {
+            continue;
+        }
+        // For external control detection race conditions, store the state before actually updating
+        bulbData->poweredOn = powerOn;
+        bulbData->inFlightPoweredOn = powerOn;
+        bulbData->inFlightEdgeAt = bulbData->commandEdgeAt;
+        bulbData->writeSequence++;
+        bulbData->writeInFlight = true;
+        powerWritesInFlight++;
+        recordPowerWrite(bulbData, powerOn);
+        Trace.record(TRACE_POWER_WRITE, bulbIndex(bulbData), powerOn, bulbData->writeSequence);
+        bulbData->writeIssuedAt = micros();
+        if (!issued++) {
+            powerWriteBatch = { startedAt, powerOn, 1, 0, 0, 0 };
+        }
+        powerWriteBatch.pending++;
+        // loop() stays on APP_CORE, so the cycle counter is good for timing how long issuing the write takes
+        uint32_t issuedCycles = ESP.getCycleCount();
+        bool written = issuePowerWrite(bulbData, powerOn);
+        bulbData->telemetry.stages[STAGE_WRITE_ISSUE].record((ESP.getCycleCount() - issuedCycles) / ESP.getCpuFreqMHz());
+        if (!written) {
+            Log.errorln("There was an issue changing the power characteristic for the bulb '%s'", bulbData->address);
+            powerWriteFailed(bulbData);
+            allIssued = false;
+        }
+        if (!FAN_OUT_POWER_WRITES && powerWritesInFlight > 0) {
+            break;
+        }
+    }
+    if (issued) {
+        // A batch still waiting on acknowledgements when the next one starts isn't logged
+        releasePowerWriteBatch();
+    }
+    return allIssued;
+}
+
+// How long in milliseconds until sendPowerCommands() has a retry to send or a write to give up on, LOOP_WAKE_NEVER if neither
+uint32_t powerCommandsDueIn() {
+    uint32_t dueIn = LOOP_WAKE_NEVER;
+    for (BulbData& bulb : bulbSlots()) {
+        long until;
+        if (bulb.writeInFlight) {
+            until = (long)POWER_WRITE_TIMEOUT - (long)((micros() - bulb.writeIssuedAt) / 1000);
+        } else if (canSendPowerCommand(&bulb)) {
+            until = (long)(bulb.retryAt - millis());
+        } else {
+            continue;
+        }
+        dueIn = std::min(dueIn, (uint32_t)std::max(until, 0L));
+    }
+    return dueIn;
+}
+
+// Sets the power states of every connected, non-paused bulb and sends the writes, see setDesiredPowerState() for edgeAt
+bool changeBulbStates(bool powerOn, unsigned long edgeAt = 0) {
+    for (BulbData& bulb : bulbSlots()) {
+        setDesiredPowerState(&bulb, powerOn, edgeAt);
+    }
+    return sendPowerCommands();
+}
+
+/*
+ This handles checking whether or not a bulb should pause/resume and update the appropriate state.
+ Note that, this does not start or stop the sensor due to race conditions and the need for delay between commands.
+*/
+void evaluatePausing(BulbData* bulb, bool poweredOn) {
+    // Check if pausing is enabled and whether the bulb changed power state from something else
+    if ((settings.pauseOnExternalControl && bulb->poweredOn != poweredOn) || bulb->paused) {
+        Log.infoln("The bulb was externally controlled and 'PAUSE_ON_EXTERNAL_CONTROL' was enabled.");
+        // Check if we should pause or resume
+        if (!bulb->paused) {
+            Log.infoln("Sensor control will be **paused** until we detect a second instance of external power control");
+            bulb->paused = true;
+            pausedBulbs++;
+            bulb->telemetry.pauseToggles++;
+        } else {
+            Log.infoln("Sensor control will **resume** as this is the second instance of external power control");
+            bulb->paused = false;
+            pausedBulbs--;
+            bulb->telemetry.pauseToggles++;
+        }
+        Trace.record(TRACE_PAUSE_TOGGLED, bulbIndex(bulb), bulb->paused);
+    }
+}
+
+/*
+ Finds the write a power state notification is the bulb echoing, if it's one of our own: a write of the same value issued
+ within POWER_ECHO_WINDOW that hasn't been echoed yet. Each write is matched to at most one notification, the oldest first.
+ Returns the write matched, or nullptr if the notification isn't an echo.
+*/
+PowerWriteRecord* matchPowerEcho(BulbData* bulb, bool poweredOn) {
+    uint32_t oldest = bulb->writeCount > POWER_WRITE_HISTORY_SIZE ? bulb->writeCount - POWER_WRITE_HISTORY_SIZE : 0;
+    // The bulb notifies in order, so a write from before the last one it echoed won't be echoed any more
+    for (uint32_t i = bulb->writeCount; i > oldest; i--) {
+        if (bulb->writeHistory[(i - 1) % POWER_WRITE_HISTORY_SIZE].echoed) {
+            oldest = i;
+            break;
+        }
+    }
+    for (uint32_t i = oldest; i < bulb->writeCount; i++) {
+        PowerWriteRecord& record = bulb->writeHistory[i % POWER_WRITE_HISTORY_SIZE];
+        if (!record.echoed && record.poweredOn == poweredOn && millis() - record.writtenAt < POWER_ECHO_WINDOW) {
+            record.echoed = true;
+            return &record;
+        }
+    }
+    return nullptr;
+}
+
+// Handles a power state notification / indication from the given bulb
+void powerStateNotified(BulbData* bulb, bool poweredOn) {
+    Log.infoln("Received power state notification from bulb '%s'. The bulb is now %s",
+        bulb->address, poweredOn ? "on" : "off");
+    bulb->lastUsedAt = millis();
+    PowerWriteRecord* echoed = matchPowerEcho(bulb, poweredOn);
+    if (echoed) {
+        if (echoed->timedOut && !bulb->writeInFlight && !bulb->commandPending && poweredOn != bulb->poweredOn) {
+            // A write that timed out went through after all, so the bulb is brought back in line, see syncConnectedBulbs()
+            Log.traceln("The bulb '%s' applied a power write late", bulb->address);
+            bulb->poweredOn = poweredOn;
+            bulb->stateSynced = false;
+            return;
+        }
+        // The echo of a write we've since superseded would otherwise have looked like external control
+        if (settings.pauseOnExternalControl && !bulb->paused && poweredOn != bulb->poweredOn) {
+            Log.traceln("Ignored the echo of an earlier power write to the bulb '%s'", bulb->address);
+            bulb->telemetry.pausesAvoided++;
+        }
+        return;
+    }
+    // Pause/Resume the bulb if enabled and the appropriate conditions are met
+    evaluatePausing(bulb, poweredOn);
+    // Make sure we store the current power state
+    bulb->poweredOn = poweredOn;
+}
+
+/*
+ Called on the NimBLE host task for every GAP event.
+ Notifications are matched to bulbs by connection and attribute handle here, as NimBLE only passes them on
+ for characteristics it has discovered itself, which a bulb connected using cached handles won't have.
+*/
+int gapEventReceived(struct ble_gap_event* event, void* arg) {
+    if (event->type != BLE_GAP_EVENT_NOTIFY_RX || OS_MBUF_PKTLEN(event->notify_rx.om) == 0) {
+        return 0;
+    }
+    BulbData* bulbData = findBulbByConnection(event->notify_rx.conn_handle);
+    if (!bulbData) {
+        return 0;
+    }
+    if (event->notify_rx.attr_handle == bulbData->handles.powerState) {
+        pushHostEvent({ BULB_POWER_NOTIFIED, getPoweredOn(event->notify_rx.om->om_data), bulbData, {} });
+    } else {
+        Log.infoln("Received an unknown notification from device '%s' for handle %u. Value: '%u'",
+            bulbData->address, event->notify_rx.attr_handle, event->notify_rx.om->om_data[0]);
+    }
+    return 0;
+}
+
+// Create a single global instance of the callback class to be used by all clients
+static ClientCallbacks clientCB;
+
+// This ensures we are bonded to the given connected device
+bool ensureBonded(NimBLEClient* pClient) {
+    bool bonded = BLEDevice::isBonded(pClient->getPeerAddress());
+    std::string deviceAddress = pClient->getPeerAddress().toString();
+    Log.traceln("The bulb '%s' is currently %s", deviceAddress.c_str(), bonded ? "bonded" : "not bonded");
+    if (!bonded) {
+        Log.infoln("Bonding...");
+        NimBLEDevice::startSecurity(pClient->getPeerAddress());
+        if (!pClient->secureConnection()) {
+            Log.errorln("Failed to bond with '%s'!", deviceAddress.c_str());
+            return false;
+        }
+        Log.infoln("Successfully bonded with '%s'!", deviceAddress.c_str());
+    } else if (!pClient->getConnInfo().isEncrypted()) {
+        // The bulb won't let us read or write until the link is encrypted, so restart encryption with the bond up front
+        if (!pClient->secureConnection()) {
+            Log.errorln("Failed to encrypt the connection to '%s'!", deviceAddress.c_str());
+            return false;
+        }
+    }
+    return true;
+}
+
+// Builds the NVS key for a bulb's cached handles, keys are limited to 15 characters so the colons are dropped
+const char* gattCacheKey(const BulbData* bulb, char (&key)[13]) {
+    char address[18];
+    formatMacAddress(bulb->mac, address);
+    for (int i = 0; i < 6; i++) {
+        key[i * 2] = address[i * 3];
+        key[i * 2 + 1] = address[i * 3 + 1];
+    }
+    key[12] = '\0';
+    return key;
+}
+
+// Loads the cached GATT handles for the given bulb, returns false if there aren't any (valid) ones
+bool loadGattHandles(BulbData* bulb) {
+    char key[13];
+    if (gattCache.getBytesLength(gattCacheKey(bulb, key)) != sizeof(GattHandles)) {
+        return false;
+    }
+    return gattCache.getBytes(key, &bulb->handles, sizeof(GattHandles)) == sizeof(GattHandles) && bulb->handles.powerState != 0;
+}
+
+void saveGattHandles(const BulbData* bulb) {
+    char key[13];
+    if (gattCache.putBytes(gattCacheKey(bulb, key), &bulb->handles, sizeof(GattHandles)) != sizeof(GattHandles)) {
+        Log.warningln("Failed to cache the GATT handles for the bulb '%s'", bulb->address);
+    }
+}
+
+void invalidateGattHandles(const BulbData* bulb) {
+    char key[13];
+    gattCache.remove(gattCacheKey(bulb, key));
+}
+
+// Discovers the bulb's power state characteristic and its handles, the slow path taken when nothing (valid) is cached
+bool discoverGattHandles(BulbData* bulb) {
+    NimBLERemoteService* lightService = bulb->client->getService(LIGHT_SERVICE_UUID);
+    if (!lightService) {
+        Log.errorln("Light service not found.");
+        return false;
+    }
+    NimBLERemoteCharacteristic* powerStateChar = lightService->getCharacteristic(POWER_STATE_CHAR_UUID);
+    if (!powerStateChar) {
+        Log.errorln("Power state characteristic not found.");
+        return false;
+    }
+    bulb->handles.powerState = powerStateChar->getHandle();
+    bulb->handles.powerStateProperties = (powerStateChar->canRead() ? BLE_GATT_CHR_PROP_READ : 0)
+        | (powerStateChar->canWriteNoResponse() ? BLE_GATT_CHR_PROP_WRITE_NO_RSP : 0)
+        | (powerStateChar->canWrite() ? BLE_GATT_CHR_PROP_WRITE : 0)
+        | (powerStateChar->canNotify() ? BLE_GATT_CHR_PROP_NOTIFY : 0)
+        | (powerStateChar->canIndicate() ? BLE_GATT_CHR_PROP_INDICATE : 0);
+    bulb->handles.powerStateCccd = 0;
+    if (powerStateChar->canNotify() || powerStateChar->canIndicate()) {
+        NimBLERemoteDescriptor* cccd = powerStateChar->getDescriptor(CCCD_UUID);
+        if (!cccd) {
+            Log.errorln("Power state notification descriptor not found.");
+            return false;
+        }
+        bulb->handles.powerStateCccd = cccd->getHandle();
+    }
+    return true;
+}
+
+// Called on the NimBLE host task for each attribute read by readPowerState() and once more when the read is done
+int powerStateRead(uint16_t connHandle, const struct ble_gatt_error* error, struct ble_gatt_attr* attr, void* arg) {
+    GattProcedure* procedure = (GattProcedure*)arg;
+    if (error->status == 0 && attr && OS_MBUF_PKTLEN(attr->om) > 0) {
+        procedure->found = true;
+        procedure->value = attr->om->om_data[0];
+        return 0;
+    }
+    procedure->status = error->status == BLE_HS_EDONE ? 0 : error->status;
+    xSemaphoreGive(procedure->completed);
+    return 0;
+}
+
+/*
+ Reads the bulb's power state by handle. This is a read by UUID limited to just that handle,
+ so it also checks that the (possibly cached) handle really is still the power state characteristic.
+*/
+bool readPowerState(BulbData* bulb) {
+    if (!(bulb->handles.powerStateProperties & BLE_GATT_CHR_PROP_READ)) {
+        return true;
+    }
+    GattProcedure& procedure = bulb->gattProcedure;
+    procedure.found = false;
+    if (ble_gattc_read_by_uuid(bulb->client->getConnId(), bulb->handles.powerState, bulb->handles.powerState,
+            &POWER_STATE_CHAR_UUID.getNative()->u, powerStateRead, &procedure) != 0) {
+        return false;
+    }
+    xSemaphoreTake(procedure.completed, portMAX_DELAY);
+    if (procedure.status != 0 || !procedure.found) {
+        return false;
+    }
+    bulb->poweredOn = getPoweredOn(&procedure.value);
+    return true;
+}
+
+// Called on the NimBLE host task once a bulb has answered our subscription
+int powerStateSubscribed(uint16_t connHandle, const struct ble_gatt_error* error, struct ble_gatt_attr* attr, void* arg) {
+    if (error->status != 0 && error->status != BLE_HS_ENOTCONN) {
+        pushHostEvent({ BULB_SUBSCRIBE_FAILED, false, (BulbData*)arg, {}, 0, error->status });
+    }
+    return 0;
+}
+
+/*
+ This subscribes to power state notifications (or indications) by writing the bulb's CCCD handle.
+ The write isn't waited on so the bulb can be controlled straight away, a failure drops the connection.
+*/
+bool subscribeToPowerState(BulbData* bulb) {
+    static const uint8_t NOTIFICATIONS_ENABLED[2] = { 0x01, 0x00 };
+    static const uint8_t INDICATIONS_ENABLED[2] = { 0x02, 0x00 };
+    if (!bulb->handles.powerStateCccd) {
+        return true;
+    }
+    // Send indications instead of notifications if that's all the bulb supports
+    const uint8_t* value = bulb->handles.powerStateProperties & BLE_GATT_CHR_PROP_NOTIFY ? NOTIFICATIONS_ENABLED : INDICATIONS_ENABLED;
+    return ble_gattc_write_flat(bulb->client->getConnId(), bulb->handles.powerStateCccd, value, 2, powerStateSubscribed, bulb) == 0;
+}
+
+// Handles the provisioning of clients and establishes the link to the bulb, setUpBulb() does the rest
+bool connectToBulb(BulbData* bulb) {
+    const char* bulbAddress = bulb->address;
+    NimBLEClient* pClient = nullptr;
+    unsigned long stageStartedAt = micros();
+
+    // Check if we have a client we should reuse first
+    if (NimBLEDevice::getClientListSize()) {
+        /*
+         Special case when we already know this device, we send false as the
+         second argument in connect() to prevent refreshing the service database.
+         This saves considerable time and power.
+        */
+        pClient = NimBLEDevice::getClientByPeerAddress(bulb->advertisement.address);
+        if (pClient){
+            if (!pClient->connect(bulb->advertisement.address, false)) {
+                Log.errorln("Failed to reconnect to '%s'", bulbAddress);
+                return false;
+            }
+            Log.infoln("Successfully reconnected to '%s'!", bulbAddress);
+        }
+        /*
+         We don't already have a client that knows this device,
+         we will check for a client that is disconnected that we can use.
+        */
+        else {
+            pClient = NimBLEDevice::getDisconnectedClient();
+            // The client may have belonged to an evicted bulb, which mustn't match its notifications any more
+            for (BulbData& other : bulbSlots()) {
+                if (other.client == pClient) {
+                    other.client = nullptr;
+                }
+            }
+        }
+    }
+
+    // No client to reuse? Create a new one
+    if (!pClient) {
+        if (NimBLEDevice::getClientListSize() >= NIMBLE_MAX_CONNECTIONS) {
+            Log.errorln("Max clients reached - no more connections available");
+            return false;
+        }
+
+        pClient = NimBLEDevice::createClient();
+        Log.traceln("Created a new client");
+
+        pClient->setClientCallbacks(&clientCB, false);
+        // Connect with the fast parameters, the scheduler relaxes them once the room is idle
+        pClient->setConnectionParams(FAST_CONN_PARAMS.minInterval, FAST_CONN_PARAMS.maxInterval,
+            FAST_CONN_PARAMS.latency, FAST_CONN_PARAMS.timeout);
+        // Set how long we are willing to wait for the connection to complete (seconds), default is 30
+        pClient->setConnectTimeout(5);
+
+
+        if (!pClient->connect(bulb->advertisement.address)) {
+            // Created a client but failed to connect, don't need to keep it as it has no data
+            NimBLEDevice::deleteClient(pClient);
+            Log.errorln("Failed to connect to '%s', deleted the client", bulbAddress);
+            return false;
+        }
+    }
+
+    if (!pClient->isConnected()) {
+        if (!pClient->connect(bulb->advertisement.address)) {
+            Log.errorln("Failed to connect to '%s'!", bulbAddress);
+            return false;
+        }
+    }
+    Log.traceln("Connected to: %s, RSSI: %d", bulbAddress, pClient->getRssi());
+    bulb->telemetry.stages[STAGE_CONNECT].record(micros() - stageStartedAt);
+    bulb->client = pClient;
+    bulb->connParams = &FAST_CONN_PARAMS;
+    return true;
+}
+
+// Bonds with the just connected bulb, finds its power state characteristic (from the cache if possible) and subscribes to it
+bool setUpBulb(BulbData* bulb) {
+    const char* bulbAddress = bulb->address;
+    NimBLEClient* pClient = bulb->client;
+    unsigned long stageStartedAt = micros();
+
+    // To be able to read & write characteristics we need to be bonded to the bulb
+    if (!ensureBonded(pClient)) {
+        Log.errorln("We aren't bonded to the bulb '%s' which is required. See the readme for help",
+            bulbAddress);
+        bulb->client = nullptr;
+        NimBLEDevice::deleteClient(pClient);
+        return false;
+    }
+    bulb->telemetry.stages[STAGE_BOND].record(micros() - stageStartedAt);
+    stageStartedAt = micros();
+
+    // Now we can read/write/subscribe, using the cached handles if we have them so we can skip service discovery
+    bool cached = !bulb->handlesStale && loadGattHandles(bulb);
+    if (cached && !readPowerState(bulb)) {
+        if (!pClient->isConnected()) {
+            Log.errorln("Lost the connection to '%s' while reading its power state", bulbAddress);
+            return false;
+        }
+        Log.warningln("The cached GATT handles for the bulb '%s' no longer match, discovering them again", bulbAddress);
+        bulb->handlesStale = true;
+        cached = false;
+    }
+    if (!cached) {
+        Log.traceln("Discovering the GATT handles for the bulb '%s'", bulbAddress);
+        invalidateGattHandles(bulb);
+        // If the handles were stale, so is the attribute database the client kept from last time
+        if (bulb->handlesStale) {
+            pClient->deleteServices();
+        }
+        if (!discoverGattHandles(bulb) || !readPowerState(bulb)) {
+            Log.errorln("Failed to find the power state of the bulb '%s'", bulbAddress);
+            // Drop the link, otherwise the bulb stops advertising and can't be found by the next scan
+            pClient->disconnect();
+            return false;
+        }
+        saveGattHandles(bulb);
+        bulb->handlesStale = false;
+    }
+    bulb->telemetry.stages[STAGE_DISCOVERY].record(micros() - stageStartedAt);
+    Log.infoln("The bulb is currently %s", bulb->poweredOn ? "on" : "off");
+
+    if (!subscribeToPowerState(bulb)) {
+        Log.errorln("Failed to subscribe to power notifications for the bulb '%s'", bulbAddress);
+        pClient->disconnect();
+        return false;
+    }
+
+    if (bulb->telemetry.connects++ > 0) {
+        bulb->telemetry.reconnects++;
+    }
+    return true;
+}
+
+// Called by NimBLE when a scan ends, either because it was stopped or it timed out
+void scanEnded(NimBLEScanResults results) {
+    notifyConnectionTask();
+}
+
+// Logs how many advertisements reached us during the scan that just ended and how much memory the scan results use
+void logScanStats() {
+    unsigned long scanDuration = millis() - scanStartedAt;
+    uint32_t callbacks = scanCallbacks.exchange(0);
+    Log.verboseln("Scanned for %lms and received %u advertisements (%u/s), NimBLE is storing %d results and ours use %u bytes",
+        scanDuration, callbacks, (uint32_t)(callbacks * 1000ull / (scanDuration ? scanDuration : 1)),
+        NimBLEDevice::getScan()->getResults().getCount(), (uint32_t)(sizeof(ScanResult) * MAX_BULBS));
+}
+
+// Sets up the just connected bulb and hands it over to loop(), reporting through the calling task's own event queue
+void finishConnecting(BulbData* bulb, BulbEventQueue& events) {
+    if (setUpBulb(bulb)) {
+        Log.infoln("Successfully connected to the bulb '%s'! We should now be able to control the bulb based on presence!",
+            bulb->address);
+        // Have the loop bring the bulb in line with the current presence state
+        events.push({ BULB_CONNECTED, false, bulb, {} });
+    } else {
+        Log.errorln("Failed to connect to the bulb '%s'", bulb->address);
+        events.push({ BULB_CONNECT_FAILED, false, bulb, {} });
+    }
+    notifyLoopTask();
+}
+
+// Called from the connection task only once the setup task is free, it gives bulbSetUp once it's done with the bulb
+void handToSetupTask(BulbData* bulb) {
+    bulbToSetUp = bulb;
+    xTaskNotifyGive(setupTaskHandle);
+}
+
+/*
+ Loads every configured bulb into the BLE controller's filter accept list and takes removed bulbs back out of it.
+ The controller refuses changes while it's scanning or connecting, so this is only called by the connection task while idle.
+*/
+void updateAcceptList() {
+    if (!SCAN_USING_ACCEPT_LIST) {
+        return;
+    }
+    for (BulbData& bulb : bulbSlots()) {
+        NimBLEAddress address(bulb.mac, BULB_ADDRESS_TYPE);
+        if (bulb.removed) {
+            if (NimBLEDevice::onWhiteList(address)) {
+                NimBLEDevice::whiteListRemove(address);
+            }
+        } else if (!NimBLEDevice::onWhiteList(address) && !NimBLEDevice::whiteListAdd(address)) {
+            Log.warningln("Failed to add the bulb '%s' to the accept list, scans won't find it", bulb.address);
+        }
+    }
+}
+
+/*
+ This is the background task that scans for any of the configured bulbs and connects to them when found.
+ Running it separately from the main loop means presence detection and control of the already connected
+ bulbs carries on while one or more bulbs are being (re)connected.
+ Every unconnected bulb found by a scan is connected to in turn, each one being handed to the setup task once its link
+ is up, so the bulbs don't each need a scan of their own and one bulb's discovery overlaps with the next one's connection.
+*/
+void connectionTask(void* parameter) {
+    unsigned long firstFoundAt = 0;
+    for (;;) {
+        switch (connectionState) {
+        case CONNECTION_IDLE: {
+            if (acceptListChanged.exchange(false)) {
+                updateAcceptList();
+            }
+            // Connections loop() hasn't applied yet still count, the queues are read first so none are missed in between
+            int pendingConnections = connectionEvents.depth() + setupEvents.depth();
+            int connected = connectedBulbs + pendingConnections;
+            if (connectRequests > 0) {
+                // loop() wants an evicted bulb back (or a scan's last bulbs weren't connected yet), their addresses are known so there's no need to scan
+                connectionState = CONNECTION_CONNECTING;
+            } else if (connected < (int)residentBulbLimit()) {
+                Log.infoln("%d/%d bulbs are unconnected, resuming scan", connected, configuredBulbs.load());
+                connectionState = CONNECTION_SCANNING;
+                firstFoundAt = 0;
+                scanCallbacks = 0;
+                scanStartedAt = millis();
+                NimBLEDevice::getScan()->start(SCAN_LENGTH, scanEnded);
+            } else {
+                // Every bulb is connected, sleep until one disconnects
+                ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+            }
+            break;
+        }
+        case CONNECTION_SCANNING: {
+            // Sleep until a configured bulb is found or the scan ends, then only until the collect window is up
+            unsigned long collecting = firstFoundAt ? std::min(millis() - firstFoundAt, (unsigned long)SCAN_COLLECT_WINDOW) : 0;
+            ulTaskNotifyTake(pdTRUE, firstFoundAt ? pdMS_TO_TICKS(SCAN_COLLECT_WINDOW - collecting) : portMAX_DELAY);
+            int requested = connectRequests;
+            if (requested > 0 && !firstFoundAt) {
+                firstFoundAt = millis();
+            }
+            int missing = (int)residentBulbLimit() - connectedBulbs - (int)(connectionEvents.depth() + setupEvents.depth());
+            if (requested > 0 && (requested >= missing || millis() - firstFoundAt >= SCAN_COLLECT_WINDOW)) {
+                // NimBLE cannot scan and connect at the same time, so stop scanning now
+                NimBLEDevice::getScan()->stop();
+                logScanStats();
+                Log.infoln("Found %d of the %d unconnected bulb(s), connecting", requested, missing);
+                connectionState = CONNECTION_CONNECTING;
+            } else if (acceptListChanged && SCAN_USING_ACCEPT_LIST) {
+                // A bulb was added or removed, the scan is started again once the accept list has been updated
+                NimBLEDevice::getScan()->stop();
+                logScanStats();
+                connectionState = requested > 0 ? CONNECTION_CONNECTING : CONNECTION_IDLE;
+            } else if (!NimBLEDevice::getScan()->isScanning()) {
+                logScanStats();
+                connectionState = requested > 0 ? CONNECTION_CONNECTING : CONNECTION_IDLE;
+            }
+            break;
+        }
+        case CONNECTION_CONNECTING: {
+            /*
+             Link up every requested bulb, handing each to the setup task whenever it's free. Once there are no links
+             left to make, the bulbs still waiting are set up here, alongside the setup task.
+            */
+            BulbData* linked[MAX_BULBS];
+            size_t linkedCount = 0, nextToSetUp = 0;
+            bool settingUp = false;
+            for (BulbData& bulb : bulbSlots()) {
+                BulbData* bulbData = &bulb;
+                if (!bulbData->connectRequested.exchange(false)) {
+                    continue;
+                }
+                connectRequests--;
+                if (!connectToBulb(bulbData)) {
+                    Log.errorln("Failed to connect to the bulb '%s'", bulbData->address);
+                    connectionEvents.push({ BULB_CONNECT_FAILED, false, bulbData, {} });
+                    notifyLoopTask();
+                    continue;
+                }
+                linked[linkedCount++] = bulbData;
+                if (settingUp && xSemaphoreTake(bulbSetUp, 0) == pdTRUE) {
+                    settingUp = false;
+                }
+                if (!settingUp) {
+                    handToSetupTask(linked[nextToSetUp++]);
+                    settingUp = true;
+                }
+            }
+            while (nextToSetUp < linkedCount) {
+                if (settingUp && xSemaphoreTake(bulbSetUp, 0) == pdTRUE) {
+                    settingUp = false;
+                }
+                if (!settingUp) {
+                    handToSetupTask(linked[nextToSetUp++]);
+                    settingUp = true;
+                } else {
+                    finishConnecting(linked[nextToSetUp++], connectionEvents);
+                }
+            }
+            if (settingUp) {
+                xSemaphoreTake(bulbSetUp, portMAX_DELAY);
+            }
+            connectionState = CONNECTION_IDLE;
+            break;
+        }
+        }
+    }
+}
+
+/*
+ This is the background task that bonds with, discovers and subscribes to the bulbs the connection task has connected to,
+ so that one bulb's discovery overlaps with the next one's connection. It takes one bulb at a time, see handToSetupTask().
+*/
+void setupTask(void* parameter) {
+    for (;;) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        finishConnecting(bulbToSetUp, setupEvents);
+        bulbToSetUp = nullptr;
+        xSemaphoreGive(bulbSetUp);
+    }
+}
+
+// Called once a bulb is connected and set up, its power state is the one read while setting it up
+void bulbConnected(BulbData* bulb) {
+    Trace.record(TRACE_BULB_CONNECTED, bulbIndex(bulb), bulb->poweredOn, bulb->handles.powerStateProperties);
+    bulb->connected = true;
+    connectedBulbs++;
+    bulb->lastUsedAt = millis();
+    bulb->connectFailed = false;
+    if (bulb->evicted) {
+        bulb->evicted = false;
+        // Any switching done while the bulb was evicted is only noticed now, as if it had been notified
+        bool poweredOn = bulb->poweredOn;
+        bulb->poweredOn = bulb->poweredOnWhenEvicted;
+        if (poweredOn != bulb->poweredOn) {
+            powerStateNotified(bulb, poweredOn);
+        }
+    }
+}
+
+void bulbDisconnected(BulbData* bulb) {
+    Trace.record(TRACE_BULB_DISCONNECTED, bulbIndex(bulb));
+    // A bulb that drops its link while the connection task is still setting it up was never counted
+    if (bulb->connected) {
+        bulb->connected = false;
+        connectedBulbs--;
+    }
+    // A presence change can reach a bulb between it being picked for eviction and its link going, that command is lost with it
+    bool commandLost = bulb->commandPending || bulb->writeInFlight;
+    abandonPowerCommands(bulb);
+    if (bulb->evicted) {
+        // loop() reconnects it when it's needed, see scheduleConnectionPool()
+        bulb->stateSynced = bulb->stateSynced && !commandLost;
+        Log.infoln("Evicted the bulb '%s' from the connection pool", bulb->address);
+        return;
+    }
+    Log.warningln("Disconnected from the bulb '%s'", bulb->address);
+    bulb->stateSynced = false;
+    // Let the connection task start looking for the bulb again
+    notifyConnectionTask();
+}
+
+// Called when the bulb acknowledges (or fails) one of its power writes, writtenAt is when (micros)
+void powerWriteAcknowledged(BulbData* bulb, uint32_t sequence, bool succeeded, unsigned long writtenAt) {
+    Trace.record(TRACE_POWER_WRITTEN, bulbIndex(bulb), !succeeded, sequence);
+    // A write that was already given up on (or went out on an earlier link) completing late is ignored
+    if (!bulb->writeInFlight || sequence != bulb->writeSequence) {
+        return;
+    }
+    if (succeeded) {
+        powerWriteSucceeded(bulb, writtenAt);
+    } else {
+        powerWriteFailed(bulb);
+    }
+}
+
+// Applies a single event from the NimBLE host task, the connection task or the setup task, see BulbEvent
+void applyBulbEvent(const BulbEvent& event) {
+    BulbData* bulb = event.bulb;
+    if (bulb->removed) {
+        // Only a link made before the bulb was removed needs dealing with, removeBulb() did the rest
+        if (event.type == BULB_CONNECTED && !replayingTrace) {
+            bulb->client->disconnect();
+        }
+        // The connection task is done with it, see removeBulb()
+        if (event.type == BULB_CONNECTED || event.type == BULB_CONNECT_FAILED) {
+            bulb->client = nullptr;
+        }
+        return;
+    }
+    switch (event.type) {
+    case BULB_ADVERTISED:
+        // Every bulb found that fits in the connection pool is connected to once the scan ends. Evicted bulbs are left to the pool
+        if (bulb->connected || bulb->evicted || bulb->connectRequested || connectionState != CONNECTION_SCANNING
+                || connectedBulbs + connectRequests >= (int)residentBulbLimit()) {
+            break;
+        }
+        Log.infoln("Found a configured bulb!");
+        // We can't connect from here due to API blocking calls, so instead save a reference for the connection task to do it
+        bulb->advertisement = event.advertisement;
+        requestConnection(bulb);
+        break;
+    case BULB_CONNECTED:
+        // The link may have dropped again before we got here, in which case the connection task has to start over
+        if (!bulb->client->isConnected()) {
+            notifyConnectionTask();
+            break;
+        }
+        bulbConnected(bulb);
+        break;
+    case BULB_DISCONNECTED:
+        bulbDisconnected(bulb);
+        break;
+    case BULB_POWER_NOTIFIED:
+        Trace.record(TRACE_POWER_NOTIFIED, bulbIndex(bulb), event.poweredOn);
+        powerStateNotified(bulb, event.poweredOn);
+        break;
+    case BULB_CONNECT_FAILED:
+        bulb->connectFailed = true;
+        bulb->connectFailedAt = millis();
+        break;
+    case BULB_POWER_WRITTEN:
+        powerWriteAcknowledged(bulb, event.writeSequence, event.writeStatus == 0, event.writtenAt);
+        break;
+    case BULB_SUBSCRIBE_FAILED:
+        Log.errorln("Failed to subscribe to power notifications for the bulb '%s' (status %d)", bulb->address, event.writeStatus);
+        // Without notifications we can't detect external control, so start over with freshly discovered handles
+        bulb->handlesStale = true;
+        if (!replayingTrace && bulb->client) {
+            bulb->client->disconnect();
+        }
+        break;
+    }
+}
+
+void applyBulbEvents(BulbEventQueue& queue) {
+    // Events are only removed once applied, see the connection task's use of BulbEventQueue::depth()
+    while (const BulbEvent* event = queue.peek()) {
+        applyBulbEvent(*event);
+        queue.pop();
+    }
+}
+
+// Applies every bulb event that has happened since the last call, this is the only place they change any state
+void processBulbEvents() {
+    // Connections first, as a disconnect reported straight after one must not be applied before it
+    applyBulbEvents(connectionEvents);
+    applyBulbEvents(setupEvents);
+    applyBulbEvents(hostEvents);
+    uint32_t dropped = hostEvents.dropped + connectionEvents.dropped + setupEvents.dropped;
+    if (dropped != bulbEventsDropped) {
+        Log.errorln("%u bulb event(s) were dropped as the queue was full, the bulbs' state may now be out of date",
+            dropped - bulbEventsDropped);
+        bulbEventsDropped = dropped;
+    }
+}
+
+// The most bulb events that have been waiting for loop() at once and how many have been dropped, across every producer
+void getBulbEventQueueStats(uint32_t& peakDepth, uint32_t& dropped) {
+    peakDepth = std::max({ hostEvents.peakDepth.load(), connectionEvents.peakDepth.load(), setupEvents.peakDepth.load() });
+    dropped = hostEvents.dropped + connectionEvents.dropped + setupEvents.dropped;
+}
+
+// Disconnects the bulb to make room in the connection pool, its state stays as it was until it is reconnected
+void evictBulb(BulbData* bulb) {
+    Log.traceln("Evicting the bulb '%s', last used %lms ago", bulb->address, millis() - bulb->lastUsedAt);
+    bulb->evicted = true;
+    bulb->poweredOnWhenEvicted = bulb->poweredOn;
+    bulb->telemetry.evictions++;
+    Trace.record(TRACE_BULB_EVICTED, bulbIndex(bulb));
+    if (!replayingTrace) {
+        bulb->client->disconnect();
+    }
+}
+
+// Whether an unconnected bulb can be asked for now, rather than waiting out a failed attempt to reconnect to it
+bool canReconnect(const BulbData* bulb) {
+    return !bulb->connected && !bulb->removed
+        && !(bulb->connectFailed && millis() - bulb->connectFailedAt < EVICTED_RECONNECT_RETRY_INTERVAL);
+}
+
+// How long in milliseconds until a bulb that failed to reconnect can be asked for again, LOOP_WAKE_NEVER if none is waiting to be
+uint32_t reconnectRetryDueIn() {
+    uint32_t dueIn = LOOP_WAKE_NEVER;
+    for (BulbData& bulb : bulbSlots()) {
+        unsigned long since = millis() - bulb.connectFailedAt;
+        if (!bulb.connected && !bulb.removed && bulb.connectFailed && since < EVICTED_RECONNECT_RETRY_INTERVAL) {
+            dueIn = std::min(dueIn, (uint32_t)(EVICTED_RECONNECT_RETRY_INTERVAL - since));
+        }
+    }
+    return dueIn;
+}
+
+// The connected bulb that was used the longest time ago, only counting bulbs that are up to date (nothing left to send) if syncedOnly is set
+BulbData* leastRecentlyUsedBulb(bool syncedOnly) {
+    BulbData* found = nullptr;
+    for (BulbData& bulb : bulbSlots()) {
+        bool upToDate = bulb.stateSynced && !bulb.commandPending && !bulb.writeInFlight;
+        if (bulb.connected && (upToDate || !syncedOnly) && (!found || (long)(bulb.lastUsedAt - found->lastUsedAt) < 0)) {
+            found = &bulb;
+        }
+    }
+    return found;
+}
+
+/*
+ Shares the links between the bulbs when there are more of them than the connection pool holds.
+ A bulb that missed a presence change while it was out of the pool is reconnected, evicting the least recently used bulb
+ that is up to date if the pool is full, and evicted bulbs are brought back whenever there's a free slot.
+ Only one eviction or reconnect is in progress at a time, the rest wait for the next loop().
+*/
+void scheduleConnectionPool() {
+    // The connections aren't replayed, the trace has the evictions this made
+    if (replayingTrace) {
+        return;
+    }
+    int limit = residentBulbLimit();
+    bool oversubscribed = configuredBulbs > limit;
+    BulbData* wanted = nullptr;
+    BulbData* evicted = nullptr;
+    for (BulbData& bulb : bulbSlots()) {
+        BulbData* bulbData = &bulb;
+        if (bulbData->evicted && bulbData->connected) {
+            // Still waiting for an eviction to go through
+            return;
+        }
+        if (!canReconnect(bulbData) || !(bulbData->evicted || oversubscribed)) {
+            continue;
+        }
+        if (!wanted && !bulbData->paused && !bulbData->stateSynced && sensorState == SENSOR_LIVE) {
+            wanted = bulbData;
+        }
+        if (!evicted && bulbData->evicted) {
+            evicted = bulbData;
+        }
+    }
+    int connected = connectedBulbs + connectionEvents.depth() + setupEvents.depth();
+    if (connected > limit) {
+        // The pool has shrunk, it doesn't matter whether the extra bulbs are up to date
+        evictBulb(leastRecentlyUsedBulb(false));
+        return;
+    }
+    if (connectionState == CONNECTION_CONNECTING || connectRequests > 0) {
+        return;
+    }
+    if (!wanted && connected < limit) {
+        // Nothing needs a command, so fill the free slot with an evicted bulb so it can notice being switched again
+        wanted = evicted;
+    }
+    if (!wanted) {
+        return;
+    }
+    if (connected == limit) {
+        BulbData* victim = leastRecentlyUsedBulb(true);
+        if (victim) {
+            evictBulb(victim);
+        }
+        return;
+    }
+    Log.traceln("Reconnecting the bulb '%s' from the connection pool", wanted->address);
+    requestConnection(wanted);
+}
+
+// Brings any bulbs that connected since the last presence change in line with the current presence state
+void syncConnectedBulbs() {
+    for (BulbData& bulb : bulbSlots()) {
+        BulbData* bulbData = &bulb;
+        if (bulbData->connected && !bulbData->stateSynced) {
+            setDesiredPowerState(bulbData, detectedState, 0);
+            bulbData->stateSynced = true;
+        }
+    }
+}
+
+// The connection parameters every connected bulb should currently be using
+const ConnParams* desiredConnParams() {
+    // While the room is occupied the next change is a turn off, so stay ready for it
+    if (detectedState || millis() - lastPresenceChange < FAST_CONN_HOLD) {
+        return &FAST_CONN_PARAMS;
+    }
+    return &IDLE_CONN_PARAMS;
+}
+
+/*
+ Moves the connected bulbs between the fast and idle connection parameters as the presence state changes.
+ An update only takes effect a few connection events after it is requested, writes carry on at the old interval until then.
+*/
+void scheduleConnParams() {
+    if (replayingTrace) {
+        return;
+    }
+    const ConnParams* params = desiredConnParams();
+    for (BulbData& bulb : bulbSlots()) {
+        BulbData* bulbData = &bulb;
+        if (bulbData->connected && bulbData->connParams != params) {
+            Log.traceln("Switching the bulb '%s' to the %s connection parameters", bulbData->address,
+                params == &FAST_CONN_PARAMS ? "fast" : "idle");
+            bulbData->client->updateConnParams(params->minInterval, params->maxInterval,
+                params->latency, params->timeout);
+            bulbData->connParams = params;
+        }
+    }
+}
+
+/*
+ Changes how many bulbs are kept connected at once, up to CONNECTION_POOL_SIZE. Can be called from any task,
+ loop() evicts bulbs that no longer fit or brings evicted ones back.
+*/
+void setConnectionPoolSize(size_t size) {
+    connectionPoolSize = std::max((size_t)1, std::min(size, CONNECTION_POOL_SIZE));
+    notifyLoopTask();
+    notifyConnectionTask();
+}
+
+/*
+ Starts controlling another bulb, leaving the other bulbs' links alone. Its address is known, so it's connected to straight away
+ if the connection pool has room (or once scheduleConnectionPool() makes some) rather than waiting for a scan to find it.
+ Returns nullptr if every slot has been used, the slots of removed bulbs are only freed by restarting.
+*/
+BulbData* addBulb(uint64_t mac) {
+    size_t slot = bulbSlotsUsed;
+    if (slot == MAX_BULBS) {
+        return nullptr;
+    }
+    BulbData* bulb = &bulbs[slot];
+    initBulb(bulb, mac);
+    bulbSlotsUsed.store(slot + 1, std::memory_order_release);
+    configuredBulbs++;
+    Trace.record(TRACE_BULB_ADDED, bulbIndex(bulb));
+    Log.infoln("Added the bulb '%s'", bulb->address);
+    if (replayingTrace) {
+        return bulb;
+    }
+    acceptListChanged = true;
+    if (connectedBulbs + connectRequests < (int)residentBulbLimit()) {
+        requestConnection(bulb);
+    } else {
+        notifyConnectionTask();
+    }
+    return bulb;
+}
+
+/*
+ Stops controlling the bulb and drops its link. Its bond and cached GATT handles are kept, as bonding again if it's
+ added back would use up another of the bulb's bonds (see the README).
+*/
+void removeBulb(BulbData* bulb) {
+    Trace.record(TRACE_BULB_REMOVED, bulbIndex(bulb));
+    Log.infoln("Removed the bulb '%s'", bulb->address);
+    bulb->removed = true;
+    configuredBulbs--;
+    if (bulb->connectRequested.exchange(false)) {
+        connectRequests--;
+    }
+    if (bulb->paused) {
+        bulb->paused = false;
+        pausedBulbs--;
+    }
+    abandonPowerCommands(bulb);
+    bool wasConnected = bulb->connected;
+    // Its disconnect is ignored when it arrives, see applyBulbEvent()
+    if (wasConnected) {
+        bulb->connected = false;
+        connectedBulbs--;
+        if (!replayingTrace) {
+            bulb->client->disconnect();
         }
     }
-};
+    // The client is NimBLE's to reuse, unless the connection task may be linking it up, then it's let go once that ends
+    if (wasConnected || connectionState != CONNECTION_CONNECTING) {
+        bulb->client = nullptr;
+    }
+    if (!replayingTrace) {
+        acceptListChanged = true;
+        notifyConnectionTask();
+    }
+}
 
-// Simple helper to get the power value for a bulb from the raw data
-bool getPoweredOn(const uint8_t* powerData) {
-    return powerData[0] == 1;
+// Turns PAUSE_ON_EXTERNAL_CONTROL on or off, turning it off resumes control of every paused bulb
+void setPauseOnExternalControl(bool enabled) {
+    Trace.record(TRACE_PAUSE_ON_EXTERNAL_CONTROL, 0, enabled);
+    settings.pauseOnExternalControl = enabled;
+    if (enabled) {
+        return;
+    }
+    for (BulbData& bulb : bulbSlots()) {
+        if (bulb.paused) {
+            Log.infoln("Sensor control of the bulb '%s' will **resume** as 'PAUSE_ON_EXTERNAL_CONTROL' was disabled", bulb.address);
+            bulb.paused = false;
+            pausedBulbs--;
+            bulb.telemetry.pauseToggles++;
+            Trace.record(TRACE_PAUSE_TOGGLED, bulbIndex(&bulb), false);
+        }
+    }
 }
 
-// Change the power state of the given bulb
-bool changeBulbState(BulbData* bulb, bool powerOn) {
-    // Check the state of the bulb first, which shouldn't count as failure
-    if (bulb->connected && !bulb->paused && powerOn != bulb->poweredOn) {
-        NimBLERemoteCharacteristic* powerStateChar = bulb->powerStateChar;
-        std::string bulbAddress = bulb->advDevice->getAddress().toString();
-        // For external control detection race conditions, store the state before actually updating
-        bulb->poweredOn = powerOn;
-        // These should all pass unless something is wrong
-        if (powerStateChar && powerStateChar->canWrite() && powerStateChar->writeValue(powerOn ? byte(1) : byte(0))) {
-            Log.noticeln("Turned the bulb '%s' %s", bulbAddress.c_str(), powerOn ? "on" : "off");
-            return true;
-        }
-        Log.errorln("There was an issue changing the power characteristic for the bulb '%s'",
-            bulbAddress.c_str());
-        // Since we updated our local state first, revert it
-        bulb->poweredOn = !powerOn;
+// Gets the connection parameters currently in effect for the given bulb, returns false if it isn't connected
+bool getBulbConnInfo(uint64_t mac, NimBLEConnInfo& connInfo) {
+    BulbData* bulb = findBulb(mac);
+    if (!bulb || !bulb->connected) {
         return false;
     }
+    connInfo = bulb->client->getConnInfo();
     return true;
 }
 
-// Changes the power states for connected, non-paused bulbs
-bool changeBulbStates(bool powerOn) {
-    bool allSucceeded = true;
-    for (auto& bulb : bulbs) {
-        if (!changeBulbState(bulb.second, powerOn)) {
-            Log.errorln("Failed to power the bulb '%s' %s", bulb.first.c_str(), powerOn ? "on": "off");
-            allSucceeded = false;
-        }
+/*
+ How many bulbs loop() counts as connected and how many bulbs are flagged as connected, for checking against the links
+ that really exist. They only have to agree once loop() has caught up on the bulbs' events.
+*/
+void getConnectedBulbCounts(int& counted, int& flagged) {
+    counted = connectedBulbs;
+    flagged = 0;
+    for (BulbData& bulb : bulbSlots()) {
+        flagged += bulb.connected ? 1 : 0;
     }
-    return allSucceeded;
 }
 
 /*
- This handles checking whether or not a bulb should pause/resume and update the appropriate state.
- Note that, this does not start or stop the sensor due to race conditions and the need for delay between commands.
+ Writes every bulb's counters and latency histograms in a compact, line based format:
+   stats uptime_ms=<ms> bulbs=<count> operational_ms=<ms after power on, 0 if not yet, see checkOperational()>
+     detecting_ms=<ms after power on that the sensor's reports were first trusted, 0 if not yet> (on the same line)
+   bulb <address> connected=<0|1> connects=<n> reconnects=<n> failed_writes=<n> pause_toggles=<n> evictions=<n>
+     write_retries=<n> coalesced=<n> pauses_avoided=<n> (on the same line)
+   stage <address> <stage> n=<n> mean_us=<us> p50_us=<us> p99_us=<us> max_us=<us> buckets=<bucket>:<n>,...
+   end
+ There is a stage line for every stage that has been timed at least once, see TelemetryStage and LatencyHistogram for the buckets.
+ Percentiles are the upper bound of the bucket they fall in. Each line is written in one go so it isn't split by the log.
 */
-void evaluatePausing(BulbData* bulb, bool poweredOn) {
-    // Check if pausing is enabled and whether the bulb changed power state from something else
-    if (PAUSE_ON_EXTERNAL_CONTROL && bulb->poweredOn != poweredOn || bulb->paused) {
-        Log.infoln("The bulb was externally controlled and 'PAUSE_ON_EXTERNAL_CONTROL' was enabled.");
-        // Check if we should pause or resume
-        if (!bulb->paused) {
-            Log.infoln("Sensor control will be **paused** until we detect a second instance of external power control");
-            bulb->paused = true;
-            pausedBulbs++;
-        } else {
-            Log.infoln("Sensor control will **resume** as this is the second instance of external power control");
-            bulb->paused = false;
-            pausedBulbs--;
+void writeTelemetry(Print& out) {
+    char line[512];
+    int length = snprintf(line, sizeof(line), "stats uptime_ms=%lu bulbs=%u operational_ms=%lu detecting_ms=%lu\n", millis(),
+        (unsigned)configuredBulbs.load(), operationalAt, sensorLiveAt);
+    out.write((const uint8_t*)line, length);
+    for (BulbData& bulb : bulbSlots()) {
+        if (bulb.removed) {
+            continue;
+        }
+        const BulbTelemetry& telemetry = bulb.telemetry;
+        length = snprintf(line, sizeof(line),
+            "bulb %s connected=%d connects=%u reconnects=%u failed_writes=%u pause_toggles=%u evictions=%u"
+            " write_retries=%u coalesced=%u pauses_avoided=%u\n",
+            bulb.address, bulb.connected ? 1 : 0, (unsigned)telemetry.connects, (unsigned)telemetry.reconnects,
+            (unsigned)telemetry.failedWrites, (unsigned)telemetry.pauseToggles, (unsigned)telemetry.evictions,
+            (unsigned)telemetry.writeRetries, (unsigned)telemetry.coalescedCommands, (unsigned)telemetry.pausesAvoided);
+        out.write((const uint8_t*)line, length);
+        for (int stage = 0; stage < STAGE_COUNT; stage++) {
+            const LatencyHistogram& histogram = telemetry.stages[stage];
+            if (!histogram.count) {
+                continue;
+            }
+            length = snprintf(line, sizeof(line), "stage %s %s n=%u mean_us=%u p50_us=%u p99_us=%u max_us=%u buckets=",
+                bulb.address, TELEMETRY_STAGE_NAMES[stage], (unsigned)histogram.count, (unsigned)(histogram.totalMicros / histogram.count),
+                (unsigned)histogram.percentileMicros(50), (unsigned)histogram.percentileMicros(99), (unsigned)histogram.maxMicros);
+            const char* separator = "";
+            for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+                if (histogram.buckets[i]) {
+                    length += snprintf(line + length, sizeof(line) - length, "%s%d:%u", separator, i, (unsigned)histogram.buckets[i]);
+                    separator = ",";
+                }
+            }
+            length += snprintf(line + length, sizeof(line) - length, "\n");
+            out.write((const uint8_t*)line, length);
         }
     }
+    out.write((const uint8_t*)"end\n", 4);
 }
 
-// Notification / Indication receiving handler callback
-void notifyCB(NimBLERemoteCharacteristic* pRemoteCharacteristic, uint8_t* pData, size_t length, bool isNotify) {
-    if (pRemoteCharacteristic->getUUID().equals(POWER_STATE_CHAR_UUID)) {
-        std::string bulbAddress = pRemoteCharacteristic->getRemoteService()->getClient()->getPeerAddress().toString();
-        // We shouldn't ever get a notification for a non-configured bulb, so don't bother with safety checks
-        BulbData* bulb = bulbs.find(bulbAddress)->second;
-        bool poweredOn = getPoweredOn(pData);
-        Log.infoln("Received power state notification from bulb '%s'. The bulb is now %s",
-            bulbAddress.c_str(), poweredOn ? "on" : "off");
-        // Pause/Resume the bulb if enabled and the appropriate conditions are met
-        evaluatePausing(bulb, poweredOn);
-        // Make sure we store the current power state
-        bulb->poweredOn = poweredOn;
-    } else {
-        Log.infoln("Received an unknown notification from device '%s', service '%s' & characteristic '%s'. Value: '%u'",
-            pRemoteCharacteristic->getRemoteService()->getClient()->getPeerAddress().toString().c_str(),
-            pRemoteCharacteristic->getRemoteService()->getUUID().toString().c_str(),
-            pRemoteCharacteristic->getUUID().toString().c_str(),
-            *pData);
+// This handles checking presence from the sensor and controlling unpaused bulbs
+void evaluatePresence() {
+    // Check presence from sensor and control any connected, unpaused bulbs
+    bool detected = observedSensorReport == 1;
+    if (detected != detectedState) {
+        Log.infoln("Presence state changed, new state: %s", detected ? "Present" : "Absent");
+        Trace.record(TRACE_PRESENCE_EDGE, 0, detected);
+        Log.verboseln("The change reached the app %l us after its frame was received (%u frames so far)",
+            micros() - sensorReportChangedAt, sensorFrames);
+        lastPresenceChange = millis();
+        bool reconnecting = connectedBulbs < (int)residentBulbLimit();
+        // Bulbs out of the connection pool miss this change, scheduleConnectionPool() reconnects them to catch up
+        for (BulbData& bulb : bulbSlots()) {
+            bulb.stateSynced = bulb.connected && bulb.stateSynced;
+        }
+        // This will handle turning all of the connected bulbs on or off with appropriate handling
+        bool changed = changeBulbStates(detectedState = detected, sensorReportChangedAt);
+        if (!changed) {
+            Log.errorln("There was an issue changing the state of at least one bulb");
+        }
+        if (reconnecting) {
+            presenceEventsWhileReconnecting++;
+            presenceEventsMissedWhileReconnecting += changed ? 0 : 1;
+            Log.infoln("Handled a presence event with %d/%d bulbs connected (%u of %u missed while reconnecting)",
+                connectedBulbs.load(), configuredBulbs.load(), presenceEventsMissedWhileReconnecting, presenceEventsWhileReconnecting);
+        }
     }
+    syncConnectedBulbs();
+    scheduleConnParams();
 }
 
-// Create a single global instance of the callback class to be used by all clients
-static ClientCallbacks clientCB;
+// The sensor configuration the settings ask for, in the units the sensor's commands take (see DFRobot_mmWave_Radar)
+struct SensorConfig {
+    int16_t rangeStart;
+    int16_t rangeEnd;
+    int16_t presenceLatency;
+    int16_t absenceLatency;
+};
 
-// This ensures we are bonded to the given connected device
-bool ensureBonded(NimBLEClient* pClient) {
-    bool bonded = BLEDevice::isBonded(pClient->getPeerAddress());
-    std::string deviceAddress = pClient->getPeerAddress().toString();
-    Log.traceln("The bulb '%s' is currently %s", deviceAddress.c_str(), bonded ? "bonded" : "not bonded");
-    if (!bonded) {
-        Log.infoln("Bonding...");
-        NimBLEDevice::startSecurity(pClient->getPeerAddress());
-        if (!pClient->secureConnection()) {
-            Log.errorln("Failed to bond with '%s'!", deviceAddress.c_str());
-            return false;
-        }
-        Log.infoln("Successfully bonded with '%s'!", deviceAddress.c_str());
+SensorConfig wantedSensorConfig(const Settings& settings) {
+    return { (int16_t)(settings.sensorDistanceStart / 0.15f), (int16_t)(settings.sensorDistanceEnd / 0.15f),
+        (int16_t)(settings.sensorPresenceLatency * 1000 / 25), (int16_t)(settings.sensorAbsenceLatency * 1000 / 25) };
+}
+
+/*
+ Brings the sensor's saved configuration in line with the settings. Every setting takes a few slow UART commands and
+ writes the sensor's flash, so the configuration last saved is kept in NVS and only the settings that changed are sent.
+ The sensor is only restored to its factory settings when nothing is known about it. Returns false if nothing was sent.
+*/
+bool configureSensor(const Settings& settings) {
+    SensorConfig wanted = wantedSensorConfig(settings);
+    SensorConfig saved;
+    bool known = sensorConfigCache.getBytes("saved", &saved, sizeof(saved)) == sizeof(saved);
+    if (known && memcmp(&saved, &wanted, sizeof(wanted)) == 0) {
+        Log.infoln("The mmWave sensor's configuration is up to date");
+        return false;
+    }
+    if (!known) {
+        Log.infoln("The mmWave sensor's configuration isn't known, restoring its factory settings");
+        sensor.factoryReset();
+    }
+    if (!known || saved.rangeStart != wanted.rangeStart || saved.rangeEnd != wanted.rangeEnd) {
+        Log.infoln("Setting the mmWave sensor's detection range");
+        sensor.DetRangeCfg(settings.sensorDistanceStart, settings.sensorDistanceEnd);
     }
+    if (!known || saved.presenceLatency != wanted.presenceLatency || saved.absenceLatency != wanted.absenceLatency) {
+        Log.infoln("Setting the mmWave sensor's output latency");
+        sensor.OutputLatency(settings.sensorPresenceLatency, settings.sensorAbsenceLatency);
+    }
+    sensorConfigCache.putBytes("saved", &wanted, sizeof(wanted));
     return true;
 }
 
-// This subscribes to power state notifications for the given connected device
-bool initBulbNotifications(NimBLEClient* pClient, NimBLERemoteCharacteristic* powerStateChar) {
-    if(powerStateChar->canNotify()) {
-        if(!powerStateChar->subscribe(true, notifyCB)) {
-            // Disconnect if subscribe failed
-            pClient->disconnect();
-            return false;
+/*
+ This is the task that configures the sensor at boot and whenever its settings change (see configureSensor()), so NimBLE
+ is started and the bulbs are connected in the meantime. A sensor that is already configured may have been left stopped
+ if only the ESP32 was reset (see pauseSensor()), so it's started unless frames arrive. loop() then waits for it to resume as usual.
+*/
+void sensorConfigTask(void* parameter) {
+    if (!configureSensor(sensorSettingsToApply)) {
+        unsigned long waitStarted = millis();
+        while (sensorFrames == 0 && millis() - waitStarted < SENSOR_FRAME_WAIT) {
+            vTaskDelay(pdMS_TO_TICKS(10));
         }
-    } else if(powerStateChar->canIndicate()) {
-        // Send false as first argument to subscribe to indications instead of notifications
-        if(!powerStateChar->subscribe(false, notifyCB)) {
-            // Disconnect if subscribe failed
-            pClient->disconnect();
-            return false;
+        if (sensorFrames == 0) {
+            Log.infoln("The mmWave sensor isn't sending frames, starting it");
+            sensor.start();
         }
     }
-    return true;
+    sensorConfigured = true;
+    notifyLoopTask();
+    vTaskDelete(nullptr);
 }
 
-// Handles the provisioning of clients and connects / interfaces with the bulb
-bool connectToBulb(BulbData* bulb) {
-    std::string bulbAddress = bulb->advDevice->getAddress().toString();
-    NimBLEClient* pClient = nullptr;
+// Configures the sensor in the background with the settings in effect, loop() waits for it to resume afterwards as at boot
+void startSensorConfig() {
+    sensorSettingsToApply = settings;
+    sensorConfigured = false;
+    if (sensorState != SENSOR_CONFIGURING) {
+        setSensorState(SENSOR_CONFIGURING);
+    }
+    if (!replayingTrace) {
+        xTaskCreatePinnedToCore(sensorConfigTask, "sensor config", SENSOR_CONFIG_TASK_STACK_SIZE, nullptr, SENSOR_CONFIG_TASK_PRIORITY,
+            nullptr, APP_CORE);
+    }
+}
 
-    // Check if we have a client we should reuse first
-    if (NimBLEDevice::getClientListSize()) {
-        /*
-         Special case when we already know this device, we send false as the
-         second argument in connect() to prevent refreshing the service database.
-         This saves considerable time and power.
-        */
-        pClient = NimBLEDevice::getClientByPeerAddress(bulb->advDevice->getAddress());
-        if (pClient){
-            if (!pClient->connect(bulb->advDevice, false)) {
-                Log.errorln("Failed to reconnect to '%s'", bulbAddress.c_str());
-                return false;
+/*
+ Applies a change to the sensor's range or latency, only sending the settings that changed (see configureSensor()).
+ The bulbs are left as they are until the sensor is live again. A change made while it's still being configured is applied after.
+*/
+void reconfigureSensor() {
+    Trace.record(TRACE_SENSOR_RECONFIGURED);
+    if (sensorState == SENSOR_CONFIGURING) {
+        sensorReconfigurePending = true;
+    } else {
+        startSensorConfig();
+    }
+}
+
+/*
+ Works out where a resuming sensor is given its latest report (-1 if no frame has arrived since it started).
+ Since the sensor has just started, it will report no presence for a few seconds. To stop our logic from turning
+ off bulbs in an occupied room, it only goes live on the first report of presence or once the buffer has passed.
+ This has no side effects so the timing can be checked on the host, millis() wrapping around is handled.
+*/
+SensorState nextSensorState(SensorState state, int8_t report, unsigned long resumedAt, unsigned long now,
+        unsigned long resumeBuffer = SENSOR_RESUME_BUFFER) {
+    if (state != SENSOR_RESUMING && state != SENSOR_ARMED) {
+        return state;
+    }
+    if (report == 1 || now - resumedAt > resumeBuffer) {
+        return SENSOR_LIVE;
+    }
+    return report == -1 ? SENSOR_RESUMING : SENSOR_ARMED;
+}
+
+// Moves a resuming sensor along, once it's live every bulb is set to whatever it reports
+void updateSensorState() {
+    if (sensorState == SENSOR_CONFIGURING) {
+        // The configuration may have restarted the sensor, so anything it reported in the meantime is stale
+        if (sensorConfigured) {
+            Trace.record(TRACE_SENSOR_CONFIGURED);
+            if (sensorReconfigurePending) {
+                sensorReconfigurePending = false;
+                startSensorConfig();
+                return;
             }
-            Log.infoln("Successfully reconnected to '%s'!", bulbAddress.c_str());
-        }
-        /*
-         We don't already have a client that knows this device,
-         we will check for a client that is disconnected that we can use.
-        */
-        else {
-            pClient = NimBLEDevice::getDisconnectedClient();
+            beginSensorResume();
         }
+        return;
     }
-
-    // No client to reuse? Create a new one
-    if (!pClient) {
-        if (NimBLEDevice::getClientListSize() >= NIMBLE_MAX_CONNECTIONS) {
-            Log.errorln("Max clients reached - no more connections available");
-            return false;
+    SensorState next = nextSensorState(sensorState, observedSensorReport, sensorResumedAt, millis());
+    if (next == sensorState) {
+        return;
+    }
+    setSensorState(next);
+    if (next == SENSOR_LIVE) {
+        detectedState = observedSensorReport == 1;
+        lastPresenceChange = millis();
+        Log.infoln("Initial presence state: %s", detectedState ? "Present" : "Absent");
+        if (!sensorLiveAt) {
+            sensorLiveAt = millis();
+            Log.noticeln("Detecting presence %lms after power on", sensorLiveAt);
         }
+        changeBulbStates(detectedState);
+    }
+}
 
-        pClient = NimBLEDevice::createClient();
-        Log.traceln("Created a new client");
-
-        pClient->setClientCallbacks(&clientCB, false);
-        /*
-         Set initial connection parameters: These settings are 15ms interval, 0 latency, 120ms timeout.
-         These settings are safe for 3 clients to connect reliably, can go faster if you have less
-         connections. Timeout should be a multiple of the interval, minimum is 100ms.
-         Min interval: 12 * 1.25ms = 15, Max interval: 12 * 1.25ms = 15, 0 latency, 51 * 10ms = 510ms timeout
-        */
-        pClient->setConnectionParams(12,12,0,51);
-        // Set how long we are willing to wait for the connection to complete (seconds), default is 30
-        pClient->setConnectTimeout(5);
-
+// This will evaluate whether or not we can use the mmWave sensor to detect presence
+bool canDetectPresence() {
+    // Check whether the sensor should be stopped or started before returning the current state
+    if (sensorState != SENSOR_PAUSED && sensorState != SENSOR_CONFIGURING && pausedBulbs == configuredBulbs) {
+        Log.infoln("Stopping the mmWave sensor as every bulb is paused");
+        pauseSensor();
+    } else if (sensorState == SENSOR_PAUSED && pausedBulbs < configuredBulbs) {
+        Log.infoln("Resuming the mmWave sensor as there are valid bulbs to control");
+        resumeSensor();
+    }
+    updateSensorState();
+    // Return the current state of the sensor
+    return sensorState == SENSOR_LIVE;
+}
 
-        if (!pClient->connect(bulb->advDevice)) {
-            // Created a client but failed to connect, don't need to keep it as it has no data
-            NimBLEDevice::deleteClient(pClient);
-            Log.errorln("Failed to connect to '%s', deleted the client", bulbAddress.c_str());
-            return false;
+/*
+ Brings the settings in effect in line with the given ones, only touching what changed. Bulbs are added and removed
+ without disturbing the other bulbs' links, and the sensor is only reconfigured if its range or latency changed.
+*/
+void applySettings(const Settings& wanted) {
+    for (BulbData& bulb : bulbSlots()) {
+        if (!bulb.removed && std::find(wanted.bulbMacs, wanted.bulbMacs + wanted.bulbCount, bulb.mac) == wanted.bulbMacs + wanted.bulbCount) {
+            removeBulb(&bulb);
         }
     }
-
-    if (!pClient->isConnected()) {
-        if (!pClient->connect(bulb->advDevice)) {
-            Log.errorln("Failed to connect to '%s'!", bulbAddress.c_str());
-            return false;
+    for (size_t i = 0; i < wanted.bulbCount; i++) {
+        if (!findBulb(wanted.bulbMacs[i]) && !addBulb(wanted.bulbMacs[i])) {
+            char address[18];
+            Log.errorln("There's no slot left for the bulb '%s', restart to free the slots of removed bulbs",
+                formatMacAddress(wanted.bulbMacs[i], address));
         }
     }
-    Log.traceln("Connected to: %s, RSSI: %d", bulbAddress.c_str(), pClient->getRssi());
-    connectedBulbs++;
+    settings.bulbCount = 0;
+    for (BulbData& bulb : bulbSlots()) {
+        if (!bulb.removed) {
+            settings.bulbMacs[settings.bulbCount++] = bulb.mac;
+        }
+    }
+    if (wanted.pauseOnExternalControl != settings.pauseOnExternalControl) {
+        setPauseOnExternalControl(wanted.pauseOnExternalControl);
+    }
+    bool sensorChanged = wanted.sensorDistanceStart != settings.sensorDistanceStart || wanted.sensorDistanceEnd != settings.sensorDistanceEnd
+        || wanted.sensorPresenceLatency != settings.sensorPresenceLatency || wanted.sensorAbsenceLatency != settings.sensorAbsenceLatency;
+    settings.sensorDistanceStart = wanted.sensorDistanceStart;
+    settings.sensorDistanceEnd = wanted.sensorDistanceEnd;
+    settings.sensorPresenceLatency = wanted.sensorPresenceLatency;
+    settings.sensorAbsenceLatency = wanted.sensorAbsenceLatency;
+    if (sensorChanged) {
+        reconfigureSensor();
+    }
+}
 
-    // To be able to read & write characteristics we need to be bonded to the bulb
-    if (!ensureBonded(pClient)) {
-        Log.errorln("We aren't bonded to the bulb '%s' which is required. See the readme for help",
-            bulbAddress.c_str());
-        NimBLEDevice::deleteClient(pClient);
+/*
+ Writes the settings in effect on one line:
+   config version=<n> pause_on_external_control=<0|1> sensor_range_m=<start>-<end> sensor_latency_s=<presence>/<absence>
+     bulbs=<address>,... (on the same line)
+*/
+void writeSettings(Print& out) {
+    char line[512];
+    int length = snprintf(line, sizeof(line), "config version=%u pause_on_external_control=%d sensor_range_m=%.2f-%.2f"
+        " sensor_latency_s=%.3f/%.3f bulbs=", settings.version, settings.pauseOnExternalControl ? 1 : 0, settings.sensorDistanceStart,
+        settings.sensorDistanceEnd, settings.sensorPresenceLatency, settings.sensorAbsenceLatency);
+    for (size_t i = 0; i < settings.bulbCount; i++) {
+        char address[18];
+        length += snprintf(line + length, sizeof(line) - length, "%s%s", i ? "," : "", formatMacAddress(settings.bulbMacs[i], address));
+    }
+    length += snprintf(line + length, sizeof(line) - length, "\n");
+    out.write((const uint8_t*)line, length);
+}
+
+// Parses two numbers separated by a space, like "0.5 6"
+bool parseNumberPair(const char* text, float& first, float& second) {
+    char* end;
+    first = strtof(text, &end);
+    if (end == text || *end != ' ') {
         return false;
     }
+    text = end + 1;
+    second = strtof(text, &end);
+    return end != text && *end == '\0';
+}
 
-    // Now we can read/write/subscribe the characteristics of the services we are interested in
-    bulb->lightService = pClient->getService(LIGHT_SERVICE_UUID);
-    if (bulb->lightService) {
-        bulb->powerStateChar = bulb->lightService->getCharacteristic(POWER_STATE_CHAR_UUID);
-        if (bulb->powerStateChar) {
-            if (bulb->powerStateChar->canRead()) {
-                bulb->poweredOn = getPoweredOn(bulb->powerStateChar->readValue().data());
-                Log.infoln("The bulb is currently %s", bulb->poweredOn ? "on" : "off");
-            }
+/*
+ Runs a command typed into the serial monitor, see the README for the commands. Changes to the settings are
+ applied straight away (see applySettings()) and then saved, so they're kept over a restart.
+*/
+void handleSerialCommand(char* command) {
+    // Anything the command takes follows the first space
+    char* argument = strchr(command, ' ');
+    if (argument) {
+        *argument++ = '\0';
+    } else {
+        argument = command + strlen(command);
+    }
+    Settings changed = settings;
+    uint64_t mac = parseMacAddress(argument);
+    uint64_t* macsEnd = changed.bulbMacs + changed.bulbCount;
+    float first, second;
+    // While the trace is being written to Serial, plain text there would split its records
+    Print& answer = Trace.recording() ? Trace.textOutput() : (Print&)Serial;
+    if (strcmp(command, "stats") == 0) {
+        writeTelemetry(answer);
+        return;
+    } else if (strcmp(command, "config") == 0) {
+        writeSettings(answer);
+        return;
+    } else if (strcmp(command, "forget-sensor-config") == 0) {
+        // For a replaced or externally reset sensor, whose configuration no longer matches what was saved
+        sensorConfigCache.remove("saved");
+        Log.infoln("Forgot the mmWave sensor's configuration, it will be configured from scratch on the next boot");
+        return;
+    } else if (strcmp(command, "add-bulb") == 0 && mac && !findBulb(mac) && changed.bulbCount < MAX_BULBS) {
+        changed.bulbMacs[changed.bulbCount++] = mac;
+    } else if (strcmp(command, "remove-bulb") == 0 && mac && std::find(changed.bulbMacs, macsEnd, mac) != macsEnd) {
+        changed.bulbCount = std::remove(changed.bulbMacs, macsEnd, mac) - changed.bulbMacs;
+    } else if (strcmp(command, "sensor-range") == 0 && parseNumberPair(argument, first, second) && validSensorRange(first, second)) {
+        changed.sensorDistanceStart = first;
+        changed.sensorDistanceEnd = second;
+    } else if (strcmp(command, "sensor-latency") == 0 && parseNumberPair(argument, first, second) && validSensorLatency(first, second)) {
+        changed.sensorPresenceLatency = first;
+        changed.sensorAbsenceLatency = second;
+    } else if (strcmp(command, "pause-on-external-control") == 0 && (strcmp(argument, "on") == 0 || strcmp(argument, "off") == 0)) {
+        changed.pauseOnExternalControl = strcmp(argument, "on") == 0;
+    } else if (strcmp(command, "reset-config") == 0) {
+        changed = defaultSettings();
+    } else {
+        Log.warningln("Unknown command or invalid argument '%s %s', see the README for the commands", command, argument);
+        return;
+    }
+    unsigned long startedAt = micros();
+    applySettings(changed);
+    if (strcmp(command, "reset-config") == 0) {
+        clearSettings(settingsStore);
+    } else if (!saveSettings(settingsStore, settings)) {
+        Log.errorln("Failed to save the settings, the change will be undone by a restart");
+    }
+    Log.infoln("Applied '%s' in %l us", command, micros() - startedAt);
+}
 
-            if (!initBulbNotifications(pClient, bulb->powerStateChar)) {
-                Log.errorln("Failed to subscribe to power notifications for the bulb '%s'",
-                    bulbAddress.c_str());
-                return false;
+// Reads whatever has been typed into the serial monitor, running each complete line as a command
+void readSerialCommands() {
+    static char command[48];
+    static size_t length = 0;
+    int c;
+    while ((c = Serial.read()) >= 0) {
+        if (c == '\r' || c == '\n') {
+            command[length] = '\0';
+            if (length) {
+                handleSerialCommand(command);
             }
+            length = 0;
+        } else if (length < sizeof(command) - 1) {
+            command[length++] = c;
         }
-    } else {
-        Log.errorln("Light service not found.");
-        return false;
     }
+}
+
+// Notes when the detector first became fully operational: the sensor is live and every bulb that fits in the pool is connected
+void checkOperational() {
+    if (!operationalAt && sensorState == SENSOR_LIVE && connectedBulbs >= (int)residentBulbLimit()) {
+        operationalAt = millis();
+        Log.noticeln("Fully operational %lms after power on, with %d bulb(s) connected", operationalAt, connectedBulbs.load());
+    }
+}
 
-    return bulb->connected = true;
+// Whether loop() has nothing left to do but wait for the sensor, the bulbs or its own timers
+bool loopIsIdle() {
+    return operationalAt && (sensorState == SENSOR_LIVE || sensorState == SENSOR_PAUSED) && connectionState == CONNECTION_IDLE
+        && connectRequests == 0 && connectedBulbs >= (int)residentBulbLimit();
 }
 
 /*
- This will scan for any of the configured bulbs and attempt to connect to one if found.
- Since the NimBLE scanner is blocking, if no configured bulbs can be found it will scan forever.
+ Sets up power management for LOW_POWER_IDLE, holding the ESP32 awake until loop() is idle.
+ ESP-IDF refuses light sleep unless it was built with tickless idle, in which case only the CPU is slowed down when idle.
 */
-void connectToBulb() {
-    // Check if we need to start/resume scanning
-    if (!NimBLEDevice::getScan()->isScanning() && bulbToConnect == nullptr) {
-        Log.infoln("%d/%d bulbs are unconnected, resuming scan", connectedBulbs, bulbs.size());
-        // Scanning is a blocking call so we might as well pause sensor
-        pauseSensor();
-        NimBLEDevice::getScan()->start(SCAN_LENGTH);
+void beginLowPowerIdle() {
+    esp_pm_lock_create(ESP_PM_CPU_FREQ_MAX, 0, "busy", &busyLock);
+    esp_pm_lock_acquire(busyLock);
+    busyLockHeld = true;
+    esp_pm_config_esp32s3_t pmConfig = { IDLE_MAX_CPU_FREQ, IDLE_MIN_CPU_FREQ, SENSOR_PRESENCE_PIN >= 0 };
+    esp_err_t result = esp_pm_configure(&pmConfig);
+    if (result != ESP_OK && pmConfig.light_sleep_enable) {
+        Log.warningln("Light sleep isn't available (%s), only the CPU will be slowed down when idle", esp_err_to_name(result));
+        pmConfig.light_sleep_enable = false;
+        result = esp_pm_configure(&pmConfig);
     }
-
-    // Check if we have found a bulb to connect to
-    if (bulbToConnect != nullptr) {
-        // Attempt to connect to the bulb
-        if (connectToBulb(bulbToConnect)) {
-            Log.infoln("Successfully connected to the bulb '%s'! We should now be able to control the bulb based on presence!",
-                bulbToConnect->advDevice->getAddress().toString().c_str());
-        } else {
-            Log.errorln("Failed to connect to the bulb '%s'", bulbToConnect->advDevice->getAddress().toString().c_str());
-        }
-        bulbToConnect = nullptr;
+    if (result != ESP_OK) {
+        Log.warningln("Power management isn't available (%s), the ESP32 will stay at full speed", esp_err_to_name(result));
+        return;
+    }
+    lightSleepEnabled = pmConfig.light_sleep_enable;
+    if (!lightSleepEnabled) {
+        return;
     }
+    // An unwired pin is held low, so it never appears to follow a report of presence
+    pinMode(SENSOR_PRESENCE_PIN, INPUT_PULLDOWN);
+    sensorOutputLevel = digitalRead(SENSOR_PRESENCE_PIN);
+    gpio_install_isr_service(0);
+    gpio_isr_handler_add((gpio_num_t)SENSOR_PRESENCE_PIN, sensorOutputReached, nullptr);
+    gpio_wakeup_enable((gpio_num_t)SENSOR_PRESENCE_PIN, sensorOutputLevel ? GPIO_INTR_LOW_LEVEL : GPIO_INTR_HIGH_LEVEL);
+    gpio_intr_enable((gpio_num_t)SENSOR_PRESENCE_PIN);
+    esp_sleep_enable_gpio_wakeup();
 }
 
-// This handles checking presence from the sensor and controlling unpaused bulbs
-void evaluatePresence() {
-    // Check presence from sensor and control any connected, unpaused bulbs
-    bool detected = sensor.readPresenceDetection();
-    if (detected != detectedState) {
-        Log.infoln("Presence state changed, new state: %s", detected ? "Present" : "Absent");
-        // This will handle turning all of the connected bulbs on or off with appropriate handling
-        if (!changeBulbStates(detectedState = detected)) {
-            Log.errorln("There was an issue changing the state of at least one bulb");
+/*
+ Lets the ESP32 slow down and light sleep while loop() is idle, and holds it awake while there's work to do.
+ After the sensor's presence output changes it's also held awake until a frame reports the change, as the UART
+ can't receive while asleep. Returns how long in milliseconds until that wait ends, or LOOP_WAKE_NEVER.
+*/
+uint32_t updatePowerManagement() {
+    if (!busyLock) {
+        return LOOP_WAKE_NEVER;
+    }
+    if (sensorOutputChanged.exchange(false)) {
+        sensorOutputChangedAt = millis();
+    }
+    bool reportsLevel = observedSensorReport == sensorOutputLevel;
+    unsigned long sinceChange = millis() - sensorOutputChangedAt;
+    bool confirming = false;
+    if (lightSleepEnabled && sensorState == SENSOR_LIVE && !reportsLevel) {
+        confirming = sinceChange < SENSOR_OUTPUT_CONFIRM_WAIT;
+        if (!confirming && sensorOutputVerified) {
+            sensorOutputVerified = false;
+            Log.warningln("The mmWave sensor's presence output no longer follows its reports, the ESP32 will stay awake");
+        }
+    } else if (lightSleepEnabled && !sensorOutputVerified && sensorOutputLevel == HIGH && reportsLevel) {
+        sensorOutputVerified = true;
+        Log.infoln("The mmWave sensor's presence output follows its reports, the ESP32 will light sleep when idle");
+    }
+    bool busy = !loopIsIdle() || confirming || (lightSleepEnabled && !sensorOutputVerified);
+    if (busy != busyLockHeld) {
+        if (busy) {
+            esp_pm_lock_acquire(busyLock);
+        } else {
+            esp_pm_lock_release(busyLock);
         }
+        busyLockHeld = busy;
+        Log.verboseln(busy ? "Holding the ESP32 awake" : "Letting the ESP32 sleep until something happens");
     }
+    return confirming ? SENSOR_OUTPUT_CONFIRM_WAIT - sinceChange : LOOP_WAKE_NEVER;
 }
 
-// This will evaluate whether or not we can use the mmWave sensor to detect presence
-bool canDetectPresence() {
-    // Check whether the sensor should be stopped or started before returning the current state
-    if (!sensorPaused && pausedBulbs == bulbs.size()) {
-        Log.infoln("Stopping the mmWave sensor as every bulb is paused");
-        pauseSensor();
-    } else if (sensorPaused && pausedBulbs < bulbs.size()) {
-        Log.infoln("Resuming the mmWave sensor as there are valid bulbs to control");
-        resumeSensor();
-        /*
-         Since the sensor has just started, it will report no presence for a few seconds.
-         To stop our logic from turning off bulbs in an occupied room, we wait to see if it
-         detects presence for our configured limit before continuing and updating bulbs.
-        */
-        unsigned long startedWaiting = millis();
-        bool detectedState = false;
-        while(!detectedState && millis() - startedWaiting <= SENSOR_RESUME_BUFFER) {
-            detectedState = sensor.readPresenceDetection();
-        }
-        changeBulbStates(detectedState);
+// Init an entry in our map for every bulb in the settings
+void initBulbs() {
+    for (size_t i = 0; i < settings.bulbCount; i++) {
+        initBulb(&bulbs[i], settings.bulbMacs[i]);
     }
-    // Return the current state of the sensor
-    return !sensorPaused;
+    configuredBulbs = settings.bulbCount;
+    bulbSlotsUsed.store(settings.bulbCount, std::memory_order_release);
 }
 
 void setup() {
     Serial.begin(115200);
-    // Initialise with log level and log output
-    Log.begin(LOG_LEVEL, &Serial);
+    // The trace's header needs the number of bulbs, so the settings are loaded first
+    settingsStore.begin(SETTINGS_NAMESPACE);
+    bool settingsLoaded = loadSettings(settingsStore, settings);
+    // Initialise with log level and log output, unless the serial port is carrying the trace instead
+    if (TRACE_OUTPUT_ENABLED) {
+        Trace.begin(&Serial, settings.bulbCount);
+    } else {
+        Log.begin(LOG_LEVEL, &Serial, LOG_OUTPUT_BINARY);
+    }
     Log.infoln("Starting Presence Detector");
+    Log.infoln(settingsLoaded ? "Using the saved settings" : "Using the default settings from config.h");
+    Trace.record(TRACE_PAUSE_ON_EXTERNAL_CONTROL, 0, settings.pauseOnExternalControl);
 
-    // Init an entry in our map for every configured bulb
-    for (std::string bulb : BULB_MAC_ADDRESSES) {
-        bulbs.insert({ bulb, new BulbData() });
-    }
+    initBulbs();
+    bulbSetUp = xSemaphoreCreateBinary();
+    gattCache.begin(GATT_CACHE_NAMESPACE);
 
-    // Configure the DFRobot sensor
+    // Configure the DFRobot sensor, its frames are parsed as they arrive and only presence changes wake loop()
+    loopTaskHandle = xTaskGetCurrentTaskHandle();
     mySerial.begin(115200, SERIAL_8N1, RX, TX);
-    sensor.factoryReset(); // Restore to the factory settings
-    sensor.DetRangeCfg(SENSOR_DISTANCE_START, SENSOR_DISTANCE_END);
-    sensor.OutputLatency(SENSOR_PRESENCE_LATENCY, SENSOR_ABSENCE_LATENCY);
+    mySerial.onReceive(sensorDataReceived, true);
+    // Typed commands wake loop() too, which otherwise sleeps until something happens
+#if ARDUINO_USB_MODE && ARDUINO_USB_CDC_ON_BOOT
+    Serial.onEvent(ARDUINO_HW_CDC_RX_EVENT, [](void*, esp_event_base_t, int32_t, void*) { notifyLoopTask(); });
+#else
+    Serial.onReceive(notifyLoopTask);
+#endif
+    // This can take seconds, so it happens alongside starting NimBLE, restoring the bonds and connecting to the bulbs
+    sensorConfigCache.begin(SENSOR_CONFIG_NAMESPACE);
+    startSensorConfig();
 
     // Initialize NimBLE, no device name specified as we are not advertising
     NimBLEDevice::init("");
+    // Power state notifications are picked up by handle, see gapEventReceived()
+    ble_gap_event_listener_register(&gapEventListener, gapEventReceived, nullptr);
 
     // Configure security & bonding
     NimBLEDevice::setSecurityIOCap(BLE_HS_IO_NO_INPUT_OUTPUT);
@@ -449,16 +2412,141 @@ void setup() {
     pScan->setWindow(15);
     // Active scan will gather scan response data from advertisers but will use more energy from both devices
     pScan->setActiveScan(true);
-}
+    // Have the controller drop repeated advertisements, and don't let NimBLE keep a result for every advertiser it hears
+    pScan->setDuplicateFilter(true);
+    pScan->setMaxResults(0);
+    if (SCAN_USING_ACCEPT_LIST) {
+        updateAcceptList();
+        pScan->setFilterPolicy(BLE_HCI_SCAN_FILT_USE_WL);
+    }
 
-void loop() {
-    // The NimBLE scanner is blocking, so either handle connections or do presence detection
-    if (connectedBulbs < bulbs.size()) {
-        // This will search for and connect to any configured bulb
-        connectToBulb();
+    // Scanning and connecting happens in the background so it never holds up presence detection
+    xTaskCreatePinnedToCore(setupTask, "setup", SETUP_TASK_STACK_SIZE, nullptr, SETUP_TASK_PRIORITY, &setupTaskHandle, APP_CORE);
+    xTaskCreatePinnedToCore(connectionTask, "connection", CONNECTION_TASK_STACK_SIZE, nullptr, CONNECTION_TASK_PRIORITY,
+        &connectionTaskHandle, APP_CORE);
+    if (LOW_POWER_IDLE) {
+        beginLowPowerIdle();
     }
-    // All configured bulbs are connected
-    else if (canDetectPresence()) {
+}
+
+/*
+ One pass of loop(), returns how long in milliseconds it can sleep for before the next.
+ The trace replayer runs these itself, see replayTraceRecord().
+*/
+uint32_t runLoopPass() {
+    Trace.beginPass();
+    // Catch up on what the other tasks reported before acting on presence, so paused and disconnected bulbs are left alone
+    processBulbEvents();
+    readSerialCommands();
+    observeSensorReport();
+    // Bulbs are connected by the connection task, so presence detection can run as soon as the sensor is
+    if (canDetectPresence()) {
         evaluatePresence();
     }
+    scheduleConnectionPool();
+    // Retries that are due, and commands that were waiting on an acknowledgement
+    sendPowerCommands();
+    checkOperational();
+
+    /*
+     Wake up in time to relax the connection parameters once the hold ends, to give up on a resuming sensor reporting presence,
+     to retry a failed power write or reconnect, or to stop waiting for the sensor to confirm a change. Once idle, nothing else needs checking on.
+    */
+    uint32_t wakeIn = loopIsIdle() ? LOOP_WAKE_NEVER : LOOP_WAKE_INTERVAL;
+    unsigned long sinceChange = millis() - lastPresenceChange;
+    if (sensorState == SENSOR_LIVE && !detectedState && sinceChange < FAST_CONN_HOLD) {
+        wakeIn = FAST_CONN_HOLD - sinceChange < wakeIn ? FAST_CONN_HOLD - sinceChange : wakeIn;
+    }
+    unsigned long sinceResume = millis() - sensorResumedAt;
+    if ((sensorState == SENSOR_RESUMING || sensorState == SENSOR_ARMED) && sinceResume <= SENSOR_RESUME_BUFFER) {
+        wakeIn = SENSOR_RESUME_BUFFER - sinceResume + 1 < wakeIn ? SENSOR_RESUME_BUFFER - sinceResume + 1 : wakeIn;
+    }
+    wakeIn = std::min(wakeIn, powerCommandsDueIn());
+    wakeIn = std::min(wakeIn, reconnectRetryDueIn());
+    wakeIn = std::min(wakeIn, updatePowerManagement());
+    // The trace's timestamps only go so long without a record
+    if (Trace.recording()) {
+        wakeIn = std::min(wakeIn, TRACE_CLOCK_INTERVAL / 1000);
+    }
+    return wakeIn;
+}
+
+/*
+ Sets the firmware up to be driven by the trace replayer instead of the ESP32's hardware, see replayingTrace.
+ The decisions the replay makes are recorded to the given output, to compare against the trace's.
+*/
+void beginTraceReplay(Print* output, uint8_t bulbCount) {
+    replayingTrace = true;
+    // The trace doesn't have the bulbs' MACs, which only have to be unique here
+    settings.bulbCount = std::min((size_t)bulbCount, MAX_BULBS);
+    for (size_t i = 0; i < settings.bulbCount; i++) {
+        settings.bulbMacs[i] = i + 1;
+    }
+    initBulbs();
+    Trace.begin(output, bulbCount, false);
+}
+
+/*
+ Hands one of the trace's records of what loop() was given back to the firmware, as it was on the ESP32.
+ A pass of loop() has to be run once every record of the pass has been replayed, other than evictions
+ which are made part way through a pass and so are replayed after it.
+ Returns false without replaying the record if it's about a bulb that isn't configured, or adds a bulb anywhere but
+ the next slot, which only a corrupt trace can have.
+*/
+bool replayTraceRecord(const TraceRecord& record) {
+    size_t slots = bulbSlotsUsed;
+    BulbData* bulb = record.bulb < slots ? &bulbs[record.bulb] : nullptr;
+    if (record.type == TRACE_BULB_ADDED ? record.bulb != slots || slots == MAX_BULBS
+            : TRACE_RECORD_LAYOUTS[record.type].bulb && (!bulb || bulb->removed)) {
+        return false;
+    }
+    switch (record.type) {
+    case TRACE_SENSOR_REPORT:
+        sensorReport = record.value;
+        sensorReportChangedAt = micros();
+        sensorFrames = record.arg;
+        break;
+    case TRACE_SENSOR_CONFIGURED:
+        sensorConfigured = true;
+        break;
+    case TRACE_BULB_CONNECTED:
+        bulb->poweredOn = record.value;
+        bulb->handles.powerStateProperties = record.arg;
+        bulbConnected(bulb);
+        break;
+    case TRACE_BULB_DISCONNECTED:
+        bulbDisconnected(bulb);
+        break;
+    case TRACE_BULB_EVICTED:
+        evictBulb(bulb);
+        break;
+    case TRACE_POWER_NOTIFIED:
+        Trace.record(TRACE_POWER_NOTIFIED, record.bulb, record.value);
+        powerStateNotified(bulb, record.value);
+        break;
+    case TRACE_POWER_WRITTEN:
+        powerWriteAcknowledged(bulb, record.arg, !record.value, micros());
+        break;
+    case TRACE_BULB_ADDED:
+        addBulb(record.bulb + 1);
+        break;
+    case TRACE_BULB_REMOVED:
+        removeBulb(bulb);
+        break;
+    case TRACE_PAUSE_ON_EXTERNAL_CONTROL:
+        setPauseOnExternalControl(record.value);
+        break;
+    case TRACE_SENSOR_RECONFIGURED:
+        reconfigureSensor();
+        break;
+    default:
+        break;
+    }
+    return true;
+}
+
+void loop() {
+    // Sleep until something happens, or the pass asks to be woken
+    uint32_t wakeIn = runLoopPass();
+    ulTaskNotifyTake(pdTRUE, wakeIn == LOOP_WAKE_NEVER ? portMAX_DELAY : pdMS_TO_TICKS(wakeIn));
 }
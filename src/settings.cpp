@@ -0,0 +1,50 @@
+/*
+ This file contains the defaults and NVS storage behind the detector's settings, see settings.h.
+*/
+
+#include <settings.h>
+
+// The NVS key the settings are saved under
+static const char* SETTINGS_KEY = "settings";
+
+Settings defaultSettings() {
+    Settings settings = {};
+    settings.version = SETTINGS_VERSION;
+    settings.bulbCount = DEFAULT_BULB_COUNT;
+    settings.pauseOnExternalControl = PAUSE_ON_EXTERNAL_CONTROL;
+    settings.sensorDistanceStart = SENSOR_DISTANCE_START;
+    settings.sensorDistanceEnd = SENSOR_DISTANCE_END;
+    settings.sensorPresenceLatency = SENSOR_PRESENCE_LATENCY;
+    settings.sensorAbsenceLatency = SENSOR_ABSENCE_LATENCY;
+    for (size_t i = 0; i < DEFAULT_BULB_COUNT; i++) {
+        settings.bulbMacs[i] = parseMacAddress(BULB_MAC_ADDRESSES[i]);
+    }
+    return settings;
+}
+
+bool loadSettings(Preferences& store, Settings& settings) {
+    Settings saved;
+    if (store.getBytesLength(SETTINGS_KEY) != sizeof(Settings)
+            || store.getBytes(SETTINGS_KEY, &saved, sizeof(Settings)) != sizeof(Settings)
+            || saved.version != SETTINGS_VERSION || saved.bulbCount > MAX_BULBS) {
+        return false;
+    }
+    settings = saved;
+    return true;
+}
+
+bool saveSettings(Preferences& store, const Settings& settings) {
+    return store.putBytes(SETTINGS_KEY, &settings, sizeof(Settings)) == sizeof(Settings);
+}
+
+void clearSettings(Preferences& store) {
+    store.remove(SETTINGS_KEY);
+}
+
+bool validSensorRange(float start, float end) {
+    return start >= 0 && start < end && end <= SENSOR_MAX_DISTANCE;
+}
+
+bool validSensorLatency(float presence, float absence) {
+    return presence >= 0 && presence <= SENSOR_MAX_LATENCY && absence >= 0 && absence <= SENSOR_MAX_LATENCY;
+}
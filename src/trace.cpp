@@ -0,0 +1,85 @@
+/*
+ This file contains the ring buffer and drain task behind the trace, see trace.h.
+ The records are timestamped with the 32-bit micros() and written out as the time since the previous one,
+ which TRACE_CLOCK_INTERVAL keeps from wrapping.
+*/
+
+#include <trace.h>
+
+TraceRecorder Trace;
+
+TraceRecorder::TraceRecorder() : output(nullptr), bulbCount(0), text(*this), outputLock(nullptr), head(0), tail(0),
+        dropped(0), lastRecordedAt(0), newPass(true), droppedWritten(0), lastWrittenAt(0), drainWaiting(false),
+        drainTaskHandle(nullptr) {}
+
+void TraceRecorder::begin(Print* output, uint8_t bulbCount, bool drainInBackground) {
+    if (!outputLock) {
+        outputLock = xSemaphoreCreateMutex();
+    }
+    this->bulbCount = bulbCount;
+    uint8_t header[TRACE_HEADER_SIZE];
+    output->write(header, encodeTraceHeader(bulbCount, header));
+    lastRecordedAt = micros();
+    if (drainInBackground && !drainTaskHandle) {
+        xTaskCreate(drainTask, "trace", TRACE_TASK_STACK_SIZE, this, TRACE_TASK_PRIORITY, &drainTaskHandle);
+    }
+    this->output = output;
+}
+
+void TraceRecorder::flush() {
+    while (writeNext()) {}
+}
+
+void TraceRecorder::drainTask(void* parameter) {
+    TraceRecorder* trace = (TraceRecorder*)parameter;
+    for (;;) {
+        trace->flush();
+        // Only sleep once the buffer is still empty after saying so, otherwise a racing record could be missed
+        trace->drainWaiting = true;
+        if (trace->head.load(std::memory_order_seq_cst) != trace->tail.load(std::memory_order_relaxed)) {
+            trace->drainWaiting = false;
+            continue;
+        }
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    }
+}
+
+// Writes out the oldest record if there is one, returns false if there wasn't
+bool TraceRecorder::writeNext() {
+    uint32_t position = tail.load(std::memory_order_relaxed);
+    if (position == head.load(std::memory_order_acquire)) {
+        return false;
+    }
+    const Entry& entry = entries[position % TRACE_BUFFER_ENTRIES];
+    xSemaphoreTake(outputLock, portMAX_DELAY);
+    // Said before the record after the gap, so the replayer knows where the gap was
+    uint32_t total = dropped;
+    if (total != droppedWritten) {
+        writeRecord({ TRACE_DROPPED, false, 0, 0, total }, entry.timestamp);
+        droppedWritten = total;
+    }
+    writeRecord({ entry.type, entry.samePass, entry.bulb, entry.value, entry.arg }, entry.timestamp);
+    xSemaphoreGive(outputLock);
+    tail.store(position + 1, std::memory_order_release);
+    return true;
+}
+
+void TraceRecorder::writeRecord(const TraceRecord& record, uint32_t timestamp) {
+    uint8_t encoded[TRACE_MAX_RECORD_SIZE];
+    output->write(encoded, encodeTraceRecord(record, timestamp - lastWrittenAt, encoded));
+    lastWrittenAt = timestamp;
+}
+
+size_t TraceRecorder::TextOutput::write(const uint8_t* buffer, size_t size) {
+    if (!trace.output || !size) {
+        return 0;
+    }
+    xSemaphoreTake(trace.outputLock, portMAX_DELAY);
+    // At the time of the record before, so the text doesn't move the replay's clock
+    trace.writeRecord({ TRACE_TEXT, false, 0, 0, (uint32_t)size }, trace.lastWrittenAt);
+    trace.output->write(buffer, size);
+    uint8_t header[TRACE_SYNC_HEADER_SIZE];
+    trace.output->write(header, encodeTraceSyncHeader(trace.bulbCount, trace.lastWrittenAt, header));
+    xSemaphoreGive(trace.outputLock);
+    return size;
+}
@@ -0,0 +1,28 @@
+/*
+ This file contains the host-side decoder for the firmware's binary log output (see LOG_OUTPUT_BINARY in config.h).
+ It reads the raw serial output from a file, or stdin if none is given, and prints each entry as a line of text
+ prefixed with the time it was logged at (seconds since boot).
+
+ Build with: pio run -e log_decoder
+ Run with: pio device monitor --raw | .pio/build/log_decoder/program
+*/
+
+#include <log_format.h>
+#include <cstdio>
+
+int main(int argc, char** argv) {
+    FILE* input = argc > 1 ? fopen(argv[1], "rb") : stdin;
+    if (!input) {
+        fprintf(stderr, "Failed to open '%s'\n", argv[1]);
+        return 1;
+    }
+    LogStreamDecoder decoder;
+    int c;
+    while ((c = fgetc(input)) != EOF) {
+        if (decoder.feed(c)) {
+            printf("%s\n", decoder.line());
+            fflush(stdout);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,538 @@
+/*
+ This file contains the soak and fault injection suite for the host-native build.
+ It runs the firmware against MAX_BULBS simulated bulbs over a long stretch of simulated time, compressed with the
+ simulation's time scale, while someone comes and goes, links drop, bulbs lose power, bonds fail, power state
+ notifications are lost and bulbs are slow to process writes. Once every simulated hour and at the end it stops injecting
+ faults until the detector has settled, then checks that loop()'s connected count matches the links that really exist, that NimBLE
+ hasn't kept more clients than it has connections, that every bulb matches the room and that the heap isn't growing.
+ Reports how long the connection pool took to fill back up after each fault and how long each presence change took to
+ reach every bulb. Exits with 1 as soon as an invariant doesn't hold.
+
+ Build and run with: pio run -e soak -t exec
+ Simulation settings can be changed with --name=value (see sim::Config), the soak defaults to --time-scale=100
+ --bond-failure-pct=10 --notification-drop-pct=5 --slow-write-pct=5, plus:
+   --hours=N            simulated hours to soak for, more than 1 so there are two checkpoints to compare (default 24)
+   --runs=N             soak this many times at once, each in its own process with the next seed, and pool the results (default 1)
+   --faults-per-hour=N  links dropped or bulbs power cut per simulated hour (default 120)
+   --presence-minutes=N mean simulated minutes between someone entering or leaving the room (default 5)
+   --log                print the firmware's serial output to stderr
+*/
+
+#include <Arduino.h>
+#include <config.h>
+#include <settings.h>
+#include <app_state.h>
+#include <NimBLEDevice.h>
+#include <sim.h>
+#include <thread>
+#include <chrono>
+#include <atomic>
+#include <algorithm>
+#include <random>
+#include <cmath>
+#include <cstdarg>
+#include <new>
+#include <map>
+#include <cstring>
+#include <malloc.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+void setup();
+void loop();
+bool getBulbConnInfo(uint64_t mac, NimBLEConnInfo& connInfo);
+void getConnectedBulbCounts(int& counted, int& flagged);
+
+// How often the soak checks on the bulbs and injects faults (us of simulated time)
+const uint64_t STEP_MICROS = 100000;
+// How long the detector gets to settle once faults stop before a checkpoint fails (ms of simulated time)
+const uint32_t SETTLE_TIMEOUT_MS = 600000;
+// How long the power stays off when a fault cuts it (ms of simulated time)
+const uint32_t POWER_CUT_MIN_MS = 1000;
+const uint32_t POWER_CUT_MAX_MS = 30000;
+/*
+ How many more allocations may be live from one hourly checkpoint to the next, going by the median. Allocations are
+ counted rather than bytes, as vectors and queues growing to a new high water mark now and then swap one allocation
+ for a bigger one, where a leak adds more of them every hour.
+*/
+const int64_t HOURLY_ALLOCATION_GROWTH_LIMIT = 4;
+
+// Heap accounting for the whole process (firmware and simulation) through the global allocation functions
+static std::atomic<uint64_t> heapInUse(0);
+static std::atomic<int64_t> liveAllocations(0);
+
+static void* trackedAlloc(size_t size) {
+    void* ptr = malloc(size ? size : 1);
+    if (!ptr) {
+        throw std::bad_alloc();
+    }
+    heapInUse += malloc_usable_size(ptr);
+    liveAllocations++;
+    return ptr;
+}
+
+static void trackedFree(void* ptr) {
+    if (ptr) {
+        heapInUse -= malloc_usable_size(ptr);
+        liveAllocations--;
+        free(ptr);
+    }
+}
+
+void* operator new(size_t size) { return trackedAlloc(size); }
+void* operator new[](size_t size) { return trackedAlloc(size); }
+void operator delete(void* ptr) noexcept { trackedFree(ptr); }
+void operator delete[](void* ptr) noexcept { trackedFree(ptr); }
+void operator delete(void* ptr, size_t) noexcept { trackedFree(ptr); }
+void operator delete[](void* ptr, size_t) noexcept { trackedFree(ptr); }
+
+// Mirrors the Arduino loopTask: setup() once, then loop() forever
+static void appTask() {
+    setup();
+    while (true) {
+        loop();
+    }
+}
+
+static double percentile(std::vector<double> values, double p) {
+    if (values.empty()) {
+        return 0;
+    }
+    std::sort(values.begin(), values.end());
+    return values[std::min(values.size() - 1, (size_t)(p / 100.0 * values.size()))];
+}
+
+static void report(const char* name, double value, const char* unit) {
+    printf("%-40s %12.3f %s\n", name, value, unit);
+}
+
+static void reportDistribution(const char* name, const std::vector<double>& values, const char* unit) {
+    std::string prefix = name;
+    report((prefix + ".count").c_str(), values.size(), "");
+    report((prefix + ".p50").c_str(), percentile(values, 50), unit);
+    report((prefix + ".p90").c_str(), percentile(values, 90), unit);
+    report((prefix + ".p99").c_str(), percentile(values, 99), unit);
+    report((prefix + ".max").c_str(), values.empty() ? 0 : *std::max_element(values.begin(), values.end()), unit);
+}
+
+static void fail(const char* format, ...) __attribute__((format(printf, 1, 2)));
+static void fail(const char* format, ...) {
+    printf("FAILED with seed %u at %.3f simulated hours: ", sim::config().seed, sim::nowMicros() / 3.6e9);
+    va_list args;
+    va_start(args, format);
+    vprintf(format, args);
+    va_end(args);
+    printf("\n");
+    fflush(stdout);
+    std::_Exit(1);
+}
+
+template <typename Condition>
+static bool waitFor(Condition condition, uint32_t timeoutMs) {
+    uint64_t deadline = sim::nowMicros() + timeoutMs * 1000ull;
+    while (!condition()) {
+        if (sim::nowMicros() > deadline) {
+            return false;
+        }
+        sim::sleepFor(STEP_MICROS);
+    }
+    return true;
+}
+
+// The link counts that have to agree once the detector has settled
+struct LinkCounts {
+    // What loop() counts as connected, and how many bulbs have their connected flag set
+    int counted;
+    int flagged;
+    // Bulbs the simulation has a link to
+    int linked;
+    // Clients NimBLE keeps, and how many of them are connected
+    int clients;
+    int clientsConnected;
+};
+
+static LinkCounts linkCounts() {
+    LinkCounts counts = {};
+    getConnectedBulbCounts(counts.counted, counts.flagged);
+    counts.linked = std::count_if(sim::bulbs().begin(), sim::bulbs().end(), [](sim::BulbModel* bulb) { return bulb->connected(); });
+    counts.clients = NimBLEDevice::getClientListSize();
+    for (NimBLEClient* client : *NimBLEDevice::getClientList()) {
+        counts.clientsConnected += client->isConnected() ? 1 : 0;
+    }
+    return counts;
+}
+
+// How many bulbs the detector keeps connected when nothing is going wrong
+static int poolLimit() {
+    return std::min((int)sim::bulbs().size(), NIMBLE_MAX_CONNECTIONS);
+}
+
+// Whether loop() has the bulb connected and set up
+static bool bulbReady(sim::BulbModel* bulb) {
+    NimBLEConnInfo connInfo;
+    return getBulbConnInfo(NimBLEAddress(bulb->mac()), connInfo);
+}
+
+// Whether loop() counts a full pool and the simulation agrees
+static bool poolFull() {
+    LinkCounts counts = linkCounts();
+    return counts.counted == poolLimit() && counts.linked == poolLimit();
+}
+
+/*
+ The last time the soak cut a bulb's power. Like a real Hue bulb it comes back on when the power does, which looks the
+ same as being switched on at the wall. The detector leaves a bulb it finds switched while it was out of the connection
+ pool as it is (see bulbConnected() in main.cpp), so a cut bulb is left out of checking that the room is in sync until
+ the first presence change after its power came back.
+*/
+struct PowerCut {
+    uint64_t backAt;
+    bool unswitched;
+};
+
+// The bulbs that aren't in the given state, other than any that haven't been switched since their power was cut, separated by spaces
+static std::string unsyncedBulbs(bool present, const std::vector<PowerCut>& powerCuts) {
+    std::string macs;
+    for (size_t i = 0; i < sim::bulbs().size(); i++) {
+        if (!powerCuts[i].unswitched && sim::bulbs()[i]->poweredOn() != present) {
+            macs += (macs.empty() ? "" : " ") + sim::bulbs()[i]->mac();
+        }
+    }
+    return macs;
+}
+
+static bool roomSynced(bool present, const std::vector<PowerCut>& powerCuts) {
+    return unsyncedBulbs(present, powerCuts).empty();
+}
+
+/*
+ What a run measured. With --runs each run is a child process that sends this to the parent over a pipe,
+ one "<kind> <name> <value>" line per value, where the totals are summed, the peaks kept and the samples pooled.
+*/
+struct SoakResult {
+    std::map<std::string, double> totals;
+    std::map<std::string, double> peaks;
+    std::map<std::string, std::vector<double>> samples;
+};
+
+static void writeResult(const SoakResult& result, FILE* out) {
+    for (const auto& total : result.totals) {
+        fprintf(out, "total %s %.17g\n", total.first.c_str(), total.second);
+    }
+    for (const auto& peak : result.peaks) {
+        fprintf(out, "peak %s %.17g\n", peak.first.c_str(), peak.second);
+    }
+    for (const auto& samples : result.samples) {
+        for (double value : samples.second) {
+            fprintf(out, "sample %s %.17g\n", samples.first.c_str(), value);
+        }
+    }
+}
+
+static void mergeResult(FILE* in, SoakResult& result) {
+    char kind[8], name[64];
+    double value;
+    while (fscanf(in, "%7s %63s %lf", kind, name, &value) == 3) {
+        if (strcmp(kind, "total") == 0) {
+            result.totals[name] += value;
+        } else if (strcmp(kind, "peak") == 0) {
+            result.peaks[name] = std::max(result.peaks[name], value);
+        } else {
+            result.samples[name].push_back(value);
+        }
+    }
+}
+
+/*
+ Soaks the firmware for the given simulated hours, injecting link drops and power cuts at the given rate spread over the
+ linked bulbs and flipping the presence every presenceMinutes on average. Exits on the first invariant that doesn't hold.
+*/
+static SoakResult runSoak(double hours, double faultsPerHour, double presenceMinutes) {
+    sim::Config faultRates = sim::config();
+    // The bulbs from config.h, then made up ones added over serial until the settings are full
+    for (const auto& mac : BULB_MAC_ADDRESSES) {
+        sim::addBulb(mac);
+    }
+    std::string commands = "pause-on-external-control off\n";
+    for (int i = 0; sim::bulbs().size() < MAX_BULBS; i++) {
+        char mac[18];
+        snprintf(mac, sizeof(mac), "fe:2e:97:4e:17:%02x", (uint8_t)i);
+        sim::addBulb(mac);
+        commands += std::string("add-bulb ") + mac + "\n";
+    }
+
+    std::mt19937 generator(sim::config().seed);
+    auto uniform = [&generator] { return std::uniform_real_distribution<double>(0, 1)(generator); };
+    // Time until the next event of a Poisson process with the given mean interval
+    auto nextArrival = [&uniform](double meanMicros) { return (uint64_t)(-std::log(1 - uniform()) * meanMicros); };
+
+    bool present = true;
+    sim::sensor().setPresence(present);
+    std::thread(appTask).detach();
+    sim::consoleInput(commands);
+    std::vector<PowerCut> powerCuts(sim::bulbs().size(), { 0, false });
+    if (!waitFor([present, &powerCuts] {
+            return getSensorState() == SENSOR_LIVE && poolFull() && roomSynced(present, powerCuts);
+        }, SETTLE_TIMEOUT_MS)) {
+        fail("the detector didn't become operational");
+    }
+    uint64_t soakFrom = sim::nowMicros();
+    uint64_t soakUntil = soakFrom + (uint64_t)(hours * 3.6e9);
+    uint64_t nextFaultAt = soakFrom + nextArrival(3.6e9 / faultsPerHour);
+    uint64_t nextEdgeAt = soakFrom + nextArrival(presenceMinutes * 6e7);
+    uint64_t nextCheckpointAt = soakFrom + 3600000000ull;
+
+    /*
+     A fault the detector hasn't recovered from yet, counting from the fault or when the power came back. It has once the
+     bulb is connected and set up again, or once the link has gone and the pool is full without it, as a bulb that's left
+     out of the pool is only brought back when it needs switching.
+    */
+    struct PendingFault {
+        uint64_t from;
+        size_t bulb;
+        bool powerCut;
+        bool linkGone;
+    };
+    std::vector<PendingFault> pendingFaults;
+    SoakResult result;
+    std::vector<double>& dropRecoveryMs = result.samples["recovery.link_drop_ms"];
+    std::vector<double>& cutRecoveryMs = result.samples["recovery.power_cut_ms"];
+    std::vector<double>& edgeToSyncedMs = result.samples["presence.edge_to_synced_ms"];
+    int linkDrops = 0, cutsInjected = 0, edges = 0, edgesSuperseded = 0, checkpoints = 0, staleAfterPowerCut = 0;
+    int peakClients = 0;
+    uint64_t edgeAt = 0;
+    std::vector<int64_t> checkpointHeap, checkpointAllocations;
+    // The heap in use other than by the soak's own records, which grow as it goes
+    auto heapExcludingSoak = [&result, &pendingFaults] {
+        int64_t own = pendingFaults.capacity() * sizeof(PendingFault);
+        for (const auto& samples : result.samples) {
+            own += samples.second.capacity() * sizeof(double);
+        }
+        return (int64_t)heapInUse - own;
+    };
+    auto realFrom = std::chrono::steady_clock::now();
+
+    while (true) {
+        uint64_t now = sim::nowMicros();
+        if (now >= nextFaultAt) {
+            nextFaultAt = now + nextArrival(3.6e9 / faultsPerHour);
+            std::vector<size_t> linked;
+            for (size_t i = 0; i < sim::bulbs().size(); i++) {
+                if (sim::bulbs()[i]->connected()) {
+                    linked.push_back(i);
+                }
+            }
+            if (!linked.empty()) {
+                size_t i = linked[generator() % linked.size()];
+                if (uniform() < 0.75) {
+                    sim::bulbs()[i]->dropLink();
+                    pendingFaults.push_back({ now, i, false, false });
+                    linkDrops++;
+                } else {
+                    uint32_t offMs = POWER_CUT_MIN_MS + generator() % (POWER_CUT_MAX_MS - POWER_CUT_MIN_MS);
+                    sim::bulbs()[i]->powerCut(offMs);
+                    powerCuts[i] = { now + offMs * 1000ull, true };
+                    pendingFaults.push_back({ now + offMs * 1000ull, i, true, false });
+                    cutsInjected++;
+                }
+            }
+        }
+        if (now >= nextEdgeAt) {
+            nextEdgeAt = now + nextArrival(presenceMinutes * 6e7);
+            edgesSuperseded += edgeAt ? 1 : 0;
+            present = !present;
+            sim::sensor().setPresence(present);
+            edgeAt = now;
+            edges++;
+            for (PowerCut& cut : powerCuts) {
+                cut.unswitched = cut.unswitched && now < cut.backAt;
+            }
+        }
+        if (edgeAt && roomSynced(present, powerCuts)) {
+            edgeToSyncedMs.push_back((now - edgeAt) / 1000.0);
+            edgeAt = 0;
+        }
+        bool full = poolFull();
+        for (auto fault = pendingFaults.begin(); fault != pendingFaults.end();) {
+            sim::BulbModel* bulb = sim::bulbs()[fault->bulb];
+            fault->linkGone = fault->linkGone || !bulb->connected();
+            bool reconnected = bulb->connectedAt() > fault->from && bulbReady(bulb);
+            if (now >= fault->from && (reconnected || (fault->linkGone && full))) {
+                (fault->powerCut ? cutRecoveryMs : dropRecoveryMs).push_back((now - fault->from) / 1000.0);
+                fault = pendingFaults.erase(fault);
+            } else {
+                fault++;
+            }
+        }
+        LinkCounts counts = linkCounts();
+        peakClients = std::max(peakClients, counts.clients);
+        if (counts.clients > NIMBLE_MAX_CONNECTIONS) {
+            fail("NimBLE has %d clients for %d connections", counts.clients, NIMBLE_MAX_CONNECTIONS);
+        }
+
+        // The soak ends on a checkpoint, so the last hour gets checked too
+        if (now >= nextCheckpointAt || now >= soakUntil) {
+            // Stop injecting faults and let the detector settle, then everything has to agree
+            sim::config().bondFailurePct = 0;
+            sim::config().notificationDropPct = 0;
+            sim::config().slowWritePct = 0;
+            if (!waitFor([present, &powerCuts] {
+                    LinkCounts counts = linkCounts();
+                    return getSensorState() == SENSOR_LIVE && roomSynced(present, powerCuts)
+                        && std::all_of(powerCuts.begin(), powerCuts.end(), [](const PowerCut& cut) { return sim::nowMicros() >= cut.backAt; })
+                        && counts.counted == poolLimit() && counts.flagged == poolLimit() && counts.linked == poolLimit()
+                        && counts.clientsConnected == poolLimit();
+                }, SETTLE_TIMEOUT_MS)) {
+                counts = linkCounts();
+                fail("the detector didn't settle: sensor %s, bulbs not %s: [%s], %d counted, %d flagged, %d linked, "
+                    "%d of %d clients connected, pool of %d", SENSOR_STATE_NAMES[getSensorState()], present ? "on" : "off",
+                    unsyncedBulbs(present, powerCuts).c_str(), counts.counted, counts.flagged, counts.linked,
+                    counts.clientsConnected, counts.clients, poolLimit());
+            }
+            for (size_t i = 0; i < sim::bulbs().size(); i++) {
+                staleAfterPowerCut += powerCuts[i].unswitched && sim::bulbs()[i]->poweredOn() != present ? 1 : 0;
+                sim::bulbs()[i]->clearWrites();
+            }
+            checkpointHeap.push_back(heapExcludingSoak());
+            checkpointAllocations.push_back(liveAllocations);
+            checkpoints++;
+            printf("# seed %u checkpoint %d: %d link drops, %d power cuts, %d presence edges, heap %lld bytes in %lld allocations, %.0fx real time\n",
+                sim::config().seed, checkpoints, linkDrops, cutsInjected, edges, (long long)checkpointHeap.back(),
+                (long long)checkpointAllocations.back(),
+                (sim::nowMicros() - soakFrom) / (double)std::chrono::duration_cast<std::chrono::microseconds>(
+                    std::chrono::steady_clock::now() - realFrom).count());
+            fflush(stdout);
+            sim::config().bondFailurePct = faultRates.bondFailurePct;
+            sim::config().notificationDropPct = faultRates.notificationDropPct;
+            sim::config().slowWritePct = faultRates.slowWritePct;
+            nextCheckpointAt = sim::nowMicros() + 3600000000ull;
+            if (sim::nowMicros() >= soakUntil) {
+                break;
+            }
+        }
+        sim::sleepFor(STEP_MICROS);
+    }
+
+    if (checkpoints < 2) {
+        fail("only %d checkpoint(s), where it takes two to tell whether the heap is growing", checkpoints);
+    }
+    std::vector<double> hourlyAllocationGrowth;
+    for (size_t i = 1; i < checkpointAllocations.size(); i++) {
+        hourlyAllocationGrowth.push_back(checkpointAllocations[i] - checkpointAllocations[i - 1]);
+    }
+    double allocationGrowth = percentile(hourlyAllocationGrowth, 50);
+    if (allocationGrowth > HOURLY_ALLOCATION_GROWTH_LIMIT) {
+        fail("a median of %.0f more allocations were live each hour over %d checkpoints", allocationGrowth, checkpoints);
+    }
+    double simulatedHours = (sim::nowMicros() - soakFrom) / 3.6e9;
+    result.totals["soak.runs"] = 1;
+    result.totals["soak.simulated_hours"] = simulatedHours;
+    result.totals["soak.bulb_hours"] = simulatedHours * sim::bulbs().size();
+    result.totals["soak.checkpoints"] = checkpoints;
+    result.totals["faults.link_drops"] = linkDrops;
+    result.totals["faults.power_cuts"] = cutsInjected;
+    result.totals["faults.failed_bonds"] = sim::faultsInjected(sim::FAULT_BOND);
+    result.totals["faults.dropped_notifications"] = sim::faultsInjected(sim::FAULT_NOTIFICATION);
+    result.totals["faults.slow_writes"] = sim::faultsInjected(sim::FAULT_SLOW_WRITE);
+    result.totals["presence.edges"] = edges;
+    result.totals["presence.edges_superseded"] = edgesSuperseded;
+    result.totals["presence.stale_after_power_cut"] = staleAfterPowerCut;
+    result.peaks["invariants.peak_clients"] = peakClients;
+    result.peaks["heap.median_hourly_allocation_growth"] = allocationGrowth;
+    result.peaks["heap.growth_bytes"] = checkpointHeap.size() >= 2 ? checkpointHeap.back() - checkpointHeap.front() : 0;
+    return result;
+}
+
+int main(int argc, char** argv) {
+    double hours = 24;
+    double faultsPerHour = 120;
+    double presenceMinutes = 5;
+    int runs = 1;
+    sim::config().timeScale = 100;
+    sim::config().bondFailurePct = 10;
+    sim::config().notificationDropPct = 5;
+    sim::config().slowWritePct = 5;
+    for (const std::string& arg : sim::configure(argc, argv)) {
+        if (arg.rfind("--hours=", 0) == 0) {
+            hours = atof(arg.c_str() + 8);
+        } else if (arg.rfind("--faults-per-hour=", 0) == 0) {
+            faultsPerHour = atof(arg.c_str() + 18);
+        } else if (arg.rfind("--presence-minutes=", 0) == 0) {
+            presenceMinutes = atof(arg.c_str() + 19);
+        } else if (arg.rfind("--runs=", 0) == 0) {
+            runs = std::max(1, atoi(arg.c_str() + 7));
+        } else if (arg == "--log") {
+            sim::setConsole(stderr);
+        } else {
+            fprintf(stderr, "Unknown argument '%s'\n", arg.c_str());
+            return 2;
+        }
+    }
+    if (hours <= 0 || faultsPerHour <= 0 || presenceMinutes <= 0) {
+        fprintf(stderr, "--hours, --faults-per-hour and --presence-minutes must be positive\n");
+        return 2;
+    }
+    if (hours <= 1) {
+        fprintf(stderr, "--hours must be more than 1, as the heap is checked from one hourly checkpoint to the next\n");
+        return 2;
+    }
+    printf("# Hue BLE presence detector soak, %d bulbs, %d connections, %d run(s) of %.1f simulated hours\n",
+        (int)MAX_BULBS, NIMBLE_MAX_CONNECTIONS, runs, hours);
+    sim::printConfig(stdout);
+    fflush(stdout);
+
+    SoakResult result;
+    if (runs == 1) {
+        result = runSoak(hours, faultsPerHour, presenceMinutes);
+    } else {
+        // The firmware is a single instance, so each run gets a process of its own and a seed of its own
+        std::vector<std::pair<pid_t, FILE*>> children;
+        for (int run = 0; run < runs; run++) {
+            int fds[2];
+            if (pipe(fds) != 0) {
+                perror("pipe");
+                return 2;
+            }
+            pid_t pid = fork();
+            if (pid == 0) {
+                close(fds[0]);
+                sim::config().seed += run;
+                FILE* out = fdopen(fds[1], "w");
+                writeResult(runSoak(hours, faultsPerHour, presenceMinutes), out);
+                fclose(out);
+                fflush(stdout);
+                std::_Exit(0);
+            }
+            close(fds[1]);
+            children.push_back({ pid, fdopen(fds[0], "r") });
+        }
+        int failed = 0;
+        for (auto& child : children) {
+            mergeResult(child.second, result);
+            fclose(child.second);
+            int status;
+            waitpid(child.first, &status, 0);
+            failed += WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : 1;
+        }
+        if (failed) {
+            printf("FAILED: %d of %d runs\n", failed, runs);
+            fflush(stdout);
+            return 1;
+        }
+    }
+
+    for (const auto& total : result.totals) {
+        report(total.first.c_str(), total.second, "");
+    }
+    for (const auto& peak : result.peaks) {
+        report(peak.first.c_str(), peak.second, "");
+    }
+    // From a link dropping, or the power coming back after a cut, until the bulb is set up again or the pool is full without it
+    reportDistribution("recovery.link_drop_ms", result.samples["recovery.link_drop_ms"], "ms");
+    reportDistribution("recovery.power_cut_ms", result.samples["recovery.power_cut_ms"], "ms");
+    // From the sensor's output changing until every bulb the detector can know about has followed it
+    reportDistribution("presence.edge_to_synced_ms", result.samples["presence.edge_to_synced_ms"], "ms");
+    printf("# soak passed\n");
+    fflush(stdout);
+    std::_Exit(0);
+}
@@ -0,0 +1,251 @@
+/*
+ This file contains the host-side replayer for the firmware's trace (see TRACE_OUTPUT_ENABLED in config.h).
+ It builds the firmware's own presence and pausing logic against the simulation (see ./sim), on a clock that only moves
+ as the trace says, feeds it everything the ESP32's loop() was given and checks that it decides the same things.
+ The passes of loop() that recorded nothing (waking to check a timer) are run at the times loop() asks to be woken,
+ so a trace replays as fast as the logic runs. Exits with 1 if any decision differs, so it can be used as a regression test.
+
+ Build with: pio run -e trace_replay
+ Run with: .pio/build/trace_replay/program trace.bin
+   --boot=N    replay the Nth boot in the trace (default 1), a trace captured across restarts has a header for each
+   --log       print the firmware's log to stderr, along with the answers to serial commands carried in the trace
+*/
+
+#include <Arduino.h>
+#include <config.h>
+#include <binary_log.h>
+#include <trace.h>
+#include <sim.h>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <string>
+#include <vector>
+
+uint32_t runLoopPass();
+void beginTraceReplay(Print* output, uint8_t bulbCount);
+bool replayTraceRecord(const TraceRecord& record);
+
+// How many differing decisions are printed before only being counted
+const int MAX_REPORTED_DIFFERENCES = 10;
+
+class StderrOutput : public Print {
+public:
+    size_t write(uint8_t c) override {
+        return fwrite(&c, 1, 1, stderr);
+    }
+    size_t write(const uint8_t* buffer, size_t size) override {
+        return fwrite(buffer, 1, size, stderr);
+    }
+};
+
+// Decodes the trace the replay records of itself, keeping its decisions to compare against the ESP32's
+class DecisionCollector : public Print {
+public:
+    size_t write(uint8_t c) override {
+        if (decoder.feed(c) == TraceDecoder::RECORD && isTraceDecision(decoder.record().type)) {
+            decisions.push_back(decoder.record());
+        }
+        return 1;
+    }
+
+    std::deque<TraceRecord> decisions;
+
+private:
+    TraceDecoder decoder;
+};
+
+static DecisionCollector replayed;
+static std::deque<TraceRecord> recorded;
+static uint64_t nextPassAt = 0;
+static uint64_t passes = 0;
+static uint64_t decisionsMatched = 0;
+static uint64_t decisionsDiffering = 0;
+static uint64_t maxSkewMicros = 0;
+// Records that couldn't be decoded, or name a bulb the replay doesn't have
+static uint64_t corrupt = 0;
+static uint64_t decisionCounts[TRACE_RECORD_TYPES];
+
+static void report(const char* name, double value, const char* unit) {
+    printf("%-40s %12.3f %s\n", name, value, unit);
+}
+
+static void printRecord(const char* who, const TraceRecord& record) {
+    printf("  %s %s bulb=%u value=%u arg=%lu at %.6fs\n", who, TRACE_RECORD_LAYOUTS[record.type].name, record.bulb, record.value,
+        (unsigned long)record.arg, record.micros / 1e6);
+}
+
+static bool sameDecision(const TraceRecord& a, const TraceRecord& b) {
+    return a.type == b.type && a.bulb == b.bulb && a.value == b.value && a.arg == b.arg;
+}
+
+static void reportDifference(const TraceRecord* expected, const TraceRecord* actual) {
+    if (decisionsDiffering++ < MAX_REPORTED_DIFFERENCES) {
+        printf("Decision %llu differs:\n", (unsigned long long)(decisionsMatched + decisionsDiffering));
+        if (expected) {
+            printRecord("the ESP32 made", *expected);
+        }
+        if (actual) {
+            printRecord("the replay made", *actual);
+        }
+    }
+}
+
+// Compares the decisions both sides have made so far, in the order they were made
+static void compareDecisions() {
+    while (!recorded.empty() && !replayed.decisions.empty()) {
+        const TraceRecord& expected = recorded.front();
+        const TraceRecord& actual = replayed.decisions.front();
+        if (sameDecision(expected, actual)) {
+            decisionsMatched++;
+            decisionCounts[expected.type]++;
+            uint64_t skew = expected.micros > actual.micros ? expected.micros - actual.micros : actual.micros - expected.micros;
+            maxSkewMicros = std::max(maxSkewMicros, skew);
+        } else {
+            reportDifference(&expected, &actual);
+        }
+        recorded.pop_front();
+        replayed.decisions.pop_front();
+    }
+}
+
+// Runs a pass of loop() at the given time, the next one is due when it asks to be woken
+static void runPass(uint64_t at) {
+    sim::setClock(at);
+    uint32_t wakeIn = runLoopPass();
+    Trace.flush();
+    // On the ESP32 a pass asking not to sleep at all takes some time, which the replay's clock has to be moved on by
+    nextPassAt = at + std::max(wakeIn, (uint32_t)1) * 1000ull;
+    passes++;
+}
+
+// Replays the records one pass of loop() made on the ESP32, after the passes that recorded nothing before it
+static void replayPass(const std::vector<TraceRecord>& pass) {
+    uint64_t at = pass.front().micros;
+    while (nextPassAt < at) {
+        runPass(nextPassAt);
+    }
+    sim::setClock(at);
+    for (const TraceRecord& record : pass) {
+        if (isTraceInput(record.type) && record.type != TRACE_BULB_EVICTED) {
+            corrupt += replayTraceRecord(record) ? 0 : 1;
+        } else if (isTraceDecision(record.type)) {
+            recorded.push_back(record);
+        }
+    }
+    runPass(at);
+    // Evictions are made part way through a pass, after its presence handling
+    for (const TraceRecord& record : pass) {
+        if (record.type == TRACE_BULB_EVICTED) {
+            sim::setClock(std::max(record.micros, at));
+            corrupt += replayTraceRecord(record) ? 0 : 1;
+        }
+    }
+    Trace.flush();
+    compareDecisions();
+}
+
+int main(int argc, char** argv) {
+    const char* path = nullptr;
+    int boot = 1;
+    bool log = false;
+    static StderrOutput logOutput;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg.rfind("--boot=", 0) == 0) {
+            boot = atoi(arg.c_str() + 7);
+        } else if (arg == "--log") {
+            log = true;
+            Log.begin(LOG_LEVEL, &logOutput);
+        } else if (arg.rfind("--", 0) != 0 && !path) {
+            path = argv[i];
+        } else {
+            fprintf(stderr, "Unknown argument '%s'\n", arg.c_str());
+            return 2;
+        }
+    }
+    FILE* input = path ? fopen(path, "rb") : nullptr;
+    if (!input) {
+        fprintf(stderr, "Usage: %s trace.bin [--boot=N] [--log]\n", argv[0]);
+        return 2;
+    }
+
+    sim::setClock(0);
+    TraceDecoder decoder;
+    std::vector<TraceRecord> pass;
+    int boots = 0;
+    uint64_t records = 0, bytes = 0, dropped = 0, lastMicros = 0;
+    auto started = std::chrono::steady_clock::now();
+    int c;
+    while ((c = fgetc(input)) != EOF) {
+        bytes++;
+        TraceDecoder::Result result = decoder.feed(c);
+        if (result == TraceDecoder::CORRUPT) {
+            corrupt++;
+        } else if (result == TraceDecoder::HEADER) {
+            if (++boots > boot) {
+                break;
+            }
+            // The bulbs are set up as the boot started with them, later changes to the settings are in the trace
+            if (boots == boot) {
+                beginTraceReplay(&replayed, decoder.bulbCount());
+            }
+        } else if (result == TraceDecoder::RECORD && boots == boot) {
+            const TraceRecord& record = decoder.record();
+            records++;
+            lastMicros = record.micros;
+            if (record.type == TRACE_DROPPED) {
+                dropped = record.arg;
+            }
+            if (!record.samePass && !pass.empty()) {
+                replayPass(pass);
+                pass.clear();
+            }
+            pass.push_back(record);
+        } else if (result == TraceDecoder::TEXT && boots == boot && log) {
+            fputc(decoder.text(), stderr);
+        }
+    }
+    if (!pass.empty()) {
+        replayPass(pass);
+    }
+    double wallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    // Whatever is left was only decided by one side
+    for (const TraceRecord& expected : recorded) {
+        reportDifference(&expected, nullptr);
+    }
+    for (const TraceRecord& actual : replayed.decisions) {
+        reportDifference(nullptr, &actual);
+    }
+    if (boots < boot) {
+        fprintf(stderr, "The trace only has %d boot(s)\n", boots);
+        return 2;
+    }
+
+    printf("# Trace replay of boot %d of %s\n", boot, path);
+    if (corrupt) {
+        printf("WARNING: %llu corrupt record(s) were skipped\n", (unsigned long long)corrupt);
+    }
+    if (dropped) {
+        printf("WARNING: the ESP32 dropped %llu record(s) as its buffer was full, the replay may differ after that\n",
+            (unsigned long long)dropped);
+    }
+    report("replay.records", records, "");
+    report("replay.bytes_per_record", records ? (double)bytes / records : 0, "bytes");
+    report("replay.trace_duration_s", lastMicros / 1e6, "s");
+    report("replay.loop_passes", passes, "");
+    report("replay.wall_time_ms", wallSeconds * 1000, "ms");
+    report("replay.records_per_s", wallSeconds > 0 ? records / wallSeconds : 0, "");
+    report("replay.speedup", wallSeconds > 0 ? lastMicros / 1e6 / wallSeconds : 0, "x");
+    report("replay.presence_edges", decisionCounts[TRACE_PRESENCE_EDGE], "");
+    report("replay.pause_toggles", decisionCounts[TRACE_PAUSE_TOGGLED], "");
+    report("replay.power_writes", decisionCounts[TRACE_POWER_WRITE], "");
+    report("replay.sensor_states", decisionCounts[TRACE_SENSOR_STATE], "");
+    report("replay.decisions_matched", decisionsMatched, "");
+    report("replay.decisions_differing", decisionsDiffering, "");
+    report("replay.max_decision_skew_ms", maxSkewMicros / 1000.0, "ms");
+    fflush(stdout);
+    // The firmware's tasks are still around, so don't wait on them
+    std::_Exit(decisionsDiffering ? 1 : 0);
+}